@@ -0,0 +1,104 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the cost of calling functions of a compilation unit through a
+// NativeFunc, with their direct wrapper (which calls them directly, and
+// inlines small ones) and with the wrapper of their type (which calls them
+// through a function pointer).
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <tuple>
+
+#include <dffi/dffi.h>
+#include <dffi/types.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+int add(int a, int b) { return a+b; }
+double fma_(double a, double b, double c) { return a*b+c; }
+int sum(int const* p, int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += p[i];
+  }
+  return s;
+}
+)";
+
+static double bench(NativeFunc const& F, void* Ret, void** Args, unsigned Iters)
+{
+  const auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I < Iters; ++I) {
+    F.call(Ret, Args);
+  }
+  const auto End = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(End-Start).count()/Iters;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned Iters = 10000000;
+  if (argc >= 2) {
+    Iters = std::stoul(argv[1]);
+  }
+
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    fprintf(stderr, "compile error: %s\n", Err.c_str());
+    return 1;
+  }
+
+  int A = 1, B = 2;
+  double X = 1., Y = 2., Z = 3.;
+  int Data[16] = {0};
+  int* P = Data;
+  int N = 16;
+  void* AddArgs[] = {&A, &B};
+  void* FmaArgs[] = {&X, &Y, &Z};
+  void* SumArgs[] = {&P, &N};
+  struct {
+    const char* Name;
+    void** Args;
+  } Funcs[] = {{"add", AddArgs}, {"fma_", FmaArgs}, {"sum", SumArgs}};
+
+  printf("%-8s %12s %12s\n", "function", "direct (ns)", "type (ns)");
+  for (auto const& F: Funcs) {
+    NativeFunc Direct = CU.getFunction(F.Name);
+    void* FPtr;
+    FunctionType const* FTy;
+    std::tie(FPtr, FTy) = CU.getFunctionAddressAndTy(F.Name);
+    NativeFunc ByType = CU.getFunction(FPtr, FTy);
+    if (!Direct || !ByType) {
+      fprintf(stderr, "unable to get function %s\n", F.Name);
+      return 1;
+    }
+    double Ret[2];
+    // Warm up
+    Direct.call(Ret, F.Args);
+    ByType.call(Ret, F.Args);
+    const double DirectTime = bench(Direct, Ret, F.Args, Iters);
+    const double TypeTime = bench(ByType, Ret, F.Args, Iters);
+    printf("%-8s %12.2f %12.2f\n", F.Name, DirectTime, TypeTime);
+  }
+  return 0;
+}
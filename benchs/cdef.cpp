@@ -0,0 +1,70 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the wall time of cdef on a large generated header, or on the
+// header given as argument (e.g. "#include <archive.h>").
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static std::string genHeader(unsigned N)
+{
+  std::stringstream ss;
+  ss << "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n";
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "struct S" << I << " { int a; double b; struct S" << I << "* next; };\n";
+    ss << "typedef struct S" << I << " S" << I << "_t;\n";
+    ss << "typedef int (*cb" << I << ")(S" << I << "_t*, void*);\n";
+    ss << "int func" << I << "(S" << I << "_t const* s, cb" << I << " f, size_t n, ...);\n";
+  }
+  return ss.str();
+}
+
+int main(int argc, char** argv)
+{
+  std::string Code;
+  if (argc >= 2) {
+    Code = argv[1];
+  }
+  else {
+    Code = genHeader(2000);
+  }
+  const unsigned Iters = 5;
+
+  DFFI::initialize();
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  double Total = 0;
+  for (unsigned I = 0; I < Iters; ++I) {
+    DFFI Jit(Opts);
+    std::string Err;
+    const auto Start = std::chrono::steady_clock::now();
+    auto CU = Jit.cdef(Code.c_str(), "bench.h", Err);
+    const auto End = std::chrono::steady_clock::now();
+    if (!CU) {
+      fprintf(stderr, "cdef error: %s\n", Err.c_str());
+      return 1;
+    }
+    Total += std::chrono::duration<double, std::milli>(End-Start).count();
+  }
+  printf("cdef: %.2f ms\n", Total/Iters);
+  return 0;
+}
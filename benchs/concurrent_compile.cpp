@@ -0,0 +1,89 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Measures the compilation throughput of a DFFI object used from several
+// threads, with CCOpts::Concurrency set to the number of threads.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static std::string genCode(unsigned T, unsigned I)
+{
+  const std::string Suffix = std::to_string(T) + "_" + std::to_string(I);
+  return "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n"
+    "struct S { int a; double b; char buf[16]; };\n"
+    "double compute_" + Suffix + "(struct S* s, int n) {\n"
+    "  double Ret = 0;\n"
+    "  for (int i = 0; i < n; ++i) { Ret += s->a * s->b + strlen(s->buf); }\n"
+    "  return Ret;\n"
+    "}\n";
+}
+
+static double run(unsigned NThreads, unsigned CUsPerThread)
+{
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.Concurrency = NThreads;
+  DFFI Jit(Opts);
+
+  const auto Start = std::chrono::steady_clock::now();
+  std::vector<std::thread> Threads;
+  for (unsigned T = 0; T < NThreads; ++T) {
+    Threads.emplace_back([&Jit, T, CUsPerThread]() {
+      for (unsigned I = 0; I < CUsPerThread; ++I) {
+        std::string Err;
+        auto CU = Jit.compile(genCode(T, I).c_str(), Err);
+        if (!CU) {
+          fprintf(stderr, "compile error: %s\n", Err.c_str());
+          exit(1);
+        }
+      }
+    });
+  }
+  for (auto& T: Threads) {
+    T.join();
+  }
+  const auto End = std::chrono::steady_clock::now();
+  const double Secs = std::chrono::duration<double>(End-Start).count();
+  return (NThreads*CUsPerThread)/Secs;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned MaxThreads = std::thread::hardware_concurrency();
+  if (argc >= 2) {
+    MaxThreads = std::stoul(argv[1]);
+  }
+  if (MaxThreads == 0) {
+    MaxThreads = 1;
+  }
+  const unsigned CUsPerThread = 16;
+
+  DFFI::initialize();
+
+  printf("%-8s %s\n", "threads", "CUs/s");
+  for (unsigned N = 1; N <= MaxThreads; N *= 2) {
+    printf("%-8u %.1f\n", N, run(N, CUsPerThread));
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the wall time of cdefs which only include headers (libc and
+// libarchive ones, or the code given as argument), with and without code
+// generation.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* LibcHeaders = R"(
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+)";
+
+static const char* LibarchiveHeaders = R"(
+#include <archive.h>
+#include <archive_entry.h>
+)";
+
+// Returns the mean time of a cdef, or a negative value if it failed
+static double bench(const char* Code, CDefMode Mode)
+{
+  const unsigned Iters = 5;
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CDef = Mode;
+
+  double Total = 0;
+  for (unsigned I = 0; I < Iters; ++I) {
+    DFFI Jit(Opts);
+    std::string Err;
+    const auto Start = std::chrono::steady_clock::now();
+    auto CU = Jit.cdef(Code, nullptr, Err);
+    const auto End = std::chrono::steady_clock::now();
+    if (!CU) {
+      fprintf(stderr, "cdef error: %s\n", Err.c_str());
+      return -1;
+    }
+    Total += std::chrono::duration<double, std::milli>(End-Start).count();
+  }
+  return Total/Iters;
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<std::pair<const char*, const char*>> Benchs;
+  if (argc >= 2) {
+    Benchs.emplace_back("custom", argv[1]);
+  }
+  else {
+    Benchs.emplace_back("libc", LibcHeaders);
+    Benchs.emplace_back("libarchive", LibarchiveHeaders);
+  }
+
+  DFFI::initialize();
+  for (auto const& B: Benchs) {
+    const double Full = bench(B.second, CDefMode::Full);
+    if (Full < 0) {
+      printf("%s: headers not available\n", B.first);
+      continue;
+    }
+    const double Auto = bench(B.second, CDefMode::Auto);
+    const double DeclsOnly = bench(B.second, CDefMode::DeclsOnly);
+    printf("%s: full: %.2f ms, auto: %.2f ms, declarations only: %.2f ms\n", B.first, Full, Auto, DeclsOnly);
+  }
+  return 0;
+}
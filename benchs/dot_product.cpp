@@ -0,0 +1,113 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures a dot product compiled with different per compilation unit
+// options (see CompileOpts). Without fast-math, the reduction can't be
+// vectorized, as floating point additions can't be reordered.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+float dot(float const* a, float const* b, int n) {
+  float s = 0.f;
+  for (int i = 0; i < n; ++i) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+)";
+
+static CompileOpts getOpts(bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, const char* PassPipeline = "")
+{
+  CompileOpts Ret;
+  Ret.FastMath = FastMath;
+  Ret.FPContractFast = FPContractFast;
+  Ret.VectorizeWidth = VectorizeWidth;
+  Ret.InterleaveCount = InterleaveCount;
+  Ret.PassPipeline = PassPipeline;
+  return Ret;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned Iters = 100000;
+  int N = 4096;
+  if (argc >= 2) {
+    Iters = std::stoul(argv[1]);
+  }
+  if (argc >= 3) {
+    N = std::stoi(argv[2]);
+  }
+
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CPU = "native";
+  DFFI Jit(Opts);
+
+  struct {
+    const char* Name;
+    CompileOpts Opts;
+  } Configs[] = {
+    {"default", getOpts(false, false, 0, 0)},
+    {"fp-contract=fast", getOpts(false, true, 0, 0)},
+    {"fast-math", getOpts(true, false, 0, 0)},
+    {"fast-math vw=8 ic=4", getOpts(true, false, 8, 4)},
+    {"fast-math vw=16 ic=2", getOpts(true, false, 16, 2)},
+    {"fast-math default<O3>", getOpts(true, false, 0, 0, "default<O3>")},
+  };
+
+  std::vector<float> A(N), B(N);
+  for (int I = 0; I < N; ++I) {
+    A[I] = (float)(I % 7) * 0.5f;
+    B[I] = (float)(I % 5) * 0.25f;
+  }
+  float const* PA = A.data();
+  float const* PB = B.data();
+  void* Args[] = {&PA, &PB, &N};
+
+  printf("%-24s %12s %12s\n", "options", "time (us)", "GFLOPS");
+  for (auto const& C: Configs) {
+    std::string Err;
+    auto CU = Jit.compile(Code, C.Opts, Err);
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+    NativeFunc Dot = CU.getFunction("dot");
+    if (!Dot) {
+      fprintf(stderr, "unable to get function dot\n");
+      return 1;
+    }
+    float Ret;
+    // Warm up
+    Dot.call(&Ret, Args);
+    const auto Start = std::chrono::steady_clock::now();
+    for (unsigned I = 0; I < Iters; ++I) {
+      Dot.call(&Ret, Args);
+    }
+    const auto End = std::chrono::steady_clock::now();
+    const double Time = std::chrono::duration<double, std::micro>(End-Start).count()/Iters;
+    printf("%-24s %12.3f %12.2f\n", C.Name, Time, (2.*N)/(Time*1e3));
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the latency of the first call to functions, which includes the
+// generation and JIT compilation of the wrapper for their types. Only the
+// wrappers of the scalar signatures are generated directly as LLVM IR, the
+// other ones are compiled by clang.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dffi/dffi.h>
+#include <dffi/types.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+#include <stdarg.h>
+
+struct S { int a; double b; };
+union U { int a; float b; };
+
+int scalar_%d(int a, short b, char c) { return a+b+c; }
+double scalar_fp_%d(float a, double b) { return a+b; }
+void* scalar_ptr_%d(void* a, unsigned long b) { return (char*)a+b; }
+struct S struct_%d(struct S s, int a) { s.a += a; return s; }
+union U union_%d(union U u) { return u; }
+int varargs_%d(int n, ...)
+{
+  va_list args;
+  va_start(args, n);
+  int Ret = 0;
+  for (int i = 0; i < n; ++i) Ret += va_arg(args, int);
+  va_end(args);
+  return Ret;
+}
+#if defined(__x86_64__)
+__attribute__((ms_abi)) int cconv_%d(int a, int b) { return a+b; }
+#else
+int cconv_%d(int a, int b) { return a+b; }
+#endif
+)";
+
+static const char* Funcs[] = {
+  "scalar", "scalar_fp", "scalar_ptr", "struct", "union", "varargs", "cconv"
+};
+
+struct S { int a; double b; };
+union U { int a; float b; };
+
+// Calls the function of Funcs[F] once
+static void callFunc(size_t F, NativeFunc const& Func)
+{
+  int A = 1, B = 2;
+  short Sh = 3;
+  char C = 4;
+  float Fl = 1.f;
+  double D = 2.;
+  void* P = nullptr;
+  unsigned long UL = 8;
+  S SArg = {1, 2.};
+  U UArg;
+  UArg.a = 1;
+  union {
+    int I;
+    double D;
+    void* P;
+    S SRet;
+    U URet;
+  } Ret;
+  switch (F) {
+    case 0: { void* Args[] = {&A, &Sh, &C}; Func.call(&Ret, Args); break; }
+    case 1: { void* Args[] = {&Fl, &D}; Func.call(&Ret, Args); break; }
+    case 2: { void* Args[] = {&P, &UL}; Func.call(&Ret, Args); break; }
+    case 3: { void* Args[] = {&SArg, &A}; Func.call(&Ret, Args); break; }
+    case 4: { void* Args[] = {&UArg}; Func.call(&Ret, Args); break; }
+    case 5: { void* Args[] = {&B, &A, &B}; Func.call(&Ret, Args); break; }
+    default: { void* Args[] = {&A, &B}; Func.call(&Ret, Args); break; }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned Iters = 20;
+  if (argc >= 2) {
+    Iters = std::stoul(argv[1]);
+  }
+
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  const size_t NFuncs = sizeof(Funcs)/sizeof(Funcs[0]);
+  std::vector<double> Times(NFuncs, 0.);
+  std::vector<double> CallTimes(NFuncs, 0.);
+  for (unsigned I = 0; I < Iters; ++I) {
+    // Each iteration uses a new DFFI object, so that wrappers are never
+    // reused from a previous iteration.
+    DFFI Jit(Opts);
+    std::vector<char> Buf(strlen(Code) + 256);
+    snprintf(&Buf[0], Buf.size(), Code, I, I, I, I, I, I, I, I);
+    std::string Err;
+    auto CU = Jit.compile(&Buf[0], Err);
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+    for (size_t F = 0; F < NFuncs; ++F) {
+      const std::string Name = std::string{Funcs[F]} + "_" + std::to_string(I);
+      const auto Start = std::chrono::steady_clock::now();
+      Type const* VarArgs[] = {Jit.getIntTy(), Jit.getIntTy()};
+      const bool IsVarArgs = std::string{Funcs[F]} == "varargs";
+      NativeFunc Func = IsVarArgs ? CU.getFunction(Name.c_str(), VarArgs, 2) : CU.getFunction(Name.c_str());
+      const auto End = std::chrono::steady_clock::now();
+      if (!Func) {
+        fprintf(stderr, "unable to get function %s\n", Name.c_str());
+        return 1;
+      }
+      // The wrapper is compiled by getFunction, and the first call runs it
+      // and the function for the first time.
+      callFunc(F, Func);
+      const auto CallEnd = std::chrono::steady_clock::now();
+      Times[F] += std::chrono::duration<double, std::micro>(End-Start).count();
+      CallTimes[F] += std::chrono::duration<double, std::micro>(CallEnd-End).count();
+    }
+  }
+
+  printf("%-12s %-9s %-18s %-16s %s\n", "signature", "wrapper", "getFunction (us)", "first call (us)", "total (us)");
+  for (size_t F = 0; F < NFuncs; ++F) {
+    // Only the scalar signatures get wrappers generated as LLVM IR
+    const bool IRWrapper = F < 3;
+    printf("%-12s %-9s %-18.1f %-16.1f %.1f\n", Funcs[F], IRWrapper ? "IR":"clang",
+      Times[F]/Iters, CallTimes[F]/Iters, (Times[F]+CallTimes[F])/Iters);
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the wall time of compiling a compilation unit which includes a
+// header with many static inline functions, and of the first call to the only
+// function it defines.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static std::string genCode(unsigned N)
+{
+  std::stringstream ss;
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "static inline int helper" << I << "(int const* a, int n) {\n"
+       << "  int r = " << I << ";\n"
+       << "  for (int i = 0; i < n; ++i) { r = r*31 + a[i] % (i+" << I+1 << "); }\n"
+       << "  return r;\n}\n";
+  }
+  ss << "int entry(int const* a, int n) { return helper0(a, n); }\n";
+  return ss.str();
+}
+
+int main(int argc, char** argv)
+{
+  const std::string Code = genCode(argc >= 2 ? atoi(argv[1]) : 2000);
+  const unsigned Iters = 5;
+
+  DFFI::initialize();
+  CCOpts Opts;
+  Opts.OptLevel = 0;
+
+  double TotalCompile = 0;
+  double TotalCall = 0;
+  for (unsigned I = 0; I < Iters; ++I) {
+    DFFI Jit(Opts);
+    std::string Err;
+    const auto Start = std::chrono::steady_clock::now();
+    auto CU = Jit.compile(Code.c_str(), Err);
+    const auto Compiled = std::chrono::steady_clock::now();
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+    int A[] = {1, 2, 3, 4};
+    int* PA = A;
+    int N = 4;
+    void* Args[] = {&PA, &N};
+    int Ret;
+    CU.getFunction("entry").call(&Ret, Args);
+    const auto Called = std::chrono::steady_clock::now();
+    TotalCompile += std::chrono::duration<double, std::milli>(Compiled-Start).count();
+    TotalCall += std::chrono::duration<double, std::milli>(Called-Compiled).count();
+  }
+  printf("compile: %.2f ms\n", TotalCompile/Iters);
+  printf("first call: %.2f ms\n", TotalCall/Iters);
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the wall time needed to compile a synthetic compilation unit of 5000
+// functions and get the address of all of them, according to the number of
+// code generation threads. With one thread, the code of each function is
+// generated when its address is first requested.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static std::string genCode(unsigned N)
+{
+  std::stringstream ss;
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "int func" << I << "(int const* a, int n) {\n"
+       << "  int r = " << I << ";\n"
+       << "  for (int i = 0; i < n; ++i) {\n"
+       << "    r = r*31 + a[i] % (i+" << I+1 << ");\n"
+       << "    if (r & 1) r ^= a[(i+" << I << ") % n];\n"
+       << "  }\n"
+       << "  return r;\n}\n";
+  }
+  return ss.str();
+}
+
+int main(int argc, char** argv)
+{
+  const unsigned N = argc >= 2 ? atoi(argv[1]) : 5000;
+  const std::string Code = genCode(N);
+
+  DFFI::initialize();
+
+  unsigned Threads[] = {1, 2, 4, std::thread::hardware_concurrency()};
+  for (unsigned T: Threads) {
+    CCOpts Opts;
+    Opts.OptLevel = 2;
+    Opts.CodeGenThreads = T;
+    DFFI Jit(Opts);
+
+    std::string Err;
+    const auto Start = std::chrono::steady_clock::now();
+    auto CU = Jit.compile(Code.c_str(), Err);
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+    for (unsigned I = 0; I < N; ++I) {
+      const std::string Name = "func" + std::to_string(I);
+      if (!std::get<0>(CU.getFunctionAddressAndTy(Name.c_str()))) {
+        fprintf(stderr, "%s isn't available!\n", Name.c_str());
+        return 1;
+      }
+    }
+    const auto End = std::chrono::steady_clock::now();
+    printf("%u threads: %.2f ms\n", T, std::chrono::duration<double, std::milli>(End-Start).count());
+  }
+  return 0;
+}
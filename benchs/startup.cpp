@@ -0,0 +1,77 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the startup cost of FFI objects: DFFI::initialize, the
+// construction of DFFI objects (the first one of the process, and the next
+// ones which reuse the shared clang invocation), and the first compilation,
+// which creates the JIT engines.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point Start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now()-Start).count();
+}
+
+int main(int argc, char** argv)
+{
+  unsigned Iters = 100;
+  if (argc >= 2) {
+    Iters = std::stoul(argv[1]);
+  }
+
+  auto Start = Clock::now();
+  DFFI::initialize();
+  const double Init = elapsedMs(Start);
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  Start = Clock::now();
+  {
+    DFFI Jit(Opts);
+  }
+  const double First = elapsedMs(Start);
+
+  double Ctor = 0;
+  double FirstCompile = 0;
+  for (unsigned I = 0; I < Iters; ++I) {
+    Start = Clock::now();
+    DFFI Jit(Opts);
+    Ctor += elapsedMs(Start);
+
+    std::string Err;
+    Start = Clock::now();
+    auto CU = Jit.compile("int get42() { return 42; }", Err);
+    FirstCompile += elapsedMs(Start);
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+  }
+
+  printf("DFFI::initialize: %.3f ms\n", Init);
+  printf("first DFFI(Opts): %.3f ms\n", First);
+  printf("DFFI(Opts): %.3f ms\n", Ctor/Iters);
+  printf("first compile: %.3f ms\n", FirstCompile/Iters);
+  return 0;
+}
@@ -0,0 +1,111 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures a 5-point stencil (one Jacobi iteration on a 2D grid) compiled
+// with different per compilation unit options (see CompileOpts).
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+void jacobi(double* restrict out, double const* restrict in, int w, int h) {
+  for (int y = 1; y < h-1; ++y) {
+    for (int x = 1; x < w-1; ++x) {
+      out[y*w+x] = 0.2 * (in[y*w+x] + in[y*w+x-1] + in[y*w+x+1] +
+                          in[(y-1)*w+x] + in[(y+1)*w+x]);
+    }
+  }
+}
+)";
+
+static CompileOpts getOpts(bool FastMath, unsigned VectorizeWidth, unsigned UnrollCount, const char* PassPipeline = "")
+{
+  CompileOpts Ret;
+  Ret.FastMath = FastMath;
+  Ret.VectorizeWidth = VectorizeWidth;
+  Ret.UnrollCount = UnrollCount;
+  Ret.PassPipeline = PassPipeline;
+  return Ret;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned Iters = 1000;
+  int W = 512;
+  int H = 512;
+  if (argc >= 2) {
+    Iters = std::stoul(argv[1]);
+  }
+  if (argc >= 3) {
+    W = H = std::stoi(argv[2]);
+  }
+
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CPU = "native";
+  DFFI Jit(Opts);
+
+  struct {
+    const char* Name;
+    CompileOpts Opts;
+  } Configs[] = {
+    {"default", getOpts(false, 0, 0)},
+    {"no vectorization", getOpts(false, 1, 0)},
+    {"vw=4 unroll=1", getOpts(false, 4, 1)},
+    {"vw=4 unroll=4", getOpts(false, 4, 4)},
+    {"fast-math", getOpts(true, 0, 0)},
+    {"fast-math default<O3>", getOpts(true, 0, 0, "default<O3>")},
+  };
+
+  std::vector<double> In(W*H), Out(W*H);
+  for (int I = 0; I < W*H; ++I) {
+    In[I] = (double)(I % 13);
+  }
+  double* POut = Out.data();
+  double const* PIn = In.data();
+  void* Args[] = {&POut, &PIn, &W, &H};
+
+  printf("%-24s %12s %14s\n", "options", "time (us)", "Mpoints/s");
+  for (auto const& C: Configs) {
+    std::string Err;
+    auto CU = Jit.compile(Code, C.Opts, Err);
+    if (!CU) {
+      fprintf(stderr, "compile error: %s\n", Err.c_str());
+      return 1;
+    }
+    NativeFunc Jacobi = CU.getFunction("jacobi");
+    if (!Jacobi) {
+      fprintf(stderr, "unable to get function jacobi\n");
+      return 1;
+    }
+    // Warm up
+    Jacobi.call(nullptr, Args);
+    const auto Start = std::chrono::steady_clock::now();
+    for (unsigned I = 0; I < Iters; ++I) {
+      Jacobi.call(nullptr, Args);
+    }
+    const auto End = std::chrono::steady_clock::now();
+    const double Time = std::chrono::duration<double, std::micro>(End-Start).count()/Iters;
+    printf("%-24s %12.2f %14.2f\n", C.Name, Time, (double)(W-2)*(H-2)/Time);
+  }
+  return 0;
+}
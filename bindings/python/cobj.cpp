@@ -605,8 +605,20 @@ py::memoryview CPointerObj::getMemoryViewCStr()
   return getMemoryViewObjects(Len);
 }
 
+namespace {
+
+void checkNotReleased(std::shared_ptr<bool const> const& Released)
+{
+  if (Released && *Released) {
+    throw BadFunctionCall{"the compilation unit of this function has been released"};
+  }
+}
+
+} // anonymous
+
 py::object CVarArgsFunction::call(py::args const& Args) const
 {
+  checkNotReleased(Released_);
   FunctionType const* FTy = getFuncType();
   auto const& Params = FTy->getParams();
   const size_t NParams = Params.size();
@@ -622,6 +634,7 @@ py::object CVarArgsFunction::call(py::args const& Args) const
 
 py::object CFunction::call(py::args const& Args) const
 {
+  checkNotReleased(Released_);
   ConvertArgsSwitch::ObjsHolder Holders;
   ConvertArgsSwitch::PyObjsHolder PyHolders;
 
@@ -580,9 +580,13 @@ struct CFunction: public CObj
 {
   using TrampPtrTy = dffi::NativeFunc::TrampPtrTy;
 
-  CFunction(dffi::NativeFunc const& NF):
+  // If Released is set, it becomes true once the compilation unit the
+  // function belongs to has been released, and the function can't be called
+  // anymore.
+  CFunction(dffi::NativeFunc const& NF, std::shared_ptr<bool const> Released = {}):
     CObj(*NF.getType()),
-    NF_(NF)
+    NF_(NF),
+    Released_(std::move(Released))
   { }
 
   pybind11::object call(pybind11::args const& Args) const;
@@ -597,13 +601,15 @@ struct CFunction: public CObj
 
 private:
   dffi::NativeFunc NF_;
+  std::shared_ptr<bool const> Released_;
 };
 
 struct CVarArgsFunction: public CObj
 {
-  CVarArgsFunction(void* FuncPtr, dffi::FunctionType const* FTy):
+  CVarArgsFunction(void* FuncPtr, dffi::FunctionType const* FTy, std::shared_ptr<bool const> Released = {}):
     CObj(*FTy),
-    FuncPtr_(FuncPtr)
+    FuncPtr_(FuncPtr),
+    Released_(std::move(Released))
   {
     assert(FTy->hasVarArgs() && "function must have variadic arguments!");
   }
@@ -618,6 +624,7 @@ struct CVarArgsFunction: public CObj
 
 private:
   void* FuncPtr_;
+  std::shared_ptr<bool const> Released_;
 };
 
 std::string getFormatDescriptor(dffi::Type const* Ty);
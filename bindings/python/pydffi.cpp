@@ -22,7 +22,10 @@
 #include <dffi/casting.h>
 #include <dffi/mdarray.h>
 
+#include <functional>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
 
 namespace py = pybind11;
 
@@ -70,29 +73,149 @@ void throwCompileErr(std::string&& Err)
   throw CompileError{std::move(Err)};
 }
 
+CompileOpts getCompileOpts(bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
+{
+  CompileOpts Ret;
+  Ret.FastMath = FastMath;
+  Ret.FPContractFast = FPContractFast;
+  Ret.VectorizeWidth = VectorizeWidth;
+  Ret.InterleaveCount = InterleaveCount;
+  Ret.UnrollCount = UnrollCount;
+  Ret.PassPipeline = PassPipeline;
+  Ret.ShareStatics = ShareStatics;
+  return Ret;
+}
+
 // DFFI wrappers
-CompilationUnit dffi_cdef(DFFI& C, const char* Code, const char* Name, bool UseLastError = false)
+CompilationUnit dffi_cdef(DFFI& C, const char* Code, const char* Name, bool UseLastError, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
 {
+  const CompileOpts Opts = getCompileOpts(FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics);
   std::string Err;
-  auto CU = C.cdef(Code, Name, Err, UseLastError);
+  auto CU = [&]() {
+    // Other python threads can run (and compile) in the meantime.
+    py::gil_scoped_release Release;
+    return C.cdef(Code, Name, Opts, Err, UseLastError);
+  }();
   if (!CU) {
     throwCompileErr(std::move(Err));
   }
   return CU;
 }
 
-CompilationUnit dffi_compile(DFFI& C, const char* Code, bool UseLastError = false)
+CompilationUnit dffi_compile(DFFI& C, const char* Code, bool UseLastError, std::vector<CompilationUnit> const& Imports, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
 {
+  const CompileOpts Opts = getCompileOpts(FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics);
   std::string Err;
-  auto CU = C.compile(Code, Err, UseLastError);
+  auto CU = [&]() {
+    // Other python threads can run (and compile) in the meantime.
+    py::gil_scoped_release Release;
+    return C.compile(Code, Imports, Opts, Err, UseLastError);
+  }();
   if (!CU) {
     throwCompileErr(std::move(Err));
   }
   return CU;
 }
 
+void dffi_precompile_headers(DFFI& C, const char* Code)
+{
+  std::string Err;
+  const bool Success = [&]() {
+    py::gil_scoped_release Release;
+    return C.precompileHeaders(Code, Err);
+  }();
+  if (!Success) {
+    throwCompileErr(std::move(Err));
+  }
+}
+
+void dffi_link_compilation_units(DFFI& C)
+{
+  std::string Err;
+  const bool Success = [&]() {
+    py::gil_scoped_release Release;
+    return C.linkCompilationUnits(Err);
+  }();
+  if (!Success) {
+    throwCompileErr(std::move(Err));
+  }
+}
+
+// The functions, types and objects of a compilation unit keep it alive:
+// releasing it only marks it as released, so that its functions can't be
+// called anymore, and it is freed once nothing references it (see cu_del).
+// Flags are shared with the functions (see CFunction), and protected by the
+// GIL.
+std::unordered_map<CompilationUnit const*, std::shared_ptr<bool>> CUReleased;
+
+std::shared_ptr<bool> const& cu_released(CompilationUnit const& CU)
+{
+  auto& Ret = CUReleased[&CU];
+  if (!Ret) {
+    Ret = std::make_shared<bool>(false);
+  }
+  return Ret;
+}
+
+void checkNotReleased(CompilationUnit const& CU)
+{
+  auto It = CUReleased.find(&CU);
+  if (It != CUReleased.end() && *It->second) {
+    throwCompileErr("the compilation unit has been released");
+  }
+}
+
+void cu_extend(CompilationUnit& CU, const char* Code, bool UseLastError)
+{
+  checkNotReleased(CU);
+  std::string Err;
+  const bool Success = [&]() {
+    py::gil_scoped_release Release;
+    return CU.extend(Code, Err, UseLastError);
+  }();
+  if (!Success) {
+    throwCompileErr(std::move(Err));
+  }
+}
+
+void cu_recompile_with_profile(CompilationUnit& CU)
+{
+  checkNotReleased(CU);
+  std::string Err;
+  const bool Success = [&]() {
+    py::gil_scoped_release Release;
+    return CU.recompileWithProfile(Err);
+  }();
+  if (!Success) {
+    throwCompileErr(std::move(Err));
+  }
+}
+
+void cu_release(CompilationUnit& CU)
+{
+  if (CU) {
+    *cu_released(CU) = true;
+  }
+}
+
+void cu_del(CompilationUnit& CU)
+{
+  auto It = CUReleased.find(&CU);
+  if (It == CUReleased.end()) {
+    return;
+  }
+  if (*It->second && CU) {
+    CU.release();
+  }
+  CUReleased.erase(It);
+}
+
 std::unique_ptr<CObj> cu_getfunction(CompilationUnit& CU, const char* Name)
 {
+  auto const& Released = cu_released(CU);
+  if (*Released) {
+    throw BadFunctionCall{"the compilation unit has been released"};
+  }
   void* FPtr;
   FunctionType const* FTy;
   std::tie(FPtr, FTy) = CU.getFunctionAddressAndTy(Name);
@@ -102,11 +225,11 @@ std::unique_ptr<CObj> cu_getfunction(CompilationUnit& CU, const char* Name)
 
   CObj* Ret;
   if (FTy->hasVarArgs()) {
-    Ret = new CVarArgsFunction{FPtr, FTy};
+    Ret = new CVarArgsFunction{FPtr, FTy, Released};
   }
   else {
     auto NF = CU.getFunction(FPtr, FTy);
-    Ret = new CFunction{NF};
+    Ret = new CFunction{NF, Released};
   }
 
   return std::unique_ptr<CObj>{Ret};
@@ -184,7 +307,22 @@ std::unique_ptr<CObj> dffi_view_from_buffer(QualType Ty, py::buffer& B)
   return Ret;
 }
 
-std::unique_ptr<DFFI> default_ctor(unsigned optLevel, py::list includeDirs, const char* Sysroot, CXXMode CXX, bool GNUExtensions, bool LazyJITWrappers)
+// Python exception type of CompileError
+py::handle PyCompileError;
+
+// Workers running asynchronous compilations need the GIL to report their
+// results, so it is released while they finish.
+struct DFFIDeleter
+{
+  void operator()(DFFI* D) const
+  {
+    py::gil_scoped_release Release;
+    delete D;
+  }
+};
+using DFFIHolder = std::unique_ptr<DFFI, DFFIDeleter>;
+
+DFFIHolder default_ctor(unsigned optLevel, py::list includeDirs, const char* Sysroot, CXXMode CXX, bool GNUExtensions, bool LazyJITWrappers, const char* CacheDir, unsigned Concurrency, unsigned CodeGenThreads, CDefMode CDef, bool DropIR, unsigned TierUpThreshold, bool ProfileInstr, const char* CPU, py::list TargetFeatures, py::list ISAVariants, bool LTO)
 {
   CCOpts Opts;
   Opts.OptLevel = optLevel;
@@ -197,7 +335,91 @@ std::unique_ptr<DFFI> default_ctor(unsigned optLevel, py::list includeDirs, cons
   Opts.CXX = CXX;
   Opts.GNUExtensions = GNUExtensions;
   Opts.LazyJITWrappers = LazyJITWrappers;
-  return std::unique_ptr<DFFI>{new DFFI{Opts}};
+  Opts.CacheDir = CacheDir;
+  Opts.Concurrency = Concurrency;
+  Opts.CodeGenThreads = CodeGenThreads;
+  Opts.CDef = CDef;
+  Opts.DropIR = DropIR;
+  Opts.TierUpThreshold = TierUpThreshold;
+  Opts.ProfileInstr = ProfileInstr;
+  Opts.CPU = CPU;
+  for (py::handle O: TargetFeatures) {
+    Opts.TargetFeatures.emplace_back(O.cast<std::string>());
+  }
+  for (py::handle O: ISAVariants) {
+    Opts.ISAVariants.emplace_back(O.cast<std::string>());
+  }
+  Opts.LTO = LTO;
+  return DFFIHolder{new DFFI{Opts}};
+}
+
+// Returns a concurrent.futures.Future which will hold the compilation unit
+// (or a CompileError exception) once compiled by one of the FFI workers.
+template <class Func>
+py::object dffi_async(py::object Self, Func Run)
+{
+  py::object Fut = py::module::import("concurrent.futures").attr("Future")();
+  // As compilation units, the future keeps the FFI object alive.
+  Fut.attr("_pydffi_ffi") = Self;
+  // Workers only have a weak reference to the future, so that they never
+  // destroy the FFI object they belong to.
+  PyObject* WeakFut = PyWeakref_NewRef(Fut.ptr(), nullptr);
+  if (!WeakFut) {
+    throw py::error_already_set();
+  }
+  Run([WeakFut](CompileResult R) {
+    py::gil_scoped_acquire Acquire;
+    auto Fut = py::reinterpret_borrow<py::object>(PyWeakref_GetObject(WeakFut));
+    Py_DECREF(WeakFut);
+    if (Fut.is_none()) {
+      return;
+    }
+    try {
+      if (!Fut.attr("set_running_or_notify_cancel")().cast<bool>()) {
+        return;
+      }
+      if (!R.CU) {
+        Fut.attr("set_exception")(PyCompileError(R.Err));
+        return;
+      }
+      py::object CU = py::cast(std::move(R.CU), py::return_value_policy::move);
+      py::detail::keep_alive_impl(CU, Fut.attr("_pydffi_ffi"));
+      Fut.attr("set_result")(CU);
+    }
+    catch (py::error_already_set& E) {
+      E.discard_as_unraisable("pydffi asynchronous compilation");
+    }
+  });
+  return Fut;
+}
+
+py::object dffi_cdef_async(py::object Self, const char* Code, const char* Name, bool UseLastError, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
+{
+  auto& C = Self.cast<DFFI&>();
+  const CompileOpts Opts = getCompileOpts(FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics);
+  return dffi_async(Self, [&](std::function<void(CompileResult)> Done) {
+    C.cdefAsync(Code, Name, Opts, std::move(Done), UseLastError);
+  });
+}
+
+py::object dffi_compile_async(py::object Self, const char* Code, bool UseLastError, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
+{
+  auto& C = Self.cast<DFFI&>();
+  const CompileOpts Opts = getCompileOpts(FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics);
+  return dffi_async(Self, [&](std::function<void(CompileResult)> Done) {
+    C.compileAsync(Code, Opts, std::move(Done), UseLastError);
+  });
+}
+
+// asyncio versions
+py::object dffi_cdef_asyncio(py::object Self, const char* Code, const char* Name, bool UseLastError, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
+{
+  return py::module::import("asyncio").attr("wrap_future")(dffi_cdef_async(Self, Code, Name, UseLastError, FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics));
+}
+
+py::object dffi_compile_asyncio(py::object Self, const char* Code, bool UseLastError, bool FastMath, bool FPContractFast, unsigned VectorizeWidth, unsigned InterleaveCount, unsigned UnrollCount, const char* PassPipeline, bool ShareStatics)
+{
+  return py::module::import("asyncio").attr("wrap_future")(dffi_compile_async(Self, Code, UseLastError, FastMath, FPContractFast, VectorizeWidth, InterleaveCount, UnrollCount, PassPipeline, ShareStatics));
 }
 
 CFunction dffi_getfunction(DFFI& D, FunctionType const& Ty, uintptr_t Ptr)
@@ -712,6 +934,10 @@ PYBIND11_MODULE(PYDFFI_EXT_NAME, m)
   py::class_<CompilationUnit>(m, "CompilationUnit")
     .def_property_readonly("funcs", py::cpp_function(cu_funcs, py::keep_alive<0,1>()))
     .def_property_readonly("types", py::cpp_function(cu_types, py::keep_alive<0,1>()))
+    .def("extend", cu_extend, py::arg("code"), py::arg("useLastError") = false)
+    .def("recompileWithProfile", cu_recompile_with_profile)
+    .def("release", cu_release)
+    .def("__del__", cu_del)
     ;
 
 
@@ -724,10 +950,22 @@ PYBIND11_MODULE(PYDFFI_EXT_NAME, m)
     .value("Std20", CXXMode::Std20)
     ;
 
-  py::class_<DFFI>(m, "FFI")
-    .def(py::init(&default_ctor), py::arg("optLevel") = 2, py::arg("includeDirs") = py::list(), py::arg("sysroot") = py::str(), py::arg("CXX") = CXXMode::NoCXX, py::arg("GNUExtensions") = true, py::arg("lazyJITWrappers") = true)
-    .def("cdef", dffi_cdef, py::keep_alive<0,1>(), py::arg("code"), py::arg("name") = nullptr, py::arg("useLastError") = false)
-    .def("compile", dffi_compile, py::keep_alive<0,1>(), py::arg("code"), py::arg("useLastError") = false)
+  py::enum_<CDefMode>(m, "CDefMode")
+    .value("Auto", CDefMode::Auto)
+    .value("Full", CDefMode::Full)
+    .value("DeclsOnly", CDefMode::DeclsOnly)
+    ;
+
+  py::class_<DFFI, DFFIHolder>(m, "FFI")
+    .def(py::init(&default_ctor), py::arg("optLevel") = 2, py::arg("includeDirs") = py::list(), py::arg("sysroot") = py::str(), py::arg("CXX") = CXXMode::NoCXX, py::arg("GNUExtensions") = true, py::arg("lazyJITWrappers") = true, py::arg("cacheDir") = py::str(), py::arg("concurrency") = 1, py::arg("codegenThreads") = 1, py::arg("cdefMode") = CDefMode::Auto, py::arg("dropIR") = false, py::arg("tierUpThreshold") = 0, py::arg("profileInstr") = false, py::arg("cpu") = py::str(), py::arg("targetFeatures") = py::list(), py::arg("isaVariants") = py::list(), py::arg("lto") = false)
+    .def("cdef", dffi_cdef, py::keep_alive<0,1>(), py::arg("code"), py::arg("name") = nullptr, py::arg("useLastError") = false, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("compile", dffi_compile, py::keep_alive<0,1>(), py::arg("code"), py::arg("useLastError") = false, py::arg("imports") = std::vector<CompilationUnit>{}, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("cdefAsync", dffi_cdef_async, py::arg("code"), py::arg("name") = nullptr, py::arg("useLastError") = false, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("compileAsync", dffi_compile_async, py::arg("code"), py::arg("useLastError") = false, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("cdefAsyncio", dffi_cdef_asyncio, py::arg("code"), py::arg("name") = nullptr, py::arg("useLastError") = false, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("compileAsyncio", dffi_compile_asyncio, py::arg("code"), py::arg("useLastError") = false, py::arg("fastMath") = false, py::arg("fpContractFast") = false, py::arg("vectorizeWidth") = 0, py::arg("interleaveCount") = 0, py::arg("unrollCount") = 0, py::arg("passPipeline") = py::str(), py::arg("shareStatics") = false)
+    .def("precompileHeaders", dffi_precompile_headers, py::arg("code"))
+    .def("linkCompilationUnits", dffi_link_compilation_units)
     //.def("view", dffi_view, py::keep_alive<0,1>(), py::keep_alive<0,2>())
     .def("basicType", 
       (BasicType const*(DFFI::*)(BasicType::BasicKind)) &DFFI::getBasicType,
@@ -867,7 +1105,7 @@ PYBIND11_MODULE(PYDFFI_EXT_NAME, m)
   m.def("setLastError", &NativeFunc::setLastError);
 
   // Exceptions
-  py::register_exception<CompileError>(m, "CompileError");
+  PyCompileError = py::register_exception<CompileError>(m, "CompileError");
   py::register_exception<UnknownFunctionError>(m, "UnknownFunctionError");
   py::register_exception<TypeError>(m, "TypeError");
   py::register_exception<DLOpenError>(m, "DLOpenError");
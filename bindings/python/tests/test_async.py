@@ -0,0 +1,67 @@
+# Copyright 2018 Adrien Guinet <adrien@guinet.me>
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import unittest
+import pydffi
+import sys
+
+from common import DFFITest
+
+class AsyncTest(DFFITest):
+    def test_future(self):
+        F = self.FFI
+        Futs = [F.compileAsync("int get_%d(int a) { return a+%d; }" % (i,i)) for i in range(4)]
+        for i,Fut in enumerate(Futs):
+            CU = Fut.result()
+            self.assertEqual(int(getattr(CU.funcs, "get_%d" % i)(1)), 1+i)
+
+    def test_cdef_error(self):
+        Fut = self.FFI.cdefAsync("int a(;")
+        self.assertRaises(pydffi.CompileError, Fut.result)
+
+    def test_compile_opts(self):
+        F = self.FFI
+        Code = '''
+int fast_math() {
+#ifdef __FAST_MATH__
+  return 1;
+#else
+  return 0;
+#endif
+}
+'''
+        CU = F.compileAsync(Code, fastMath=True).result()
+        self.assertEqual(int(CU.funcs.fast_math()), 1)
+        CU = F.cdefAsync(Code, fastMath=True).result()
+        self.assertEqual(int(CU.funcs.fast_math()), 1)
+        CU = F.cdef(Code, fastMath=True)
+        self.assertEqual(int(CU.funcs.fast_math()), 1)
+        CU = F.compileAsync(Code).result()
+        self.assertEqual(int(CU.funcs.fast_math()), 0)
+
+    @unittest.skipIf(sys.version_info < (3,5), "asyncio needs python >= 3.5")
+    def test_asyncio(self):
+        import asyncio
+        F = self.FFI
+        async def run():
+            CU = await F.cdefAsyncio("struct A { int a; short b; }; int get(struct A* a);")
+            return CU.types.A.size
+        loop = asyncio.new_event_loop()
+        try:
+            self.assertEqual(loop.run_until_complete(run()), 8)
+        finally:
+            loop.close()
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,40 @@
+# Copyright 2018 Adrien Guinet <adrien@guinet.me>
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# RUN: "%python" "%s"
+#
+
+import unittest
+import pydffi
+
+from common import DFFITest
+
+class CompileImportsTest(DFFITest):
+    def test_compile_imports(self):
+        CUDecls = self.FFI.cdef('''
+typedef struct {
+  int a;
+  short b;
+} A;
+int twice(int a) { return a*2; }
+''')
+        CU = self.FFI.compile('''
+int sum(A const* a) { return twice(a->a) + a->b; }
+''', imports=[CUDecls])
+        self.assertEqual(CU.types.A, CUDecls.types.A)
+        A = CUDecls.types.A(a=20, b=2)
+        self.assertEqual(CU.funcs.sum(pydffi.ptr(A)).value, 42)
+
+if __name__ == '__main__':
+    unittest.main()
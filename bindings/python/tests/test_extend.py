@@ -0,0 +1,44 @@
+# Copyright 2018 Adrien Guinet <adrien@guinet.me>
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# RUN: "%python" "%s"
+#
+
+import unittest
+import pydffi
+
+from common import DFFITest
+
+class ExtendTest(DFFITest):
+    def test_extend(self):
+        CU = self.FFI.cdef('''
+typedef struct {
+  int a;
+  short b;
+} A;
+int twice(int a) { return a*2; }
+''')
+        TyA = CU.types.A
+        CU.extend('''
+int sum(A const* a) { return twice(a->a) + a->b; }
+''')
+        self.assertEqual(CU.types.A, TyA)
+        A = TyA(a=20, b=2)
+        self.assertEqual(CU.funcs.sum(pydffi.ptr(A)).value, 42)
+
+        with self.assertRaises(pydffi.CompileError):
+            CU.extend("int invalid(struct D* d) { return d->x; }")
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,44 @@
+# Copyright 2018 Adrien Guinet <adrien@guinet.me>
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# RUN: "%python" "%s"
+#
+
+import unittest
+import pydffi
+
+from common import DFFITest
+
+class PCHTest(DFFITest):
+    def test_pch(self):
+        with self.assertRaises(pydffi.CompileError):
+            self.FFI.precompileHeaders("struct A { int a; ")
+
+        self.FFI.precompileHeaders('''
+#include <stdlib.h>
+typedef struct {
+  int a;
+  short b;
+} A;
+''')
+        CU = self.FFI.cdef('''
+int sum(A const* a) { return a->a + a->b; }
+''')
+        self.assertTrue(isinstance(CU.types.A, pydffi.StructType))
+        A = CU.types.A(a=40, b=2)
+        self.assertEqual(CU.funcs.sum(pydffi.ptr(A)).value, 42)
+        self.assertEqual(CU.funcs.atoi(b"12").value, 12)
+
+if __name__ == '__main__':
+    unittest.main()
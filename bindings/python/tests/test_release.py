@@ -0,0 +1,58 @@
+# Copyright 2018 Adrien Guinet <adrien@guinet.me>
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# RUN: "%python" "%s"
+#
+
+import unittest
+import pydffi
+
+from common import DFFITest
+
+class ReleaseTest(DFFITest):
+    def test_release(self):
+        for i in range(20):
+            CU = self.FFI.compile('''
+struct S { int a; int b; };
+int kernel(int a) { struct S s = {a, %d}; return s.a + s.b; }
+''' % i)
+            self.assertEqual(CU.funcs.kernel(10).value, 10+i)
+            CU.release()
+            # Releasing twice is a no-op
+            CU.release()
+
+    def test_release_alive(self):
+        CU = self.FFI.compile('''
+struct S { int a; int b; };
+int kernel(int a) { return a+1; }
+''')
+        kernel = CU.funcs.kernel
+        S = CU.types.S
+        s = S(a=1, b=2)
+        self.assertEqual(kernel(10).value, 11)
+        CU.release()
+        # Functions obtained before can't be called anymore...
+        with self.assertRaises(pydffi.BadFunctionCall):
+            kernel(10)
+        with self.assertRaises(pydffi.BadFunctionCall):
+            CU.funcs.kernel
+        # ... but the types and objects are still usable, as they keep the
+        # compilation unit alive.
+        self.assertEqual(s.a + s.b, 3)
+        s = S(a=3, b=4)
+        self.assertEqual(s.a + s.b, 7)
+        del CU, kernel, S, s
+
+if __name__ == '__main__':
+    unittest.main()
@@ -31,11 +31,13 @@ class CompositeType;
 
 namespace details {
 struct CUImpl;
+struct ASTTypeImporter;
 } // details
 
 class DFFI_API CompositeField
 {
   friend struct details::CUImpl;
+  friend struct details::ASTTypeImporter;
   friend class CompositeType;
 
 public:
@@ -78,6 +80,7 @@ private:
 class DFFI_API CompositeType: public CanOpaqueType
 {
   friend struct details::CUImpl;
+  friend struct details::ASTTypeImporter;
   friend struct details::DFFICtx;
 
 public:
@@ -149,6 +152,7 @@ protected:
 class DFFI_API UnionType: public CompositeType
 {
   friend struct details::CUImpl;
+  friend struct details::ASTTypeImporter;
   friend struct details::DFFICtx;
 
 public:
@@ -175,6 +179,7 @@ public:
   using Fields = std::unordered_map<std::string, IntType>;
 
   friend struct details::CUImpl;
+  friend struct details::ASTTypeImporter;
   friend struct details::DFFICtx;
 
   // Generate opaque enum
@@ -19,6 +19,8 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <functional>
+#include <future>
 
 #include <dffi/cc.h>
 #include <dffi/exports.h>
@@ -51,6 +53,20 @@ enum CXXMode: uint8_t {
   Std20,
 };
 
+// How cdef handles the functions and variables defined by a compilation unit
+// (see CCOpts::CDef).
+enum class CDefMode: uint8_t {
+  // Code is only generated if the compilation unit defines functions or
+  // variables. Static inline functions of system headers aren't taken into
+  // account, and can't be called if no code is generated.
+  Auto,
+  // Code is always generated
+  Full,
+  // No code is generated: only types and function declarations are imported,
+  // and functions are looked up in the process and the loaded libraries.
+  DeclsOnly,
+};
+
 struct CCOpts
 {
   unsigned OptLevel;
@@ -62,11 +78,122 @@ struct CCOpts
 
   bool LazyJITWrappers = true;
 
+  // If not empty, compiled compilation units (object code and types) are
+  // stored in this directory, and reused by later compilations of the same
+  // code with the same options and unmodified included headers.
+  std::string CacheDir;
+
+  // Number of compilation units that can be compiled concurrently, from
+  // different threads. If greater than one, a pool of this many clang
+  // instances is created, and compilation units are compiled in parallel
+  // before being loaded into the shared JIT.
+  // Whatever this value, a DFFI object can be used from several threads.
+  // Concurrent compilation needs LLVM to be built with LLVM_ENABLE_THREADS.
+  unsigned Concurrency = 1;
+
+  // Number of threads used to generate the machine code of a compilation
+  // unit. If greater than one, compilation units are split in this many
+  // partitions, whose code is generated in parallel when the compilation unit
+  // is compiled. Otherwise, the code of each function is only generated the
+  // first time it is used.
+  unsigned CodeGenThreads = 1;
+
+  // If set, the machine code of compilation units and wrappers is generated
+  // as soon as they are compiled, and their LLVM IR, LLVM context and debug
+  // informations are freed right after. Only the object code, the symbols
+  // they define and the dffi types are kept. Types are then all created at
+  // compilation time, and the IR of wrappers is generated again when
+  // exported (see FunctionType::getWrapperLLVM).
+  bool DropIR = false;
+
+  // If not zero (and OptLevel isn't either), compilation units are first
+  // compiled without optimizations. Their functions called this many times
+  // (through a NativeFunc or a pointer) are then optimized at OptLevel by a
+  // background worker, and the optimized code replaces the unoptimized one
+  // behind the same function pointers. Variadic functions are never
+  // optimized this way, and compilation units compiled with tiers aren't
+  // stored in the on-disk cache.
+  unsigned TierUpThreshold = 0;
+
+  // If set, compilation units are instrumented to count how many times each
+  // of their branches is taken, and can then be compiled again with these
+  // counts (see CompilationUnit::recompileWithProfile). TierUpThreshold is
+  // ignored, and compilation units compiled this way aren't stored in the
+  // on-disk cache.
+  bool ProfileInstr = false;
+
+  // If set, the code of compilation units can later be linked together and
+  // optimized as a whole (see DFFI::linkCompilationUnits), e.g. to inline
+  // functions of a compilation unit in the ones of another. Their functions
+  // are then called through a stub, so that the pointers returned before
+  // use the new code. Ignored with TierUpThreshold, ProfileInstr or
+  // ISAVariants, and compilation units compiled this way aren't stored in
+  // the on-disk cache.
+  bool LTO = false;
+
+  // When no code is generated for a cdef'd compilation unit, nothing is added
+  // to the JIT, and only the wrappers of its functions are compiled.
+  CDefMode CDef = CDefMode::Auto;
+
+  // CPU code is generated for, by clang and the JIT. "native" is the CPU of
+  // the host, with the features it supports. If empty, the baseline CPU of
+  // the target is used.
+  std::string CPU;
+  // Features enabled ("+avx2") or disabled ("-avx512f") on top of the ones
+  // of CPU.
+  std::vector<std::string> TargetFeatures;
+
+  // CPUs (e.g. "x86-64-v3", "x86-64-v4") for which the functions of
+  // compilation units (and the static functions they call) are also
+  // compiled, from the least to the most capable.
+  // The functions returned by compilation units are the ones compiled for
+  // the last of them supported by the host, or for CPU if there is none.
+  // Only supported on x86 targets, and ignored with TierUpThreshold or
+  // ProfileInstr. Compilations fail if one of them isn't a known CPU.
+  std::vector<std::string> ISAVariants;
+
   bool hasCXX() const { return CXX != CXXMode::NoCXX; }
 
   std::string getSysroot() const;
 };
 
+// Options of the code generated for a single compilation unit (see
+// DFFI::compile), on top of the ones of its DFFI object. They also apply to
+// the code it is extended with, or compiled again with a profile.
+struct CompileOpts
+{
+  // Not an aggregate, so that "{CU}" is always a list of imports in calls to
+  // DFFI::compile.
+  CompileOpts() { }
+
+  // Same as clang's -ffast-math
+  bool FastMath = false;
+  // Same as clang's -ffp-contract=fast: floating point operations can be
+  // fused (e.g. into FMAs) across statements.
+  bool FPContractFast = false;
+
+  // If not zero, the loops of the compilation unit are vectorized with this
+  // width, interleaved this many times, and unrolled this many times, as if
+  // they had the matching "#pragma clang loop" (which takes precedence). One
+  // disables the transformation.
+  unsigned VectorizeWidth = 0;
+  unsigned InterleaveCount = 0;
+  unsigned UnrollCount = 0;
+
+  // If not empty, pipeline of LLVM passes (with the syntax of opt's -passes,
+  // e.g. "function(sroa,instcombine),default<O3>") run on the compilation
+  // unit instead of the one of CCOpts::OptLevel. Ignored with
+  // CCOpts::TierUpThreshold.
+  std::string PassPipeline;
+
+  // If set, the static variables of the compilation unit are shared with the
+  // code importing or extending it (see DFFI::compile and
+  // CompilationUnit::extend), which otherwise gets its own copies of the
+  // ones it uses. They are then kept as they are by the optimizer, which
+  // can't fold or remove them anymore.
+  bool ShareStatics = false;
+};
+
 class DFFI;
 
 struct Exception
@@ -106,11 +233,49 @@ public:
   std::vector<std::string> getTypes() const;
   std::vector<std::string> getFunctions() const;
 
+  // Adds the declarations and definitions of Code to the compilation unit.
+  // Code sees everything the compilation unit already declares, which is not
+  // parsed again: only Code is parsed and code generated. Static variables
+  // are shared with it if the compilation unit has been compiled with
+  // CompileOpts::ShareStatics. Returns false and sets Err if Code does not
+  // compile.
+  bool extend(const char* Code, std::string& Err, bool UseLastError = false);
+
+  // Compiles the compilation unit again, optimized using the profile
+  // collected by its instrumentation since it has been compiled (see
+  // CCOpts::ProfileInstr). Its functions returned from now on use the new
+  // code, and the same variables as the instrumented one, which is still
+  // used by the NativeFunc objects and the pointers returned before. Code
+  // the compilation unit has been extended with isn't compiled again.
+  // Returns false and sets Err on failure, e.g. if the profile doesn't match
+  // the code of the compilation unit.
+  bool recompileWithProfile(std::string& Err);
+
+  // Frees the compilation unit: its code is removed from the JIT, and its
+  // sources and types are dropped. This object becomes invalid, and so do its
+  // copies, its types and the NativeFunc objects it has returned. If other
+  // compilation units import it (see DFFI::compile), it is only freed with
+  // the last of them.
+  // The code of the wrappers used to call its functions is kept by the DFFI
+  // object, as other compilation units can have functions of the same type.
+  // Functions whose type uses the structures, unions or enums of the
+  // compilation unit get wrappers of their own, which thus leak when it is
+  // released.
+  void release();
+
 private:
   // Owned by DFFIImpl
   details::CUImpl* Impl_;
 };
 
+// Result of an asynchronous compilation. If CU is invalid, Err contains the
+// compilation errors.
+struct CompileResult
+{
+  CompilationUnit CU;
+  std::string Err;
+};
+
 // Based on LLVM's DynamicLibrary
 struct DFFI_API DynamicLibrary
 {
@@ -145,7 +310,47 @@ public:
   static void initialize();
 
   CompilationUnit compile(const char* Code, std::string& Err, bool UseLastError = false);
+  // Compiles Code with the declarations of the Imports compilation units
+  // visible, as if their sources were included. Their types are reused by the
+  // new compilation unit, and their sources are only parsed once for each set
+  // of imports. Their static variables are shared with Code if they have
+  // been compiled with CompileOpts::ShareStatics.
+  CompilationUnit compile(const char* Code, std::vector<CompilationUnit> const& Imports, std::string& Err, bool UseLastError = false);
+  // Compiles Code with Opts, which only apply to this compilation unit
+  CompilationUnit compile(const char* Code, CompileOpts const& Opts, std::string& Err, bool UseLastError = false);
+  CompilationUnit compile(const char* Code, std::vector<CompilationUnit> const& Imports, CompileOpts const& Opts, std::string& Err, bool UseLastError = false);
   CompilationUnit cdef(const char* Code, const char* CUName, std::string& Err, bool UseLastError = false);
+  CompilationUnit cdef(const char* Code, const char* CUName, CompileOpts const& Opts, std::string& Err, bool UseLastError = false);
+
+  // Asynchronous versions of compile and cdef. They are run by background
+  // workers owned by this object (as many as CCOpts::Concurrency). Done is
+  // called from the worker thread once the compilation is finished.
+  std::future<CompileResult> compileAsync(const char* Code, bool UseLastError = false);
+  std::future<CompileResult> compileAsync(const char* Code, CompileOpts const& Opts, bool UseLastError = false);
+  std::future<CompileResult> cdefAsync(const char* Code, const char* CUName, bool UseLastError = false);
+  std::future<CompileResult> cdefAsync(const char* Code, const char* CUName, CompileOpts const& Opts, bool UseLastError = false);
+  void compileAsync(const char* Code, std::function<void(CompileResult)> Done, bool UseLastError = false);
+  void compileAsync(const char* Code, CompileOpts const& Opts, std::function<void(CompileResult)> Done, bool UseLastError = false);
+  void cdefAsync(const char* Code, const char* CUName, std::function<void(CompileResult)> Done, bool UseLastError = false);
+  void cdefAsync(const char* Code, const char* CUName, CompileOpts const& Opts, std::function<void(CompileResult)> Done, bool UseLastError = false);
+
+  // Precompiles Code (typically a list of #include directives), which is then
+  // implicitly included by the next compile and cdef calls, without being
+  // parsed again. Calling it again replaces the previous precompiled header.
+  // Returns false and sets Err if Code does not compile.
+  bool precompileHeaders(const char* Code, std::string& Err);
+
+  // Links the code of the compilation units compiled with CCOpts::LTO (and
+  // not released) in a single module, optimized with the pipeline of a full
+  // LTO at CCOpts::OptLevel, and makes their functions (and the pointers
+  // returned before) use the new code. Calling it again links them again,
+  // along with the ones compiled since, and frees the previous code: none of
+  // their functions may be running in other threads meanwhile. Released
+  // compilation units which have been linked are only freed then. Returns
+  // false and sets Err if a compilation unit can't be linked with the
+  // previous ones (e.g. if they define the same function): it is then
+  // excluded from the next links, and uses its own code.
+  bool linkCompilationUnits(std::string& Err);
 
   BasicType const* getBasicType(BasicType::BasicKind K);
   template <class T>
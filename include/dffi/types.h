@@ -17,6 +17,7 @@
 
 // RTTI based on LLVM RTTI https://llvm.org/docs/HowToSetUpLLVMStyleRTTI.html
 
+#include <algorithm>
 #include <vector>
 #include <cstdint>
 #include <cassert>
@@ -61,6 +62,9 @@ protected:
   void addName(const char* Name) const {
     Names_.push_back(Name);
   }
+  void removeName(const char* Name) const {
+    Names_.erase(std::remove(Names_.begin(), Names_.end(), Name), Names_.end());
+  }
 
   const TypeKind Kind_;
   details::DFFIImpl& Dffi_;
@@ -127,5 +127,13 @@ void CUImpl::inlineCompositesAnonymousMembers()
 #endif
 }
 
+void CUImpl::inlineCompositesAnonymousMembers(ArrayRef<CompositeType*> CTys)
+{
+  std::unordered_set<CompositeType*> Visited;
+  for (auto* CTy: CTys) {
+    inlineCompositesAnonymousMembersImpl(Visited, CTy);
+  }
+}
+
 } // details
 } // dffi
@@ -51,9 +51,97 @@ CompilationUnit DFFI::compile(const char* Code, std::string& Err, bool UseLastEr
   return CompilationUnit{Impl_->compile(Code, llvm::StringRef{}, false, Err, UseLastError)};
 }
 
+CompilationUnit DFFI::compile(const char* Code, std::vector<CompilationUnit> const& Imports, std::string& Err, bool UseLastError)
+{
+  return compile(Code, Imports, CompileOpts{}, Err, UseLastError);
+}
+
+CompilationUnit DFFI::compile(const char* Code, CompileOpts const& Opts, std::string& Err, bool UseLastError)
+{
+  return CompilationUnit{Impl_->compile(Code, llvm::StringRef{}, false, Err, UseLastError, {}, Opts)};
+}
+
+CompilationUnit DFFI::compile(const char* Code, std::vector<CompilationUnit> const& Imports, CompileOpts const& Opts, std::string& Err, bool UseLastError)
+{
+  SmallVector<details::CUImpl*, 2> ImportsImpl;
+  for (auto const& CU: Imports) {
+    if (CU.isValid()) {
+      ImportsImpl.push_back(CU.Impl_);
+    }
+  }
+  return CompilationUnit{Impl_->compile(Code, llvm::StringRef{}, false, Err, UseLastError, ImportsImpl, Opts)};
+}
+
 CompilationUnit DFFI::cdef(const char* Code, const char* CUName, std::string& Err, bool UseLastError)
 {
-  return CompilationUnit{Impl_->compile(Code, CUName ? CUName : llvm::StringRef{}, true, Err, UseLastError)};
+  return cdef(Code, CUName, CompileOpts{}, Err, UseLastError);
+}
+
+CompilationUnit DFFI::cdef(const char* Code, const char* CUName, CompileOpts const& Opts, std::string& Err, bool UseLastError)
+{
+  return CompilationUnit{Impl_->compile(Code, CUName ? CUName : llvm::StringRef{}, true, Err, UseLastError, {}, Opts)};
+}
+
+void DFFI::compileAsync(const char* Code, std::function<void(CompileResult)> Done, bool UseLastError)
+{
+  compileAsync(Code, CompileOpts{}, std::move(Done), UseLastError);
+}
+
+void DFFI::compileAsync(const char* Code, CompileOpts const& Opts, std::function<void(CompileResult)> Done, bool UseLastError)
+{
+  Impl_->compileAsync(Code, std::string{}, false, UseLastError, Opts,
+    [Done](details::CUImpl* CU, std::string& Err) {
+      Done(CompileResult{CompilationUnit{CU}, std::move(Err)});
+    });
+}
+
+void DFFI::cdefAsync(const char* Code, const char* CUName, std::function<void(CompileResult)> Done, bool UseLastError)
+{
+  cdefAsync(Code, CUName, CompileOpts{}, std::move(Done), UseLastError);
+}
+
+void DFFI::cdefAsync(const char* Code, const char* CUName, CompileOpts const& Opts, std::function<void(CompileResult)> Done, bool UseLastError)
+{
+  Impl_->compileAsync(Code, CUName ? CUName : std::string{}, true, UseLastError, Opts,
+    [Done](details::CUImpl* CU, std::string& Err) {
+      Done(CompileResult{CompilationUnit{CU}, std::move(Err)});
+    });
+}
+
+std::future<CompileResult> DFFI::compileAsync(const char* Code, bool UseLastError)
+{
+  return compileAsync(Code, CompileOpts{}, UseLastError);
+}
+
+std::future<CompileResult> DFFI::compileAsync(const char* Code, CompileOpts const& Opts, bool UseLastError)
+{
+  auto Promise = std::make_shared<std::promise<CompileResult>>();
+  auto Ret = Promise->get_future();
+  compileAsync(Code, Opts, [Promise](CompileResult R) { Promise->set_value(std::move(R)); }, UseLastError);
+  return Ret;
+}
+
+std::future<CompileResult> DFFI::cdefAsync(const char* Code, const char* CUName, bool UseLastError)
+{
+  return cdefAsync(Code, CUName, CompileOpts{}, UseLastError);
+}
+
+std::future<CompileResult> DFFI::cdefAsync(const char* Code, const char* CUName, CompileOpts const& Opts, bool UseLastError)
+{
+  auto Promise = std::make_shared<std::promise<CompileResult>>();
+  auto Ret = Promise->get_future();
+  cdefAsync(Code, CUName, Opts, [Promise](CompileResult R) { Promise->set_value(std::move(R)); }, UseLastError);
+  return Ret;
+}
+
+bool DFFI::precompileHeaders(const char* Code, std::string& Err)
+{
+  return Impl_->precompileHeaders(Code, Err);
+}
+
+bool DFFI::linkCompilationUnits(std::string& Err)
+{
+  return Impl_->linkCompilationUnits(Err);
 }
 
 BasicType const* DFFI::getBasicType(BasicType::BasicKind K)
@@ -420,6 +508,25 @@ NativeFunc CompilationUnit::getFunction(void* FPtr, FunctionType const* FTy, Typ
   return Impl_->getFunction(FPtr, FTy, ArrayRef<Type const*>{VarArgsTys, VarArgsCount});
 }
 
+bool CompilationUnit::extend(const char* Code, std::string& Err, bool UseLastError)
+{
+  assert(isValid());
+  return Impl_->DFFI_.extend(*Impl_, Code, Err, UseLastError);
+}
+
+bool CompilationUnit::recompileWithProfile(std::string& Err)
+{
+  assert(isValid());
+  return Impl_->DFFI_.recompileWithProfile(*Impl_, Err);
+}
+
+void CompilationUnit::release()
+{
+  assert(isValid());
+  Impl_->DFFI_.release(*Impl_);
+  Impl_ = nullptr;
+}
+
 bool CompilationUnit::isValid() const
 {
   return (bool)Impl_;
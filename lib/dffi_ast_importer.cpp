@@ -0,0 +1,582 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Attr.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/DeclCXX.h>
+#include <clang/AST/RecordLayout.h>
+#include <clang/Basic/TargetInfo.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/Preprocessor.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include <dffi/casting.h>
+#include "dffi_ast_importer.h"
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+ASTTypeImporter::ASTTypeImporter(CUImpl& CU, clang::CompilerInstance& Compiler, bool UseLastError, bool NewDeclsOnly, bool HasCode):
+  CU_(CU),
+  UseLastError_(UseLastError),
+  NewDeclsOnly_(NewDeclsOnly),
+  HasCode_(HasCode),
+  LangOpts_(Compiler.getInvocation().LangOpts),
+  Diags_(&Compiler.getSourceManager().getDiagnostics()),
+  FileMgr_(&Compiler.getFileManager()),
+  SourceMgr_(&Compiler.getSourceManager()),
+  Target_(&Compiler.getTarget()),
+  PP_(Compiler.getPreprocessorPtr()),
+  ASTCtx_(&Compiler.getASTContext())
+{ }
+
+ASTTypeImporter::~ASTTypeImporter()
+{ }
+
+bool ASTTypeImporter::importTranslationUnit(CUImpl& CU, clang::CompilerInstance& Compiler, bool UseLastError, bool Extend, bool HasCode)
+{
+  std::unique_ptr<ASTTypeImporter> Importer{new ASTTypeImporter{CU, Compiler, UseLastError, Extend, HasCode}};
+  std::lock_guard<std::recursive_mutex> Lock(CU.DFFI_.Mutex_);
+  if (Extend && CU.ASTImporter_) {
+    // Only the declarations of the new code are indexed, and the AST of the
+    // previous parts isn't needed anymore.
+    CU.ASTImporter_->importAll();
+  }
+  if (!Importer->indexTranslationUnit(Compiler.getDiagnostics())) {
+    return false;
+  }
+  CU.ASTImporter_ = std::move(Importer);
+  CU.DFFI_.retainAST(CU);
+  return true;
+}
+
+bool ASTTypeImporter::indexTranslationUnit(clang::DiagnosticsEngine& Diags)
+{
+  // Declarations of precompiled sources are only deserialized if they are
+  // needed.
+  auto const* TU = ASTCtx_->getTranslationUnitDecl();
+  for (clang::Decl const* D: NewDeclsOnly_ ? TU->noload_decls() : TU->decls()) {
+    importDecl(D);
+  }
+  definePending();
+  if (UnsupportedFields_.empty()) {
+    return true;
+  }
+  const unsigned DiagID = Diags.getCustomDiagID(clang::DiagnosticsEngine::Error,
+    "unsupported type %0 for field %1 of %2");
+  for (clang::FieldDecl const* FD: UnsupportedFields_) {
+    Diags.Report(FD->getLocation(), DiagID) << FD->getType() << FD
+      << ASTCtx_->getRecordType(FD->getParent());
+  }
+  return false;
+}
+
+dffi::CanOpaqueType* ASTTypeImporter::importComposite(StringRef Name)
+{
+  auto It = Composites_.find(Name);
+  if (It == Composites_.end()) {
+    return nullptr;
+  }
+  auto* Ret = importTag(It->second);
+  definePending();
+  return Ret;
+}
+
+bool ASTTypeImporter::importTypedef(StringRef Name)
+{
+  auto It = Typedefs_.find(Name);
+  if (It == Typedefs_.end()) {
+    return false;
+  }
+  CU_.setAlias(Name, importType(It->second->getUnderlyingType()));
+  definePending();
+  return true;
+}
+
+void ASTTypeImporter::importAll()
+{
+  for (auto const& It: Composites_) {
+    importTag(It.getValue());
+  }
+  for (auto const& It: Typedefs_) {
+    if (!CU_.AliasTys_.count(It.getKey())) {
+      CU_.setAlias(It.getKey(), importType(It.getValue()->getUnderlyingType()));
+    }
+  }
+  definePending();
+}
+
+void ASTTypeImporter::importDecl(clang::Decl const* D)
+{
+  if (D->isImplicit() || D->isInvalidDecl()) {
+    return;
+  }
+  if (auto const* LSD = llvm::dyn_cast<clang::LinkageSpecDecl>(D)) {
+    if (LSD->getLanguage() == clang::LinkageSpecDecl::lang_c) {
+      for (clang::Decl const* CD: LSD->decls()) {
+        importDecl(CD);
+      }
+    }
+  }
+  else
+  if (auto const* FD = llvm::dyn_cast<clang::FunctionDecl>(D)) {
+    importFunction(FD);
+  }
+  else
+  if (auto const* TD = llvm::dyn_cast<clang::TypedefNameDecl>(D)) {
+    Typedefs_.try_emplace(TD->getName(), TD);
+  }
+  else
+  if (auto const* TD = llvm::dyn_cast<clang::TagDecl>(D)) {
+    indexTag(TD);
+    // In C, structures declared inside other ones are visible from the
+    // whole translation unit.
+    auto const* RD = llvm::dyn_cast<clang::RecordDecl>(TD);
+    if (RD && !LangOpts_->CPlusPlus) {
+      for (clang::Decl const* SD: RD->decls()) {
+        if (llvm::isa<clang::TagDecl>(SD)) {
+          importDecl(SD);
+        }
+      }
+    }
+  }
+}
+
+void ASTTypeImporter::indexTag(clang::TagDecl const* TD)
+{
+  StringRef Name = TD->getName();
+  if (Name.startswith("__dffi")) {
+    llvm::report_fatal_error("__dffi is a compiler reserved prefix and can't be used in a structure name!");
+  }
+  if (!Name.empty()) {
+    Composites_.try_emplace(Name, TD);
+  }
+  auto const* RD = llvm::dyn_cast<clang::RecordDecl>(TD);
+  if (RD && RD->isThisDeclarationADefinition()) {
+    checkRecord(RD);
+  }
+}
+
+void ASTTypeImporter::checkRecord(clang::RecordDecl const* RD)
+{
+  // Structures of system headers with unsupported fields are left opaque
+  // (see defineRecord), as they might never be used.
+  if (!CheckedRecords_.insert(RD).second || RD->isInvalidDecl() ||
+      SourceMgr_->isInSystemHeader(RD->getLocation())) {
+    return;
+  }
+  if (auto const* CXXRD = llvm::dyn_cast<clang::CXXRecordDecl>(RD)) {
+    if (!CXXRD->isCLike()) {
+      return;
+    }
+  }
+  for (clang::FieldDecl const* FD: RD->fields()) {
+    if (FD->isUnnamedBitfield()) {
+      continue;
+    }
+    if (!isSupported(FD->getType())) {
+      UnsupportedFields_.push_back(FD);
+      continue;
+    }
+    // Anonymous structures/unions can only be reached through their fields
+    auto const* FRD = FD->getType()->getAsRecordDecl();
+    if (FRD && FRD->getName().empty() && FRD->getDefinition()) {
+      checkRecord(FRD->getDefinition());
+    }
+  }
+}
+
+bool ASTTypeImporter::isSupported(clang::QualType QTy)
+{
+  // Same as importType, without creating any type
+  clang::Type const* Ty = QTy.getCanonicalType().getTypePtr();
+  if (llvm::isa<clang::BuiltinType>(Ty) || llvm::isa<clang::ComplexType>(Ty)) {
+    BasicType::BasicKind Kind;
+    return getBasicKind(Ty, Kind);
+  }
+  if (llvm::isa<clang::PointerType>(Ty)) {
+    return true;
+  }
+  if (auto const* ATy = llvm::dyn_cast<clang::ArrayType>(Ty)) {
+    return isSupported(ATy->getElementType());
+  }
+  if (auto const* VTy = llvm::dyn_cast<clang::VectorType>(Ty)) {
+    return isSupported(VTy->getElementType());
+  }
+  if (auto const* TTy = llvm::dyn_cast<clang::TagType>(Ty)) {
+    auto const* CXXRD = llvm::dyn_cast<clang::CXXRecordDecl>(TTy->getDecl());
+    return !CXXRD || CXXRD->isCLike();
+  }
+  if (auto const* ATy = llvm::dyn_cast<clang::AtomicType>(Ty)) {
+    return isSupported(ATy->getValueType());
+  }
+  return false;
+}
+
+void ASTTypeImporter::importFunction(clang::FunctionDecl const* FD)
+{
+  // The most recent declaration has the merged type and attributes of the
+  // previous ones.
+  FD = FD->getMostRecentDecl();
+  if (!VisitedFuncs_.insert(FD->getCanonicalDecl()).second) {
+    return;
+  }
+  if (LangOpts_->CPlusPlus && !FD->isExternC()) {
+    return;
+  }
+  if (!FD->getIdentifier() || FD->isNoReturn()) {
+    return;
+  }
+  // Without generated code, functions only defined by the translation unit
+  // (e.g. static inline functions of system headers) can't be called.
+  clang::FunctionDecl const* Def;
+  if (!HasCode_ && FD->isDefined(Def)) {
+    const auto Linkage = ASTCtx_->GetGVALinkageForFunction(Def);
+    if (Linkage == clang::GVA_Internal || Linkage == clang::GVA_DiscardableODR) {
+      return;
+    }
+  }
+  auto const* FTy = FD->getType()->getAs<clang::FunctionType>();
+  assert(FTy);
+  auto const* DFTy = importFunctionType(FTy, UseLastError_);
+  if (!DFTy) {
+    return;
+  }
+
+  // See tests/asm_redirect.cpp. Functions are registered with the name of
+  // their symbol, and their C name is an alias to it.
+  StringRef Name = FD->getName();
+  if (auto const* Attr = FD->getAttr<clang::AsmLabelAttr>()) {
+    std::string Label = Attr->getLabel().str();
+    if (Label != Name) {
+      CU_.FuncAliases_[Name] = Label;
+    }
+    CU_.FuncTys_[Label] = DFTy;
+  }
+  else {
+    CU_.FuncTys_[Name] = DFTy;
+  }
+}
+
+dffi::QualType ASTTypeImporter::importQualType(clang::QualType QTy)
+{
+  dffi::QualType Ret{importType(QTy)};
+  if (QTy.isConstQualified()) {
+    return Ret.withConst();
+  }
+  return Ret;
+}
+
+bool ASTTypeImporter::getBasicKind(clang::Type const* Ty, BasicType::BasicKind& Kind)
+{
+  if (auto const* BTy = llvm::dyn_cast<clang::BuiltinType>(Ty)) {
+#define HANDLE_BASICTY(TySize, KTy)\
+    if (Size == TySize) {\
+      Kind = BasicType::getKind<KTy>();\
+      return true;\
+    }
+
+    switch (BTy->getKind()) {
+      case clang::BuiltinType::Bool:
+        Kind = BasicType::Bool;
+        return true;
+      case clang::BuiltinType::Char_S:
+      case clang::BuiltinType::Char_U:
+        Kind = BasicType::Char;
+        return true;
+      case clang::BuiltinType::Float:
+        Kind = BasicType::Float;
+        return true;
+      case clang::BuiltinType::Double:
+        Kind = BasicType::Double;
+        return true;
+      case clang::BuiltinType::LongDouble:
+        Kind = BasicType::LongDouble;
+        return true;
+      default:
+        break;
+    };
+    if (!BTy->isInteger()) {
+      return false;
+    }
+    // Integers are mapped on their size, as the debug info based path does
+    // (for instance, wchar_t is an int32_t).
+    const auto Size = ASTCtx_->getTypeSize(BTy);
+    if (BTy->isSignedInteger()) {
+      HANDLE_BASICTY(8, int8_t);
+      HANDLE_BASICTY(16, int16_t);
+      HANDLE_BASICTY(32, int32_t);
+      HANDLE_BASICTY(64, int64_t);
+#ifdef DFFI_SUPPORT_I128
+      HANDLE_BASICTY(128, __int128_t);
+#endif
+    }
+    else {
+      HANDLE_BASICTY(8, uint8_t);
+      HANDLE_BASICTY(16, uint16_t);
+      HANDLE_BASICTY(32, uint32_t);
+      HANDLE_BASICTY(64, uint64_t);
+#ifdef DFFI_SUPPORT_I128
+      HANDLE_BASICTY(128, __uint128_t);
+#endif
+    }
+#undef HANDLE_BASICTY
+    return false;
+  }
+
+#ifdef DFFI_SUPPORT_COMPLEX
+  if (auto const* CTy = llvm::dyn_cast<clang::ComplexType>(Ty)) {
+    auto const* EltTy = CTy->getElementType()->getAs<clang::BuiltinType>();
+    switch (EltTy ? EltTy->getKind() : clang::BuiltinType::Void) {
+      case clang::BuiltinType::Float:
+        Kind = BasicType::ComplexFloat;
+        return true;
+      case clang::BuiltinType::Double:
+        Kind = BasicType::ComplexDouble;
+        return true;
+      case clang::BuiltinType::LongDouble:
+        Kind = BasicType::ComplexLongDouble;
+        return true;
+      default:
+        return false;
+    };
+  }
+#endif
+  return false;
+}
+
+dffi::Type const* ASTTypeImporter::importType(clang::QualType QTy)
+{
+  // Typedefs, elaborated types, parenthesis, ... are all removed from the
+  // canonical type.
+  clang::Type const* Ty = QTy.getCanonicalType().getTypePtr();
+  auto& DFFI = CU_.DFFI_;
+
+  if (llvm::isa<clang::BuiltinType>(Ty) || llvm::isa<clang::ComplexType>(Ty)) {
+    // void is represented by a null type
+    BasicType::BasicKind Kind;
+    return getBasicKind(Ty, Kind) ? DFFI.getBasicType(Kind) : nullptr;
+  }
+
+  if (auto const* PtrTy = llvm::dyn_cast<clang::PointerType>(Ty)) {
+    return DFFI.getPointerType(importQualType(PtrTy->getPointeeType()));
+  }
+
+  if (auto const* ATy = llvm::dyn_cast<clang::ConstantArrayType>(Ty)) {
+    return DFFI.getArrayType(importQualType(ATy->getElementType()), ATy->getSize().getZExtValue());
+  }
+  if (auto const* ATy = llvm::dyn_cast<clang::IncompleteArrayType>(Ty)) {
+    // Flexible array members
+    return DFFI.getArrayType(importQualType(ATy->getElementType()), 0);
+  }
+  if (auto const* ATy = llvm::dyn_cast<clang::ArrayType>(Ty)) {
+    return DFFI.getPointerType(importQualType(ATy->getElementType()));
+  }
+  if (auto const* VTy = llvm::dyn_cast<clang::VectorType>(Ty)) {
+    return DFFI.getArrayType(importQualType(VTy->getElementType()), VTy->getNumElements());
+  }
+
+  if (auto const* TTy = llvm::dyn_cast<clang::TagType>(Ty)) {
+    return importTag(TTy->getDecl());
+  }
+
+  if (auto const* FTy = llvm::dyn_cast<clang::FunctionType>(Ty)) {
+    return importFunctionType(FTy, false /* UseLastError */);
+  }
+
+  if (auto const* ATy = llvm::dyn_cast<clang::AtomicType>(Ty)) {
+    return importType(ATy->getValueType());
+  }
+
+  // C++ references, member pointers, blocks, ... aren't supported
+  return nullptr;
+}
+
+dffi::FunctionType const* ASTTypeImporter::importFunctionType(clang::FunctionType const* FTy, bool UseLastError)
+{
+  clang::QualType CRetTy = FTy->getReturnType();
+  auto RetTy = importQualType(CRetTy);
+  if (!RetTy.getType() && !CRetTy->isVoidType()) {
+    return nullptr;
+  }
+
+  llvm::SmallVector<dffi::QualType, 8> ParamsTy;
+  bool IsVarArgs = false;
+  // Functions without prototypes (int f()) are considered as taking no
+  // argument.
+  if (auto const* FPTy = llvm::dyn_cast<clang::FunctionProtoType>(FTy)) {
+    ParamsTy.reserve(FPTy->getNumParams());
+    for (clang::QualType PTy: FPTy->getParamTypes()) {
+      auto ATy = importQualType(PTy);
+      if (!ATy.getType()) {
+        return nullptr;
+      }
+      ParamsTy.push_back(ATy);
+    }
+    IsVarArgs = FPTy->isVariadic();
+  }
+  // dffi's calling conventions are mapped on clang's ones (see cconv.cpp)
+  auto CC = static_cast<dffi::CallingConv>(FTy->getCallConv());
+  return CU_.getContext().getFunctionType(CU_.DFFI_, RetTy, ParamsTy, CC, IsVarArgs, UseLastError);
+}
+
+dffi::CanOpaqueType* ASTTypeImporter::importTag(clang::TagDecl const* TD)
+{
+  TD = llvm::cast<clang::TagDecl>(TD->getCanonicalDecl());
+  auto It = Tags_.find(TD);
+  if (It != Tags_.end()) {
+    return It->second;
+  }
+
+  // C++ types, we don't support this!
+  if (auto const* CXXRD = llvm::dyn_cast<clang::CXXRecordDecl>(TD)) {
+    if (!CXXRD->isCLike()) {
+      Tags_[TD] = nullptr;
+      return nullptr;
+    }
+  }
+
+  StringRef Name = TD->getName();
+  CanOpaqueType* CATy = nullptr;
+  if (!Name.empty()) {
+    auto ItCU = CU_.CompositeTys_.find(Name);
+    if (ItCU != CU_.CompositeTys_.end()) {
+      CATy = ItCU->second.get();
+    }
+  }
+  else
+  if (NewDeclsOnly_ && TD->isFromASTFile()) {
+    // Anonymous types of the extended compilation unit are found through
+    // the typedefs naming them.
+    if (auto const* TND = TD->getTypedefNameForAnonDecl()) {
+      auto It = CU_.AliasTys_.find(TND->getName());
+      if (It != CU_.AliasTys_.end()) {
+        CATy = const_cast<CanOpaqueType*>(dffi::dyn_cast_or_null<CanOpaqueType>(It->second));
+      }
+    }
+  }
+  if (CATy && !CATy->isOpaque()) {
+    // Already defined by a previous part of the compilation unit
+    Tags_[TD] = CATy;
+    return CATy;
+  }
+  if (!CATy) {
+    dffi::Type::TypeKind Kind;
+    if (TD->isEnum()) {
+      Kind = dffi::Type::TY_Enum;
+    }
+    else
+    if (TD->isUnion()) {
+      Kind = dffi::Type::TY_Union;
+    }
+    else {
+      Kind = dffi::Type::TY_Struct;
+    }
+    CATy = CU_.declareComposite(Kind, Name);
+  }
+  Tags_[TD] = CATy;
+  if (auto const* Def = TD->getDefinition()) {
+    Pending_.emplace_back(Def, CATy);
+  }
+  return CATy;
+}
+
+void ASTTypeImporter::defineRecord(clang::RecordDecl const* RD, CompositeType* CTy)
+{
+  if (RD->isInvalidDecl()) {
+    return;
+  }
+  auto const& Layout = ASTCtx_->getASTRecordLayout(RD);
+  std::vector<CompositeField> Fields;
+  size_t AnonIdx = 0;
+  for (clang::FieldDecl const* FD: RD->fields()) {
+    // Same as the debug informations
+    if (FD->isUnnamedBitfield()) {
+      continue;
+    }
+    const uint64_t FOffset = Layout.getFieldOffset(FD->getFieldIndex());
+    if (FD->isBitField() && (FOffset % 8 != 0 ||
+        FD->getBitWidthValue(*ASTCtx_) != ASTCtx_->getTypeSize(FD->getType()))) {
+      // Fields are addressed by bytes, with the size of their type. Other
+      // bitfields can't be represented, and are skipped (the size of the
+      // structure still comes from the layout).
+      continue;
+    }
+    std::string FName;
+    {
+      StringRef S = FD->getName();
+      if (!S.empty()) {
+        FName = S.str();
+      }
+      else {
+        FName = std::string{"__dffi_anon_"} + std::to_string(AnonIdx++);
+      }
+    }
+    dffi::Type const* FTy = importType(FD->getType());
+    if (!FTy) {
+      // Only structures of system headers can get there (see checkRecord),
+      // and they stay opaque.
+      return;
+    }
+    Fields.emplace_back(CompositeField{FName.c_str(), FTy, static_cast<unsigned>(FOffset/8)});
+  }
+  const auto Size = Layout.getSize().getQuantity();
+  const auto Align = Layout.getAlignment().getQuantity();
+  if (auto* UTy = dffi::dyn_cast<UnionType>(CTy)) {
+    UTy->setBody(std::move(Fields), Size, Align);
+  }
+  else {
+    CTy->setBody(std::move(Fields), Size, Align);
+  }
+}
+
+void ASTTypeImporter::defineEnum(clang::EnumDecl const* ED, EnumType* ETy)
+{
+  EnumType::Fields Fields;
+  for (clang::EnumConstantDecl const* ECD: ED->enumerators()) {
+    llvm::APSInt const& Val = ECD->getInitVal();
+    assert(Val.isSignedIntN(sizeof(int)*8) && "enum whose value isn't an int");
+    Fields[ECD->getName().str()] = Val.getExtValue();
+  }
+  ETy->setBody(std::move(Fields));
+}
+
+void ASTTypeImporter::definePending()
+{
+  llvm::SmallVector<CompositeType*, 16> Defined;
+  while (!Pending_.empty()) {
+    auto P = Pending_.pop_back_val();
+    if (!P.second->isOpaque()) {
+      continue;
+    }
+    if (auto* CTy = dffi::dyn_cast<CompositeType>(P.second)) {
+      defineRecord(llvm::cast<clang::RecordDecl>(P.first), CTy);
+      if (!CTy->isOpaque()) {
+        Defined.push_back(CTy);
+      }
+    }
+    else {
+      defineEnum(llvm::cast<clang::EnumDecl>(P.first), dffi::cast<EnumType>(P.second));
+    }
+  }
+  // Anonymous members can only be inlined once their types are defined
+  CU_.inlineCompositesAnonymousMembers(Defined);
+}
+
+} // details
+} // dffi
@@ -0,0 +1,139 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DFFI_AST_IMPORTER_H
+#define DFFI_AST_IMPORTER_H
+
+#include <memory>
+#include <utility>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <clang/AST/Type.h>
+
+#include <dffi/composite_type.h>
+#include <dffi/types.h>
+
+namespace clang {
+class ASTContext;
+class CompilerInstance;
+class Decl;
+class DiagnosticsEngine;
+class EnumDecl;
+class FieldDecl;
+class FileManager;
+class FunctionDecl;
+class LangOptions;
+class Preprocessor;
+class RecordDecl;
+class SourceManager;
+class TagDecl;
+class TargetInfo;
+class TypedefNameDecl;
+} // clang
+
+namespace dffi {
+namespace details {
+
+struct CUImpl;
+
+// Creates the types, typedefs and function types of a compilation unit
+// straight from the clang AST, using clang's record layouts for the offsets,
+// sizes and alignments of structures and unions. Unlike the debug info based
+// path, this doesn't need the compilation unit to be code generated.
+// Like the debug info based path, types are only created the first time they
+// are looked up. The AST is thus kept alive with the importer (see
+// DFFIImpl::compile_llvm_with_decls).
+struct ASTTypeImporter
+{
+  // If NewDeclsOnly is set, CU is being extended (see DFFIImpl::extend), and
+  // declarations coming from its precompiled sources have already been
+  // imported. If HasCode isn't set, no code is generated for the translation
+  // unit (see CDefMode).
+  ASTTypeImporter(CUImpl& CU, clang::CompilerInstance& Compiler, bool UseLastError, bool NewDeclsOnly, bool HasCode);
+  ~ASTTypeImporter();
+
+  // Imports the functions declared at the top level of the translation unit
+  // parsed by Compiler, and indexes its typedefs and named
+  // structures/unions/enums, whose AST is then kept by CU. Returns false if a
+  // structure/union has a field whose type isn't supported, which is
+  // reported as an error of the translation unit.
+  static bool importTranslationUnit(CUImpl& CU, clang::CompilerInstance& Compiler, bool UseLastError, bool Extend, bool HasCode);
+
+  // Null if Name isn't a structure/union/enum of the translation unit
+  dffi::CanOpaqueType* importComposite(llvm::StringRef Name);
+  // Returns false if Name isn't a typedef of the translation unit. Otherwise,
+  // the type it names is an alias of the compilation unit.
+  bool importTypedef(llvm::StringRef Name);
+  // Imports every indexed type
+  void importAll();
+
+  llvm::StringMap<clang::TagDecl const*> const& composites() const { return Composites_; }
+  llvm::StringMap<clang::TypedefNameDecl const*> const& typedefs() const { return Typedefs_; }
+
+private:
+  bool indexTranslationUnit(clang::DiagnosticsEngine& Diags);
+  void importDecl(clang::Decl const* D);
+  void importFunction(clang::FunctionDecl const* FD);
+  void indexTag(clang::TagDecl const* TD);
+  void checkRecord(clang::RecordDecl const* RD);
+  bool isSupported(clang::QualType QTy);
+  bool getBasicKind(clang::Type const* Ty, dffi::BasicType::BasicKind& Kind);
+
+  dffi::QualType importQualType(clang::QualType QTy);
+  dffi::Type const* importType(clang::QualType QTy);
+  dffi::FunctionType const* importFunctionType(clang::FunctionType const* FTy, bool UseLastError);
+  dffi::CanOpaqueType* importTag(clang::TagDecl const* TD);
+
+  void defineRecord(clang::RecordDecl const* RD, dffi::CompositeType* CTy);
+  void defineEnum(clang::EnumDecl const* ED, dffi::EnumType* ETy);
+  void definePending();
+
+  CUImpl& CU_;
+  bool UseLastError_;
+  bool NewDeclsOnly_;
+  bool HasCode_;
+
+  // The AST, and what it refers to. The order matters, as they are freed in
+  // the reverse one.
+  std::shared_ptr<clang::LangOptions> LangOpts_;
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags_;
+  llvm::IntrusiveRefCntPtr<clang::FileManager> FileMgr_;
+  llvm::IntrusiveRefCntPtr<clang::SourceManager> SourceMgr_;
+  llvm::IntrusiveRefCntPtr<clang::TargetInfo> Target_;
+  std::shared_ptr<clang::Preprocessor> PP_;
+  llvm::IntrusiveRefCntPtr<clang::ASTContext> ASTCtx_;
+
+  // Named declarations of the translation unit, imported on first lookup
+  llvm::StringMap<clang::TagDecl const*> Composites_;
+  llvm::StringMap<clang::TypedefNameDecl const*> Typedefs_;
+  // Fields whose type isn't supported, found while indexing
+  llvm::SmallVector<clang::FieldDecl const*, 4> UnsupportedFields_;
+  llvm::SmallPtrSet<clang::RecordDecl const*, 32> CheckedRecords_;
+
+  llvm::DenseMap<clang::TagDecl const*, dffi::CanOpaqueType*> Tags_;
+  // Declared tags whose body still needs to be imported. Bodies are imported
+  // once the type being looked up is declared, so that the recursion depth
+  // isn't bounded by the length of chains of types referencing each others.
+  llvm::SmallVector<std::pair<clang::TagDecl const*, dffi::CanOpaqueType*>, 16> Pending_;
+  llvm::SmallPtrSet<clang::Decl const*, 32> VisitedFuncs_;
+};
+
+} // details
+} // dffi
+
+#endif
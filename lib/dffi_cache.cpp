@@ -0,0 +1,743 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// On-disk cache of compilation units. An entry contains the JIT object code
+// of the CU and a serialized version of its types and functions tables. It
+// is indexed by a hash of the source code, the compilation options and the
+// process triple, and is only considered valid if every file included during
+// the original compilation still has the same content.
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <dffi/composite_type.h>
+#include <dffi/casting.h>
+#include "dffi_impl.h"
+#include "dffi_cache.h"
+#include "dffi_vfs.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+// Bump this each time the format of a cache entry, or the way its types are
+// computed, changes
+const uint32_t CacheVersion = 2;
+const char CacheMagic[] = {'D','F','F','I','C','U'};
+
+enum CacheTypeKind: uint8_t {
+  CT_Struct,
+  CT_Union,
+  CT_Enum,
+  CT_Basic,
+  CT_Pointer,
+  CT_Array,
+  CT_Function
+};
+
+std::string hashFile(llvm::vfs::FileSystem& FS, StringRef Path)
+{
+  auto Buf = FS.getBufferForFile(Path);
+  if (!Buf) {
+    return {};
+  }
+  StringRef Data = (*Buf)->getBuffer();
+  return toHex(SHA1::hash(ArrayRef<uint8_t>{(const uint8_t*)Data.data(), Data.size()}));
+}
+
+struct CacheWriter
+{
+  CacheWriter(raw_ostream& OS):
+    W_(OS, support::little)
+  { }
+
+  void u8(uint8_t V) { W_.write(V); }
+  void u32(uint32_t V) { W_.write(V); }
+  void u64(uint64_t V) { W_.write(V); }
+  void i32(int32_t V) { W_.write(V); }
+  void str(StringRef S)
+  {
+    u32(S.size());
+    W_.OS << S;
+  }
+
+private:
+  support::endian::Writer W_;
+};
+
+struct CacheReader
+{
+  CacheReader(StringRef Data):
+    Data_(Data)
+  { }
+
+  bool u8(uint8_t& V) { return read(V); }
+  bool u32(uint32_t& V) { return read(V); }
+  bool u64(uint64_t& V) { return read(V); }
+  bool i32(int32_t& V) { return read(V); }
+  bool str(StringRef& S)
+  {
+    uint32_t Len;
+    if (!u32(Len) || Data_.size() < Len) {
+      return false;
+    }
+    S = Data_.substr(0, Len);
+    Data_ = Data_.drop_front(Len);
+    return true;
+  }
+  bool bytes(StringRef& S, uint64_t Len)
+  {
+    if (Data_.size() < Len) {
+      return false;
+    }
+    S = Data_.substr(0, Len);
+    Data_ = Data_.drop_front(Len);
+    return true;
+  }
+
+  StringRef remaining() const { return Data_; }
+
+private:
+  template <class T>
+  bool read(T& V)
+  {
+    if (Data_.size() < sizeof(T)) {
+      return false;
+    }
+    V = support::endian::read<T, support::little, support::unaligned>(Data_.data());
+    Data_ = Data_.drop_front(sizeof(T));
+    return true;
+  }
+
+  StringRef Data_;
+};
+
+// Serialize the types used by a CU. Composite types (owned by the CU) get the
+// first IDs, so that they can be declared as opaque types before anything
+// else is read back. Other types are recorded after the types they depend on.
+struct TypesSerializer
+{
+  TypesSerializer(raw_ostream& OS):
+    W_(OS)
+  { }
+
+  void addComposite(CanOpaqueType const* Ty)
+  {
+    const uint32_t Id = Ids_.size();
+    Ids_[Ty] = Id;
+  }
+
+  void qualType(CacheWriter& W, QualType QTy)
+  {
+    W.u32(getId(QTy.getType()));
+    W.u8(QTy.hasConst());
+  }
+
+  // 0 is the void/null type
+  uint32_t getId(Type const* Ty)
+  {
+    if (!Ty) {
+      return 0;
+    }
+    auto It = Ids_.find(Ty);
+    if (It != Ids_.end()) {
+      return It->second + 1;
+    }
+
+    if (auto const* BTy = dyn_cast<BasicType>(Ty)) {
+      W_.u8(CT_Basic);
+      W_.u8(BTy->getBasicKind());
+    }
+    else
+    if (auto const* PTy = dyn_cast<PointerType>(Ty)) {
+      const auto Pointee = PTy->getPointee();
+      // Make sure the pointee is recorded before this type
+      getId(Pointee.getType());
+      W_.u8(CT_Pointer);
+      qualType(W_, Pointee);
+    }
+    else
+    if (auto const* ATy = dyn_cast<ArrayType>(Ty)) {
+      getId(ATy->getElementType());
+      W_.u8(CT_Array);
+      qualType(W_, ATy->getElementType());
+      W_.u64(ATy->getNumElements());
+    }
+    else
+    if (auto const* FTy = dyn_cast<FunctionType>(Ty)) {
+      getId(FTy->getReturnType());
+      for (QualType P: FTy->getParams()) {
+        getId(P.getType());
+      }
+      W_.u8(CT_Function);
+      qualType(W_, FTy->getReturnType());
+      W_.u32(FTy->getParams().size());
+      for (QualType P: FTy->getParams()) {
+        qualType(W_, P);
+      }
+      W_.u8(FTy->getCC());
+      W_.u8(FTy->hasVarArgs());
+      W_.u8(FTy->useLastError());
+    }
+    else {
+      llvm::report_fatal_error("unable to serialize a composite type that does not belong to this CU!");
+    }
+    const uint32_t Id = Ids_.size();
+    Ids_[Ty] = Id;
+    ++Count_;
+    return Id + 1;
+  }
+
+  uint32_t count() const { return Count_; }
+
+private:
+  CacheWriter W_;
+  DenseMap<Type const*, uint32_t> Ids_;
+  uint32_t Count_ = 0;
+};
+
+} // anonymous
+
+CUObjectCache::~CUObjectCache()
+{ }
+
+void CUObjectCache::notifyObjectCompiled(const Module* M, MemoryBufferRef Obj)
+{
+  Objects_[M] = MemoryBuffer::getMemBufferCopy(Obj.getBuffer(), Obj.getBufferIdentifier());
+}
+
+std::unique_ptr<MemoryBuffer> CUObjectCache::getObject(const Module*)
+{
+  // Lookups are done by DFFIImpl before running clang.
+  return nullptr;
+}
+
+std::unique_ptr<MemoryBuffer> CUObjectCache::takeObject(const Module* M)
+{
+  auto It = Objects_.find(M);
+  if (It == Objects_.end()) {
+    return nullptr;
+  }
+  auto Ret = std::move(It->second);
+  Objects_.erase(It);
+  return Ret;
+}
+
+CUDepsCollector::~CUDepsCollector()
+{ }
+
+bool CUDepsCollector::sawDependency(StringRef Filename, bool /*FromModule*/, bool /*IsSystem*/, bool IsModuleFile, bool IsMissing)
+{
+  // Precompiled headers and preambles are temporary files, and the headers
+  // they have been built from are reported as well.
+  if (!IsMissing && !IsModuleFile && Filename != "<built-in>") {
+    Deps_.insert(Filename);
+  }
+  // We keep our own list, that can be cleared between compilations.
+  return false;
+}
+
+void CUImpl::serialize(raw_ostream& OS) const
+{
+  std::string TypesBuf;
+  std::string TablesBuf;
+  raw_string_ostream TypesOS(TypesBuf);
+  raw_string_ostream TablesOS(TablesBuf);
+  TypesSerializer TS(TypesOS);
+  CacheWriter W(OS);
+  CacheWriter TW(TablesOS);
+
+  // Composite declarations
+  W.u32(CompositeTys_.size());
+  SmallVector<CanOpaqueType const*, 16> Composites;
+  for (auto const& It: CompositeTys_) {
+    CanOpaqueType const* Ty = It.getValue().get();
+    uint8_t Kind;
+    if (isa<StructType>(Ty)) {
+      Kind = CT_Struct;
+    }
+    else
+    if (isa<UnionType>(Ty)) {
+      Kind = CT_Union;
+    }
+    else {
+      Kind = CT_Enum;
+    }
+    W.u8(Kind);
+    W.str(It.getKey());
+    W.u8(!Ty->getNames().empty());
+    TS.addComposite(Ty);
+    Composites.push_back(Ty);
+  }
+
+  // Composite bodies
+  for (CanOpaqueType const* Ty: Composites) {
+    TW.u8(Ty->isOpaque());
+    if (Ty->isOpaque()) {
+      continue;
+    }
+    if (auto const* CTy = dyn_cast<CompositeType>(Ty)) {
+      auto const& Fields = CTy->getOrgFields();
+      TW.u32(Fields.size());
+      for (CompositeField const& F: Fields) {
+        TW.str(F.getName());
+        TW.u32(TS.getId(F.getType()));
+        TW.u32(F.getOffset());
+      }
+      TW.u64(CTy->getSize());
+      TW.u32(CTy->getAlign());
+    }
+    else {
+      auto const& Fields = cast<EnumType>(Ty)->getFields();
+      TW.u32(Fields.size());
+      for (auto const& F: Fields) {
+        TW.str(F.first);
+        TW.i32(F.second);
+      }
+    }
+  }
+
+  TW.u32(AliasTys_.size());
+  for (auto const& It: AliasTys_) {
+    TW.str(It.getKey());
+    TW.u32(TS.getId(It.getValue()));
+  }
+
+  TW.u32(FuncTys_.size());
+  for (auto const& It: FuncTys_) {
+    TW.str(It.getKey());
+    TW.u32(TS.getId(It.getValue()));
+  }
+
+  TW.u32(FuncAliases_.size());
+  for (auto const& It: FuncAliases_) {
+    TW.str(It.getKey());
+    TW.str(It.getValue());
+  }
+
+  W.u32(TS.count());
+  OS << TypesOS.str() << TablesOS.str();
+}
+
+bool CUImpl::deserialize(StringRef& Data)
+{
+  CacheReader R(Data);
+  SmallVector<Type const*, 64> Tys;
+  Tys.push_back(nullptr);
+
+  auto GetTy = [&](uint32_t Id, Type const*& Ty) {
+    if (Id >= Tys.size()) {
+      return false;
+    }
+    Ty = Tys[Id];
+    return true;
+  };
+  auto GetQualTy = [&](QualType& QTy) {
+    uint32_t Id;
+    uint8_t Const;
+    Type const* Ty;
+    if (!R.u32(Id) || !R.u8(Const) || !GetTy(Id, Ty)) {
+      return false;
+    }
+    QTy = Const ? QualType{Ty}.withConst() : QualType{Ty};
+    return true;
+  };
+
+  uint32_t NComposites;
+  if (!R.u32(NComposites)) {
+    return false;
+  }
+  SmallVector<CanOpaqueType*, 16> Composites;
+  for (uint32_t I = 0; I < NComposites; ++I) {
+    uint8_t Kind, Named;
+    StringRef Name;
+    if (!R.u8(Kind) || !R.str(Name) || !R.u8(Named)) {
+      return false;
+    }
+    CanOpaqueType* Ptr;
+    switch (Kind) {
+      case CT_Struct:
+        Ptr = new StructType{DFFI_};
+        break;
+      case CT_Union:
+        Ptr = new UnionType{DFFI_};
+        break;
+      case CT_Enum:
+        Ptr = new EnumType{DFFI_};
+        break;
+      default:
+        return false;
+    };
+    auto It = CompositeTys_.try_emplace(Name, std::unique_ptr<CanOpaqueType>{Ptr});
+    if (!It.second) {
+      return false;
+    }
+    if (Named) {
+      Ptr->addName(It.first->getKeyData());
+    }
+    Composites.push_back(Ptr);
+    Tys.push_back(Ptr);
+  }
+
+  uint32_t NTypes;
+  if (!R.u32(NTypes)) {
+    return false;
+  }
+  for (uint32_t I = 0; I < NTypes; ++I) {
+    uint8_t Kind;
+    if (!R.u8(Kind)) {
+      return false;
+    }
+    switch (Kind) {
+      case CT_Basic:
+      {
+        uint8_t BK;
+        if (!R.u8(BK)) {
+          return false;
+        }
+        Tys.push_back(DFFI_.getBasicType((BasicType::BasicKind)BK));
+        break;
+      }
+      case CT_Pointer:
+      {
+        QualType Pointee;
+        if (!GetQualTy(Pointee)) {
+          return false;
+        }
+        Tys.push_back(DFFI_.getPointerType(Pointee));
+        break;
+      }
+      case CT_Array:
+      {
+        QualType EltTy;
+        uint64_t N;
+        if (!GetQualTy(EltTy) || !R.u64(N)) {
+          return false;
+        }
+        Tys.push_back(DFFI_.getArrayType(EltTy, N));
+        break;
+      }
+      case CT_Function:
+      {
+        QualType RetTy;
+        uint32_t NParams;
+        if (!GetQualTy(RetTy) || !R.u32(NParams)) {
+          return false;
+        }
+        SmallVector<QualType, 8> Params;
+        Params.resize(NParams);
+        for (QualType& P: Params) {
+          if (!GetQualTy(P)) {
+            return false;
+          }
+        }
+        uint8_t CC, VarArgs, UseLastError;
+        if (!R.u8(CC) || !R.u8(VarArgs) || !R.u8(UseLastError)) {
+          return false;
+        }
+        Tys.push_back(getContext().getFunctionType(DFFI_, RetTy, Params, (CallingConv)CC, VarArgs, UseLastError));
+        break;
+      }
+      default:
+        return false;
+    };
+  }
+
+  for (CanOpaqueType* Ty: Composites) {
+    uint8_t Opaque;
+    uint32_t NFields;
+    if (!R.u8(Opaque)) {
+      return false;
+    }
+    if (Opaque) {
+      continue;
+    }
+    if (!R.u32(NFields)) {
+      return false;
+    }
+    if (auto* CTy = dyn_cast<CompositeType>(Ty)) {
+      std::vector<CompositeField> Fields;
+      Fields.reserve(NFields);
+      for (uint32_t I = 0; I < NFields; ++I) {
+        StringRef FName;
+        uint32_t FTyId, FOffset;
+        Type const* FTy;
+        if (!R.str(FName) || !R.u32(FTyId) || !R.u32(FOffset) || !GetTy(FTyId, FTy)) {
+          return false;
+        }
+        Fields.emplace_back(CompositeField{FName.str().c_str(), FTy, FOffset});
+      }
+      uint64_t Size;
+      uint32_t Align;
+      if (!R.u64(Size) || !R.u32(Align)) {
+        return false;
+      }
+      CTy->setBody(std::move(Fields), Size, Align);
+    }
+    else {
+      EnumType::Fields Fields;
+      for (uint32_t I = 0; I < NFields; ++I) {
+        StringRef FName;
+        int32_t Val;
+        if (!R.str(FName) || !R.i32(Val)) {
+          return false;
+        }
+        Fields[FName.str()] = Val;
+      }
+      cast<EnumType>(Ty)->setBody(std::move(Fields));
+    }
+  }
+  inlineCompositesAnonymousMembers();
+
+  uint32_t Count;
+  if (!R.u32(Count)) {
+    return false;
+  }
+  for (uint32_t I = 0; I < Count; ++I) {
+    StringRef Name;
+    uint32_t Id;
+    Type const* Ty;
+    if (!R.str(Name) || !R.u32(Id) || !GetTy(Id, Ty)) {
+      return false;
+    }
+    setAlias(Name, Ty);
+  }
+
+  if (!R.u32(Count)) {
+    return false;
+  }
+  for (uint32_t I = 0; I < Count; ++I) {
+    StringRef Name;
+    uint32_t Id;
+    Type const* Ty;
+    if (!R.str(Name) || !R.u32(Id) || !GetTy(Id, Ty)) {
+      return false;
+    }
+    auto const* FTy = dyn_cast_or_null<FunctionType>(Ty);
+    if (!FTy) {
+      return false;
+    }
+    FuncTys_[Name] = FTy;
+  }
+
+  if (!R.u32(Count)) {
+    return false;
+  }
+  for (uint32_t I = 0; I < Count; ++I) {
+    StringRef Name, Target;
+    if (!R.str(Name) || !R.str(Target)) {
+      return false;
+    }
+    FuncAliases_[Name] = Target.str();
+  }
+
+  Data = R.remaining();
+  return true;
+}
+
+std::string DFFIImpl::getCacheKey(StringRef Code, StringRef CUName, bool IncludeDefs, bool UseLastError, CompileOpts const& CUOpts) const
+{
+  SHA1 H;
+  auto AddStr = [&](StringRef S) {
+    H.update(std::to_string(S.size()));
+    H.update(":");
+    H.update(S);
+  };
+  AddStr(std::to_string(CacheVersion));
+  AddStr(LLVM_VERSION_STRING);
+  AddStr(sys::getProcessTriple());
+  AddStr(std::to_string(Opts_.OptLevel));
+  AddStr(CPU_);
+  for (auto const& F: Features_) {
+    AddStr(F);
+  }
+  for (auto const& V: Opts_.ISAVariants) {
+    AddStr(V);
+  }
+  for (auto const& D: Opts_.IncludeDirs) {
+    AddStr(D);
+  }
+  AddStr(Opts_.getSysroot());
+  AddStr(std::to_string(Opts_.CXX));
+  AddStr(std::to_string(Opts_.GNUExtensions));
+  AddStr(std::to_string(IncludeDefs));
+  AddStr(std::to_string(static_cast<unsigned>(Opts_.CDef)));
+  AddStr(std::to_string(UseLastError));
+  AddStr(std::to_string(CUOpts.FastMath));
+  AddStr(std::to_string(CUOpts.FPContractFast));
+  AddStr(std::to_string(CUOpts.VectorizeWidth));
+  AddStr(std::to_string(CUOpts.InterleaveCount));
+  AddStr(std::to_string(CUOpts.UnrollCount));
+  AddStr(CUOpts.PassPipeline);
+  AddStr(std::to_string(CUOpts.ShareStatics));
+  AddStr(PCHCode_);
+  AddStr(CUName);
+  AddStr(Code);
+  return toHex(H.final());
+}
+
+static std::string getCachePath(StringRef Dir, StringRef Key)
+{
+  SmallString<256> Path{Dir};
+  sys::path::append(Path, Key + ".dffic");
+  return Path.str().str();
+}
+
+CUImpl* DFFIImpl::loadCachedCU(StringRef Key, StringRef Code, StringRef CUName, StringRef StaticsPrefix)
+{
+  auto BufOrErr = MemoryBuffer::getFile(getCachePath(Opts_.CacheDir, Key), /* IsText */ false, /* RequiresNullTerminator */ false);
+  if (!BufOrErr) {
+    return nullptr;
+  }
+  StringRef Data = (*BufOrErr)->getBuffer();
+  if (!Data.startswith(StringRef{CacheMagic, sizeof(CacheMagic)})) {
+    return nullptr;
+  }
+  Data = Data.drop_front(sizeof(CacheMagic));
+
+  CacheReader R(Data);
+  uint32_t Version, NDeps;
+  if (!R.u32(Version) || Version != CacheVersion || !R.u32(NDeps)) {
+    return nullptr;
+  }
+  // Verify that the included files did not change.
+  auto& FS = *VFS_;
+  for (uint32_t I = 0; I < NDeps; ++I) {
+    StringRef Path, Hash;
+    if (!R.str(Path) || !R.str(Hash)) {
+      return nullptr;
+    }
+    if (hashFile(FS, Path) != Hash) {
+      return nullptr;
+    }
+  }
+
+  Data = R.remaining();
+  std::unique_ptr<CUImpl> CU(new CUImpl{*this});
+  CU->Name_ = CUName.str();
+  CU->StaticsPrefix_ = StaticsPrefix.str();
+  if (!CU->deserialize(Data)) {
+    return nullptr;
+  }
+
+  R = CacheReader{Data};
+  uint32_t NObjs;
+  if (!R.u32(NObjs)) {
+    return nullptr;
+  }
+  SmallVector<object::OwningBinary<object::ObjectFile>, 1> Objs;
+  for (uint32_t I = 0; I < NObjs; ++I) {
+    uint64_t Size;
+    StringRef Bytes;
+    if (!R.u64(Size) || !R.bytes(Bytes, Size)) {
+      return nullptr;
+    }
+    auto ObjBuf = MemoryBuffer::getMemBufferCopy(Bytes, CUName);
+    auto ObjOrErr = object::ObjectFile::createObjectFile(ObjBuf->getMemBufferRef());
+    if (!ObjOrErr) {
+      consumeError(ObjOrErr.takeError());
+      return nullptr;
+    }
+    Objs.emplace_back(std::move(*ObjOrErr), std::move(ObjBuf));
+  }
+  for (auto& Obj: Objs) {
+    registerSymbols(*CU, *Obj.getBinary());
+    getEngine(*CU).addObjectFile(std::move(Obj));
+  }
+
+  // Named CUs can be included by others, so their source still needs to be
+  // reachable.
+  VFS_->addFile(CUName, time(NULL), MemoryBuffer::getMemBufferCopy(Code));
+
+  auto* Ret = CU.get();
+  CUs_.emplace_back(std::move(CU));
+  return Ret;
+}
+
+void DFFIImpl::storeCachedCU(StringRef Key, StringRef CUName, CUImpl const& CU, Frontend const& FE, ArrayRef<MemoryBufferRef> Objects)
+{
+  std::string Buf;
+  raw_string_ostream OS(Buf);
+  CacheWriter W(OS);
+  OS.write(CacheMagic, sizeof(CacheMagic));
+  W.u32(CacheVersion);
+
+  auto& FS = *VFS_;
+  SmallVector<std::pair<StringRef, std::string>, 16> Deps;
+  for (auto const& D: FE.DepsCollector->deps()) {
+    StringRef Path = D.getKey();
+    if (Path == CUName || Path.startswith("/__dffi_private/")) {
+      continue;
+    }
+    auto Hash = hashFile(FS, Path);
+    if (Hash.empty()) {
+      // Can't validate this entry later on, don't store it.
+      return;
+    }
+    Deps.emplace_back(Path, std::move(Hash));
+  }
+  W.u32(Deps.size());
+  for (auto const& D: Deps) {
+    W.str(D.first);
+    W.str(D.second);
+  }
+
+  CU.serialize(OS);
+
+  W.u32(Objects.size());
+  for (auto const& Obj: Objects) {
+    W.u64(Obj.getBufferSize());
+    OS << Obj.getBuffer();
+  }
+  OS.flush();
+
+  // Write to a temporary file and rename it, so that concurrent processes
+  // never see partial entries.
+  if (sys::fs::create_directories(Opts_.CacheDir)) {
+    return;
+  }
+  int FD;
+  SmallString<256> TmpPath;
+  if (sys::fs::createUniqueFile(getCachePath(Opts_.CacheDir, Key) + "-%%%%%%%%.tmp", FD, TmpPath)) {
+    return;
+  }
+  {
+    raw_fd_ostream TmpOS(FD, /* shouldClose */ true);
+    TmpOS << Buf;
+    TmpOS.close();
+    if (TmpOS.has_error()) {
+      TmpOS.clear_error();
+      sys::fs::remove(TmpPath);
+      return;
+    }
+  }
+  if (sys::fs::rename(TmpPath, getCachePath(Opts_.CacheDir, Key))) {
+    sys::fs::remove(TmpPath);
+  }
+}
+
+} // details
+} // dffi
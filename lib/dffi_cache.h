@@ -0,0 +1,67 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DFFI_CACHE_H
+#define DFFI_CACHE_H
+
+#include <memory>
+#include <string>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <clang/Frontend/Utils.h>
+
+namespace dffi {
+namespace details {
+
+// Keeps a copy of the object code generated by the JIT for each module, so
+// that it can be stored in the on-disk cache.
+// Virtual functions are defined in dffi_cache.cpp, which is compiled with the
+// same RTTI settings as LLVM.
+struct CUObjectCache: public llvm::ObjectCache
+{
+  ~CUObjectCache() override;
+
+  void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+
+  std::unique_ptr<llvm::MemoryBuffer> takeObject(const llvm::Module* M);
+
+private:
+  llvm::DenseMap<const llvm::Module*, std::unique_ptr<llvm::MemoryBuffer>> Objects_;
+};
+
+// Records every file (including system headers) read by the preprocessor
+// during a compilation.
+struct CUDepsCollector: public clang::DependencyCollector
+{
+  ~CUDepsCollector() override;
+
+  bool sawDependency(llvm::StringRef Filename, bool FromModule, bool IsSystem, bool IsModuleFile, bool IsMissing) override;
+
+  llvm::StringSet<> const& deps() const { return Deps_; }
+  void clear() { Deps_.clear(); }
+
+private:
+  llvm::StringSet<> Deps_;
+};
+
+} // details
+} // dffi
+
+#endif
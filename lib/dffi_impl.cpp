@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <string>
+#include <algorithm>
 #include <cinttypes>
 
 #include <clang/Basic/FileManager.h>
@@ -28,14 +29,20 @@
 #include <clang/Frontend/CompilerInvocation.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/FrontendDiagnostic.h>
+#include <clang/Frontend/PrecompiledPreamble.h>
 #include <clang/Frontend/TextDiagnosticBuffer.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
 #include <clang/Frontend/Utils.h>
 #include <clang/FrontendTool/Utils.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <llvm/ADT/ScopeExit.h>
 #include <llvm/BinaryFormat/Dwarf.h>
+#include <llvm/CodeGen/ParallelCG.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Object/ObjectFile.h>
@@ -48,6 +55,7 @@
 #include <llvm/Support/Process.h>
 #include <llvm/Support/Program.h>
 #include <llvm/Support/Signals.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/VirtualFileSystem.h>
@@ -61,6 +69,10 @@
 #include <dffi/composite_type.h>
 #include <dffi/casting.h>
 #include "dffi_impl.h"
+#include "dffi_ast_importer.h"
+#include "dffi_cache.h"
+#include "dffi_jit.h"
+#include "dffi_vfs.h"
 #include "types_printer.h"
 
 using namespace llvm;
@@ -154,50 +166,39 @@ llvm::DIType const* stripDITypePtr(llvm::DIType const* Ty)
   return PtrATy->getBaseType();
 }
 
-std::string getWrapperName(size_t Idx)
+// Returns true if M defines functions or variables that need to be given to
+// the JIT.
+bool hasDefinitions(llvm::Module const& M)
 {
-  return std::string{WrapperPrefix} + std::to_string(Idx);
+  for (GlobalObject const& GO: M.global_objects()) {
+    if (!GO.isDeclaration() && !GO.hasAvailableExternallyLinkage()) {
+      return true;
+    }
+  }
+  return false;
 }
 
-} // anonymous
-
-DFFIImpl::DFFIImpl(CCOpts const& Opts):
-    Clang_(new CompilerInstance{}),
-		DiagOpts_(new DiagnosticOptions{}),
-		DiagID_(new DiagnosticIDs{}),
-    ErrorMsgStream_(ErrorMsg_),
-    VFS_(new llvm::vfs::InMemoryFileSystem{}),
-    Opts_(Opts)
+// Runs clang's driver to get the -cc1 invocation of a dummy source file. As
+// this is costly, invocations are shared by the DFFI objects of the process
+// created with the same driver arguments.
+std::shared_ptr<CompilerInvocation const> getDriverInvocation(ArrayRef<const char*> Args, DiagnosticsEngine& Diags, IntrusiveRefCntPtr<vfs::FileSystem> FS)
 {
-  TextDiagnosticPrinter *DiagClient =
-    new TextDiagnosticPrinter{ErrorMsgStream_, &*DiagOpts_};
-  Diags_ = new DiagnosticsEngine{DiagID_, &*DiagOpts_, DiagClient, true};
-
-  // Add an overleay with our virtual file system on top of the system!
-  IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> Overlay(new llvm::vfs::OverlayFileSystem{vfs::getRealFileSystem()});
-  Overlay->pushOverlay(VFS_);
-  // Finally add clang's ressources
-  Overlay->pushOverlay(getClangResFileSystem());
-
-  const auto TripleStr = llvm::sys::getProcessTriple();
-  Driver_.reset(new driver::Driver{"dummy", TripleStr, *Diags_, "clang interpreter", Overlay});
-  Driver_->setCheckInputsExist(false);
-
-  const char* ResDir = getClangResRootDirectory();
-  SmallVector<const char*, 17> Args = {"dffi",
-    Opts.hasCXX() ? "dummy.cpp" : "dummy.c",
-    "-fsyntax-only", "-resource-dir", ResDir};
-  const auto Sysroot = Opts.getSysroot();
-  if (!Sysroot.empty()) {
-    Args.push_back("--sysroot");
-    Args.push_back(Sysroot.c_str());
-  }
-  for (auto const& D: Opts.IncludeDirs) {
-    Args.push_back("-I");
-    Args.push_back(D.c_str());
-  }
-
-  std::unique_ptr<driver::Compilation> C(Driver_->BuildCompilation(Args));
+  static std::mutex Mutex;
+  static llvm::StringMap<std::shared_ptr<CompilerInvocation const>> Invocations;
+  std::string Key;
+  for (const char* A: Args) {
+    Key += A;
+    Key.push_back(0);
+  }
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Invocations.find(Key);
+  if (It != Invocations.end()) {
+    return It->second;
+  }
+
+  driver::Driver Driver{"dummy", llvm::sys::getProcessTriple(), Diags, "clang interpreter", FS};
+  Driver.setCheckInputsExist(false);
+  std::unique_ptr<driver::Compilation> C(Driver.BuildCompilation(Args));
   if (!C) {
     unreachable("unable to instantiate clang");
   }
@@ -212,19 +213,125 @@ DFFIImpl::DFFIImpl(CCOpts const& Opts):
 
   const driver::Command &Cmd = cast<driver::Command>(*Jobs.begin());
   if (llvm::StringRef(Cmd.getCreator().getName()) != "clang") {
-    Diags_->Report(diag::err_fe_expected_clang_command);
+    Diags.Report(diag::err_fe_expected_clang_command);
     unreachable("bad command");
   }
 
   // Initialize a compiler invocation object from the clang (-cc1) arguments.
   const llvm::opt::ArgStringList &CCArgs = Cmd.getArguments();
-  std::unique_ptr<CompilerInvocation> pCI(new CompilerInvocation{});
-  CompilerInvocation::CreateFromArgs(*pCI, CCArgs, *Diags_);
+  auto CI = std::make_shared<CompilerInvocation>();
+  CompilerInvocation::CreateFromArgs(*CI, CCArgs, Diags);
+  Invocations[Key] = CI;
+  return CI;
+}
+
+// Target of the process, looked up once
+void checkNativeTarget(std::string const& Triple)
+{
+  static const bool Found = [&]() {
+    std::string Error;
+    if (!TargetRegistry::lookupTarget(Triple, Error)) {
+      std::stringstream ss;
+      ss << "unable to find native target: " << Error << "!";
+      unreachable(ss.str().c_str());
+    }
+    return true;
+  }();
+  (void)Found;
+}
+
+} // anonymous
+
+void stripAsmPrefixes(llvm::Module& M)
+{
+  for (Function& F: M) {
+    StringRef FName = F.getName();
+    if (FName.size() > 0 && FName[0] == 1) {
+      // Clang emits the "\01" prefix in some cases, when ASM function
+      // redirects are used!
+      F.setName(FName.substr(1));
+    }
+  }
+}
+
+std::string getWrapperName(size_t Idx)
+{
+  return std::string{WrapperPrefix} + std::to_string(Idx);
+}
 
-  auto& CI = *pCI;
+Frontend::Frontend():
+  DiagOpts(new DiagnosticOptions{}),
+  DiagID(new DiagnosticIDs{}),
+  ErrorMsgStream(ErrorMsg),
+  Clang(new CompilerInstance{})
+{
+  TextDiagnosticPrinter *DiagClient =
+    new TextDiagnosticPrinter{ErrorMsgStream, &*DiagOpts};
+  Diags = new DiagnosticsEngine{DiagID, &*DiagOpts, DiagClient, true};
+}
+
+Frontend::~Frontend()
+{ }
+
+void Frontend::resetDiagnostics()
+{
+  auto& Diag = Clang->getDiagnostics();
+  Diag.Reset();
+  Diag.getClient()->clear();
+}
+
+void Frontend::getCompileError(std::string& Err)
+{
+  ErrorMsgStream.flush();
+  Err = std::move(ErrorMsg);
+  ErrorMsg = std::string{};
+}
+
+DFFIImpl::DFFIImpl(CCOpts const& Opts):
+    VFS_(new DFFIFileSystem{}),
+    MainFE_(new Frontend{}),
+    Triple_(llvm::sys::getProcessTriple()),
+    CPU_(Opts.CPU),
+    Opts_(Opts)
+{
+  if (CPU_ == "native") {
+    // Like clang's -march=native
+    CPU_ = sys::getHostCPUName().str();
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures)) {
+      for (auto const& F: HostFeatures) {
+        Features_.push_back((F.getValue() ? "+" : "-") + F.getKey().str());
+      }
+    }
+  }
+  Features_.append(Opts.TargetFeatures.begin(), Opts.TargetFeatures.end());
+
+  auto& Diags = *MainFE_->Diags;
+  const char* ResDir = getClangResRootDirectory();
+  SmallVector<const char*, 17> Args = {"dffi",
+    Opts.hasCXX() ? "dummy.cpp" : "dummy.c",
+    "-fsyntax-only", "-resource-dir", ResDir};
+  const auto Sysroot = Opts.getSysroot();
+  if (!Sysroot.empty()) {
+    Args.push_back("--sysroot");
+    Args.push_back(Sysroot.c_str());
+  }
+  for (auto const& D: Opts.IncludeDirs) {
+    Args.push_back("-I");
+    Args.push_back(D.c_str());
+  }
+
+  // The options below are applied to a copy of the shared invocation
+  CompilerInvocation CI{*getDriverInvocation(Args, Diags, VFS_)};
 
   auto& TO = CI.getTargetOpts();
-  TO.Triple = TripleStr;
+  TO.Triple = Triple_;
+  if (!CPU_.empty()) {
+    TO.CPU = CPU_;
+  }
+  // Clang computes the final features from these (see
+  // TargetInfo::CreateTargetInfo).
+  TO.FeaturesAsWritten.insert(TO.FeaturesAsWritten.end(), Features_.begin(), Features_.end());
   // We create it by hand to have a minimal user-friendly API!
   auto& CGO = CI.getCodeGenOpts();
   CGO.OptimizeSize = false;
@@ -265,106 +372,370 @@ DFFIImpl::DFFIImpl(CCOpts const& Opts):
 
   CI.getFrontendOpts().ProgramAction = frontend::EmitLLVMOnly;
 
-  Clang_->setInvocation(std::move(pCI));
-  Clang_->setDiagnostics(&*Diags_);
-  assert(Clang_->hasDiagnostics());
+  initFrontend(*MainFE_, CI);
 
-  FileMgr_ = new FileManager(Clang_->getFileSystemOpts(), std::move(Overlay));
-  Clang_->createSourceManager(*FileMgr_);
-  Clang_->setFileManager(FileMgr_.get());
+  // The execution engine of the wrappers is only created when first needed
+  // (see getWrappersEngine).
+  checkNativeTarget(Triple_);
+  GlobalPrefix_ = createTargetMachine()->createDataLayout().getGlobalPrefix();
+  ISASuffix_ = selectISAVariant();
 
-  // Intialize execution engine!
-  std::string Error;
-  const llvm::Target *Tgt = TargetRegistry::lookupTarget(TO.Triple, Error);
-  if (!Tgt) {
-    std::stringstream ss;
-    ss << "unable to find native target: " << Error << "!";
-    unreachable(ss.str().c_str());
+  if (!Opts.CacheDir.empty()) {
+    ObjCache_.reset(new CUObjectCache{});
   }
 
-  std::unique_ptr<llvm::Module> DummyM(new llvm::Module{"DummyM",Ctx_});
-  DummyM->setTargetTriple(TO.Triple);
-  EngineBuilder EB(std::move(DummyM));
-  EB.setEngineKind(EngineKind::JIT)
-    .setErrorStr(&Error)
-    .setOptLevel(CodeGenOpt::Default)
-    .setRelocationModel(Reloc::Static);
+  if (Opts.CodeGenThreads > 1 || Opts.DropIR) {
+    MainFE_->TM = createTargetMachine();
+  }
 
-  SmallVector<std::string, 1> Attrs;
-  // TODO: get the target machine from clang?
-  EE_.reset(EB.create());
-  if (!EE_) {
-    std::stringstream ss;
-    ss << "error creating jit: " << Error; 
-    unreachable(ss.str().c_str());
+  // Additional frontends, used to compile compilation units concurrently.
+  // They generate object code with their own target machine, which is then
+  // loaded in the JIT engine of the compilation unit.
+  if (Opts.Concurrency > 1) {
+    for (unsigned I = 0; I < Opts.Concurrency; ++I) {
+      std::unique_ptr<Frontend> FE(new Frontend{});
+      initFrontend(*FE, CI);
+      FE->TM = createTargetMachine();
+      FreeFrontends_.push_back(FE.get());
+      Frontends_.emplace_back(std::move(FE));
+    }
   }
 }
 
-void DFFIImpl::resetDiagnostics()
+void DFFIImpl::initFrontend(Frontend& FE, CompilerInvocation const& CI)
 {
-  auto& Diag = Clang_->getDiagnostics();
-  Diag.Reset();
-  Diag.getClient()->clear();
+  FE.Clang->setInvocation(std::make_shared<CompilerInvocation>(CI));
+  FE.Clang->setDiagnostics(&*FE.Diags);
+  assert(FE.Clang->hasDiagnostics());
+
+  resetFileManager(FE);
+
+  if (!Opts_.CacheDir.empty()) {
+    FE.DepsCollector = std::make_shared<CUDepsCollector>();
+    FE.Clang->addDependencyCollector(FE.DepsCollector);
+  }
+}
+
+void DFFIImpl::resetFileManager(Frontend& FE)
+{
+  // Drops the files (and their content) cached by the previous compilations
+  FE.FileMgr = new FileManager(FE.Clang->getFileSystemOpts(), VFS_);
+  FE.Clang->createSourceManager(*FE.FileMgr);
+  FE.Clang->setFileManager(FE.FileMgr.get());
+}
+
+Frontend* DFFIImpl::acquireFrontend()
+{
+  std::unique_lock<std::mutex> Lock(FrontendsMutex_);
+  FrontendsCV_.wait(Lock, [this]() { return !FreeFrontends_.empty(); });
+  Frontend* FE = FreeFrontends_.pop_back_val();
+  const bool Reset = FE->FSGeneration != FSGeneration_;
+  FE->FSGeneration = FSGeneration_;
+  Lock.unlock();
+  if (Reset) {
+    resetFileManager(*FE);
+  }
+  return FE;
+}
+
+void DFFIImpl::releaseFrontend(Frontend* FE)
+{
+  {
+    std::lock_guard<std::mutex> Lock(FrontendsMutex_);
+    FreeFrontends_.push_back(FE);
+  }
+  FrontendsCV_.notify_one();
+}
+
+std::unique_ptr<TargetMachine> DFFIImpl::createTargetMachine() const
+{
+  // Same configuration as the JIT's target machine. Only members set by the
+  // constructor are used, as this is called without the lock held (e.g. by
+  // the threads of splitCodeGen, see emitObjects).
+  EngineBuilder TMB;
+  TMB.setOptLevel(CodeGenOpt::Default)
+    .setRelocationModel(Reloc::Static);
+  std::unique_ptr<TargetMachine> TM(TMB.selectTarget(Triple{Triple_}, "", CPU_, Features_));
+  if (!TM) {
+    unreachable("unable to create target machine");
+  }
+  return TM;
 }
 
-void DFFIImpl::getCompileError(std::string& Err)
+std::unique_ptr<MemoryBuffer> DFFIImpl::emitObject(TargetMachine& TM, llvm::Module& M)
 {
-  ErrorMsgStream_.flush();
-  Err = std::move(ErrorMsg_);
-  ErrorMsg_ = std::string{};
+  SmallVector<char, 0> ObjBuf;
+  raw_svector_ostream OS(ObjBuf);
+  legacy::PassManager PM;
+  MCContext* MCCtx;
+  M.setDataLayout(TM.createDataLayout());
+  if (TM.addPassesToEmitMC(PM, MCCtx, OS, false)) {
+    llvm::report_fatal_error("target does not support MC emission!");
+  }
+  PM.run(M);
+  return std::unique_ptr<MemoryBuffer>{new SmallVectorMemoryBuffer{std::move(ObjBuf)}};
 }
 
-std::unique_ptr<llvm::Module> DFFIImpl::compile_llvm_with_decls(StringRef const Code, StringRef const CUName, FuncAliasesMap& FuncAliases, std::string& Err)
+void DFFIImpl::emitObjects(Frontend& FE, llvm::Module& M, SmallVectorImpl<std::unique_ptr<MemoryBuffer>>& Objs)
 {
-  // Two pass compilation!
-  // First pass parse the AST of clang and generate wrappers for every
-  // defined-only functions. Second pass generates the LLVM IR of the original
-  // code with these definitions!
-  const bool hasCXX = Opts_.hasCXX();
-  auto& CI = Clang_->getInvocation();
+  unsigned NParts = 0;
+  if (Opts_.CodeGenThreads > 1) {
+    for (Function const& F: M) {
+      if (!F.isDeclaration() && ++NParts == Opts_.CodeGenThreads) {
+        break;
+      }
+    }
+  }
+  if (NParts <= 1) {
+    Objs.emplace_back(emitObject(*FE.TM, M));
+    return;
+  }
+
+  // Split the module in NParts partitions, whose code is generated
+  // concurrently by LLVM's thread pool. Local symbols are kept private to
+  // their partition, so that they do not clash with the ones of other
+  // compilation units in the JIT.
+  SmallVector<SmallVector<char, 0>, 8> Bufs(NParts);
+  SmallVector<std::unique_ptr<raw_svector_ostream>, 8> Streams;
+  SmallVector<raw_pwrite_stream*, 8> OSs;
+  for (auto& Buf: Bufs) {
+    Streams.emplace_back(new raw_svector_ostream{Buf});
+    OSs.push_back(Streams.back().get());
+  }
+  splitCodeGen(M, OSs, {}, [this]() { return createTargetMachine(); },
+    CGFT_ObjectFile, true /* PreserveLocals */);
+  Streams.clear();
+  for (auto& Buf: Bufs) {
+    Objs.emplace_back(new SmallVectorMemoryBuffer{std::move(Buf)});
+  }
+}
+
+std::unique_ptr<llvm::Module> DFFIImpl::compile_llvm_with_decls(Frontend& FE, StringRef const Code, StringRef const CUName, CUImpl& CU, bool UseLastError, std::string& Err, bool Extend, std::shared_ptr<PCHBuffer> PCH)
+{
+  // Types and functions are imported from the AST (see
+  // EmitLLVMWithASTTypesAction), so that no debug informations need to be
+  // generated.
+  auto Buf = MemoryBuffer::getMemBufferCopy(Code, CUName);
+  auto& CI = FE.Clang->getInvocation();
   CI.getFrontendOpts().Inputs.clear();
   CI.getFrontendOpts().Inputs.push_back(
-    FrontendInputFile(CUName, hasCXX ? Language::CXX : Language::C));
-  auto Buf = MemoryBuffer::getMemBufferCopy(Code);
-  VFS_->addFile(CUName, time(NULL), std::move(Buf));
-  auto Action = std::make_unique<ASTGenWrappersAction>(FuncAliases);
-  if(!Clang_->ExecuteAction(*Action)) {
-    getCompileError(Err);
-    resetDiagnostics();
+    FrontendInputFile(CUName, Opts_.hasCXX() ? Language::CXX : Language::C));
+  VFS_->addFile(CUName, time(NULL), MemoryBuffer::getMemBufferCopy(Code, CUName));
+
+  // The preamble options are only set for this compilation unit
+  auto& PPO = CI.getPreprocessorOpts();
+  const PreprocessorOptions SavedPPO = PPO;
+  auto Preamble = getPreamble(FE, *Buf, getLangOptsKey(CU.Opts_));
+  if (Preamble) {
+    // The preamble is stored in a temporary file, which is reachable through
+    // VFS_. The source manager takes ownership of the remapped buffer.
+    IntrusiveRefCntPtr<vfs::FileSystem> FS = VFS_;
+    Preamble->AddImplicitPreamble(CI, FS, Buf.release());
+    assert(FS == VFS_ && "preamble file not reachable");
+  }
+
+  // The AST is kept with the compilation unit, so that its types are
+  // imported on first use (see ASTTypeImporter). It gets its own language
+  // options and source manager, which aren't reused by the next
+  // compilations. Its diagnostics are reported through the frontend while it
+  // is parsed, and ignored afterwards.
+  auto SavedLO = CI.LangOpts;
+  CI.LangOpts = std::make_shared<LangOptions>(*SavedLO);
+  IntrusiveRefCntPtr<DiagnosticsEngine> ASTDiags{new DiagnosticsEngine{FE.DiagID, FE.DiagOpts, FE.Diags->getClient(), false}};
+  FE.Clang->setSourceManager(new SourceManager{*ASTDiags, FE.Clang->getFileManager()});
+  FE.Diags->setSourceManager(&FE.Clang->getSourceManager());
+
+  auto& CGO = CI.getCodeGenOpts();
+  CGO.setDebugInfo(codegenoptions::NoDebugInfo);
+  auto Action = std::make_unique<EmitLLVMWithASTTypesAction>(&CU.getLLVMContext(), CU, UseLastError, Opts_.CDef, Extend, std::move(PCH));
+  const bool Success = FE.Clang->ExecuteAction(*Action);
+  CGO.setDebugInfo(codegenoptions::FullDebugInfo);
+  PPO = SavedPPO;
+  CI.LangOpts = std::move(SavedLO);
+  ASTDiags->setClient(new IgnoringDiagConsumer{}, true);
+  if(!Success) {
+    FE.getCompileError(Err);
+  }
+  FE.resetDiagnostics();
+  FE.Clang->createSourceManager(FE.Clang->getFileManager());
+  if (!Success) {
+    return nullptr;
+  }
+  return Action->takeModule();
+}
+
+std::shared_ptr<PrecompiledPreamble> DFFIImpl::getPreamble(Frontend& FE, MemoryBuffer const& Buf, StringRef LangOptsKey)
+{
+  // Like clangd, the leading block of preprocessor directives of the code is
+  // precompiled, and reused by the next compilation units which start with
+  // the same one (as long as the files it includes did not change).
+  auto& CI = FE.Clang->getInvocation();
+  if (!CI.getPreprocessorOpts().ImplicitPCHInclude.empty()) {
+    // Preambles can't be chained to the precompiled headers (see
+    // precompileHeaders).
+    return nullptr;
+  }
+  const auto Bounds = ComputePreambleBounds(*CI.getLangOpts(), Buf.getMemBufferRef(), 0);
+  if (Bounds.Size == 0) {
     return nullptr;
   }
+  {
+    std::lock_guard<std::mutex> Lock(PreambleMutex_);
+    // Clang doesn't check the language options the preamble has been built
+    // with (see getLangOptsKey).
+    if (Preamble_ && PreambleKey_ == LangOptsKey &&
+        Preamble_->CanReuse(CI, Buf.getMemBufferRef(), Bounds, *VFS_)) {
+      return Preamble_;
+    }
+  }
 
-  resetDiagnostics();
-  auto BufForceDecl = Code.str() + "\n";
-  if (hasCXX) BufForceDecl += "extern \"C\" {\n";
-  BufForceDecl += Action->forceDecls();
-  if (hasCXX) BufForceDecl += "\n}\n";
-  SmallString<128> PrivateCU;
-  ("/__dffi_private/force_decls/" + CUName).toStringRef(PrivateCU);
-  return compile_llvm(BufForceDecl, PrivateCU, Err);
+  PreambleCallbacks Callbacks;
+  auto PreambleOrErr = PrecompiledPreamble::Build(CI, &Buf, Bounds, *FE.Diags,
+    VFS_, FE.Clang->getPCHContainerOperations(), /* StoreInMemory */ false,
+    Callbacks);
+  // Errors are reported by the compilation of the whole code
+  std::string Ignored;
+  FE.getCompileError(Ignored);
+  FE.resetDiagnostics();
+  if (!PreambleOrErr) {
+    return nullptr;
+  }
+  auto Ret = std::make_shared<PrecompiledPreamble>(std::move(*PreambleOrErr));
+  std::lock_guard<std::mutex> Lock(PreambleMutex_);
+  Preamble_ = Ret;
+  PreambleKey_ = LangOptsKey.str();
+  return Ret;
 }
 
-std::unique_ptr<llvm::Module> DFFIImpl::compile_llvm(StringRef const Code, StringRef const CUName, std::string& Err)
+std::unique_ptr<llvm::Module> DFFIImpl::compile_llvm(Frontend& FE, LLVMContext& Ctx, StringRef const Code, StringRef const CUName, std::string& Err, bool HasImports)
 {
   // DiagnosticsEngine->Reset() does not seem to reset everything, as errors
   // are added up from other compilation units!
   auto Buf = MemoryBuffer::getMemBufferCopy(Code);
-  auto& CI = Clang_->getInvocation();
+  auto& CI = FE.Clang->getInvocation();
   CI.getFrontendOpts().Inputs.clear();
   CI.getFrontendOpts().Inputs.push_back(
     FrontendInputFile(CUName, Opts_.hasCXX() ? Language::CXX : Language::C));
   VFS_->addFile(CUName, time(NULL), std::move(Buf));
 
-  auto LLVMAction = std::make_unique<clang::EmitLLVMOnlyAction>(&Ctx_);
-  if(!Clang_->ExecuteAction(*LLVMAction)) {
-    getCompileError(Err);
-    resetDiagnostics();
+  std::unique_ptr<clang::EmitLLVMOnlyAction> LLVMAction;
+  if (HasImports) {
+    LLVMAction = std::make_unique<EmitLLVMWithImportsAction>(&Ctx);
+  }
+  else {
+    LLVMAction = std::make_unique<clang::EmitLLVMOnlyAction>(&Ctx);
+  }
+  if(!FE.Clang->ExecuteAction(*LLVMAction)) {
+    FE.getCompileError(Err);
+    FE.resetDiagnostics();
     return nullptr;
   }
-  resetDiagnostics();
+  FE.resetDiagnostics();
   return LLVMAction->takeModule();
 }
 
+bool DFFIImpl::precompileHeaders(StringRef const Code, std::string& Err)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  auto PCHPath = buildPCH(Code, Err);
+  if (PCHPath.empty()) {
+    return false;
+  }
+  PCHPath_ = std::move(PCHPath);
+  PCHCode_ = Code.str();
+  return true;
+}
+
+bool DFFIImpl::getCompilePCH(ArrayRef<CUImpl*> Imports, CompileOpts const& CUOpts, std::string& PCHPath, std::string& Err)
+{
+  // The precompiled headers are built with the default language options,
+  // and clang refuses to load them with other ones. They are then built
+  // again like the sources of imported compilation units.
+  if (Imports.empty() && (PCHPath_.empty() || getLangOptsKey(CUOpts).empty())) {
+    PCHPath = PCHPath_;
+    return true;
+  }
+  PCHPath = getImportsPCH(Imports, Err, CUOpts);
+  return !PCHPath.empty();
+}
+
+std::string DFFIImpl::getImportsPCH(ArrayRef<CUImpl*> Imports, std::string& Err, CompileOpts const& CUOpts)
+{
+  // The sources of the imported compilation units are precompiled once for
+  // every set of imports and language options, after the precompiled
+  // headers they have been compiled with.
+  // The files are also identified in the key, as named compilation units
+  // can be compiled again with a different content.
+  std::string Code = PCHCode_;
+  Code += '\n';
+  std::string Files;
+  auto AddFile = [&](std::string const& Path) {
+    Code += "#include \"" + Path + "\"\n";
+    auto St = VFS_->status(Path);
+    if (St) {
+      Files += std::to_string(St->getUniqueID().getDevice()) + ':' +
+        std::to_string(St->getUniqueID().getFile()) + ':' +
+        std::to_string(sys::toTimeT(St->getLastModificationTime())) + '\n';
+    }
+  };
+  for (CUImpl const* CU: Imports) {
+    AddFile(CU->Name_);
+    for (auto const& Ext: CU->Extensions_) {
+      AddFile(Ext);
+    }
+  }
+  const std::string Key = getLangOptsKey(CUOpts) + '\n' + Code + Files;
+  auto It = ImportsPCHs_.find(Key);
+  if (It != ImportsPCHs_.end()) {
+    return It->second;
+  }
+  auto PCHPath = buildPCH(Code, Err, CUOpts);
+  if (!PCHPath.empty()) {
+    ImportsPCHs_[Key] = PCHPath;
+  }
+  return PCHPath;
+}
+
+std::string DFFIImpl::buildPCH(StringRef const Code, std::string& Err, CompileOpts const& CUOpts)
+{
+  // The header and its AST only live in the virtual file system. Clang
+  // validates the PCH against the header when loading it, so the former
+  // needs to stay reachable.
+  const std::string Path = "/__dffi_private/pch_" + std::to_string(CUIdx_++) + (Opts_.hasCXX() ? ".hpp":".h");
+  auto& FE = *MainFE_;
+  auto& CI = FE.Clang->getInvocation();
+  CI.getFrontendOpts().Inputs.clear();
+  CI.getFrontendOpts().Inputs.push_back(
+    FrontendInputFile(Path, Opts_.hasCXX() ? Language::CXX : Language::C));
+  CI.getPreprocessorOpts().ImplicitPCHInclude.clear();
+  VFS_->addFile(Path, time(NULL), MemoryBuffer::getMemBufferCopy(Code));
+
+  // The PCH can only be loaded with the language options it has been built
+  // with.
+  auto& LO = *CI.getLangOpts();
+  auto& CGO = CI.getCodeGenOpts();
+  const LangOptions SavedLO = LO;
+  const CodeGenOptions SavedCGO = CGO;
+  applyCompileOpts(CI, CUOpts);
+
+  auto Buffer = std::make_shared<PCHBuffer>();
+  GeneratePCHInMemoryAction Action(Buffer);
+  const bool Success = FE.Clang->ExecuteAction(Action);
+  LO = SavedLO;
+  CGO = SavedCGO;
+  if (!Success || !Buffer->IsComplete) {
+    FE.getCompileError(Err);
+    FE.resetDiagnostics();
+    return std::string{};
+  }
+  FE.resetDiagnostics();
+
+  // Files of VFS_ must be null terminated (see DFFIFileSystem::removeFiles)
+  std::string PCHPath = Path + ".pch";
+  VFS_->addFile(PCHPath, time(NULL), MemoryBuffer::getMemBufferCopy(StringRef{Buffer->Data.data(), Buffer->Data.size()}, PCHPath));
+  return PCHPath;
+}
+
 void getFuncWrapperName(SmallVectorImpl<char>& Ret, StringRef const Name)
 {
   (WrapperPrefix + Name).toVector(Ret);
@@ -381,8 +752,87 @@ bool isWrapperFunction(StringRef const Name)
   return Name.startswith(WrapperPrefix);
 }
 
+namespace {
+// FFI object destroyed by a task of one of its own workers (e.g. by the
+// callback of an asynchronous compilation dropping its last reference)
+thread_local DFFIImpl const* DestroyingWorkerFFI = nullptr;
+} // anonymous
+
 DFFIImpl::~DFFIImpl()
-{ }
+{
+  // Pending asynchronous compilations are finished first
+  {
+    std::lock_guard<std::mutex> Lock(TasksMutex_);
+    StopWorkers_ = true;
+  }
+  TasksCV_.notify_all();
+  const auto Self = std::this_thread::get_id();
+  for (auto& W: Workers_) {
+    if (W.get_id() != Self) {
+      W.join();
+      continue;
+    }
+    // A worker can't join itself: it returns as soon as its current task
+    // does (see workerLoop), and the tasks left are run here.
+    W.detach();
+    DestroyingWorkerFFI = this;
+  }
+  if (DestroyingWorkerFFI == this) {
+    for (auto& Task: Tasks_) {
+      Task();
+    }
+  }
+  // The ASTs kept by compilation units refer to the frontends they have been
+  // parsed by (see ASTTypeImporter).
+  CUs_.clear();
+}
+
+void DFFIImpl::compileAsync(std::string Code, std::string CUName, bool IncludeDefs, bool UseLastError, CompileOpts CUOpts, std::function<void(CUImpl*, std::string&)> Done)
+{
+  auto Task = [this, Code, CUName, IncludeDefs, UseLastError, CUOpts, Done]() {
+    std::string Err;
+    auto* CU = compile(Code, CUName, IncludeDefs, Err, UseLastError, {}, CUOpts);
+    Done(CU, Err);
+  };
+  addTask(std::move(Task));
+}
+
+void DFFIImpl::addTask(std::function<void()> Task)
+{
+  {
+    std::lock_guard<std::mutex> Lock(TasksMutex_);
+    if (Workers_.empty()) {
+      const unsigned NWorkers = std::max(Opts_.Concurrency, 1U);
+      for (unsigned I = 0; I < NWorkers; ++I) {
+        Workers_.emplace_back([this]() { workerLoop(); });
+      }
+    }
+    Tasks_.emplace_back(std::move(Task));
+  }
+  TasksCV_.notify_one();
+}
+
+void DFFIImpl::workerLoop()
+{
+  while (true) {
+    std::function<void()> Task;
+    {
+      std::unique_lock<std::mutex> Lock(TasksMutex_);
+      TasksCV_.wait(Lock, [this]() { return StopWorkers_ || !Tasks_.empty(); });
+      if (Tasks_.empty()) {
+        return;
+      }
+      Task = std::move(Tasks_.front());
+      Tasks_.pop_front();
+    }
+    Task();
+    if (DestroyingWorkerFFI == this) {
+      // The FFI object has been destroyed by this task
+      DestroyingWorkerFFI = nullptr;
+      return;
+    }
+  }
+}
 
 std::pair<size_t, bool> DFFIImpl::getFuncTypeWrapperId(FunctionType const* FTy)
 {
@@ -439,8 +889,68 @@ void DFFIImpl::genFuncTypeWrapper(TypePrinter& P, size_t WrapperIdx, llvm::raw_s
   ss << ");\n}\n";
 }
 
-CUImpl* DFFIImpl::compile(StringRef const Code, StringRef CUName, bool IncludeDefs, std::string& Err, bool UseLastError)
+CUImpl* DFFIImpl::compile(StringRef const Code, StringRef CUName, bool IncludeDefs, std::string& Err, bool UseLastError, ArrayRef<CUImpl*> Imports, CompileOpts const& CUOpts)
 {
+  std::unique_lock<std::recursive_mutex> Lock(Mutex_);
+  if (!CUOpts.PassPipeline.empty() && !checkPassPipeline(CUOpts.PassPipeline, Err)) {
+    return nullptr;
+  }
+
+  // Compilation units compiled with tiers are optimized from their IR, which
+  // isn't stored in the on-disk cache (see prepareTiers).
+  // The same goes for the counters of instrumented ones (see
+  // instrumentModule).
+  const bool Instrumented = Opts_.ProfileInstr;
+  const bool Tiered = Opts_.TierUpThreshold > 0 && Opts_.OptLevel > 0 && !Instrumented;
+  const bool Multiversioned = !Opts_.ISAVariants.empty() && !Tiered && !Instrumented;
+  // Nor is the IR of the ones compiled for LTO (see prepareLTO)
+  const bool Linkable = Opts_.LTO && !Tiered && !Instrumented && !Multiversioned;
+  // Loop hints are added to the unoptimized module (see addLoopHints)
+  const bool HasLoopHints = CUOpts.VectorizeWidth || CUOpts.InterleaveCount || CUOpts.UnrollCount;
+  // Local variables are made external (see promoteStatics) if they are used
+  // by other code: optimized tiers, code recompiled with a profile, linked
+  // code, or the code importing or extending the compilation unit.
+  const bool SharesStatics = CUOpts.ShareStatics || Tiered || Instrumented || Linkable;
+  const bool UsesImportedStatics = llvm::any_of(Imports, [](CUImpl const* Import) {
+    return !Import->StaticsPrefix_.empty();
+  });
+  // Clang's pipeline is replaced by optimizeModule for the compilation units
+  // whose module is changed before being optimized (see below).
+  const bool LatePipeline = !Tiered && (Instrumented || Multiversioned ||
+    HasLoopHints || !CUOpts.PassPipeline.empty() || SharesStatics ||
+    UsesImportedStatics);
+  if (Multiversioned && !checkISAVariants(Err)) {
+    return nullptr;
+  }
+
+  // Types of the imported compilation units can't be stored in the on-disk
+  // cache.
+  std::string CacheKey;
+  if (!Opts_.CacheDir.empty() && Imports.empty() && !Tiered && !Instrumented && !Linkable) {
+    // Anonymous CU names are generated, and thus aren't part of the key.
+    CacheKey = getCacheKey(Code, CUName, IncludeDefs, UseLastError, CUOpts);
+  }
+
+  // The prefix of cached compilation units comes from their key, and can't
+  // be used by two of them (see getStaticsPrefix). It is only kept once the
+  // compilation unit has been compiled.
+  std::string StaticsPrefix;
+  if (SharesStatics) {
+    StaticsPrefix = getStaticsPrefix(CacheKey);
+  }
+  auto ReleasePrefix = llvm::make_scope_exit([&]() {
+    std::lock_guard<std::recursive_mutex> PrefixLock(Mutex_);
+    KeyedStatics_.erase(StaticsPrefix);
+  });
+
+  // Frontends of the pool are used without the lock held (see below)
+  // The declarations of the imported compilation units are made visible by
+  // their precompiled sources, which replace the precompiled headers.
+  std::string PCHPath;
+  if (!getCompilePCH(Imports, CUOpts, PCHPath, Err)) {
+    return nullptr;
+  }
+
   std::string AnonCUName;
   if (CUName.empty()) {
     AnonCUName = "/__dffi_private/anon_cu_" + std::to_string(CUIdx_++) + (Opts_.hasCXX() ? ".cpp":".c");
@@ -454,132 +964,658 @@ CUImpl* DFFIImpl::compile(StringRef const Code, StringRef CUName, bool IncludeDe
   }
 #endif
 
+  if (!CacheKey.empty()) {
+    if (auto* CachedCU = loadCachedCU(CacheKey, Code, CUName, StaticsPrefix)) {
+      ReleasePrefix.release();
+      CachedCU->Opts_ = CUOpts;
+      if (!Opts_.LazyJITWrappers) {
+        compileFuncTypesWrappers(*CachedCU);
+      }
+      return CachedCU;
+    }
+  }
+
+  // The imported compilation units can't be destroyed while the lock isn't
+  // held below. They stay pinned once the compilation unit is compiled.
+  for (CUImpl* Import: Imports) {
+    ++Import->Importers_;
+  }
+  auto UnpinImports = llvm::make_scope_exit([&]() {
+    std::lock_guard<std::recursive_mutex> UnpinLock(Mutex_);
+    for (CUImpl* Import: Imports) {
+      if (--Import->Importers_ == 0 && Import->Released_) {
+        destroyCU(*Import);
+      }
+    }
+  });
+
+  // If concurrent compilation is enabled, clang runs on one of the frontends
+  // of the pool without holding the global lock.
+  Frontend* FE = MainFE_.get();
+  if (!Frontends_.empty()) {
+    Lock.unlock();
+    FE = acquireFrontend();
+  }
+  auto ReleaseFE = llvm::make_scope_exit([&]() {
+    if (FE != MainFE_.get()) {
+      releaseFrontend(FE);
+    }
+  });
+  if (FE->DepsCollector) {
+    FE->DepsCollector->clear();
+  }
+  FE->Clang->getInvocation().getPreprocessorOpts().ImplicitPCHInclude = PCHPath;
+
   std::unique_ptr<llvm::Module> M;
   std::unique_ptr<CUImpl> CU(new CUImpl{*this});
+  CU->Name_ = CUName.str();
+  CU->Imports_.append(Imports.begin(), Imports.end());
+  CU->StaticsPrefix_ = StaticsPrefix;
+  CU->Opts_ = CUOpts;
+
+  // The invocation is restored once the compilation unit is compiled, so
+  // that its options (see CompileOpts) don't apply to the next ones.
+  auto& CI = FE->Clang->getInvocation();
+  auto& CGO = CI.getCodeGenOpts();
+  auto& LO = *CI.getLangOpts();
+  const CodeGenOptions SavedCGO = CGO;
+  const LangOptions SavedLO = LO;
+  applyCompileOpts(CI, CUOpts);
+  // Tiered compilation units are first compiled without optimizations, but
+  // their functions can still be inlined once optimized (see tierUp).
+  if (Tiered) {
+    CGO.OptimizationLevel = 0;
+    CGO.DisableO0ImplyOptNone = true;
+  }
+  // Instrumented ones are optimized once their instrumentation has been
+  // lowered (see instrumentModule), multiversioned ones once their
+  // functions have been cloned (see cloneISAVariants), the ones with loop
+  // options once their loops have been given hints, and the ones with
+  // shared variables once these have been made external.
+  if (Instrumented) {
+    CGO.setProfileInstr(CodeGenOptions::ProfileClangInstr);
+  }
+  if (LatePipeline) {
+    CGO.DisableLLVMPasses = true;
+  }
+  if (IncludeDefs) {
+    M = compile_llvm_with_decls(*FE, Code, CUName, *CU, UseLastError, Err);
+  }
+  else {
+    M = compile_llvm(*FE, CU->getLLVMContext(), Code, CUName, Err, !Imports.empty());
+  }
+  CGO = SavedCGO;
+  LO = SavedLO;
+  if (!M) {
+    return nullptr;
+  }
+  auto* pM = M.get();
+  if (!Lock.owns_lock()) {
+    Lock.lock();
+  }
+
+  if (IncludeDefs) {
+    // Types and functions have already been imported from the AST
+    stripAsmPrefixes(*M);
+  }
+  else {
+    // Index the types declared in the compilation unit. The associated dffi
+    // types are only created when they are first needed (e.g. by the function
+    // types below, or by CUImpl::getType).
+    DebugInfoFinder DIF;
+    DIF.processModule(*pM);
+    for (DIType const* Ty: DIF.types()) {
+      if (Ty == nullptr) {
+        continue;
+      }
+      if (auto const* DTy = llvm::dyn_cast<DIDerivedType>(Ty)) {
+        if (DTy->getTag() == dwarf::DW_TAG_typedef) {
+          CU->indexDITypedef(DTy);
+        }
+      }
+      else
+      if (auto const* CTy = llvm::dyn_cast<DICompositeType>(Ty)) {
+        auto Tag = Ty->getTag();
+        if (Tag == dwarf::DW_TAG_structure_type || Tag == dwarf::DW_TAG_union_type || Tag == dwarf::DW_TAG_enumeration_type) {
+          CU->indexDIComposite(CTy);
+        }
+      }
+    }
+
+    // Generate function types
+    const bool hasCXX = Opts_.hasCXX();
+    for (Function& F: *M) {
+      if (F.isIntrinsic())
+        continue;
+      if (F.doesNotReturn())
+        continue;
+      // Types of C++ functions aren't created, as they can't be called
+      auto const* SP = F.getSubprogram();
+      if (!SP || (hasCXX && !SP->getLinkageName().empty()))
+        continue;
+      auto* DFTy = CU->getFunctionType(F, UseLastError);
+      if (!DFTy)
+        continue;
+      StringRef FName = F.getName();
+      if (FName.size() > 0 && FName[0] == 1) {
+        // Clang emits the "\01" prefix in some cases, when ASM function
+        // redirects are used!
+        F.setName(FName.substr(1));
+        FName = F.getName();
+      }
+      CU->parseFunctionAlias(F);
+      CU->FuncTys_[FName] = DFTy;
+    }
+  }
+
+  // Strip debug info (we don't need them anymore)!
+  llvm::StripDebugInfo(*pM);
+
+  SmallVector<std::unique_ptr<MemoryBuffer>, 1> Objs;
+  const bool HasCode = hasDefinitions(*pM);
+  // The code of this compilation unit uses the shared variables of its
+  // imports, and the other code using its variables must find them. They
+  // must not be optimized away before.
+  if (UsesImportedStatics && HasCode) {
+    useImportedStatics(*pM, Imports);
+  }
+  if (SharesStatics && HasCode) {
+    promoteStatics(*pM, CU->StaticsPrefix_);
+  }
+  if (HasLoopHints && HasCode) {
+    addLoopHints(*pM, CUOpts);
+  }
+  if (Tiered && HasCode) {
+    prepareTiers(*CU, *pM);
+  }
+  if (Instrumented && HasCode) {
+    instrumentModule(*CU, *pM);
+  }
+  if (Multiversioned && HasCode) {
+    cloneISAVariants(*CU, *pM);
+  }
+  // The IR kept for LTO is only simplified, as it is optimized again once
+  // linked.
+  if (LatePipeline && HasCode) {
+    optimizeModule(*pM, getOptTargetMachine(*FE), Opts_.OptLevel,
+      Linkable ? OptPhase::LTOPreLink : OptPhase::PerModule, CUOpts.PassPipeline);
+  }
+  if (Linkable && HasCode) {
+    prepareLTO(*CU, *pM);
+  }
+  // Functions whose address isn't the one of their code in this module
+  // can't be called directly by their wrappers.
+  if (HasCode && !Tiered && !Instrumented && !Multiversioned && !Linkable) {
+    genDirectWrappers(*CU, *pM);
+  }
+  const bool EmitObjs = HasCode && FE->TM != nullptr;
+  if (!HasCode) {
+    // Nothing to give to the JIT: functions are looked up in the process and
+    // the loaded libraries (see getFunctionAddress), and only their wrappers
+    // need to be compiled.
+    M.reset();
+  }
+  else
+  if (EmitObjs) {
+    // Generate object code outside of the EE, and load it afterwards (see
+    // below). Pool frontends have their own target machine, and compilation
+    // units their own LLVM context, so that this can be done without the
+    // lock held.
+    if (FE != MainFE_.get()) {
+      Lock.unlock();
+    }
+    emitObjects(*FE, *pM, Objs);
+    M.reset();
+    if (!Lock.owns_lock()) {
+      Lock.lock();
+    }
+  }
+  else
+  if (ObjCache_) {
+    // The on-disk cache needs the object code of the whole module
+    auto& EE = getEngine(*CU);
+    registerSymbols(*CU, *pM);
+    EE.addModule(std::move(M));
+    EE.generateCodeForModule(pM);
+    if (auto Obj = ObjCache_->takeObject(pM)) {
+      Objs.emplace_back(std::move(Obj));
+    }
+  }
+  else {
+    addModuleToJIT(*FE, *CU, std::move(M));
+  }
+
+  if (!CacheKey.empty() && (!HasCode || !Objs.empty())) {
+    CU->materializeTypes();
+    SmallVector<MemoryBufferRef, 1> ObjRefs;
+    for (auto const& Obj: Objs) {
+      ObjRefs.push_back(Obj->getMemBufferRef());
+    }
+    storeCachedCU(CacheKey, CUName, *CU, *FE, ObjRefs);
+  }
+
+  if (EmitObjs) {
+    for (auto& Obj: Objs) {
+      addObjectToJIT(*CU, std::move(Obj));
+    }
+  }
+  if (Opts_.DropIR) {
+    // Objects are always emitted (the main frontend has a target machine),
+    // so that nothing references the LLVM context of the compilation unit
+    // anymore.
+    assert((EmitObjs || !HasCode) && "module given to the JIT!");
+    CU->dropIR();
+  }
+
+  if (!Opts_.LazyJITWrappers) {
+    compileFuncTypesWrappers(*CU);
+  }
+
+  UnpinImports.release();
+  ReleasePrefix.release();
+  auto* Ret = CU.get();
+  CUs_.emplace_back(std::move(CU));
+  return Ret;
+}
+
+std::unique_ptr<ExecutionEngine> DFFIImpl::createEngine(std::string const& Triple, LLVMContext& Ctx, bool ForCU)
+{
+  std::unique_ptr<llvm::Module> DummyM(new llvm::Module{"DummyM",Ctx});
+  DummyM->setTargetTriple(Triple);
+  std::string Error;
+  EngineBuilder EB(std::move(DummyM));
+  EB.setEngineKind(EngineKind::JIT)
+    .setErrorStr(&Error)
+    .setOptLevel(CodeGenOpt::Default)
+    .setRelocationModel(Reloc::Static)
+    .setMCPU(CPU_)
+    .setMAttrs(Features_);
+  if (ForCU) {
+    // The memory manager owns the code of the compilation unit, and is
+    // destroyed with the engine.
+    EB.setMemoryManager(std::make_unique<SectionMemoryManager>())
+      .setSymbolResolver(std::make_unique<CUSymbolResolver>(*this));
+  }
+
+  // TODO: get the target machine from clang?
+  std::unique_ptr<ExecutionEngine> EE(EB.create());
+  if (!EE) {
+    std::stringstream ss;
+    ss << "error creating jit: " << Error; 
+    unreachable(ss.str().c_str());
+  }
+  if (ForCU && ObjCache_) {
+    EE->setObjectCache(ObjCache_.get());
+  }
+  return EE;
+}
+
+ExecutionEngine& DFFIImpl::getEngine(CUImpl& CU)
+{
+  if (!CU.EE_) {
+    // If the IR is dropped, the engine only holds object code, and its
+    // (empty) module does not need a context of its own.
+    auto& Ctx = Opts_.DropIR ? Ctx_ : CU.getLLVMContext();
+    CU.EE_ = createEngine(Triple_, Ctx, true /* ForCU */);
+    CU.Objects_.reset(new CUObjectListener{GlobalPrefix_});
+    CU.EE_->RegisterJITEventListener(CU.Objects_.get());
+  }
+  return *CU.EE_;
+}
+
+ExecutionEngine& DFFIImpl::getWrappersEngine()
+{
+  if (!EE_) {
+    EE_ = createEngine(Triple_, Ctx_, false /* ForCU */);
+  }
+  return *EE_;
+}
+
+std::string DFFIImpl::getStaticsPrefix(std::string& CacheKey)
+{
+  // Objects of the on-disk cache are loaded by other processes, so that the
+  // prefix of their variables only depends on their key. If the same code is
+  // already loaded, the new one gets variables of its own, and isn't cached:
+  // the code using them would otherwise use the ones of the first one (see
+  // useImportedStatics).
+  if (!CacheKey.empty()) {
+    std::string Ret = "__dffi_static." + CacheKey + ".";
+    if (KeyedStatics_.insert(Ret).second) {
+      return Ret;
+    }
+    CacheKey.clear();
+  }
+  return "__dffi_static." + std::to_string(CUIdx_++) + ".";
+}
+
+TargetMachine& DFFIImpl::getOptTargetMachine(Frontend& FE)
+{
+  if (FE.TM) {
+    return *FE.TM;
+  }
+  // Frontends without a target machine are only used with the lock held
+  if (!OptTM_) {
+    OptTM_ = createTargetMachine();
+  }
+  return *OptTM_;
+}
+
+void DFFIImpl::useImportedStatics(Module& M, ArrayRef<CUImpl*> Sources)
+{
+  // Clang emits the local variables the code uses again, even if they come
+  // from the sources of other compilation units. These are the only local
+  // variables of the translation unit with this name, which have been made
+  // external by promoteStatics. Tentative definitions coming from these
+  // sources are only declared.
+  for (GlobalVariable& GV: M.globals()) {
+    if (!GV.isDeclaration() && (!GV.hasLocalLinkage() || GV.isConstant())) {
+      continue;
+    }
+    for (CUImpl* CU: Sources) {
+      if (CU->StaticsPrefix_.empty()) {
+        continue;
+      }
+      std::string Name = CU->StaticsPrefix_ + GV.getName().str();
+      auto It = SymbolOwners_.find(Name);
+      if (It == SymbolOwners_.end() || It->second != CU) {
+        continue;
+      }
+      GV.setName(Name);
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setComdat(nullptr);
+      break;
+    }
+  }
+}
+
+void DFFIImpl::registerSymbols(CUImpl& CU, llvm::Module const& M)
+{
+  for (GlobalValue const& GV: M.global_values()) {
+    if (!GV.isDeclaration() && !GV.hasLocalLinkage()) {
+      SymbolOwners_.try_emplace(GV.getName(), &CU);
+    }
+  }
+}
+
+void DFFIImpl::registerSymbols(CUImpl& CU, object::ObjectFile const& Obj)
+{
+  const char Prefix = GlobalPrefix_;
+  for (auto const& Sym: Obj.symbols()) {
+    auto FlagsOrErr = Sym.getFlags();
+    if (!FlagsOrErr) {
+      consumeError(FlagsOrErr.takeError());
+      continue;
+    }
+    if (!(*FlagsOrErr & object::SymbolRef::SF_Global) || (*FlagsOrErr & object::SymbolRef::SF_Undefined)) {
+      continue;
+    }
+    auto NameOrErr = Sym.getName();
+    if (!NameOrErr) {
+      consumeError(NameOrErr.takeError());
+      continue;
+    }
+    StringRef Name = *NameOrErr;
+    if (Prefix && !Name.empty() && Name.front() == Prefix) {
+      Name = Name.drop_front();
+    }
+    SymbolOwners_.try_emplace(Name, &CU);
+  }
+}
+
+void DFFIImpl::addObjectToJIT(CUImpl& CU, std::unique_ptr<MemoryBuffer> Obj)
+{
+  auto ObjOrErr = object::ObjectFile::createObjectFile(Obj->getMemBufferRef());
+  if (!ObjOrErr) {
+    llvm::report_fatal_error(ObjOrErr.takeError());
+  }
+  registerSymbols(CU, **ObjOrErr);
+  getEngine(CU).addObjectFile(object::OwningBinary<object::ObjectFile>{std::move(*ObjOrErr), std::move(Obj)});
+}
+
+void DFFIImpl::addModuleToJIT(Frontend& FE, CUImpl& CU, std::unique_ptr<llvm::Module> M)
+{
+  if (FE.TM) {
+    SmallVector<std::unique_ptr<MemoryBuffer>, 1> Objs;
+    emitObjects(FE, *M, Objs);
+    for (auto& Obj: Objs) {
+      addObjectToJIT(CU, std::move(Obj));
+    }
+    return;
+  }
+
+  // Add one module per function to the EE. MCJIT only generates code for
+  // one of them when one of its symbols is looked up, so that unused
+  // functions (e.g. static inline ones coming from headers) are never
+  // compiled.
+  registerSymbols(CU, *M);
+  auto& EE = getEngine(CU);
+  const bool Split = splitModule(*M, [&](std::unique_ptr<llvm::Module> FM) {
+    EE.addModule(std::move(FM));
+  });
+  if (!Split) {
+    EE.addModule(std::move(M));
+  }
+}
+
+bool DFFIImpl::extend(CUImpl& CU, StringRef const Code, std::string& Err, bool UseLastError)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+
+  // The previous parts of the compilation unit are loaded from a precompiled
+  // header, so that only the new code is parsed, and code generated.
+  SmallVector<CUImpl*, 4> Sources{CU.Imports_.begin(), CU.Imports_.end()};
+  Sources.push_back(&CU);
+  if (CU.PCHPath_.empty()) {
+    CU.PCHPath_ = getImportsPCH(Sources, Err, CU.Opts_);
+    if (CU.PCHPath_.empty()) {
+      return false;
+    }
+  }
+
+  const std::string Name = "/__dffi_private/ext_" + std::to_string(CUIdx_++) + (Opts_.hasCXX() ? ".cpp":".c");
+  auto& FE = *MainFE_;
+  auto& CI = FE.Clang->getInvocation();
+  CI.getPreprocessorOpts().ImplicitPCHInclude = CU.PCHPath_;
+  // The new code is compiled with the options of the compilation unit (see
+  // compile), which its precompiled header has been built with.
+  auto& CGO = CI.getCodeGenOpts();
+  auto& LO = *CI.getLangOpts();
+  const CodeGenOptions SavedCGO = CGO;
+  const LangOptions SavedLO = LO;
+  applyCompileOpts(CI, CU.Opts_);
+  // Like the code of the compilation unit, the new one is optimized once its
+  // loops have been given hints and its shared variables have been handled.
+  auto const& CUOpts = CU.Opts_;
+  const bool SharedStatics = llvm::any_of(Sources, [](CUImpl const* Source) {
+    return !Source->StaticsPrefix_.empty();
+  });
+  const bool LatePipeline = SharedStatics || CUOpts.VectorizeWidth ||
+    CUOpts.InterleaveCount || CUOpts.UnrollCount || !CUOpts.PassPipeline.empty();
+  if (LatePipeline) {
+    CGO.DisableLLVMPasses = true;
+  }
+  // The new code is also precompiled, chained to the previous parts.
+  auto PCH = std::make_shared<PCHBuffer>();
+  auto M = compile_llvm_with_decls(FE, Code, Name, CU, UseLastError, Err, true /* Extend */, PCH);
+  CGO = SavedCGO;
+  LO = SavedLO;
+  if (!M) {
+    return false;
+  }
+  stripAsmPrefixes(*M);
+  if (hasDefinitions(*M)) {
+    if (SharedStatics) {
+      useImportedStatics(*M, Sources);
+    }
+    if (!CU.StaticsPrefix_.empty()) {
+      promoteStatics(*M, CU.StaticsPrefix_);
+    }
+    if (LatePipeline) {
+      addLoopHints(*M, CUOpts);
+      optimizeModule(*M, getOptTargetMachine(FE), Opts_.OptLevel,
+        OptPhase::PerModule, CUOpts.PassPipeline);
+    }
+    addModuleToJIT(FE, CU, std::move(M));
+  }
+  M.reset();
+  if (Opts_.DropIR) {
+    CU.dropIR();
+  }
+  CU.Extensions_.push_back(Name);
+  CU.PrivateFiles_.push_back(Name);
+
+  // If the new code could not be precompiled, the precompiled header is
+  // built again from all the sources by the next extension.
+  CU.PCHPath_.clear();
+  if (PCH->IsComplete) {
+    // Files of VFS_ must be null terminated (see DFFIFileSystem::removeFiles)
+    CU.PCHPath_ = Name + ".pch";
+    VFS_->addFile(CU.PCHPath_, time(NULL), MemoryBuffer::getMemBufferCopy(StringRef{PCH->Data.data(), PCH->Data.size()}, CU.PCHPath_));
+    CU.PrivateFiles_.push_back(CU.PCHPath_);
+  }
+
+  if (!Opts_.LazyJITWrappers) {
+    compileFuncTypesWrappers(CU);
+  }
+  return true;
+}
+
+void DFFIImpl::release(CUImpl& CU)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  // The code and types of imported compilation units are used by the ones
+  // importing them.
+  CU.Released_ = true;
+  if (CU.Importers_ == 0) {
+    destroyCU(CU);
+  }
+}
 
-  if (IncludeDefs) {
-    M = compile_llvm_with_decls(Code, CUName, CU->FuncAliases_, Err);
+void DFFIImpl::retainAST(CUImpl& CU)
+{
+  forgetAST(CU);
+  ASTCUs_.push_back(&CU);
+  if (ASTCUs_.size() <= MaxRetainedASTs) {
+    return;
   }
-  else {
-    M = compile_llvm(Code, CUName, Err);
+  CUImpl* Oldest = ASTCUs_.front();
+  ASTCUs_.erase(ASTCUs_.begin());
+  Oldest->ASTImporter_->importAll();
+  Oldest->ASTImporter_.reset();
+}
+
+void DFFIImpl::forgetAST(CUImpl& CU)
+{
+  auto It = llvm::find(ASTCUs_, &CU);
+  if (It != ASTCUs_.end()) {
+    ASTCUs_.erase(It);
   }
-  if (!M) {
-    return nullptr;
+}
+
+void DFFIImpl::destroyCU(CUImpl& CU)
+{
+  KeyedStatics_.erase(CU.StaticsPrefix_);
+  for (auto It = SymbolOwners_.begin(), End = SymbolOwners_.end(); It != End;) {
+    auto Cur = It++;
+    if (Cur->second == &CU) {
+      SymbolOwners_.erase(Cur);
+    }
   }
-  auto* pM = M.get();
 
-  // Pre-parse metadata in two passes to find and declare structures
-  // First pass will declare every structure as opaque ones. Next pass defines the ones which are.
-  DebugInfoFinder DIF;
-  DIF.processModule(*pM);
-  SmallVector<DICompositeType const*, 16> Composites;
-  SmallVector<DIDerivedType const*, 16> Typedefs;
-  for (DIType const* Ty: DIF.types()) {
-    if (Ty == nullptr) {
+  // Sources of the compilation unit, and the precompiled headers they are
+  // part of.
+  std::vector<std::string> Files = std::move(CU.PrivateFiles_);
+  Files.push_back(CU.Name_);
+  const std::string Include = "#include \"" + CU.Name_ + "\"\n";
+  for (auto It = ImportsPCHs_.begin(), End = ImportsPCHs_.end(); It != End;) {
+    auto Cur = It++;
+    if (Cur->getKey().find(Include) == StringRef::npos) {
       continue;
     }
-    if (auto const* DTy = llvm::dyn_cast<DIDerivedType>(Ty)) {
-      if (DTy->getTag() == dwarf::DW_TAG_typedef) {
-        Typedefs.push_back(DTy);
-      }
-    }
-    else {
-      Ty = getCanonicalDIType(Ty);
-      if (auto const* CTy = llvm::dyn_cast<DICompositeType>(Ty)) {
-        auto Tag = Ty->getTag();
-        if (Tag == dwarf::DW_TAG_structure_type || Tag == dwarf::DW_TAG_union_type || Tag == dwarf::DW_TAG_enumeration_type) {
-          Composites.push_back(CTy);
-          CU->declareDIComposite(CTy);
-        }
-      }
+    StringRef PCHPath = Cur->getValue();
+    Files.push_back(PCHPath.str());
+    Files.push_back(PCHPath.drop_back(strlen(".pch")).str());
+    ImportsPCHs_.erase(Cur);
+  }
+  VFS_->removeFiles(Files);
+
+  // Clang caches the content of the files it has read. Named compilation
+  // units can be compiled again with a different content, so that this cache
+  // needs to be dropped. Otherwise, it is only done from time to time, to
+  // bound its size.
+  ReleasedFiles_ += Files.size();
+  if (!StringRef{CU.Name_}.startswith("/__dffi_private/") || ReleasedFiles_ >= 256) {
+    ReleasedFiles_ = 0;
+    resetFileManager(*MainFE_);
+    std::lock_guard<std::mutex> FELock(FrontendsMutex_);
+    ++FSGeneration_;
+  }
+
+  // Free the types which use the ones of the compilation unit, and the
+  // wrappers associated with them.
+  SmallPtrSet<Type const*, 32> Dead;
+  for (auto const& It: CU.CompositeTys_) {
+    Dead.insert(It.getValue().get());
+  }
+  DCtx_.purgeTypes(Dead);
+  for (auto It = FuncTyWrappers_.begin(), End = FuncTyWrappers_.end(); It != End;) {
+    auto Cur = It++;
+    if (Dead.count(Cur->first)) {
+      FuncTyWrappers_.erase(Cur);
     }
   }
-
-  // Parse structures and unions
-  for (DICompositeType const* Ty: Composites) {
-    CU->parseDIComposite(Ty, *M);
+  for (auto It = VarArgsFuncTyWrappers_.begin(), End = VarArgsFuncTyWrappers_.end(); It != End;) {
+    auto Cur = It++;
+    if (Dead.count(Cur->first.first)) {
+      VarArgsFuncTyWrappers_.erase(Cur);
+    }
   }
+  CU.clearAliases();
 
-  CU->inlineCompositesAnonymousMembers();
+  // This frees the modules, objects and code of the compilation unit
+  auto Imports = std::move(CU.Imports_);
+  auto ItCU = llvm::find_if(CUs_, [&](std::unique_ptr<CUImpl> const& P) { return P.get() == &CU; });
+  assert(ItCU != CUs_.end() && "unknown compilation unit!");
+  CUs_.erase(ItCU);
 
-  for (auto const* DTy: Typedefs) {
-    // TODO: optimize this! We could add the visited typedefs in the alias list
-    // as long as we traverse it, and remove them from the list of typedefs to
-    // visit.
-    CU->setAlias(DTy->getName(), CU->getTypeFromDIType(DTy));
+  for (CUImpl* Import: Imports) {
+    if (--Import->Importers_ == 0 && Import->Released_) {
+      destroyCU(*Import);
+    }
   }
+}
 
-  // Generate function types
+void DFFIImpl::compileFuncTypesWrappers(CUImpl const& CU)
+{
   std::string Buf;
   llvm::raw_string_ostream Wrappers(Buf);
   TypePrinter Printer;
-  SmallVector<Function*, 16> ToRemove;
-  const bool hasCXX = Opts_.hasCXX();
-  for (Function& F: *M) {
-    if (F.isIntrinsic())
-      continue;
-    if (hasCXX && !F.getSubprogram()->getLinkageName().empty())
-      continue;
-    StringRef FName = F.getName();
-    const bool ForceDecl = FName.startswith("__dffi_force_decl_");
-    const bool ForceTypedef = FName.startswith("__dffi_force_typedef");
-    if (!ForceDecl && !ForceTypedef && F.doesNotReturn())
-      continue;
-    if (ForceTypedef) {
-      ToRemove.push_back(&F);
-      continue;
+  auto WrappersM = createWrappersModule();
+  for (auto const& It: CU.FuncTys_) {
+    auto Id = getFuncTypeWrapperId(It.getValue());
+    if (!Id.second && !genFuncTypeWrapperIR(*WrappersM, Id.first, It.getValue(), {})) {
+      genFuncTypeWrapper(Printer, Id.first, Wrappers, It.getValue(), {});
     }
-    auto* DFTy = CU->getFunctionType(F, UseLastError);
-    if (!DFTy)
-      continue;
-    if (ForceDecl) {
-      FName = FName.substr(strlen("__dffi_force_decl_"));
-      ToRemove.push_back(&F);
-    }
-    else {
-      if (FName.size() > 0 && FName[0] == 1) {
-        // Clang emits the "\01" prefix in some cases, when ASM function
-        // redirects are used!
-        F.setName(FName.substr(1));
-        FName = F.getName();
-      }
-      CU->parseFunctionAlias(F);
-    }
-    CU->FuncTys_[FName] = DFTy;
-    if (!Opts_.LazyJITWrappers) {
-      auto Id = getFuncTypeWrapperId(DFTy);
-      if (!Id.second) {
-        // TODO: if varag, do we always generate the wrapper for the version w/o varargs?
-        genFuncTypeWrapper(Printer, Id.first, Wrappers, DFTy, {});
-      }
-    }
-  }
-
-  for (Function* F: ToRemove) {
-    F->eraseFromParent();
   }
-
-  // Strip debug info (we don't need them anymore)!
-  llvm::StripDebugInfo(*pM);
-
-  // Add the module to the EE
-  EE_->addModule(std::move(M));
-  EE_->generateCodeForModule(pM);
-
-  // Compile wrappers
+  compileWrappersModule(std::move(WrappersM));
   compileWrappers(Printer, Wrappers.str());
-
-  // We don't need these anymore
-  CU->AnonTys_.clear();
-
-  auto* Ret = CU.get();
-  CUs_.emplace_back(std::move(CU));
-  return Ret;
 }
 
 void DFFIImpl::compileWrappers(TypePrinter& Printer, std::string const& Wrappers)
 {
-  auto& CI = Clang_->getInvocation();
+  if (Wrappers.empty()) {
+    return;
+  }
+  addWrappersToJIT(compileWrappersIR(Printer, Wrappers));
+}
+
+std::unique_ptr<llvm::Module> DFFIImpl::compileWrappersIR(TypePrinter& Printer, std::string const& Wrappers)
+{
+  auto& CI = MainFE_->Clang->getInvocation();
+  // Wrappers are C code which declares its own types, and can't include the
+  // precompiled header. compile() sets it back for each compilation unit.
+  CI.getPreprocessorOpts().ImplicitPCHInclude.clear();
   CI.getLangOpts()->CPlusPlus = false;
   CI.getLangOpts()->C99 = true;
   CI.getLangOpts()->C11 = true;
@@ -589,20 +1625,59 @@ void DFFIImpl::compileWrappers(TypePrinter& Printer, std::string const& Wrappers
   ss << "/__dffi_private/wrappers_" << CUIdx_++ << ".c";
   CGO.setDebugInfo(codegenoptions::NoDebugInfo);
   std::string Err;
-  auto M = compile_llvm(WCode, ss.str(), Err);
+  const std::string Path = ss.str();
+  auto M = compile_llvm(*MainFE_, Ctx_, WCode, Path, Err);
   CGO.setDebugInfo(codegenoptions::FullDebugInfo);
+  // Nothing includes the source of the wrappers
+  VFS_->removeFiles(Path);
   if (!M) {
     errs() << WCode;
     errs() << Err;
     llvm::report_fatal_error("unable to compile wrappers!");
   }
-  auto* pM = M.get();
-  EE_->addModule(std::move(M));
-  EE_->generateCodeForModule(pM);
 
   CI.getLangOpts()->CPlusPlus = Opts_.hasCXX();
   CI.getLangOpts()->C99 = !Opts_.hasCXX();
   CI.getLangOpts()->C11 = !Opts_.hasCXX();
+  return M;
+}
+
+void DFFIImpl::addWrappersToJIT(std::unique_ptr<llvm::Module> M)
+{
+  if (Opts_.DropIR) {
+    // Only the object code is kept (see getWrapperLLVMFunc)
+    SmallVector<std::unique_ptr<MemoryBuffer>, 1> Objs;
+    emitObjects(*MainFE_, *M, Objs);
+    M.reset();
+    for (auto& Obj: Objs) {
+      auto ObjOrErr = object::ObjectFile::createObjectFile(Obj->getMemBufferRef());
+      if (!ObjOrErr) {
+        llvm::report_fatal_error(ObjOrErr.takeError());
+      }
+      getWrappersEngine().addObjectFile(object::OwningBinary<object::ObjectFile>{std::move(*ObjOrErr), std::move(Obj)});
+    }
+    return;
+  }
+  auto* pM = M.get();
+  auto& EE = getWrappersEngine();
+  EE.addModule(std::move(M));
+  EE.generateCodeForModule(pM);
+}
+
+void DFFIImpl::compileWrapper(size_t WrapperIdx, FunctionType const* FTy, ArrayRef<Type const*> VarArgs)
+{
+  // Try to generate the wrapper directly as LLVM IR, which avoids running
+  // clang for simple function types.
+  auto M = createWrappersModule();
+  if (genFuncTypeWrapperIR(*M, WrapperIdx, FTy, VarArgs)) {
+    compileWrappersModule(std::move(M));
+    return;
+  }
+  std::string Buf;
+  llvm::raw_string_ostream ss(Buf);
+  TypePrinter P;
+  genFuncTypeWrapper(P, WrapperIdx, ss, FTy, VarArgs);
+  compileWrappers(P, ss.str());
 }
 
 void* DFFIImpl::getWrapperAddress(FunctionType const* FTy)
@@ -611,20 +1686,17 @@ void* DFFIImpl::getWrapperAddress(FunctionType const* FTy)
   auto Id = getFuncTypeWrapperId(FTy);
   size_t WIdx = Id.first;
   if (!Id.second) {
-    std::string Buf;
-    llvm::raw_string_ostream ss(Buf);
-    TypePrinter P;
-    genFuncTypeWrapper(P, WIdx, ss, FTy, None);
-    compileWrappers(P, ss.str());
+    compileWrapper(WIdx, FTy, None);
   }
   std::string TName = getWrapperName(WIdx);
-  void* Ret = (void*)EE_->getFunctionAddress(TName.c_str());
+  void* Ret = (void*)getWrappersEngine().getFunctionAddress(TName.c_str());
   assert(Ret && "function wrapper does not exist!");
   return Ret;
 }
 
-Function* DFFIImpl::getWrapperLLVMFunc(FunctionType const* FTy, ArrayRef<Type const*> VarArgs)
+Function* DFFIImpl::getWrapperLLVMFunc(FunctionType const* FTy, ArrayRef<Type const*> VarArgs, std::unique_ptr<llvm::Module>& Owner)
 {
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
   // TODO: suboptimal. Lookup of the wrapper ID is done twice, and the full
   // compilation of the wrapper is done, whereas it might not be necessary!
   getWrapperAddress(FTy);
@@ -639,7 +1711,21 @@ Function* DFFIImpl::getWrapperLLVMFunc(FunctionType const* FTy, ArrayRef<Type co
   }
   assert(Id.second && "wrapper should already exist!");
   std::string TName = getWrapperName(Id.first);
-  return EE_->FindFunctionNamed(TName);
+  if (!Opts_.DropIR) {
+    return getWrappersEngine().FindFunctionNamed(TName);
+  }
+
+  // The IR of the wrapper has been dropped once compiled: generate it again
+  // the same way (see compileWrapper).
+  Owner = createWrappersModule();
+  if (!genFuncTypeWrapperIR(*Owner, Id.first, FTy, VarArgs)) {
+    std::string Buf;
+    llvm::raw_string_ostream ss(Buf);
+    TypePrinter P;
+    genFuncTypeWrapper(P, Id.first, ss, FTy, VarArgs);
+    Owner = compileWrappersIR(P, ss.str());
+  }
+  return Owner->getFunction(TName);
 }
 
 void* DFFIImpl::getWrapperAddress(FunctionType const* FTy, ArrayRef<Type const*> VarArgs)
@@ -647,28 +1733,33 @@ void* DFFIImpl::getWrapperAddress(FunctionType const* FTy, ArrayRef<Type const*>
   auto Id = getFuncTypeWrapperId(FTy, VarArgs);
   size_t WIdx = Id.first;
   if (!Id.second) {
-    std::string Buf;
-    llvm::raw_string_ostream ss(Buf);
-    TypePrinter P;
-    genFuncTypeWrapper(P, WIdx, ss, FTy, VarArgs);
-    compileWrappers(P, ss.str());
+    compileWrapper(WIdx, FTy, VarArgs);
   }
   std::string TName = getWrapperName(WIdx);
-  void* Ret = (void*)EE_->getFunctionAddress(TName.c_str());
+  void* Ret = (void*)getWrappersEngine().getFunctionAddress(TName.c_str());
   assert(Ret && "function wrapper does not exist!");
   return Ret;
 }
 
-void* DFFIImpl::getFunctionAddress(StringRef Name)
+void* DFFIImpl::getFunctionAddress(StringRef Name, CUImpl* CU)
 {
-  // TODO: chances that this is clearly sub optimal
-  // TODO: use getAddressToGlobalIfAvailable?
-  Function* F = EE_->FindFunctionNamed(Name);
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  // This generates the code of the module defining Name if it hasn't been
+  // done yet. Functions coming from object files (e.g. cached CUs) have no IR
+  // counterpart, but are also found here.
   const std::string NameStr = Name.str();
-  if (!F || F->isDeclaration()) {
-    return sys::DynamicLibrary::SearchForAddressOfSymbol(NameStr);
+  if (CU && CU->EE_) {
+    if (auto Addr = getCUSymbolAddress(*CU, NameStr, true /* FunctionsOnly */)) {
+      return (void*)Addr;
+    }
+  }
+  auto It = SymbolOwners_.find(Name);
+  if (It != SymbolOwners_.end() && It->second != CU) {
+    if (auto Addr = getCUSymbolAddress(*It->second, NameStr, true /* FunctionsOnly */)) {
+      return (void*)Addr;
+    }
   }
-  return (void*)EE_->getFunctionAddress(NameStr);
+  return sys::DynamicLibrary::SearchForAddressOfSymbol(NameStr);
 #if 0
   // TODO: we would like to be able to do this! Unfortunatly, MCJIT API is
   // private...
@@ -684,9 +1775,52 @@ void* DFFIImpl::getFunctionAddress(StringRef Name)
 #endif
 }
 
-NativeFunc DFFIImpl::getFunction(FunctionType const* FTy, void* FPtr)
+uint64_t DFFIImpl::resolveSymbol(std::string const& Name)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  // Name is mangled, whereas engines look up IR names
+  StringRef IRName = Name;
+  const char Prefix = GlobalPrefix_;
+  if (Prefix && !IRName.empty() && IRName.front() == Prefix) {
+    IRName = IRName.drop_front();
+  }
+  if (auto Addr = getTiersSymbolAddress(IRName)) {
+    return Addr;
+  }
+  auto It = SymbolOwners_.find(IRName);
+  if (It != SymbolOwners_.end()) {
+    // This also finalizes the code of the other compilation unit, which
+    // might be called by this one from now on.
+    if (auto Addr = getCUSymbolAddress(*It->second, IRName.str(), false /* FunctionsOnly */)) {
+      return Addr;
+    }
+  }
+  return RTDyldMemoryManager::getSymbolAddressInProcess(Name);
+}
+
+uint64_t DFFIImpl::getCUSymbolAddress(CUImpl& CU, std::string const& Name, bool FunctionsOnly)
+{
+  auto& EE = *CU.EE_;
+  if (!Finalizing_.insert(&CU).second) {
+    // The code of CU references code which references Name, and whose
+    // symbols are being resolved: the engine of CU can't be finalized again
+    // (which would resolve them again). Symbols of its loaded objects
+    // already have an address, and functions of its modules can be found
+    // without finalizing it, like MCJIT does for its own modules.
+    if (auto Addr = CU.Objects_->lookup(Name)) {
+      return Addr;
+    }
+    auto* F = EE.FindFunctionNamed(Name);
+    return F ? (uint64_t)EE.getPointerToFunction(F) : 0;
+  }
+  auto Erase = llvm::make_scope_exit([&]() { Finalizing_.erase(&CU); });
+  return FunctionsOnly ? EE.getFunctionAddress(Name) : EE.getGlobalValueAddress(Name);
+}
+
+NativeFunc DFFIImpl::getFunction(FunctionType const* FTy, void* FPtr, void* Wrapper)
 {
-  auto TFPtr = (NativeFunc::TrampPtrTy)getWrapperAddress(FTy);
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  auto TFPtr = (NativeFunc::TrampPtrTy)(Wrapper ? Wrapper : getWrapperAddress(FTy));
   assert(TFPtr && "function type trampoline doesn't exist!");
   return {TFPtr, FPtr, FTy};
 }
@@ -694,6 +1828,7 @@ NativeFunc DFFIImpl::getFunction(FunctionType const* FTy, void* FPtr)
 // TODO: QualType here!
 NativeFunc DFFIImpl::getFunction(FunctionType const* FTy, ArrayRef<Type const*> VarArgs, void* FPtr)
 {
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
   if (!FTy->hasVarArgs()) {
     return NativeFunc{};
   }
@@ -714,16 +1849,19 @@ NativeFunc DFFIImpl::getFunction(FunctionType const* FTy, ArrayRef<Type const*>
 
 BasicType const* DFFIImpl::getBasicType(BasicType::BasicKind K)
 {
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
   return getContext().getBasicType(*this, K);
 }
 
 PointerType const* DFFIImpl::getPointerType(QualType Ty)
 {
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
   return getContext().getPtrType(*this, Ty);
 }
 
 ArrayType const* DFFIImpl::getArrayType(QualType Ty, uint64_t NElements)
 {
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
   return getContext().getArrayType(*this, Ty, NElements);
 }
 
@@ -734,6 +1872,50 @@ CUImpl::CUImpl(DFFIImpl& DFFI):
   DFFI_(DFFI)
 { }
 
+CUImpl::~CUImpl()
+{
+  // Pending optimizations of its functions are dropped (see
+  // DFFIImpl::tierUp)
+  for (auto const& It: TieredFuncs_) {
+    It.getValue()->CU = nullptr;
+  }
+  // Compilation units which fail to compile are freed without the lock held
+  if (ASTImporter_) {
+    std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
+    DFFI_.forgetAST(*this);
+  }
+}
+
+llvm::LLVMContext& CUImpl::getLLVMContext()
+{
+  if (!LLVMCtx_) {
+    LLVMCtx_.reset(new llvm::LLVMContext{});
+  }
+  return *LLVMCtx_;
+}
+
+void CUImpl::dropIR()
+{
+  // Debug info nodes are owned by the context
+  materializeTypes();
+  assert(PendingComposites_.empty() && "composite types still need to be parsed!");
+  DIComposites_.clear();
+  DITypedefs_.clear();
+  AnonTys_.clear();
+  ASTImporter_.reset();
+  DFFI_.forgetAST(*this);
+  LLVMCtx_.reset();
+}
+
+void CUImpl::clearAliases()
+{
+  for (auto const& It: AliasTys_) {
+    if (It.getValue()) {
+      It.getValue()->removeName(It.getKeyData());
+    }
+  }
+}
+
 std::tuple<void*, FunctionType const*> CUImpl::getFunctionAddressAndTy(llvm::StringRef Name)
 {
   auto ItAlias = FuncAliases_.find(Name);
@@ -744,7 +1926,48 @@ std::tuple<void*, FunctionType const*> CUImpl::getFunctionAddressAndTy(llvm::Str
   if (ItFTy == FuncTys_.end()) {
     return std::tuple<void*, FunctionType const*>{nullptr,nullptr};
   }
-  return std::tuple<void*, FunctionType const*>{DFFI_.getFunctionAddress(Name), ItFTy->second};
+  // Profiled and ISA variant functions are looked up with the lock held.
+  // getFunctionAddress takes it anyway.
+  const bool Profiled = DFFI_.Opts_.ProfileInstr;
+  const bool HasVariants = !DFFI_.ISASuffix_.empty();
+  std::unique_lock<std::recursive_mutex> Lock(DFFI_.Mutex_, std::defer_lock);
+  if (Profiled || HasVariants) {
+    Lock.lock();
+  }
+  if (Profiled) {
+    auto ItProf = ProfiledSyms_.find(Name);
+    if (ItProf != ProfiledSyms_.end()) {
+      Name = ItProf->second;
+    }
+  }
+  if (HasVariants) {
+    // Functions without variants (e.g. from extensions) use their default
+    // code.
+    auto Ins = ISAFuncs_.try_emplace(Name, nullptr);
+    if (Ins.second) {
+      Ins.first->second = DFFI_.getFunctionAddress((Name + DFFI_.ISASuffix_).str(), this);
+    }
+    if (Ins.first->second) {
+      return std::tuple<void*, FunctionType const*>{Ins.first->second, ItFTy->second};
+    }
+  }
+  return std::tuple<void*, FunctionType const*>{DFFI_.getFunctionAddress(Name, this), ItFTy->second};
+}
+
+void* CUImpl::getDirectWrapper(llvm::StringRef Name)
+{
+  std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
+  if (!EE_) {
+    return nullptr;
+  }
+  auto ItAlias = FuncAliases_.find(Name);
+  if (ItAlias != FuncAliases_.end()) {
+    Name = ItAlias->second;
+  }
+  // Other compilation units might define a wrapper with the same name
+  SmallString<128> WName;
+  getFuncWrapperName(WName, Name);
+  return (void*)DFFI_.getCUSymbolAddress(*this, WName.str().str(), true /* FunctionsOnly */);
 }
 
 NativeFunc CUImpl::getFunction(llvm::StringRef Name)
@@ -752,7 +1975,10 @@ NativeFunc CUImpl::getFunction(llvm::StringRef Name)
   void* FPtr;
   FunctionType const* FTy;
   std::tie(FPtr, FTy) = getFunctionAddressAndTy(Name);
-  return getFunction(FPtr, FTy);
+  if (!FPtr || !FTy) {
+    return {};
+  }
+  return DFFI_.getFunction(FTy, FPtr, getDirectWrapper(Name));
 }
 
 NativeFunc CUImpl::getFunction(llvm::StringRef Name, llvm::ArrayRef<Type const*> VarArgs)
@@ -780,45 +2006,80 @@ NativeFunc CUImpl::getFunction(void* FPtr, FunctionType const* FTy)
 }
 
 template <class T>
-static T const* getCompositeType(CompositeTysMap const& Tys, StringRef Name)
+T const* CUImpl::getCompositeType(StringRef Name)
 {
-  auto It = Tys.find(Name);
-  if (It == Tys.end()) {
-    return nullptr;
+  std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
+  auto It = CompositeTys_.find(Name);
+  if (It != CompositeTys_.end()) {
+    return dffi::dyn_cast<T>(It->second.get());
+  }
+  if (auto* ITy = getImportedComposite(Name)) {
+    return dffi::dyn_cast<T>(ITy);
+  }
+  auto ItDI = DIComposites_.find(Name);
+  if (ItDI != DIComposites_.end()) {
+    return dffi::dyn_cast<T>(getCompositeFromDI(ItDI->second));
   }
-  return dffi::dyn_cast<T>(It->second.get());
+  if (ASTImporter_) {
+    return dffi::dyn_cast_or_null<T>(ASTImporter_->importComposite(Name));
+  }
+  return nullptr;
 }
 
-StructType const* CUImpl::getStructType(StringRef Name) const
+StructType const* CUImpl::getStructType(StringRef Name)
 {
-  return getCompositeType<StructType>(CompositeTys_, Name);
+  return getCompositeType<StructType>(Name);
 }
 
-UnionType const* CUImpl::getUnionType(StringRef Name) const
+UnionType const* CUImpl::getUnionType(StringRef Name)
 {
-  return getCompositeType<UnionType>(CompositeTys_, Name);
+  return getCompositeType<UnionType>(Name);
 }
 
-EnumType const* CUImpl::getEnumType(StringRef Name) const
+EnumType const* CUImpl::getEnumType(StringRef Name)
 {
-  return getCompositeType<EnumType>(CompositeTys_, Name);
+  return getCompositeType<EnumType>(Name);
 }
 
 std::vector<std::string> CUImpl::getTypes() const
 {
+  std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
   std::vector<std::string> Ret;
-  Ret.reserve(CompositeTys_.size() + AliasTys_.size());
+  Ret.reserve(CompositeTys_.size() + DIComposites_.size() + AliasTys_.size() + DITypedefs_.size());
+  for (auto const& C: DIComposites_) {
+    Ret.emplace_back(C.getKey().str());
+  }
   for (auto const& C: CompositeTys_) {
+    if (!DIComposites_.count(C.getKey())) {
+      Ret.emplace_back(C.getKey().str());
+    }
+  }
+  for (auto const& C: DITypedefs_) {
     Ret.emplace_back(C.getKey().str());
   }
   for (auto const& C: AliasTys_) {
-    Ret.emplace_back(C.getKey().str());
+    if (!DITypedefs_.count(C.getKey())) {
+      Ret.emplace_back(C.getKey().str());
+    }
+  }
+  if (ASTImporter_) {
+    for (auto const& C: ASTImporter_->composites()) {
+      if (!CompositeTys_.count(C.getKey())) {
+        Ret.emplace_back(C.getKey().str());
+      }
+    }
+    for (auto const& C: ASTImporter_->typedefs()) {
+      if (!AliasTys_.count(C.getKey())) {
+        Ret.emplace_back(C.getKey().str());
+      }
+    }
   }
   return Ret;
 }
 
 std::vector<std::string> CUImpl::getFunctions() const
 {
+  std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
   std::vector<std::string> Ret;
   Ret.reserve(FuncTys_.size() + FuncAliases_.size());
   for (auto const& C: FuncTys_) {
@@ -830,53 +2091,214 @@ std::vector<std::string> CUImpl::getFunctions() const
   return Ret;
 }
 
-void CUImpl::declareDIComposite(DICompositeType const* DCTy)
+void CUImpl::indexDIComposite(DICompositeType const* DCTy)
 {
-  const auto Tag = DCTy->getTag();
-  assert((Tag == dwarf::DW_TAG_structure_type || Tag == dwarf::DW_TAG_union_type ||
-    Tag == dwarf::DW_TAG_enumeration_type) && "declareDIComposite called without a valid type!");
+  // Anonymous types can only be reached through other types
+  StringRef Name = DCTy->getName();
+  if (Name.empty()) {
+    return;
+  }
+  if (Name.startswith("__dffi")) {
+    llvm::report_fatal_error("__dffi is a compiler reserved prefix and can't be used in a structure name!");
+  }
+  // Prefer definitions over forward declarations
+  auto It = DIComposites_.try_emplace(Name, DCTy);
+  if (!It.second && It.first->second->isForwardDecl()) {
+    It.first->second = DCTy;
+  }
+}
+
+void CUImpl::indexDITypedef(DIDerivedType const* DTy)
+{
+  DITypedefs_.try_emplace(DTy->getName(), DTy);
+}
+
+void CUImpl::materializeTypes()
+{
+  if (ASTImporter_) {
+    ASTImporter_->importAll();
+  }
+  for (auto const& It: DIComposites_) {
+    getCompositeFromDI(It.getValue());
+  }
+  for (auto const& It: DITypedefs_) {
+    if (!AliasTys_.count(It.getKey())) {
+      setAlias(It.getKey(), getTypeFromDIType(It.getValue()));
+    }
+  }
+}
+
+CanOpaqueType* CUImpl::getImportedComposite(StringRef Name)
+{
+  for (CUImpl* Import: Imports_) {
+    if (auto const* Ty = Import->getCompositeType<CanOpaqueType>(Name)) {
+      return const_cast<CanOpaqueType*>(Ty);
+    }
+  }
+  return nullptr;
+}
+
+dffi::Type const* CUImpl::getImportedType(DIType const* Ty)
+{
+  // Typedefs are looked up by name, so that anonymous structures they name
+  // are found as well.
+  while (auto const* DTy = llvm::dyn_cast_or_null<DIDerivedType>(Ty)) {
+    const auto Tag = DTy->getTag();
+    if (Tag == dwarf::DW_TAG_typedef) {
+      for (CUImpl* Import: Imports_) {
+        if (auto const* ITy = Import->getType(DTy->getName())) {
+          return ITy;
+        }
+      }
+    }
+    else
+    if (Tag != dwarf::DW_TAG_const_type && Tag != dwarf::DW_TAG_volatile_type &&
+        Tag != dwarf::DW_TAG_restrict_type) {
+      break;
+    }
+    Ty = DTy->getBaseType();
+  }
+  return nullptr;
+}
 
+CanOpaqueType* CUImpl::getCompositeFromDI(DICompositeType const* DCTy)
+{
+  // Composite types reached through pointers are only declared, and their
+  // bodies are parsed once the type being resolved is complete. This bounds
+  // the recursion depth to the nesting of composite types, and not to the
+  // length of the chains of types referencing each others.
+  CanOpaqueType* CATy = nullptr;
   StringRef Name = DCTy->getName();
+  if (Name.size() > 0) {
+    auto It = CompositeTys_.find(Name);
+    if (It != CompositeTys_.end()) {
+      CATy = It->second.get();
+    }
+    else
+    if (auto* ITy = getImportedComposite(Name)) {
+      return ITy;
+    }
+    else {
+      // DCTy might only be a forward declaration
+      auto ItDI = DIComposites_.find(Name);
+      if (ItDI != DIComposites_.end()) {
+        DCTy = ItDI->second;
+      }
+    }
+  }
+  else {
+    auto It = AnonTys_.find(DCTy);
+    if (It != AnonTys_.end()) {
+      CATy = dffi::cast<dffi::CanOpaqueType>(It->second);
+    }
+  }
 
-  auto AddTy = [&](StringRef Name_) {
-    CanOpaqueType* Ptr;
-    switch (Tag) {
-      case dwarf::DW_TAG_structure_type:
-        Ptr = new StructType{DFFI_};
-        break;
-      case dwarf::DW_TAG_union_type:
-        Ptr = new UnionType{DFFI_};
-        break;
-      case dwarf::DW_TAG_enumeration_type:
-        Ptr = new EnumType{DFFI_};
-        break;
-    };
-    return CompositeTys_.try_emplace(Name_, std::unique_ptr<CanOpaqueType>{Ptr});
+  if (!CATy) {
+    CATy = declareDIComposite(DCTy);
+    PendingComposites_[CATy] = DCTy;
+  }
+  if (PointeeDepth_ == 0) {
+    // Types used by value need their body right away
+    auto It = PendingComposites_.find(CATy);
+    if (It != PendingComposites_.end()) {
+      DCTy = It->second;
+      PendingComposites_.erase(It);
+      defineDIComposite(DCTy, CATy);
+    }
+  }
+  if (ResolveDepth_ == 0) {
+    flushPendingComposites();
+  }
+  return CATy;
+}
+
+void CUImpl::defineDIComposite(DICompositeType const* DCTy, CanOpaqueType* CATy)
+{
+  ++ResolveDepth_;
+  const unsigned PointeeDepth = PointeeDepth_;
+  PointeeDepth_ = 0;
+  parseDIComposite(DCTy, CATy);
+  if (auto* CTy = dffi::dyn_cast<CompositeType>(CATy)) {
+    // Anonymous members have already been parsed (and their own anonymous
+    // members inlined).
+    std::unordered_set<CompositeType*> Visited;
+    inlineCompositesAnonymousMembersImpl(Visited, CTy);
+  }
+  PointeeDepth_ = PointeeDepth;
+  --ResolveDepth_;
+}
+
+void CUImpl::flushPendingComposites()
+{
+  while (!PendingComposites_.empty()) {
+    auto It = PendingComposites_.begin();
+    auto* CATy = It->first;
+    auto const* DCTy = It->second;
+    PendingComposites_.erase(It);
+    defineDIComposite(DCTy, CATy);
+  }
+}
+
+CanOpaqueType* CUImpl::declareComposite(dffi::Type::TypeKind Kind, StringRef Name)
+{
+  std::unique_ptr<CanOpaqueType> Ptr;
+  switch (Kind) {
+    case dffi::Type::TY_Struct:
+      Ptr.reset(new StructType{DFFI_});
+      break;
+    case dffi::Type::TY_Union:
+      Ptr.reset(new UnionType{DFFI_});
+      break;
+    case dffi::Type::TY_Enum:
+      Ptr.reset(new EnumType{DFFI_});
+      break;
+    default:
+      unreachable("declareComposite called without a valid type kind!");
   };
 
   if (Name.size() > 0) {
     // Sets the struct as an opaque one.
-    if (Name.startswith("__dffi")) {
-      llvm::report_fatal_error("__dffi is a compiler reserved prefix and can't be used in a structure name!");
-    }
-    auto It = AddTy(Name);
+    auto It = CompositeTys_.try_emplace(Name, std::move(Ptr));
+    assert(It.second && "structure/union/enum already declared!");
     It.first->getValue()->addName(It.first->getKeyData());
+    return It.first->getValue().get();
   }
-  else {
-    // Add to the map of anonymous types, and generate a name
-    if (AnonTys_.count(DCTy) == 1) {
-      return;
-    }
-    auto ID = AnonTys_.size() + 1;
-    std::stringstream ss;
-    ss << "__dffi_anon_struct_" << ID;
-    auto It = AddTy(ss.str());
-    assert(It.second && "anonymous structure ID already existed!!");
-    AnonTys_[DCTy] = It.first->second.get();
+
+  // Generate a name for anonymous types
+  std::stringstream ss;
+  ss << "__dffi_anon_struct_" << ++AnonIdx_;
+  auto It = CompositeTys_.try_emplace(ss.str(), std::move(Ptr));
+  assert(It.second && "anonymous structure ID already existed!!");
+  return It.first->getValue().get();
+}
+
+CanOpaqueType* CUImpl::declareDIComposite(DICompositeType const* DCTy)
+{
+  dffi::Type::TypeKind Kind;
+  switch (DCTy->getTag()) {
+    case dwarf::DW_TAG_structure_type:
+      Kind = dffi::Type::TY_Struct;
+      break;
+    case dwarf::DW_TAG_union_type:
+      Kind = dffi::Type::TY_Union;
+      break;
+    case dwarf::DW_TAG_enumeration_type:
+      Kind = dffi::Type::TY_Enum;
+      break;
+    default:
+      unreachable("declareDIComposite called without a valid type!");
+  };
+
+  StringRef Name = DCTy->getName();
+  auto* CATy = declareComposite(Kind, Name);
+  if (Name.empty()) {
+    // Add to the map of anonymous types
+    AnonTys_[DCTy] = CATy;
   }
+  return CATy;
 }
 
-void CUImpl::parseDIComposite(DICompositeType const* DCTy, llvm::Module& M)
+void CUImpl::parseDIComposite(DICompositeType const* DCTy, CanOpaqueType* CATy)
 {
   // C++ type, we don't support this!
   if (!DCTy->getIdentifier().empty()) {
@@ -887,18 +2309,6 @@ void CUImpl::parseDIComposite(DICompositeType const* DCTy, llvm::Module& M)
   assert((Tag == dwarf::DW_TAG_structure_type || Tag == dwarf::DW_TAG_union_type ||
     Tag == dwarf::DW_TAG_enumeration_type) && "parseDIComposite called without a valid type!");
 
-  StringRef Name = DCTy->getName();
-  dffi::CanOpaqueType* CATy;
-  if (Name.size() > 0) {
-    auto It = CompositeTys_.find(Name);
-    assert(It != CompositeTys_.end() && "structure/union/enum hasn't been previously declared!");
-    CATy = It->second.get();
-  }
-  else {
-    auto It = AnonTys_.find(DCTy);
-    assert(It != AnonTys_.end() && "anonymous structure/union/enum hasn't been previously declared!");
-    CATy = dffi::cast<dffi::CanOpaqueType>(It->second);
-  }
   // If the structure/union isn't know yet, this sets the composite type as an
   // opaque one. This can be useful if the type is self-referencing
   // itself throught a pointer (classical case in linked list for instance).
@@ -980,6 +2390,21 @@ dffi::QualType CUImpl::getQualTypeFromDIType(llvm::DIType const* Ty)
 
 dffi::Type const* CUImpl::getTypeFromDIType(llvm::DIType const* Ty)
 {
+  ++ResolveDepth_;
+  auto const* Ret = resolveDIType(Ty);
+  if (--ResolveDepth_ == 0) {
+    flushPendingComposites();
+  }
+  return Ret;
+}
+
+dffi::Type const* CUImpl::resolveDIType(llvm::DIType const* Ty)
+{
+  if (!Imports_.empty()) {
+    if (auto const* ITy = getImportedType(Ty)) {
+      return ITy;
+    }
+  }
   Ty = getCanonicalDIType(Ty);
   if (!Ty) {
     return nullptr;
@@ -1045,7 +2470,9 @@ dffi::Type const* CUImpl::getTypeFromDIType(llvm::DIType const* Ty)
     // C++ type, not supported
     const auto Tag = PtrTy->getTag();
     if (Tag == llvm::dwarf::DW_TAG_pointer_type) {
+      ++PointeeDepth_;
       auto Pointee = getQualTypeFromDIType(PtrTy->getBaseType());
+      --PointeeDepth_;
       return getPointerType(Pointee);
     }
     if (Tag == llvm::dwarf::DW_TAG_reference_type) {
@@ -1070,19 +2497,7 @@ dffi::Type const* CUImpl::getTypeFromDIType(llvm::DIType const* Ty)
       case llvm::dwarf::DW_TAG_union_type:
       case llvm::dwarf::DW_TAG_enumeration_type:
       {
-        StringRef Name = DTy->getName();
-        if (Name.size() == 0) {
-          auto It = AnonTys_.find(DTy);
-          if (It == AnonTys_.end()) {
-            llvm::report_fatal_error("unknown literal struct/union/enum!");
-          }
-          return It->second;
-        }
-        auto It = CompositeTys_.find(Name);
-        if (It == CompositeTys_.end()) {
-          llvm::report_fatal_error("unknown struct/union/enum!");
-        }
-        return It->second.get();
+        return getCompositeFromDI(DTy);
       }
       case llvm::dwarf::DW_TAG_array_type:
       {
@@ -1160,19 +2575,31 @@ dffi::FunctionType const* CUImpl::getFunctionType(Function& F, bool UseLastError
   return getFunctionType(Ty, UseLastError);
 }
 
-dffi::Type const* CUImpl::getType(StringRef Name) const
+dffi::Type const* CUImpl::getType(StringRef Name)
 {
+  std::lock_guard<std::recursive_mutex> Lock(DFFI_.Mutex_);
   {
     auto It = AliasTys_.find(Name);
     if (It != AliasTys_.end())
       return It->second;
   }
+  for (CUImpl* Import: Imports_) {
+    if (auto const* Ty = Import->getType(Name)) {
+      return Ty;
+    }
+  }
   {
-    auto It = CompositeTys_.find(Name);
-    if (It != CompositeTys_.end())
-      return It->second.get();
+    auto It = DITypedefs_.find(Name);
+    if (It != DITypedefs_.end()) {
+      auto const* Ty = getTypeFromDIType(It->second);
+      setAlias(Name, Ty);
+      return Ty;
+    }
   }
-  return nullptr;
+  if (ASTImporter_ && ASTImporter_->importTypedef(Name)) {
+    return AliasTys_.lookup(Name);
+  }
+  return getCompositeType<CanOpaqueType>(Name);
 }
 
 
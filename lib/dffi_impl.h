@@ -15,18 +15,27 @@
 #ifndef DFFI_IMPL_H
 #define DFFI_IMPL_H
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
 #include <unordered_set>
 
 #include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/LLVMContext.h>
 
 #include <clang/Frontend/FrontendAction.h>
+#include <clang/CodeGen/CodeGenAction.h>
 
 #include <dffi/dffi.h>
 #include <dffi/composite_type.h>
@@ -34,13 +43,19 @@
 #include "dffictx.h"
 
 namespace llvm {
+class MemoryBuffer;
+class MemoryBufferRef;
 class Module;
 class Function;
 class TargetMachine;
 class ExecutionEngine;
 class DIType;
 class DICompositeType;
+class DIDerivedType;
 class DISubroutineType;
+namespace object {
+class ObjectFile;
+}
 namespace vfs {
 class FileSystem;
 }
@@ -48,10 +63,14 @@ class FileSystem;
 
 namespace clang {
 class CompilerInstance;
+class CompilerInvocation;
+class FileManager;
 class DiagnosticIDs;
 class DiagnosticOptions;
 class DiagnosticsEngine;
 class TextDiagnosticPrinter;
+class PrecompiledPreamble;
+struct PCHBuffer;
 namespace driver {
 class Driver;
 } // driver
@@ -73,6 +92,57 @@ void getFuncTrampolineName(llvm::SmallVectorImpl<char>& Ret, llvm::StringRef con
 void getFuncWrapperName(llvm::SmallVectorImpl<char>& Ret, llvm::StringRef const Name);
 llvm::StringRef getFuncNameFromWrapper(llvm::StringRef const Name);
 bool isWrapperFunction(llvm::StringRef const Name);
+std::string getWrapperName(size_t Idx);
+// Removes the "\01" prefix clang gives to functions with an asm label
+void stripAsmPrefixes(llvm::Module& M);
+
+// Splits M into one module per function (see dffi_split.cpp), and gives them
+// to Fn. Returns false if M can't be split.
+bool splitModule(llvm::Module& M, llvm::function_ref<void(std::unique_ptr<llvm::Module>)> Fn);
+
+// Rebased modules (see dffi_tiers.cpp) are compiled from the same source as
+// a compilation unit already in the JIT, and loaded in its engine next to its
+// code. Local variables of both modules must have been made external by
+// promoteStatics, with the same prefix (see CUImpl::StaticsPrefix_).
+// rebaseModule then makes M only define
+// the functions selected by Keep, renamed with Suffix: its other functions are
+// only kept for inlining, and the variables of the compilation unit are used.
+void promoteStatics(llvm::Module& M, llvm::StringRef Prefix);
+void rebaseModule(llvm::Module& M, llvm::function_ref<bool(llvm::Function const&)> Keep, llvm::StringRef Suffix);
+// Names of the symbols used by M and defined elsewhere
+std::vector<std::string> getExternalRefs(llvm::Module const& M);
+// Pipelines of clang run by optimizeModule
+enum class OptPhase
+{
+  PerModule,
+  // Per module pipeline of code which is later linked with full LTO
+  LTOPreLink,
+  // Full LTO backend
+  LTO
+};
+// Runs the same optimization pipeline as clang at OptLevel for Phase, or
+// Pipeline if not empty (see CompileOpts::PassPipeline).
+void optimizeModule(llvm::Module& M, llvm::TargetMachine& TM, unsigned OptLevel, OptPhase Phase = OptPhase::PerModule, llvm::StringRef Pipeline = {});
+// Returns false and sets Err if Pipeline can't be parsed
+bool checkPassPipeline(llvm::StringRef Pipeline, std::string& Err);
+// Applies the floating point options of Opts to CI (see dffi_pipeline.cpp)
+void applyCompileOpts(clang::CompilerInvocation& CI, CompileOpts const& Opts);
+// Identifies the language options set by applyCompileOpts, which precompiled
+// headers and preambles are checked against when loaded. Empty for the
+// default ones.
+std::string getLangOptsKey(CompileOpts const& Opts);
+// Adds the loop transformation hints of Opts to the loops of M (see
+// CompileOpts::VectorizeWidth)
+void addLoopHints(llvm::Module& M, CompileOpts const& Opts);
+// Makes F call its code through a variable (its slot), so that it, and
+// pointers to it, can then be made to use other code (see dffi_tiers.cpp).
+// Returns the name of the slot.
+std::string createStub(llvm::Function& F);
+// Atomically makes the slot at SlotAddr point to Addr
+void storeSlot(uint64_t SlotAddr, uint64_t Addr);
+// Address of the symbols used by the code of tiered functions (see
+// dffi_tiers.cpp), 0 for other ones
+uint64_t getTiersSymbolAddress(llvm::StringRef Name);
 
 typedef llvm::StringMap<dffi::FunctionType const*> FuncTysMap;
 typedef llvm::StringMap<std::unique_ptr<dffi::CanOpaqueType>> CompositeTysMap;
@@ -83,80 +153,301 @@ typedef llvm::StringMap<std::string> FuncAliasesMap;
 llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> getClangResFileSystem();
 const char* getClangResRootDirectory();
 
+struct ASTTypeImporter;
 struct CUImpl;
+struct DFFIImpl;
+struct CUObjectCache;
+struct CUDepsCollector;
+struct CUObjectListener;
+struct DFFIFileSystem;
+
+// A clang compiler instance, with its diagnostics. Each one can only be used
+// by one thread at a time.
+struct Frontend
+{
+  Frontend();
+  ~Frontend();
+
+  void resetDiagnostics();
+  void getCompileError(std::string& Err);
+
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts;
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> DiagID;
+  std::string ErrorMsg;
+  llvm::raw_string_ostream ErrorMsgStream;
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags;
+  std::unique_ptr<clang::CompilerInstance> Clang;
+  llvm::IntrusiveRefCntPtr<clang::FileManager> FileMgr;
+  std::shared_ptr<CUDepsCollector> DepsCollector;
+
+  // Used to generate object code outside of the JIT. Null for the main
+  // frontend, whose modules are directly given to the JIT, unless
+  // CCOpts::CodeGenThreads > 1 or CCOpts::DropIR is set.
+  std::unique_ptr<llvm::TargetMachine> TM;
+  // Compared to DFFIImpl::FSGeneration_ to know whether the file manager
+  // needs to be reset (see DFFIImpl::release).
+  size_t FSGeneration = 0;
+};
+
+// Counters of a function of an instrumented compilation unit (see
+// CCOpts::ProfileInstr), and the PGO name and hash of the function given to
+// clang with them.
+struct ProfiledFunc
+{
+  std::string Name;
+  uint64_t Hash;
+  // Symbol of the counters, an array of NumCounters 64-bit integers
+  std::string Counters;
+  uint32_t NumCounters;
+};
+
+// Function of a compilation unit compiled with tiers (see
+// CCOpts::TierUpThreshold). Its unoptimized code counts its calls, and it is
+// optimized in the background once they reach the threshold (see
+// prepareTiers).
+struct TieredFunc: public std::enable_shared_from_this<TieredFunc>
+{
+  TieredFunc(DFFIImpl& DFFI, CUImpl& CU, llvm::StringRef Name):
+    DFFI(DFFI),
+    CU(&CU),
+    Name(Name.str())
+  { }
+
+  DFFIImpl& DFFI;
+  // Null once the compilation unit is destroyed. Protected by the lock of
+  // DFFI.
+  CUImpl* CU;
+  std::string Name;
+};
 
 struct DFFIImpl
 {
   friend struct CUImpl;
+  friend struct ASTTypeImporter;
 
   DFFIImpl(CCOpts const& Opts);
   ~DFFIImpl();
 
-  CUImpl* compile(llvm::StringRef const Code, llvm::StringRef CUName, bool IncludeDefs, std::string& Err, bool UseLastError);
+  CUImpl* compile(llvm::StringRef const Code, llvm::StringRef CUName, bool IncludeDefs, std::string& Err, bool UseLastError, llvm::ArrayRef<CUImpl*> Imports = {}, CompileOpts const& CUOpts = {});
+  void compileAsync(std::string Code, std::string CUName, bool IncludeDefs, bool UseLastError, CompileOpts CUOpts, std::function<void(CUImpl*, std::string&)> Done);
+  bool precompileHeaders(llvm::StringRef const Code, std::string& Err);
+  bool extend(CUImpl& CU, llvm::StringRef const Code, std::string& Err, bool UseLastError);
+  bool recompileWithProfile(CUImpl& CU, std::string& Err);
+  bool linkCompilationUnits(std::string& Err);
+  void release(CUImpl& CU);
+
+  // Address of the symbol Name (as found in object files) for the JIT
+  // engines of the compilation units (see CUSymbolResolver).
+  uint64_t resolveSymbol(std::string const& Name);
 
   BasicType const* getBasicType(BasicType::BasicKind K);
   PointerType const* getPointerType(QualType Ty);
   ArrayType const* getArrayType(QualType Ty, uint64_t NElements);
-  NativeFunc getFunction(FunctionType const* FTy, void* FPtr);
+  // If Wrapper is null, the wrapper of FTy is used
+  NativeFunc getFunction(FunctionType const* FTy, void* FPtr, void* Wrapper = nullptr);
   NativeFunc getFunction(FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs, void* FPtr);
 
-  llvm::Function* getWrapperLLVMFunc(FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
+  // If the IR of the wrappers is dropped (see CCOpts::DropIR), the one of
+  // this wrapper is generated again in a module given to Owner.
+  llvm::Function* getWrapperLLVMFunc(FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs, std::unique_ptr<llvm::Module>& Owner);
+
+  // Optimizes the function of TF in the background, and makes the
+  // unoptimized code use it (see dffi_tiers.cpp).
+  void tierUp(std::shared_ptr<TieredFunc> TF);
 
 protected:
   DFFICtx& getContext() { return DCtx_; }
   DFFICtx const& getContext() const { return DCtx_; }
-  void* getFunctionAddress(llvm::StringRef Name);
+  // If CU is set, its own definition of Name is looked up first.
+  void* getFunctionAddress(llvm::StringRef Name, CUImpl* CU = nullptr);
 
 private:
-  std::unique_ptr<llvm::Module> compile_llvm_with_decls(llvm::StringRef const Code, llvm::StringRef const CUName, FuncAliasesMap& FuncAliases, std::string& Err);
-  std::unique_ptr<llvm::Module> compile_llvm(llvm::StringRef const Code, llvm::StringRef const CUName, std::string& Err);
+  std::unique_ptr<llvm::Module> compile_llvm_with_decls(Frontend& FE, llvm::StringRef const Code, llvm::StringRef const CUName, CUImpl& CU, bool UseLastError, std::string& Err, bool Extend = false, std::shared_ptr<clang::PCHBuffer> PCH = nullptr);
+  std::unique_ptr<llvm::Module> compile_llvm(Frontend& FE, llvm::LLVMContext& Ctx, llvm::StringRef const Code, llvm::StringRef const CUName, std::string& Err, bool HasImports = false);
+  std::shared_ptr<clang::PrecompiledPreamble> getPreamble(Frontend& FE, llvm::MemoryBuffer const& Buf, llvm::StringRef LangOptsKey);
+  std::string buildPCH(llvm::StringRef const Code, std::string& Err, CompileOpts const& CUOpts = {});
+  // Each compilation unit has its own JIT engine, so that its code can be
+  // freed when it is released.
+  std::unique_ptr<llvm::ExecutionEngine> createEngine(std::string const& Triple, llvm::LLVMContext& Ctx, bool ForCU);
+  llvm::ExecutionEngine& getEngine(CUImpl& CU);
+  llvm::ExecutionEngine& getWrappersEngine();
+  void addModuleToJIT(Frontend& FE, CUImpl& CU, std::unique_ptr<llvm::Module> M);
+  void addObjectToJIT(CUImpl& CU, std::unique_ptr<llvm::MemoryBuffer> Obj);
+  void registerSymbols(CUImpl& CU, llvm::Module const& M);
+  void registerSymbols(CUImpl& CU, llvm::object::ObjectFile const& Obj);
+  uint64_t getCUSymbolAddress(CUImpl& CU, std::string const& Name, bool FunctionsOnly);
+  void destroyCU(CUImpl& CU);
+  // The AST of the last cdefs is kept to import their types lazily (see
+  // ASTTypeImporter). Beyond MaxRetainedASTs, the types of the oldest one are
+  // all imported, and its AST is freed.
+  void retainAST(CUImpl& CU);
+  void forgetAST(CUImpl& CU);
+  void resetFileManager(Frontend& FE);
+  std::string getImportsPCH(llvm::ArrayRef<CUImpl*> Imports, std::string& Err, CompileOpts const& CUOpts = {});
+  // Precompiled header implicitly included by a compilation unit with these
+  // imports and options. Returns false and sets Err if it can't be built.
+  bool getCompilePCH(llvm::ArrayRef<CUImpl*> Imports, CompileOpts const& CUOpts, std::string& PCHPath, std::string& Err);
+  // Local variables of M coming from the sources of Sources are made
+  // declarations of the ones of these compilation units (see promoteStatics).
+  void useImportedStatics(llvm::Module& M, llvm::ArrayRef<CUImpl*> Sources);
+  // Prefix of the local variables of a new compilation unit (see
+  // CUImpl::StaticsPrefix_). CacheKey is cleared if the compilation unit
+  // can't be cached.
+  std::string getStaticsPrefix(std::string& CacheKey);
+
+  void initFrontend(Frontend& FE, clang::CompilerInvocation const& CI);
+  void addTask(std::function<void()> Task);
+  void workerLoop();
+  Frontend* acquireFrontend();
+  void releaseFrontend(Frontend* FE);
+  std::unique_ptr<llvm::TargetMachine> createTargetMachine() const;
+  // Target machine the modules compiled by FE are optimized for (see
+  // optimizeModule)
+  llvm::TargetMachine& getOptTargetMachine(Frontend& FE);
+  std::unique_ptr<llvm::MemoryBuffer> emitObject(llvm::TargetMachine& TM, llvm::Module& M);
+  void emitObjects(Frontend& FE, llvm::Module& M, llvm::SmallVectorImpl<std::unique_ptr<llvm::MemoryBuffer>>& Objs);
 
   std::pair<size_t, bool> getFuncTypeWrapperId(FunctionType const* FTy);
   std::pair<size_t, bool> getFuncTypeWrapperId(FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
   void genFuncTypeWrapper(TypePrinter& P, size_t WrapperIdx, llvm::raw_string_ostream& ss, FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
-  void getCompileError(std::string& Err);
-  void resetDiagnostics();
   void compileWrappers(TypePrinter& P, std::string const& Wrappers);
+  std::unique_ptr<llvm::Module> compileWrappersIR(TypePrinter& P, std::string const& Wrappers);
+  void addWrappersToJIT(std::unique_ptr<llvm::Module> M);
+  void compileWrapper(size_t WrapperIdx, FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
+
+  // Tiered compilation (see dffi_tiers.cpp). M is the unoptimized module of
+  // CU, whose functions are made to call their most optimized version.
+  void prepareTiers(CUImpl& CU, llvm::Module& M);
+  // Profile guided optimization (see dffi_profile.cpp). M is the unoptimized
+  // module of CU, whose instrumentation is lowered to counters.
+  void instrumentModule(CUImpl& CU, llvm::Module& M);
+  // ISA variants (see dffi_isa.cpp). M is the unoptimized module of CU,
+  // whose functions are cloned for each variant.
+  void cloneISAVariants(CUImpl& CU, llvm::Module& M);
+  bool checkISAVariants(std::string& Err) const;
+  std::string selectISAVariant() const;
+  // Link time optimization (see dffi_lto.cpp). M is the module of CU, whose
+  // functions are made to call the linked code once there is one.
+  void prepareLTO(CUImpl& CU, llvm::Module& M);
+  // Refs are the symbols used by the object (see getExternalRefs)
+  void addRebasedObjectToJIT(CUImpl& CU, std::unique_ptr<llvm::MemoryBuffer> Obj, llvm::ArrayRef<std::string> Refs);
+
+  // LLVM IR wrappers (see dffi_wrappers_ir.cpp)
+  bool genFuncTypeWrapperIR(llvm::Module& M, size_t WrapperIdx, FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
+  // Wrappers of the functions of CU defined in M, which call them directly
+  // (see getFuncWrapperName for their names).
+  void genDirectWrappers(CUImpl& CU, llvm::Module& M);
+  std::unique_ptr<llvm::Module> createWrappersModule();
+  void compileWrappersModule(std::unique_ptr<llvm::Module> M);
 
   void* getWrapperAddress(FunctionType const* FTy);
   void* getWrapperAddress(FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
 
+  // On-disk cache (see dffi_cache.cpp)
+  std::string getCacheKey(llvm::StringRef Code, llvm::StringRef CUName, bool IncludeDefs, bool UseLastError, CompileOpts const& CUOpts) const;
+  CUImpl* loadCachedCU(llvm::StringRef Key, llvm::StringRef Code, llvm::StringRef CUName, llvm::StringRef StaticsPrefix);
+  void storeCachedCU(llvm::StringRef Key, llvm::StringRef CUName, CUImpl const& CU, Frontend const& FE, llvm::ArrayRef<llvm::MemoryBufferRef> Objects);
+  void compileFuncTypesWrappers(CUImpl const& CU);
+
 private:
-  std::unique_ptr<clang::driver::Driver> Driver_;
-  std::unique_ptr<clang::CompilerInstance> Clang_;
-  llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags_;
-  std::string ErrorMsg_;
-  llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> DiagID_;
-  llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts_;
-  llvm::raw_string_ostream ErrorMsgStream_;
+  // Protects everything below, except the frontends pool.
+  std::recursive_mutex Mutex_;
+
   llvm::LLVMContext Ctx_;
-  std::unique_ptr<llvm::TargetMachine> TM_;
+  llvm::IntrusiveRefCntPtr<DFFIFileSystem> VFS_;
+  // Used for wrappers, and for every compilation units if
+  // CCOpts::Concurrency <= 1.
+  std::unique_ptr<Frontend> MainFE_;
+  // Triple of the process, for which code is generated
+  std::string Triple_;
+  // Prefix of the symbols of the object code generated for Triple_, which
+  // IR names don't have.
+  char GlobalPrefix_ = 0;
+  // CPU and features code is generated for (see CCOpts::CPU), with "native"
+  // resolved.
+  std::string CPU_;
+  llvm::SmallVector<std::string, 8> Features_;
+  // Suffix of the clones of functions run by the host (see
+  // CCOpts::ISAVariants), empty if there is none.
+  std::string ISASuffix_;
+  // Engine of the wrappers, whose IR is in Ctx_. Compilation units have
+  // their own (see createEngine). Created on first use (see
+  // getWrappersEngine).
   std::unique_ptr<llvm::ExecutionEngine> EE_;
-  llvm::IntrusiveRefCntPtr<clang::SourceManager> SrcMgr_;
-  llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> VFS_;
-  llvm::IntrusiveRefCntPtr<clang::FileManager> FileMgr_;
   llvm::SmallVector<std::unique_ptr<CUImpl>, 8> CUs_;
+  // Compilation unit whose engine defines each external symbol
+  llvm::StringMap<CUImpl*> SymbolOwners_;
+  // Prefixes of the variables of the compilation units which come from their
+  // cache key (see getStaticsPrefix)
+  llvm::StringSet<> KeyedStatics_;
+  // Compilation units whose engine is being finalized
+  llvm::SmallPtrSet<CUImpl*, 4> Finalizing_;
+  // Compilation units keeping their AST, oldest first (see retainAST)
+  static constexpr size_t MaxRetainedASTs = 4;
+  llvm::SmallVector<CUImpl*, MaxRetainedASTs+1> ASTCUs_;
+  // Number of files removed from VFS_ since the file managers of the
+  // frontends have been reset (see release).
+  size_t ReleasedFiles_ = 0;
   llvm::DenseMap<dffi::FunctionType const*, size_t> FuncTyWrappers_;
   llvm::DenseMap<std::pair<dffi::FunctionType const*, llvm::ArrayRef<Type const*>>, size_t> VarArgsFuncTyWrappers_;
   size_t WrapperIdx_ = 0;
 
+  std::unique_ptr<CUObjectCache> ObjCache_;
+
+  // Pool of frontends used to compile compilation units concurrently
+  llvm::SmallVector<std::unique_ptr<Frontend>, 8> Frontends_;
+  llvm::SmallVector<Frontend*, 8> FreeFrontends_;
+  std::mutex FrontendsMutex_;
+  std::condition_variable FrontendsCV_;
+  size_t FSGeneration_ = 0;
+
+  // Workers running asynchronous compilations and optimizations (see
+  // tierUp), started on first use
+  std::vector<std::thread> Workers_;
+  std::deque<std::function<void()>> Tasks_;
+  std::mutex TasksMutex_;
+  std::condition_variable TasksCV_;
+  bool StopWorkers_ = false;
+
   DFFICtx DCtx_;
 
   CCOpts Opts_;
 
   size_t CUIdx_ = 0;
+
+  // Compilation unit holding the code of the last link of the compilation
+  // units compiled for LTO (see linkCompilationUnits), which import it.
+  CUImpl* LTOCU_ = nullptr;
+
+  // See getOptTargetMachine
+  std::unique_ptr<llvm::TargetMachine> OptTM_;
+
+  // Precompiled header implicitly included by every compilation unit (see
+  // precompileHeaders), and the code it has been built from.
+  std::string PCHPath_;
+  std::string PCHCode_;
+  // Precompiled sources of imported compilation units (see getImportsPCH)
+  llvm::StringMap<std::string> ImportsPCHs_;
+
+  // Preamble of the last cdef (see getPreamble). It has its own lock, as it
+  // is used by the frontends of the pool.
+  std::shared_ptr<clang::PrecompiledPreamble> Preamble_;
+  // Language options it has been built with (see getLangOptsKey)
+  std::string PreambleKey_;
+  std::mutex PreambleMutex_;
 };
 
 struct CUImpl
 {
   
   CUImpl(DFFIImpl& DFFI);
+  ~CUImpl();
 
-  dffi::Type const* getType(llvm::StringRef Name) const;
+  dffi::Type const* getType(llvm::StringRef Name);
 
-  dffi::StructType const* getStructType(llvm::StringRef Name) const;
-  dffi::UnionType const* getUnionType(llvm::StringRef Name) const;
-  dffi::EnumType const* getEnumType(llvm::StringRef Name) const;
+  dffi::StructType const* getStructType(llvm::StringRef Name);
+  dffi::UnionType const* getUnionType(llvm::StringRef Name);
+  dffi::EnumType const* getEnumType(llvm::StringRef Name);
 
   BasicType const* getBasicType(BasicType::BasicKind K) const {
     return DFFI_.getBasicType(K);
@@ -170,6 +461,7 @@ struct CUImpl
 
   QualType getQualTypeFromDIType(llvm::DIType const* Ty);
   dffi::Type const* getTypeFromDIType(llvm::DIType const* Ty);
+  dffi::Type const* resolveDIType(llvm::DIType const* Ty);
 
   std::tuple<void*, FunctionType const*> getFunctionAddressAndTy(llvm::StringRef Name);
 
@@ -177,10 +469,36 @@ struct CUImpl
   NativeFunc getFunction(void* FPtr, FunctionType const* FTy);
   NativeFunc getFunction(llvm::StringRef Name, llvm::ArrayRef<Type const*> VarArgs);
   NativeFunc getFunction(void* FPtr, FunctionType const* FTy, llvm::ArrayRef<Type const*> VarArgs);
-
-
-  void declareDIComposite(llvm::DICompositeType const* Ty);
-  void parseDIComposite(llvm::DICompositeType const* Ty, llvm::Module& M);
+  // Address of the direct wrapper of Name (see DFFIImpl::genDirectWrappers),
+  // null if it has none.
+  void* getDirectWrapper(llvm::StringRef Name);
+
+
+  // Types are only created from debug info the first time they are needed
+  // (see getCompositeFromDI). These functions fill the index used to find
+  // them by name.
+  void indexDIComposite(llvm::DICompositeType const* Ty);
+  void indexDITypedef(llvm::DIDerivedType const* Ty);
+  // Creates every type of the index (used by the on-disk cache)
+  void materializeTypes();
+  // Creates every type of the index, and frees the LLVM context (see
+  // CCOpts::DropIR). The module of the compilation unit must have been
+  // destroyed.
+  void dropIR();
+  llvm::LLVMContext& getLLVMContext();
+
+  // Declares an opaque structure/union/enum. Anonymous ones are given a
+  // generated name.
+  dffi::CanOpaqueType* declareComposite(dffi::Type::TypeKind Kind, llvm::StringRef Name);
+  dffi::CanOpaqueType* getCompositeFromDI(llvm::DICompositeType const* Ty);
+  // Types of the imported compilation units, which are reused instead of
+  // being created again from debug info.
+  dffi::CanOpaqueType* getImportedComposite(llvm::StringRef Name);
+  dffi::Type const* getImportedType(llvm::DIType const* Ty);
+  dffi::CanOpaqueType* declareDIComposite(llvm::DICompositeType const* Ty);
+  void defineDIComposite(llvm::DICompositeType const* Ty, dffi::CanOpaqueType* CATy);
+  void parseDIComposite(llvm::DICompositeType const* Ty, dffi::CanOpaqueType* CATy);
+  void flushPendingComposites();
   void setAlias(llvm::StringRef Name, dffi::Type const* Ty) {
     auto ItIns = AliasTys_.try_emplace(Name, Ty);
     if (Ty) {
@@ -188,48 +506,165 @@ struct CUImpl
     }
   }
   void parseFunctionAlias(llvm::Function& F);
+  // Removes the names given by the typedefs of this compilation unit to
+  // types it does not own.
+  void clearAliases();
 
   DFFICtx& getContext() { return DFFI_.getContext(); }
   DFFICtx const& getContext() const { return DFFI_.getContext(); }
 
   void inlineCompositesAnonymousMembers();
+  void inlineCompositesAnonymousMembers(llvm::ArrayRef<CompositeType*> CTys);
 
   std::vector<std::string> getTypes() const;
   std::vector<std::string> getFunctions() const;
 
+  // Serialization of the types and functions tables, used by the on-disk
+  // cache.
+  void serialize(llvm::raw_ostream& OS) const;
+  bool deserialize(llvm::StringRef& Data);
+
   DFFIImpl& DFFI_;
+  // Context of the IR and debug info of the compilation unit, freed with it.
+  // Created on demand (see getLLVMContext).
+  std::unique_ptr<llvm::LLVMContext> LLVMCtx_;
+  // Path of the source of the compilation unit in the virtual file system,
+  // and of the code it has been extended with.
+  std::string Name_;
+  std::vector<std::string> Extensions_;
+  llvm::SmallVector<CUImpl*, 2> Imports_;
+  // Chained precompiled header of all the sources above (see
+  // DFFIImpl::extend), built on first extension.
+  std::string PCHPath_;
+  // Files of the virtual file system only used by this compilation unit,
+  // removed when it is released.
+  std::vector<std::string> PrivateFiles_;
+  // Symbols of the objects loaded in EE_, registered in it (and thus
+  // destroyed after it).
+  std::unique_ptr<CUObjectListener> Objects_;
+  // JIT engine with the code of the compilation unit. Null if it has none.
+  std::unique_ptr<llvm::ExecutionEngine> EE_;
+  // Released compilation units are only freed once the ones importing them
+  // are (see DFFIImpl::release).
+  unsigned Importers_ = 0;
+  bool Released_ = false;
+
+  // Unoptimized IR of a compilation unit compiled with tiers, as bitcode,
+  // and its functions which can be optimized from it (see
+  // DFFIImpl::prepareTiers).
+  std::shared_ptr<std::string const> TierIR_;
+  llvm::StringMap<std::shared_ptr<TieredFunc>> TieredFuncs_;
+  // Prefix of the local variables of the compilation unit, made external for
+  // rebased modules, linked code, and the code importing or extending it
+  // (see promoteStatics). Empty if they are kept local (see
+  // CompileOpts::ShareStatics).
+  std::string StaticsPrefix_;
+  // Options it has been compiled with, which also apply to the code
+  // extending it or compiled again with a profile.
+  CompileOpts Opts_;
+  // Functions of an instrumented compilation unit, and the symbols of the
+  // ones compiled again with their profile (see
+  // DFFIImpl::recompileWithProfile).
+  std::vector<ProfiledFunc> ProfiledFuncs_;
+  llvm::StringMap<std::string> ProfiledSyms_;
+  // Addresses of the variants of functions run by the host (see
+  // CCOpts::ISAVariants), resolved on first use.
+  llvm::StringMap<void*> ISAFuncs_;
+  // IR of a compilation unit compiled for LTO, as bitcode, and the slots of
+  // its functions which are made to call the linked code (see
+  // DFFIImpl::prepareLTO).
+  std::string LTOIR_;
+  llvm::StringMap<std::string> LTOSlots_;
 
   CompositeTysMap CompositeTys_;
   FuncTysMap FuncTys_;
   AliasTysMap AliasTys_;
   FuncAliasesMap FuncAliases_;
 
-  // Temporary map used during debug metadata parsing
   AnonTysMap AnonTys_;
+  size_t AnonIdx_ = 0;
+
+  // Debug info types declared in the compilation unit, by name. Debug info
+  // nodes are owned by the LLVM context, and thus outlive the module of the
+  // compilation unit.
+  llvm::StringMap<llvm::DICompositeType const*> DIComposites_;
+  llvm::StringMap<llvm::DIDerivedType const*> DITypedefs_;
+  // Declared composite types whose body still needs to be parsed
+  llvm::DenseMap<dffi::CanOpaqueType*, llvm::DICompositeType const*> PendingComposites_;
+  unsigned ResolveDepth_ = 0;
+  unsigned PointeeDepth_ = 0;
+  // AST of a cdef, from which types are imported on first use (see
+  // ASTTypeImporter). Freed with the IR (see dropIR), or once newer cdefs
+  // have been compiled (see DFFIImpl::retainAST).
+  std::unique_ptr<ASTTypeImporter> ASTImporter_;
 
 private:
+  template <class T>
+  T const* getCompositeType(llvm::StringRef Name);
+
   static void inlineCompositesAnonymousMembersImpl(std::unordered_set<CompositeType*>& Visited, CompositeType* CTy);
 };
 
-struct ASTGenWrappersAction: public clang::ASTFrontendAction
+// Generates the LLVM IR of a compilation unit, and imports the types and
+// functions it declares from the AST into CU (see dffi_impl_clang.cpp). If
+// no code needs to be generated (see CDefMode), the module is left empty.
+// If Extend is set, the code extends CU (see DFFIImpl::extend).
+struct EmitLLVMWithASTTypesAction: public clang::EmitLLVMOnlyAction
+{
+  // If PCH is set, the AST of the code is also serialized into it, chained
+  // to the precompiled header it has been compiled with (see
+  // DFFIImpl::extend).
+  EmitLLVMWithASTTypesAction(llvm::LLVMContext* Ctx, CUImpl& CU, bool UseLastError, CDefMode Mode, bool Extend = false, std::shared_ptr<clang::PCHBuffer> PCH = nullptr):
+    clang::EmitLLVMOnlyAction(Ctx),
+    CU_(CU),
+    UseLastError_(UseLastError),
+    Mode_(Mode),
+    Extend_(Extend),
+    PCH_(std::move(PCH))
+  { }
+
+protected:
+  std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) override;
+  void EndSourceFileAction() override;
+
+private:
+  CUImpl& CU_;
+  bool UseLastError_;
+  CDefMode Mode_;
+  bool Extend_;
+  std::shared_ptr<clang::PCHBuffer> PCH_;
+};
+
+// Generates the LLVM IR of a compilation unit which imports others (see
+// DFFIImpl::compile). The external definitions of the imported compilation
+// units are skipped, as they are already in the JIT.
+struct EmitLLVMWithImportsAction: public clang::EmitLLVMOnlyAction
 {
-  ASTGenWrappersAction(FuncAliasesMap& FuncAliases):
-    clang::ASTFrontendAction(),
-    FuncAliases_(FuncAliases),
-    ForceDecls_(ForceDeclsStr_)
+  EmitLLVMWithImportsAction(llvm::LLVMContext* Ctx):
+    clang::EmitLLVMOnlyAction(Ctx)
   { }
 
+protected:
   std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) override;
+};
+
+// Serializes the AST of a header into memory, instead of writing it to an
+// output file like clang::GeneratePCHAction.
+struct GeneratePCHInMemoryAction: public clang::ASTFrontendAction
+{
+  GeneratePCHInMemoryAction(std::shared_ptr<clang::PCHBuffer> Buffer):
+    Buffer_(std::move(Buffer))
+  { }
 
-  std::string& forceDecls(); 
+  clang::TranslationUnitKind getTranslationUnitKind() override { return clang::TU_Prefix; }
+  bool hasASTFileSupport() const override { return false; }
 
-  llvm::IntrusiveRefCntPtr<clang::ASTContext> releaseAST() { return std::move(ASTCtxt_); }
+protected:
+  std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) override;
+  bool BeginSourceFileAction(clang::CompilerInstance& Compiler) override;
 
 private:
-  std::string ForceDeclsStr_;
-  llvm::raw_string_ostream ForceDecls_;
-  llvm::IntrusiveRefCntPtr<clang::ASTContext> ASTCtxt_;
-  FuncAliasesMap& FuncAliases_;
+  std::shared_ptr<clang::PCHBuffer> Buffer_;
 };
 
 } // details
@@ -15,15 +15,21 @@
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/FrontendActions.h>
-#include <clang/AST/RecursiveASTVisitor.h>
-#include <llvm/ADT/StringSet.h>
+#include <clang/Frontend/MultiplexConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclCXX.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Serialization/ASTReader.h>
+#include <clang/Serialization/ASTWriter.h>
+#include <clang/Serialization/PCHContainerOperations.h>
 
+#include "dffi_ast_importer.h"
 #include "dffi_impl.h"
 
 
 #include <functional>
-#include <sstream>
-#include <unordered_set>
+#include <string>
+#include <vector>
 
 using namespace clang;
 using namespace llvm;
@@ -33,219 +39,305 @@ namespace details {
 
 namespace {
 
-// This is from clang/AST/TypePrinter.cpp. This function isn't exported :/
-// This is used as part of a hack because the "dump" API of FunctionDecl does
-// not seem to print these attributes!
-void printFunctionAttrs(const clang::FunctionType::ExtInfo &Info,
-                           raw_ostream &OS) {
-  switch (Info.getCC()) {
-  case clang::CC_C:
-    // The C calling convention is the default on the vast majority of platforms
-    // we support.  If the user wrote it explicitly, it will usually be printed
-    // while traversing the AttributedType.  If the type has been desugared, let
-    // the canonical spelling be the implicit calling convention.
-    // FIXME: It would be better to be explicit in certain contexts, such as a
-    // cdecl function typedef used to declare a member function with the
-    // Microsoft C++ ABI.
-    break;
-  case clang::CC_X86StdCall:
-    OS << " __attribute__((stdcall))";
-    break;
-  case clang::CC_X86FastCall:
-    OS << " __attribute__((fastcall))";
-    break;
-  case clang::CC_X86ThisCall:
-    OS << " __attribute__((thiscall))";
-    break;
-  case clang::CC_X86VectorCall:
-    OS << " __attribute__((vectorcall))";
-    break;
-  case clang::CC_X86Pascal:
-    OS << " __attribute__((pascal))";
-    break;
-  case clang::CC_AAPCS:
-    OS << " __attribute__((pcs(\"aapcs\")))";
-    break;
-  case clang::CC_AAPCS_VFP:
-    OS << " __attribute__((pcs(\"aapcs-vfp\")))";
-    break;
-  case clang::CC_IntelOclBicc:
-    OS << " __attribute__((intel_ocl_bicc))";
-    break;
-  case clang::CC_Win64:
-    OS << " __attribute__((ms_abi))";
-    break;
-  case clang::CC_X86_64SysV:
-    OS << " __attribute__((sysv_abi))";
-    break;
-  case clang::CC_X86RegCall:
-    OS << " __attribute__((regcall))";
-    break;
-  case clang::CC_AArch64VectorCall:
-    OS << "__attribute__((aarch64_vector_pcs))";
-  case clang::CC_SpirFunction:
-  case clang::CC_OpenCLKernel:
-  case clang::CC_SwiftAsync:
-    // Do nothing. These CCs are not available as attributes.
-    break;
-  case clang::CC_Swift:
-    OS << " __attribute__((swiftcall))";
-    break;
-  case clang::CC_PreserveMost:
-    OS << " __attribute__((preserve_most))";
-    break;
-  case clang::CC_PreserveAll:
-    OS << " __attribute__((preserve_all))";
-    break;
-  }
-
-  if (Info.getNoReturn())
-    OS << " __attribute__((noreturn))";
-  if (Info.getProducesResult())
-    OS << " __attribute__((ns_returns_retained))";
-  if (Info.getRegParm())
-    OS << " __attribute__((regparm ("
-       << Info.getRegParm() << ")))";
-  if (Info.getNoCallerSavedRegs())
-    OS << " __attribute__((no_caller_saved_registers))";
+// Returns true if D is an external definition coming from the precompiled
+// sources of other compilation units (or of previous parts of the same one),
+// and thus already is in the JIT.
+bool isImportedDefinition(ASTContext& Ctx, Decl const* D)
+{
+  if (!D->isFromASTFile()) {
+    return false;
+  }
+  if (auto const* FD = llvm::dyn_cast<FunctionDecl>(D)) {
+    return FD->doesThisDeclarationHaveABody() &&
+      Ctx.GetGVALinkageForFunction(FD) == GVA_StrongExternal;
+  }
+  if (auto const* VD = llvm::dyn_cast<VarDecl>(D)) {
+    return VD->isFileVarDecl() &&
+      Ctx.GetGVALinkageForVariable(VD) == GVA_StrongExternal;
+  }
+  return false;
 }
 
-struct ASTGenWrappersConsumer: public clang::ASTConsumer
+// Wraps the CodeGen consumer, and imports the types and functions declared in
+// the translation unit once it has been parsed (see ASTTypeImporter).
+// In CDefMode::Auto, the declarations given to CodeGen are recorded, and only
+// replayed at the end of the translation unit if one of them needs code to be
+// generated.
+// When extending a compilation unit, only the declarations of the new code are
+// imported and code generated.
+// PCH is the consumer serializing the AST, if any, which is also one of the
+// consumers of CG (so that it sees the AST being loaded and modified), but
+// always serializes it.
+struct ASTTypesConsumer: public clang::MultiplexConsumer
 {
-  ASTGenWrappersConsumer(raw_string_ostream& ForceDecls, FuncAliasesMap& FuncAliases, LangOptions const& LO):
-    ForceDecls_(ForceDecls),
-    FuncAliases_(FuncAliases),
-    PP_(LO),
-    ForceIdx_(0)
+  ASTTypesConsumer(std::vector<std::unique_ptr<clang::ASTConsumer>> CG, clang::ASTConsumer* PCH, CompilerInstance& Compiler, CUImpl& CU, bool UseLastError, CDefMode Mode, bool Extend):
+    clang::MultiplexConsumer(std::move(CG)),
+    PCH_(PCH),
+    Compiler_(Compiler),
+    CU_(CU),
+    UseLastError_(UseLastError),
+    Mode_(Mode),
+    Extend_(Extend),
+    ASTCtx_(nullptr),
+    NeedsCodeGen_(Mode == CDefMode::Full)
+  { }
+
+  void Initialize(ASTContext& Ctx) override
   {
-    PP_.IncludeTagDefinition = false;
-    PP_.AnonymousTagLocations = false;
-    PP_.IncludeNewlines = false;
+    ASTCtx_ = &Ctx;
+    clang::MultiplexConsumer::Initialize(Ctx);
   }
 
-  bool HandleTopLevelDecl(DeclGroupRef DR) override
+  bool HandleTopLevelDecl(DeclGroupRef DG) override
   {
-    for (auto& D: DR) {
-      HandleDecl(D);
+    for (Decl* D: DG) {
+      checkCodeGen(D);
     }
+    toCodeGen([this, DG]() { clang::MultiplexConsumer::HandleTopLevelDecl(DG); });
     return true;
   }
 
-private:
-  void HandleDecl(Decl* D)
+  void HandleInlineFunctionDefinition(FunctionDecl* FD) override
   {
-    if (auto* LSD = llvm::dyn_cast<LinkageSpecDecl>(D)) {
-      if (LSD->getLanguage() == clang::LinkageSpecDecl::lang_c) {
-        for (auto* CD: LSD->decls()) {
-          HandleDecl(CD);
-        }
+    checkCodeGen(FD);
+    toCodeGen([this, FD]() { clang::MultiplexConsumer::HandleInlineFunctionDefinition(FD); });
+  }
+
+  void HandleInterestingDecl(DeclGroupRef DG) override
+  {
+    for (Decl* D: DG) {
+      if (Extend_ && isImportedDefinition(*ASTCtx_, D)) {
+        continue;
       }
+      checkCodeGen(D);
+      toCodeGen([this, D]() { clang::MultiplexConsumer::HandleInterestingDecl(DeclGroupRef{D}); });
     }
-    else
-    if (auto* FD = llvm::dyn_cast<FunctionDecl>(D)) {
-      HandleFD(FD);
-    }
-    else
-    if (auto* TD = llvm::dyn_cast<TypedefDecl>(D)) {
-      HandleTypedefDecl(TD);
-    }
   }
 
-  void HandleTypedefDecl(TypedefDecl* TD)
+  void HandleTagDeclDefinition(TagDecl* D) override
+  {
+    toCodeGen([this, D]() { clang::MultiplexConsumer::HandleTagDeclDefinition(D); });
+  }
+
+  void HandleTagDeclRequiredDefinition(TagDecl const* D) override
   {
-    // TODO: AFAIK, no use-def chain in clang, see if there is a way to know if
-    // it is used somewhere!
-    // Force the emission of this type by creating an empty function that takes
-    // this type as argument!
-    ForceDecls_ << "void __dffi_force_typedef_" << std::to_string(ForceIdx_++) << "(" << TD->getName().str() << " *__Arg) {}\n";
+    toCodeGen([this, D]() { clang::MultiplexConsumer::HandleTagDeclRequiredDefinition(D); });
   }
 
-  void HandleFD(FunctionDecl* FD)
+  void HandleCXXStaticMemberVarInstantiation(VarDecl* VD) override
   {
-    if (FD->hasBody() && !FD->isInlineSpecified()) {
+    checkCodeGen(VD);
+    toCodeGen([this, VD]() { clang::MultiplexConsumer::HandleCXXStaticMemberVarInstantiation(VD); });
+  }
+
+  void CompleteTentativeDefinition(VarDecl* VD) override
+  {
+    if (Extend_ && VD->isFromASTFile()) {
       return;
     }
+    checkCodeGen(VD);
+    toCodeGen([this, VD]() { clang::MultiplexConsumer::CompleteTentativeDefinition(VD); });
+  }
 
-    if (auto* Prev = FD->getPreviousDecl()) {
-      if (!Prev->isImplicit()) {
-        return;
-      }
-    }
+  void CompleteExternalDeclaration(VarDecl* VD) override
+  {
+    toCodeGen([this, VD]() { clang::MultiplexConsumer::CompleteExternalDeclaration(VD); });
+  }
+
+  void AssignInheritanceModel(CXXRecordDecl* RD) override
+  {
+    toCodeGen([this, RD]() { clang::MultiplexConsumer::AssignInheritanceModel(RD); });
+  }
 
-    auto* FTy = FD->getType()->getAs<clang::FunctionType>();
-    assert(FTy);
+  void HandleVTable(CXXRecordDecl* RD) override
+  {
+    toCodeGen([this, RD]() { clang::MultiplexConsumer::HandleVTable(RD); });
+  }
 
-    auto const& FExtInfo = FTy->getExtInfo();
-    bool NoReturn = FExtInfo.getNoReturn();
-    if (NoReturn) {
+  void HandleTranslationUnit(ASTContext& Ctx) override
+  {
+    // The AST might be incomplete or invalid, and the compilation will fail
+    // anyway.
+    if (!Compiler_.getDiagnostics().hasErrorOccurred()) {
+      ASTTypeImporter::importTranslationUnit(CU_, Compiler_, UseLastError_, Extend_, NeedsCodeGen_);
+    }
+    if (!NeedsCodeGen_) {
+      if (PCH_) {
+        PCH_->HandleTranslationUnit(Ctx);
+      }
       return;
     }
-
-    // Function name and params
-    std::string FuncName;
-    DeclarationName DeclName = FD->getNameInfo().getName();
-    if (auto *Attr = FD->getAttr<AsmLabelAttr>()) {
-      FuncName = Attr->getLabel().str();
-      FuncAliases_[DeclName.getAsString()] = FuncName;
+    for (auto& Fn: Deferred_) {
+      Fn();
     }
-    else {
-      FuncName = DeclName.getAsString();
+    Deferred_.clear();
+    clang::MultiplexConsumer::HandleTranslationUnit(Ctx);
+  }
+
+private:
+  template <class Func>
+  void toCodeGen(Func&& Fn)
+  {
+    switch (Mode_) {
+      case CDefMode::Full:
+        Fn();
+        break;
+      case CDefMode::Auto:
+        Deferred_.emplace_back(std::forward<Func>(Fn));
+        break;
+      case CDefMode::DeclsOnly:
+        break;
+    };
+  }
+
+  bool isDiscardable(GVALinkage Linkage, Decl const* D) const
+  {
+    if (Linkage == GVA_AvailableExternally) {
+      return true;
     }
+    // Static inline functions of system headers are mostly helpers of their
+    // other inline functions. They are only available if code is generated
+    // for other reasons (see ASTTypeImporter::importFunction).
+    return (Linkage == GVA_Internal || Linkage == GVA_DiscardableODR) &&
+      ASTCtx_->getSourceManager().isInSystemHeader(D->getLocation());
+  }
 
-    // Verify that we didn't already visited that function. It can occur with aliases.
-    if (!Visited_.insert(FuncName).second) {
+  void checkCodeGen(Decl const* D)
+  {
+    if (NeedsCodeGen_ || Mode_ != CDefMode::Auto) {
       return;
     }
+    if (auto const* DC = llvm::dyn_cast<LinkageSpecDecl>(D)) {
+      for (Decl const* CD: DC->decls()) {
+        checkCodeGen(CD);
+      }
+    }
+    else
+    if (auto const* DC = llvm::dyn_cast<NamespaceDecl>(D)) {
+      for (Decl const* CD: DC->decls()) {
+        checkCodeGen(CD);
+      }
+    }
+    else
+    if (auto const* FD = llvm::dyn_cast<FunctionDecl>(D)) {
+      if (FD->doesThisDeclarationHaveABody() && !FD->isDependentContext() &&
+          FD->getTemplatedKind() != FunctionDecl::TK_FunctionTemplate) {
+        NeedsCodeGen_ = !isDiscardable(ASTCtx_->GetGVALinkageForFunction(FD), FD);
+      }
+    }
+    else
+    if (auto const* VD = llvm::dyn_cast<VarDecl>(D)) {
+      if (VD->isFileVarDecl() && VD->isThisDeclarationADefinition() != VarDecl::DeclarationOnly) {
+        NeedsCodeGen_ = !isDiscardable(ASTCtx_->GetGVALinkageForVariable(VD), VD);
+      }
+    }
+  }
 
-    auto Params = FD->parameters();
-
-    SmallString<128> NewFuncNameBuf;
-    StringRef NewFuncName = (Twine{"__dffi_force_decl_"} + FuncName).toStringRef(NewFuncNameBuf);
-
-    auto& ASTCtx = FD->getASTContext();
-    IdentifierInfo* NewName = &ASTCtx.Idents.get(NewFuncName);
-
-    // TODO: create a real body within the clang AST, and find a way to feed this back to llvm!
-    FunctionDecl* NewFD = FunctionDecl::Create(ASTCtx, ASTCtx.getTranslationUnitDecl(), SourceLocation(), SourceLocation(), NewName, clang::QualType{FTy, 0}, nullptr, SC_None);
-    auto* NewFDCtx = NewFD->getDeclContext();
-    SmallVector<ParmVarDecl*, 8> NewParams;
-    NewParams.reserve(Params.size());
-    size_t ArgId = 0;
-    for (ParmVarDecl* P: Params) {
-      if (P->getName().empty()) {
-        std::string Name = "__Arg_" + std::to_string(ArgId++);
-        P = ParmVarDecl::Create(ASTCtx, NewFDCtx, P->getBeginLoc(), P->getLocation(),
-          &ASTCtx.Idents.get(Name), P->getType(), P->getTypeSourceInfo(), P->getStorageClass(), nullptr);
+  clang::ASTConsumer* PCH_;
+  CompilerInstance& Compiler_;
+  CUImpl& CU_;
+  bool UseLastError_;
+  CDefMode Mode_;
+  bool Extend_;
+  ASTContext* ASTCtx_;
+  bool NeedsCodeGen_;
+  std::vector<std::function<void()>> Deferred_;
+};
+
+// Forwards everything to CodeGen, except the external definitions coming from
+// the precompiled sources of the imported compilation units. The local
+// variables coming from them are still emitted, and replaced by the ones of
+// these compilation units afterwards (see DFFIImpl::useImportedStatics).
+struct ImportsConsumer: public clang::MultiplexConsumer
+{
+  ImportsConsumer(std::vector<std::unique_ptr<clang::ASTConsumer>> CG):
+    clang::MultiplexConsumer(std::move(CG)),
+    ASTCtx_(nullptr)
+  { }
+
+  void Initialize(ASTContext& Ctx) override
+  {
+    ASTCtx_ = &Ctx;
+    clang::MultiplexConsumer::Initialize(Ctx);
+  }
+
+  void HandleInterestingDecl(DeclGroupRef DG) override
+  {
+    for (Decl* D: DG) {
+      if (!isImportedDefinition(*ASTCtx_, D)) {
+        clang::MultiplexConsumer::HandleInterestingDecl(DeclGroupRef{D});
       }
-      NewParams.push_back(P);
     }
-    NewFD->setParams(NewParams);
+  }
 
-    printFunctionAttrs(FExtInfo, ForceDecls_);
-    NewFD->print(ForceDecls_, PP_, 0, true);
-    ForceDecls_ << " {}\n";
+  void CompleteTentativeDefinition(VarDecl* VD) override
+  {
+    if (!VD->isFromASTFile()) {
+      clang::MultiplexConsumer::CompleteTentativeDefinition(VD);
+    }
   }
 
 private:
-  raw_string_ostream& ForceDecls_;
-  FuncAliasesMap& FuncAliases_;
-  StringSet<> Visited_;
-  PrintingPolicy PP_;
-  unsigned ForceIdx_;
+  ASTContext* ASTCtx_;
 };
 
 } // anonymous
 
+std::unique_ptr<clang::ASTConsumer> EmitLLVMWithASTTypesAction::CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
+{
+  auto CG = clang::EmitLLVMOnlyAction::CreateASTConsumer(Compiler, InFile);
+  if (!CG) {
+    return nullptr;
+  }
+  std::vector<std::unique_ptr<clang::ASTConsumer>> Consumers;
+  Consumers.emplace_back(std::move(CG));
+  clang::ASTConsumer* PCH = nullptr;
+  if (PCH_) {
+    Consumers.emplace_back(std::make_unique<PCHGenerator>(Compiler.getPreprocessor(),
+      Compiler.getModuleCache(), InFile, /* isysroot */ "", PCH_,
+      Compiler.getFrontendOpts().ModuleFileExtensions,
+      /* AllowASTWithErrors */ false, /* IncludeTimestamps */ false));
+    PCH = Consumers.back().get();
+  }
+  return std::make_unique<ASTTypesConsumer>(std::move(Consumers), PCH, Compiler, CU_, UseLastError_, Mode_, Extend_);
+}
+
+void EmitLLVMWithASTTypesAction::EndSourceFileAction()
+{
+  clang::EmitLLVMOnlyAction::EndSourceFileAction();
+  // The AST outlives the consumers (see ASTTypeImporter)
+  auto& Compiler = getCompilerInstance();
+  if (Compiler.hasASTContext()) {
+    Compiler.getASTContext().setASTMutationListener(nullptr);
+  }
+  if (auto Reader = Compiler.getASTReader()) {
+    Reader->setDeserializationListener(nullptr);
+  }
+}
+
+std::unique_ptr<clang::ASTConsumer> EmitLLVMWithImportsAction::CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
+{
+  auto CG = clang::EmitLLVMOnlyAction::CreateASTConsumer(Compiler, InFile);
+  if (!CG) {
+    return nullptr;
+  }
+  std::vector<std::unique_ptr<clang::ASTConsumer>> Consumers;
+  Consumers.emplace_back(std::move(CG));
+  return std::make_unique<ImportsConsumer>(std::move(Consumers));
+}
 
-std::unique_ptr<clang::ASTConsumer> ASTGenWrappersAction::CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
+std::unique_ptr<clang::ASTConsumer> GeneratePCHInMemoryAction::CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
 {
-  ASTCtxt_ = llvm::IntrusiveRefCntPtr<clang::ASTContext>{&Compiler.getASTContext()};
-  return std::make_unique<ASTGenWrappersConsumer>(ForceDecls_, FuncAliases_, Compiler.getLangOpts());
+  return std::make_unique<PCHGenerator>(Compiler.getPreprocessor(),
+    Compiler.getModuleCache(), InFile, /* isysroot */ "", Buffer_,
+    Compiler.getFrontendOpts().ModuleFileExtensions,
+    /* AllowASTWithErrors */ false, /* IncludeTimestamps */ false);
 }
 
-std::string& ASTGenWrappersAction::forceDecls()
+bool GeneratePCHInMemoryAction::BeginSourceFileAction(clang::CompilerInstance& Compiler)
 {
-  return ForceDecls_.str();
+  Compiler.getLangOpts().CompilingPCH = true;
+  return true;
 }
 
 } // details
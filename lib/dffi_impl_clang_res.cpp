@@ -1,11 +1,11 @@
 // Copyright 2018 Adrien Guinet <adrien@guinet.me>
-// 
+//
 // Licensed under the Apache License, Version 2.0 (the "License");
 // you may not use this file except in compliance with the License.
 // You may obtain a copy of the License at
-// 
+//
 //     http://www.apache.org/licenses/LICENSE-2.0
-// 
+//
 // Unless required by applicable law or agreed to in writing, software
 // distributed under the License is distributed on an "AS IS" BASIS,
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
@@ -13,39 +13,269 @@
 // limitations under the License.
 
 #include "dffi_impl.h"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/VirtualFileSystem.h>
 
+#include <mutex>
+
 using namespace clang;
 using namespace llvm;
 
-// Implemented in clang_res.h included below
-static void initVFS(vfs::InMemoryFileSystem&);
+// Data generated by cmake (see tools/pack_clang_res.cpp for the format)!
+#include <dffi/clang_res.h>
+
+namespace {
+
+struct ResFile
+{
+  // Stored data, which might be compressed
+  StringRef Data;
+  uint32_t Size;
+  bool Compressed;
+  sys::fs::UniqueID ID;
+  // Decompressed content, created when the file is first opened
+  std::unique_ptr<MemoryBuffer> Buffer;
+};
+
+struct ResDir
+{
+  sys::fs::UniqueID ID;
+  std::vector<vfs::directory_entry> Entries;
+};
+
+struct ResFileHandle: public vfs::File
+{
+  ResFileHandle(vfs::Status Stat, StringRef Data):
+    Stat_(std::move(Stat)),
+    Data_(Data)
+  { }
+
+  ErrorOr<vfs::Status> status() override { return Stat_; }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> getBuffer(Twine const& Name, int64_t /*FileSize*/, bool RequiresNullTerminator, bool /*IsVolatile*/) override
+  {
+    // Data is null terminated, and lives as long as the process
+    return MemoryBuffer::getMemBuffer(Data_, Name.str(), RequiresNullTerminator);
+  }
+  std::error_code close() override { return {}; }
+
+private:
+  vfs::Status Stat_;
+  StringRef Data_;
+};
 
-// Used by initVFS!
-static void addPath(vfs::InMemoryFileSystem& VFS, const char* Path, const uint8_t* Data, size_t Len)
+struct ResDirIterator: public vfs::detail::DirIterImpl
 {
-  assert(sys::path::is_relative(Path) && "path must be relative!");
-  SmallString<1024> FullPath;
-  (StringRef{dffi::details::getClangResRootDirectory()} + "/" + Path).toStringRef(FullPath);
-  VFS.addFile(FullPath, time(NULL), 
-    MemoryBuffer::getMemBuffer(StringRef{(const char*)Data, Len}, "", false));
+  ResDirIterator(std::vector<vfs::directory_entry> const& Entries):
+    Entries_(Entries)
+  {
+    if (!Entries_.empty()) {
+      CurrentEntry = Entries_.front();
+    }
+  }
+
+  std::error_code increment() override
+  {
+    ++Idx_;
+    CurrentEntry = Idx_ < Entries_.size() ? Entries_[Idx_] : vfs::directory_entry{};
+    return {};
+  }
+
+private:
+  std::vector<vfs::directory_entry> const& Entries_;
+  size_t Idx_ = 0;
+};
+
+// Read-only file system with the headers of the archive. Their index is
+// created at once, but each header is only decompressed the first time it is
+// opened, and then kept for the lifetime of the process.
+class ClangResFileSystem: public vfs::FileSystem
+{
+public:
+  ClangResFileSystem(StringRef Archive);
+
+  ErrorOr<vfs::Status> status(Twine const& Path) override;
+  ErrorOr<std::unique_ptr<vfs::File>> openFileForRead(Twine const& Path) override;
+  vfs::directory_iterator dir_begin(Twine const& Dir, std::error_code& EC) override;
+  ErrorOr<std::string> getCurrentWorkingDirectory() const override;
+  std::error_code setCurrentWorkingDirectory(Twine const& Path) override;
+
+private:
+  std::string getFullPath(Twine const& Path) const;
+  void addToParent(StringRef Path, sys::fs::file_type Type);
+  vfs::Status getStatus(StringRef Path, sys::fs::UniqueID ID, sys::fs::file_type Type, uint64_t Size) const;
+
+  StringMap<ResFile> Files_;
+  StringMap<ResDir> Dirs_;
+  sys::TimePoint<> ModTime_;
+  // Protects the decompressed buffers and the working directory, as frontends
+  // use this file system concurrently.
+  mutable std::mutex Lock_;
+  std::string WD_;
+};
+
+ClangResFileSystem::ClangResFileSystem(StringRef Archive):
+  ModTime_(sys::toTimePoint(time(NULL))),
+  WD_("/")
+{
+  using namespace llvm::support;
+  const StringRef Magic = "DFFIRES1";
+  auto Invalid = []() {
+    llvm::report_fatal_error("invalid clang resources archive!");
+  };
+  auto Read32 = [&](size_t Off) {
+    if (Off + 4 > Archive.size()) {
+      Invalid();
+    }
+    return endian::read32le(Archive.data() + Off);
+  };
+  if (!Archive.startswith(Magic)) {
+    Invalid();
+  }
+  const uint32_t NFiles = Read32(Magic.size());
+  SmallString<256> Path;
+  for (uint32_t I = 0; I < NFiles; ++I) {
+    const size_t Off = Magic.size() + 4 + I*6*4;
+    const uint32_t NameOff = Read32(Off);
+    const uint32_t NameLen = Read32(Off+4);
+    const uint32_t DataOff = Read32(Off+8);
+    const uint32_t StoredSize = Read32(Off+12);
+    if ((uint64_t)NameOff + NameLen > Archive.size() || (uint64_t)DataOff + StoredSize > Archive.size()) {
+      Invalid();
+    }
+    Path = dffi::details::getClangResRootDirectory();
+    sys::path::append(Path, "include", Archive.substr(NameOff, NameLen));
+    sys::path::native(Path);
+
+    ResFile F;
+    F.Data = Archive.substr(DataOff, StoredSize);
+    F.Size = Read32(Off+16);
+    F.Compressed = Read32(Off+20) != 0;
+    F.ID = vfs::getNextVirtualUniqueID();
+    Files_.try_emplace(Path, std::move(F));
+    addToParent(Path, sys::fs::file_type::regular_file);
+  }
 }
 
-static IntrusiveRefCntPtr<vfs::FileSystem> createClangResFileSystem()
+void ClangResFileSystem::addToParent(StringRef Path, sys::fs::file_type Type)
 {
-  auto* VFS = new vfs::InMemoryFileSystem{};
-  initVFS(*VFS);
-  return IntrusiveRefCntPtr<vfs::FileSystem>{VFS};
+  const StringRef Parent = sys::path::parent_path(Path);
+  if (Parent.empty() || Parent == Path) {
+    return;
+  }
+  auto Ins = Dirs_.try_emplace(Parent);
+  Ins.first->second.Entries.emplace_back(Path.str(), Type);
+  if (Ins.second) {
+    Ins.first->second.ID = vfs::getNextVirtualUniqueID();
+    addToParent(Ins.first->getKey(), sys::fs::file_type::directory_file);
+  }
 }
 
-// Data generated by cmake!
-#include <dffi/clang_res.h>
+std::string ClangResFileSystem::getFullPath(Twine const& Path) const
+{
+  SmallString<256> Ret;
+  Path.toVector(Ret);
+  {
+    std::lock_guard<std::mutex> Guard(Lock_);
+    sys::fs::make_absolute(WD_, Ret);
+  }
+  sys::path::remove_dots(Ret, true /* remove_dot_dot */);
+  sys::path::native(Ret);
+  return Ret.str().str();
+}
+
+vfs::Status ClangResFileSystem::getStatus(StringRef Path, sys::fs::UniqueID ID, sys::fs::file_type Type, uint64_t Size) const
+{
+  return vfs::Status{Path, ID, ModTime_, 0, 0, Size, Type,
+    sys::fs::perms::all_read | sys::fs::perms::all_exe};
+}
+
+ErrorOr<vfs::Status> ClangResFileSystem::status(Twine const& Path)
+{
+  const std::string FullPath = getFullPath(Path);
+  auto ItF = Files_.find(FullPath);
+  if (ItF != Files_.end()) {
+    return getStatus(Path.str(), ItF->second.ID, sys::fs::file_type::regular_file, ItF->second.Size);
+  }
+  auto ItD = Dirs_.find(FullPath);
+  if (ItD != Dirs_.end()) {
+    return getStatus(Path.str(), ItD->second.ID, sys::fs::file_type::directory_file, 0);
+  }
+  return make_error_code(std::errc::no_such_file_or_directory);
+}
+
+ErrorOr<std::unique_ptr<vfs::File>> ClangResFileSystem::openFileForRead(Twine const& Path)
+{
+  const std::string FullPath = getFullPath(Path);
+  auto It = Files_.find(FullPath);
+  if (It == Files_.end()) {
+    return Dirs_.count(FullPath) ? make_error_code(std::errc::is_a_directory) : make_error_code(std::errc::no_such_file_or_directory);
+  }
+  auto& F = It->second;
+  StringRef Data = F.Data;
+  if (F.Compressed) {
+    std::lock_guard<std::mutex> Guard(Lock_);
+    if (!F.Buffer) {
+      // The new buffer is null terminated
+      auto Buf = WritableMemoryBuffer::getNewUninitMemBuffer(F.Size, FullPath);
+      size_t Size = F.Size;
+      if (!zlib::isAvailable()) {
+        llvm::report_fatal_error("zlib is needed to decompress clang resources!");
+      }
+      if (auto Err = zlib::uncompress(F.Data, Buf->getBufferStart(), Size)) {
+        llvm::report_fatal_error(std::move(Err));
+      }
+      if (Size != F.Size) {
+        llvm::report_fatal_error(Twine{"invalid size for clang resource '"} + FullPath + "'");
+      }
+      F.Buffer = std::move(Buf);
+    }
+    Data = F.Buffer->getBuffer();
+  }
+  return std::unique_ptr<vfs::File>{new ResFileHandle{
+    getStatus(Path.str(), F.ID, sys::fs::file_type::regular_file, F.Size), Data}};
+}
+
+vfs::directory_iterator ClangResFileSystem::dir_begin(Twine const& Dir, std::error_code& EC)
+{
+  auto It = Dirs_.find(getFullPath(Dir));
+  if (It == Dirs_.end()) {
+    EC = make_error_code(std::errc::no_such_file_or_directory);
+    return {};
+  }
+  EC = {};
+  return vfs::directory_iterator{std::make_shared<ResDirIterator>(It->second.Entries)};
+}
+
+ErrorOr<std::string> ClangResFileSystem::getCurrentWorkingDirectory() const
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return WD_;
+}
+
+std::error_code ClangResFileSystem::setCurrentWorkingDirectory(Twine const& Path)
+{
+  // Like the in-memory file system, any directory is accepted
+  SmallString<256> WD;
+  Path.toVector(WD);
+  std::lock_guard<std::mutex> Guard(Lock_);
+  sys::fs::make_absolute(WD_, WD);
+  sys::path::remove_dots(WD, true /* remove_dot_dot */);
+  WD_ = WD.str().str();
+  return {};
+}
+
+} // anonymous
 
 // "Public" API
 IntrusiveRefCntPtr<vfs::FileSystem> dffi::details::getClangResFileSystem()
 {
-  static IntrusiveRefCntPtr<vfs::FileSystem> FS = createClangResFileSystem();
+  static IntrusiveRefCntPtr<vfs::FileSystem> FS{new ClangResFileSystem{
+    StringRef{(const char*)ClangResArchive, sizeof(ClangResArchive)}}};
   return FS;
 }
 
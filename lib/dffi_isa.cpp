@@ -0,0 +1,185 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ISA variants (see CCOpts::ISAVariants). Before being optimized, each
+// function of a compilation unit is cloned for every variant CPU:
+//
+//   define @f(args) "target-cpu"="x86-64"                  ; baseline
+//   define @f.__dffi_isa0(args) "target-cpu"="x86-64-v3"   ; first variant
+//   ...
+//
+// so that the optimizer (e.g. the vectorizers) and the code generator use the
+// features of this CPU for the clone. The functions they call which aren't
+// exported (e.g. static ones) are cloned the same way, and the clones of a
+// variant call each others. The variant run by the host is
+// selected once from its CPUID (see selectISAVariant), and CUImpl then
+// returns the address of its clones.
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/X86TargetParser.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+std::string getISASuffix(size_t Idx)
+{
+  return ".__dffi_isa" + std::to_string(Idx);
+}
+
+bool isKnownCPU(Triple const& T, StringRef CPU)
+{
+  return X86::parseArchX86(CPU, T.isArch64Bit()) != X86::CK_None;
+}
+
+// Features of every x86 CPU, which sys::getHostCPUFeatures doesn't report
+bool isBaseFeature(StringRef F)
+{
+  return F == "x87";
+}
+
+} // anonymous
+
+bool DFFIImpl::checkISAVariants(std::string& Err) const
+{
+  const Triple T{Triple_};
+  if (!T.isX86()) {
+    return true;
+  }
+  for (auto const& CPU: Opts_.ISAVariants) {
+    if (!isKnownCPU(T, CPU)) {
+      Err = "unknown ISA variant CPU '" + CPU + "'";
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string DFFIImpl::selectISAVariant() const
+{
+  const Triple T{Triple_};
+  if (Opts_.ISAVariants.empty() || !T.isX86()) {
+    return {};
+  }
+  // Variants are ignored with tiers or instrumentation (see compile)
+  if (Opts_.ProfileInstr || (Opts_.TierUpThreshold > 0 && Opts_.OptLevel > 0)) {
+    return {};
+  }
+  StringMap<bool> HostFeatures;
+  if (!sys::getHostCPUFeatures(HostFeatures)) {
+    return {};
+  }
+  // Unknown CPUs are reported when compiling (see checkISAVariants)
+  for (size_t I = Opts_.ISAVariants.size(); I-- > 0; ) {
+    if (!isKnownCPU(T, Opts_.ISAVariants[I])) {
+      continue;
+    }
+    SmallVector<StringRef, 32> Features;
+    X86::getFeaturesForCPU(Opts_.ISAVariants[I], Features);
+    const bool Supported = llvm::all_of(Features, [&](StringRef F) {
+      return isBaseFeature(F) || HostFeatures.lookup(F);
+    });
+    if (Supported) {
+      return getISASuffix(I);
+    }
+  }
+  return {};
+}
+
+void DFFIImpl::cloneISAVariants(CUImpl& CU, Module& M)
+{
+  if (!Triple{Triple_}.isX86()) {
+    return;
+  }
+  std::vector<std::string> VariantFeatures;
+  for (auto const& CPU: Opts_.ISAVariants) {
+    SmallVector<StringRef, 32> Features;
+    X86::getFeaturesForCPU(CPU, Features);
+    std::string Str;
+    for (StringRef F: Features) {
+      Str += ",+";
+      Str += F;
+    }
+    VariantFeatures.emplace_back(std::move(Str));
+  }
+
+  // Functions of the compilation unit, and the ones they call directly
+  // which aren't exported. Functions whose address is taken are still used
+  // through their baseline version.
+  SmallVector<Function*, 16> Funcs;
+  SmallPtrSet<Function*, 16> Seen;
+  for (auto const& It: CU.FuncTys_) {
+    Function* F = M.getFunction(It.getKey());
+    if (F && !F->isDeclaration() && F->hasExternalLinkage() && Seen.insert(F).second) {
+      Funcs.push_back(F);
+    }
+  }
+  for (size_t Idx = 0; Idx < Funcs.size(); ++Idx) {
+    for (Instruction& I: instructions(*Funcs[Idx])) {
+      auto* Call = dyn_cast<CallBase>(&I);
+      Function* Callee = Call ? Call->getCalledFunction() : nullptr;
+      if (Callee && !Callee->isDeclaration() && !Callee->hasExternalLinkage() &&
+          Seen.insert(Callee).second) {
+        Funcs.push_back(Callee);
+      }
+    }
+  }
+
+  for (size_t I = 0; I < Opts_.ISAVariants.size(); ++I) {
+    DenseMap<Function*, Function*> Clones;
+    for (Function* F: Funcs) {
+      // Features of the variant are added to the ones the compilation unit
+      // has been compiled with.
+      const std::string BaseFeatures = F->getFnAttribute("target-features").getValueAsString().str();
+      ValueToValueMapTy VMap;
+      Function* Clone = CloneFunction(F, VMap);
+      Clone->setName(F->getName() + getISASuffix(I));
+      Clone->addFnAttr("target-cpu", Opts_.ISAVariants[I]);
+      StringRef Features = VariantFeatures[I];
+      if (BaseFeatures.empty()) {
+        Features = Features.drop_front();
+      }
+      Clone->addFnAttr("target-features", BaseFeatures + Features.str());
+      Clones[F] = Clone;
+    }
+    for (auto const& It: Clones) {
+      for (Instruction& Inst: instructions(*It.second)) {
+        auto* Call = dyn_cast<CallBase>(&Inst);
+        if (!Call) {
+          continue;
+        }
+        auto ItClone = Clones.find(Call->getCalledFunction());
+        if (ItClone != Clones.end()) {
+          Call->setCalledFunction(ItClone->second);
+        }
+      }
+    }
+  }
+}
+
+} // details
+} // dffi
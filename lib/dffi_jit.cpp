@@ -0,0 +1,79 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <llvm/Object/ObjectFile.h>
+
+#include "dffi_jit.h"
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+CUSymbolResolver::~CUSymbolResolver()
+{ }
+
+JITSymbol CUSymbolResolver::findSymbol(std::string const& Name)
+{
+  if (auto Addr = DFFI_.resolveSymbol(Name)) {
+    return JITSymbol{Addr, JITSymbolFlags::Exported};
+  }
+  return nullptr;
+}
+
+JITSymbol CUSymbolResolver::findSymbolInLogicalDylib(std::string const&)
+{
+  // Each compilation unit is its own logical dylib, whose symbols are found
+  // by its engine.
+  return nullptr;
+}
+
+CUObjectListener::~CUObjectListener()
+{ }
+
+void CUObjectListener::notifyObjectLoaded(ObjectKey, object::ObjectFile const& Obj, RuntimeDyld::LoadedObjectInfo const& L)
+{
+  for (auto const& Sym: Obj.symbols()) {
+    auto FlagsOrErr = Sym.getFlags();
+    if (!FlagsOrErr) {
+      consumeError(FlagsOrErr.takeError());
+      continue;
+    }
+    if (!(*FlagsOrErr & object::SymbolRef::SF_Global) || (*FlagsOrErr & object::SymbolRef::SF_Undefined)) {
+      continue;
+    }
+    auto NameOrErr = Sym.getName();
+    auto AddrOrErr = Sym.getAddress();
+    auto SecOrErr = Sym.getSection();
+    if (!NameOrErr || !AddrOrErr || !SecOrErr || *SecOrErr == Obj.section_end()) {
+      consumeError(NameOrErr.takeError());
+      consumeError(AddrOrErr.takeError());
+      consumeError(SecOrErr.takeError());
+      continue;
+    }
+    const uint64_t SecLoadAddr = L.getSectionLoadAddress(**SecOrErr);
+    if (!SecLoadAddr) {
+      continue;
+    }
+    StringRef Name = *NameOrErr;
+    if (GlobalPrefix_ && !Name.empty() && Name.front() == GlobalPrefix_) {
+      Name = Name.drop_front();
+    }
+    Symbols_[Name] = SecLoadAddr + *AddrOrErr - (*SecOrErr)->getAddress();
+  }
+}
+
+} // details
+} // dffi
@@ -0,0 +1,75 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DFFI_JIT_H
+#define DFFI_JIT_H
+
+#include <string>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+
+namespace dffi {
+namespace details {
+
+struct DFFIImpl;
+
+// Resolves the external symbols of the JIT engine of a compilation unit.
+// Symbols defined by other compilation units are looked up in their own
+// engines, and the remaining ones in the process (see
+// DFFIImpl::resolveSymbol).
+// Virtual functions are defined in dffi_jit.cpp, which is compiled with the
+// same RTTI settings as LLVM.
+struct CUSymbolResolver: public llvm::LegacyJITSymbolResolver
+{
+  CUSymbolResolver(DFFIImpl& DFFI):
+    DFFI_(DFFI)
+  { }
+  ~CUSymbolResolver() override;
+
+  llvm::JITSymbol findSymbol(std::string const& Name) override;
+  llvm::JITSymbol findSymbolInLogicalDylib(std::string const& Name) override;
+
+private:
+  DFFIImpl& DFFI_;
+};
+
+// Records the addresses of the symbols defined by the objects loaded in the
+// JIT engine of a compilation unit. They are known as soon as an object is
+// loaded, before its relocations are resolved, so that they can be found
+// while the engine is being finalized (see DFFIImpl::getCUSymbolAddress).
+struct CUObjectListener: public llvm::JITEventListener
+{
+  // GlobalPrefix is the one the symbols of the objects start with (see
+  // DFFIImpl::GlobalPrefix_).
+  CUObjectListener(char GlobalPrefix):
+    GlobalPrefix_(GlobalPrefix)
+  { }
+  ~CUObjectListener() override;
+
+  void notifyObjectLoaded(ObjectKey Key, llvm::object::ObjectFile const& Obj, llvm::RuntimeDyld::LoadedObjectInfo const& L) override;
+
+  // Returns 0 if Name (an IR name) isn't defined by the loaded objects
+  uint64_t lookup(llvm::StringRef Name) const { return Symbols_.lookup(Name); }
+
+private:
+  char GlobalPrefix_;
+  llvm::StringMap<uint64_t> Symbols_;
+};
+
+} // details
+} // dffi
+
+#endif
@@ -39,7 +39,8 @@ std::unique_ptr<llvm::Module> isolateFunc(llvm::Function* F, const char* FuncNam
 
 std::string FunctionType::getWrapperLLVM(const char* FuncName) const
 {
-  llvm::Function* F = getDFFI().getWrapperLLVMFunc(this, llvm::None);
+  std::unique_ptr<llvm::Module> Owner;
+  llvm::Function* F = getDFFI().getWrapperLLVMFunc(this, llvm::None, Owner);
   auto M = isolateFunc(F, FuncName);
   std::string Ret;
   llvm::raw_string_ostream ss(Ret);
@@ -49,7 +50,8 @@ std::string FunctionType::getWrapperLLVM(const char* FuncName) const
 
 std::string FunctionType::getWrapperLLVMStr(const char* FuncName) const
 {
-  llvm::Function* F = getDFFI().getWrapperLLVMFunc(this, llvm::None);
+  std::unique_ptr<llvm::Module> Owner;
+  llvm::Function* F = getDFFI().getWrapperLLVMFunc(this, llvm::None, Owner);
   auto M = isolateFunc(F, FuncName);
   std::string Ret;
   llvm::raw_string_ostream ss(Ret);
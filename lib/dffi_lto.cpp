@@ -0,0 +1,150 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Link time optimization (see CCOpts::LTO). Compilation units compiled for
+// LTO are optimized with clang's LTO pre-link pipeline, their IR is then
+// kept, and their functions are called through the same stubs as tiered ones
+// (see dffi_tiers.cpp), whose slots first point to their own code.
+// linkCompilationUnits links these IRs in a single module, optimized with
+// clang's full LTO pipeline. Like recompiled code, it is rebased (see
+// rebaseModule), so that it uses the variables of the linked compilation
+// units, and loaded in an internal compilation unit which imports them. The
+// slots of the linked functions then point to the new code.
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticPrinter.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+void DFFIImpl::prepareLTO(CUImpl& CU, Module& M)
+{
+  // Module level assembly would be defined twice in the engine of the
+  // compilation unit.
+  if (!M.getModuleInlineAsm().empty() || !M.ifunc_empty()) {
+    return;
+  }
+
+  // Linked code uses the variables of the compilation unit, which have
+  // been made external (see promoteStatics).
+  raw_string_ostream OS(CU.LTOIR_);
+  WriteBitcodeToFile(M, OS);
+  OS.flush();
+
+  for (auto const& It: CU.FuncTys_) {
+    Function* F = M.getFunction(It.getKey());
+    if (!F || F->isDeclaration() || !F->hasExternalLinkage() || F->isVarArg()) {
+      continue;
+    }
+    CU.LTOSlots_[It.getKey()] = createStub(*F);
+  }
+}
+
+bool DFFIImpl::linkCompilationUnits(std::string& Err)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  if (!Opts_.LTO) {
+    Err = "link time optimization isn't enabled";
+    return false;
+  }
+  SmallVector<CUImpl*, 8> Linked;
+  for (auto const& CU: CUs_) {
+    if (!CU->Released_ && !CU->LTOIR_.empty()) {
+      Linked.push_back(CU.get());
+    }
+  }
+  if (Linked.empty()) {
+    return true;
+  }
+
+  // Errors of the linker are reported through the diagnostics of the
+  // context, which would otherwise exit the process.
+  std::string LinkErr;
+  LLVMContext Ctx;
+  Ctx.setDiagnosticHandlerCallBack([](DiagnosticInfo const& DI, void* Context) {
+    if (DI.getSeverity() != DS_Error) {
+      return;
+    }
+    raw_string_ostream OS(*static_cast<std::string*>(Context));
+    DiagnosticPrinterRawOStream DP(OS);
+    DI.print(DP);
+  }, &LinkErr);
+
+  const std::string Name = "/__dffi_private/lto_" + std::to_string(CUIdx_++);
+  auto M = std::make_unique<Module>(Name, Ctx);
+  Linker L(*M);
+  for (CUImpl* CU: Linked) {
+    auto MOrErr = parseBitcodeFile(MemoryBufferRef{CU->LTOIR_, CU->Name_}, Ctx);
+    if (!MOrErr) {
+      llvm::report_fatal_error(MOrErr.takeError());
+    }
+    if (L.linkInModule(std::move(*MOrErr))) {
+      // It would make the next links fail too: it keeps using its own code
+      // from now on.
+      CU->LTOIR_.clear();
+      CU->LTOSlots_.clear();
+      Err = "unable to link '" + CU->Name_ + "', which won't be linked anymore: " + LinkErr;
+      return false;
+    }
+  }
+
+  const std::string Suffix = ".__dffi_lto" + std::to_string(CUIdx_++);
+  rebaseModule(*M, [](Function const&) { return true; }, Suffix);
+  auto TM = createTargetMachine();
+  M->setDataLayout(TM->createDataLayout());
+  optimizeModule(*M, *TM, Opts_.OptLevel, OptPhase::LTO);
+
+  // The linked compilation units are only freed once this code isn't used
+  // anymore (see release).
+  std::unique_ptr<CUImpl> LTOCU(new CUImpl{*this});
+  LTOCU->Name_ = Name;
+  for (CUImpl* CU: Linked) {
+    ++CU->Importers_;
+    LTOCU->Imports_.push_back(CU);
+  }
+  CUImpl& NewCU = *LTOCU;
+  CUs_.emplace_back(std::move(LTOCU));
+  addObjectToJIT(NewCU, emitObject(*TM, *M));
+
+  for (CUImpl* CU: Linked) {
+    for (auto const& It: CU->LTOSlots_) {
+      const uint64_t Addr = getCUSymbolAddress(NewCU, (It.getKey() + Suffix).str(), true /* FunctionsOnly */);
+      const uint64_t SlotAddr = getCUSymbolAddress(*CU, It.getValue(), false /* FunctionsOnly */);
+      if (Addr && SlotAddr) {
+        storeSlot(SlotAddr, Addr);
+      }
+    }
+  }
+
+  // Nothing uses the code of the previous link anymore
+  if (LTOCU_) {
+    release(*LTOCU_);
+  }
+  LTOCU_ = &NewCU;
+  return true;
+}
+
+} // details
+} // dffi
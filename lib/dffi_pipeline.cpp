@@ -0,0 +1,157 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Options of the code of a single compilation unit (see CompileOpts).
+// Floating point ones are applied to the clang invocation the compilation
+// unit is compiled with (see DFFIImpl::compile, which restores it
+// afterwards). Loop ones are added to the loops of its unoptimized module as
+// the same metadata as "#pragma clang loop", and are thus also honored by
+// the code optimized later on (e.g. by tiers or link time optimization).
+
+#include <clang/Frontend/CompilerInvocation.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+
+#include "dffi_impl.h"
+
+using namespace llvm;
+using namespace clang;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+// Whether the loop ID has metadata whose name starts with Prefix
+bool hasLoopHint(MDNode const* ID, StringRef Prefix)
+{
+  if (!ID) {
+    return false;
+  }
+  for (unsigned I = 1, E = ID->getNumOperands(); I < E; ++I) {
+    auto const* Op = dyn_cast<MDNode>(ID->getOperand(I));
+    if (Op && Op->getNumOperands() > 0) {
+      auto const* S = dyn_cast<MDString>(Op->getOperand(0));
+      if (S && S->getString().startswith(Prefix)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void addLoopHints(Loop& L, CompileOpts const& Opts)
+{
+  LLVMContext& Ctx = L.getHeader()->getContext();
+  MDNode* ID = L.getLoopID();
+  // The first operand of a loop ID is the ID itself
+  SmallVector<Metadata*, 8> MDs{nullptr};
+  if (ID) {
+    MDs.append(ID->op_begin() + 1, ID->op_end());
+  }
+  const size_t NMDs = MDs.size();
+  auto AddHint = [&](StringRef Name, Type* Ty, unsigned V) {
+    MDs.push_back(MDNode::get(Ctx, {MDString::get(Ctx, Name),
+      ConstantAsMetadata::get(ConstantInt::get(Ty, V))}));
+  };
+  Type* I1 = Type::getInt1Ty(Ctx);
+  Type* I32 = Type::getInt32Ty(Ctx);
+
+  // Pragmas of the loop take precedence
+  if (Opts.VectorizeWidth && !hasLoopHint(ID, "llvm.loop.vectorize.")) {
+    AddHint("llvm.loop.vectorize.width", I32, Opts.VectorizeWidth);
+    AddHint("llvm.loop.vectorize.enable", I1, Opts.VectorizeWidth > 1);
+  }
+  if (Opts.InterleaveCount && !hasLoopHint(ID, "llvm.loop.interleave.")) {
+    AddHint("llvm.loop.interleave.count", I32, Opts.InterleaveCount);
+  }
+  if (Opts.UnrollCount && !hasLoopHint(ID, "llvm.loop.unroll.")) {
+    if (Opts.UnrollCount == 1) {
+      MDs.push_back(MDNode::get(Ctx, MDString::get(Ctx, "llvm.loop.unroll.disable")));
+    }
+    else {
+      AddHint("llvm.loop.unroll.count", I32, Opts.UnrollCount);
+    }
+  }
+  if (MDs.size() == NMDs) {
+    return;
+  }
+  MDNode* NewID = MDNode::getDistinct(Ctx, MDs);
+  NewID->replaceOperandWith(0, NewID);
+  L.setLoopID(NewID);
+}
+
+} // anonymous
+
+void applyCompileOpts(CompilerInvocation& CI, CompileOpts const& Opts)
+{
+  // Same options as the ones clang's driver gives to the frontend
+  auto& LO = *CI.getLangOpts();
+  auto& CGO = CI.getCodeGenOpts();
+  if (Opts.FastMath) {
+    LO.FastMath = true;
+    LO.FiniteMathOnly = true;
+    LO.UnsafeFPMath = true;
+    LO.AllowFPReassoc = true;
+    LO.NoHonorNaNs = true;
+    LO.NoHonorInfs = true;
+    LO.NoSignedZero = true;
+    LO.AllowRecip = true;
+    LO.ApproxFunc = true;
+    LO.MathErrno = false;
+    CGO.UnsafeFPMath = true;
+    CGO.NoInfsFPMath = true;
+    CGO.NoNaNsFPMath = true;
+    CGO.NoSignedZeros = true;
+  }
+  if (Opts.FastMath || Opts.FPContractFast) {
+    LO.setDefaultFPContractMode(LangOptions::FPM_Fast);
+  }
+}
+
+std::string getLangOptsKey(CompileOpts const& Opts)
+{
+  std::string Ret;
+  if (Opts.FastMath) {
+    Ret += "-ffast-math ";
+  }
+  else
+  if (Opts.FPContractFast) {
+    Ret += "-ffp-contract=fast ";
+  }
+  return Ret;
+}
+
+void addLoopHints(Module& M, CompileOpts const& Opts)
+{
+  if (Opts.VectorizeWidth == 0 && Opts.InterleaveCount == 0 && Opts.UnrollCount == 0) {
+    return;
+  }
+  for (Function& F: M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    DominatorTree DT{F};
+    LoopInfo LI{DT};
+    for (Loop* L: LI.getLoopsInPreorder()) {
+      addLoopHints(*L, Opts);
+    }
+  }
+}
+
+} // details
+} // dffi
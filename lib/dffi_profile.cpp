@@ -0,0 +1,215 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Profile guided optimization (see CCOpts::ProfileInstr). Instrumented
+// compilation units are compiled with clang's frontend instrumentation, whose
+// counter increments are lowered to plain global arrays, one per function
+// (there is no profile runtime in the JIT). recompileWithProfile then writes
+// these counters to an indexed profile, which clang uses to compile the
+// compilation unit again (branch weights, function entry counts, and the
+// profile summary used by the inliner). The new code is loaded as a rebased
+// module next to the instrumented one (see rebaseModule).
+
+#include <clang/CodeGen/CodeGenAction.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/ProfileData/InstrProfWriter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "dffi_impl.h"
+#include "dffi_vfs.h"
+
+using namespace llvm;
+using namespace clang;
+
+namespace dffi {
+namespace details {
+
+void DFFIImpl::instrumentModule(CUImpl& CU, Module& M)
+{
+  // Code compiled with the profile uses the variables of the instrumented
+  // one, which have been made external (see promoteStatics).
+  DenseMap<GlobalVariable*, GlobalVariable*> Counters;
+  for (Function& F: M) {
+    for (Instruction& I: make_early_inc_range(instructions(F))) {
+      if (isa<InstrProfValueProfileInst>(I)) {
+        I.eraseFromParent();
+        continue;
+      }
+      auto* Inc = dyn_cast<InstrProfIncrementInst>(&I);
+      if (!Inc) {
+        continue;
+      }
+      // Counters are indexed by the variable holding the PGO name of their
+      // function.
+      GlobalVariable* NameVar = Inc->getName();
+      GlobalVariable*& Cnts = Counters[NameVar];
+      if (!Cnts) {
+        ProfiledFunc PF;
+        PF.Name = getPGOFuncNameVarInitializer(NameVar).str();
+        PF.Hash = Inc->getHash()->getZExtValue();
+        PF.NumCounters = Inc->getNumCounters()->getZExtValue();
+        PF.Counters = "__dffi_prof." + std::to_string(CUIdx_++);
+        auto* Ty = ArrayType::get(Type::getInt64Ty(M.getContext()), PF.NumCounters);
+        Cnts = new GlobalVariable{M, Ty, false, GlobalValue::ExternalLinkage,
+          Constant::getNullValue(Ty), PF.Counters};
+        CU.ProfiledFuncs_.emplace_back(std::move(PF));
+      }
+      IRBuilder<> B(Inc);
+      Value* Addr = B.CreateConstInBoundsGEP2_32(Cnts->getValueType(), Cnts, 0,
+        Inc->getIndex()->getZExtValue());
+      Value* Count = B.CreateLoad(B.getInt64Ty(), Addr);
+      B.CreateStore(B.CreateAdd(Count, Inc->getStep()), Addr);
+      Inc->eraseFromParent();
+    }
+  }
+  for (auto const& It: Counters) {
+    It.first->removeDeadConstantUsers();
+    if (It.first->use_empty()) {
+      It.first->eraseFromParent();
+    }
+  }
+}
+
+bool DFFIImpl::recompileWithProfile(CUImpl& CU, std::string& Err)
+{
+  std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+  if (!Opts_.ProfileInstr) {
+    Err = "compilation unit isn't instrumented";
+    return false;
+  }
+  if (CU.ProfiledFuncs_.empty()) {
+    // No code has been generated for this compilation unit
+    return true;
+  }
+
+  // Counters are read while other threads might update them, as the
+  // instrumentation does not use atomic operations anyway.
+  InstrProfWriter Writer;
+  bool Called = false;
+  for (auto const& PF: CU.ProfiledFuncs_) {
+    auto const* Cnts = (uint64_t const*)getCUSymbolAddress(CU, PF.Counters, false /* FunctionsOnly */);
+    if (!Cnts) {
+      continue;
+    }
+    // The first counter of a function counts its calls
+    Called |= PF.NumCounters > 0 && Cnts[0] > 0;
+    NamedInstrProfRecord Record{PF.Name, PF.Hash, std::vector<uint64_t>(Cnts, Cnts + PF.NumCounters)};
+    Writer.addRecord(std::move(Record), [](Error E) { consumeError(std::move(E)); });
+  }
+
+  // Clang reads the profile from the real file system
+  SmallString<128> ProfPath;
+  int FD;
+  if (auto EC = sys::fs::createTemporaryFile("dffi", "profdata", FD, ProfPath)) {
+    Err = "unable to create profile: " + EC.message();
+    return false;
+  }
+  auto RemoveProf = llvm::make_scope_exit([&]() { sys::fs::remove(ProfPath); });
+  {
+    raw_fd_ostream OS(FD, true /* shouldClose */);
+    if (auto E = Writer.write(OS)) {
+      Err = "unable to write profile: " + toString(std::move(E));
+      return false;
+    }
+  }
+
+  auto Source = VFS_->getBufferForFile(CU.Name_);
+  if (!Source) {
+    Err = "unable to read '" + CU.Name_ + "': " + Source.getError().message();
+    return false;
+  }
+  SmallVector<CUImpl*, 4> Imports{CU.Imports_.begin(), CU.Imports_.end()};
+  std::string PCHPath;
+  if (!getCompilePCH(Imports, CU.Opts_, PCHPath, Err)) {
+    return false;
+  }
+
+  // Like instrumented code, the new code is optimized by optimizeModule, once
+  // its local variables have been made external again.
+  // It is compiled with the options of the compilation unit, and the
+  // invocation is restored afterwards, as in compile.
+  auto& FE = *MainFE_;
+  auto& CI = FE.Clang->getInvocation();
+  auto& PPO = CI.getPreprocessorOpts();
+  auto& CGO = CI.getCodeGenOpts();
+  auto& LO = *CI.getLangOpts();
+  const std::string SavedPCHPath = PPO.ImplicitPCHInclude;
+  const CodeGenOptions SavedCGO = CGO;
+  const LangOptions SavedLO = LO;
+  PPO.ImplicitPCHInclude = PCHPath;
+  applyCompileOpts(CI, CU.Opts_);
+  CGO.setProfileUse(CodeGenOptions::ProfileClangInstr);
+  CGO.ProfileInstrumentUsePath = ProfPath.str().str();
+  CGO.DisableLLVMPasses = true;
+  CGO.setDebugInfo(codegenoptions::NoDebugInfo);
+  LLVMContext Ctx;
+  auto M = compile_llvm(FE, Ctx, (*Source)->getBuffer(), CU.Name_, Err, !CU.Imports_.empty());
+  PPO.ImplicitPCHInclude = SavedPCHPath;
+  CGO = SavedCGO;
+  LO = SavedLO;
+  if (!M) {
+    return false;
+  }
+  // Clang silently ignores the profile of the functions whose code doesn't
+  // match it: code compiled with the profile of called functions has entry
+  // counts.
+  if (Called && llvm::none_of(*M, [](Function const& F) {
+        auto Count = F.getEntryCount();
+        return Count && Count->getCount() > 0;
+      })) {
+    Err = "the profile of the compilation unit doesn't match its code";
+    return false;
+  }
+  // Module level assembly would be defined twice in the engine of the
+  // compilation unit.
+  if (!M->getModuleInlineAsm().empty() || !M->ifunc_empty()) {
+    Err = "compilation units with module level assembly can't be recompiled";
+    return false;
+  }
+
+  stripAsmPrefixes(*M);
+  useImportedStatics(*M, Imports);
+  promoteStatics(*M, CU.StaticsPrefix_);
+  const std::string Suffix = ".__dffi_pgo" + std::to_string(CUIdx_++);
+  rebaseModule(*M, [](Function const&) { return true; }, Suffix);
+  addLoopHints(*M, CU.Opts_);
+  optimizeModule(*M, getOptTargetMachine(FE), Opts_.OptLevel, OptPhase::PerModule, CU.Opts_.PassPipeline);
+
+  SmallVector<std::pair<StringRef, std::string>, 16> Syms;
+  for (auto const& It: CU.FuncTys_) {
+    std::string Sym = (It.getKey() + Suffix).str();
+    Function const* F = M->getFunction(Sym);
+    if (F && !F->isDeclaration()) {
+      Syms.emplace_back(It.getKey(), std::move(Sym));
+    }
+  }
+  const auto Refs = getExternalRefs(*M);
+  addRebasedObjectToJIT(CU, emitObject(*TM, *M), Refs);
+  for (auto& S: Syms) {
+    CU.ProfiledSyms_[S.first] = std::move(S.second);
+  }
+  return true;
+}
+
+} // details
+} // dffi
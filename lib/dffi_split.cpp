@@ -0,0 +1,210 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Splitting of compilation units into one module per function. Given to the
+// JIT, each of these modules is only code generated the first time one of its
+// symbols is looked up.
+//
+// llvm::SplitModule isn't used because it assigns globals to a fixed number of
+// partitions (thus mixing unused functions with used ones), and clones a
+// declaration of every global of the original module in each partition.
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/EquivalenceClasses.h>
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+typedef SmallSetVector<GlobalValue*, 8> GlobalRefs;
+
+void collectGlobalRefs(Value* V, GlobalRefs& Refs, SmallPtrSetImpl<Constant*>& Visited)
+{
+  if (auto* GV = dyn_cast<GlobalValue>(V)) {
+    Refs.insert(GV);
+    return;
+  }
+  auto* C = dyn_cast<Constant>(V);
+  if (!C || !Visited.insert(C).second) {
+    return;
+  }
+  for (Value* Op: C->operands()) {
+    collectGlobalRefs(Op, Refs, Visited);
+  }
+}
+
+GlobalRefs getGlobalRefs(GlobalObject& GO)
+{
+  GlobalRefs Refs;
+  SmallPtrSet<Constant*, 16> Visited;
+  if (auto* F = dyn_cast<Function>(&GO)) {
+    if (F->hasPersonalityFn()) {
+      collectGlobalRefs(F->getPersonalityFn(), Refs, Visited);
+    }
+    for (Instruction& I: instructions(F)) {
+      for (Value* Op: I.operands()) {
+        collectGlobalRefs(Op, Refs, Visited);
+      }
+    }
+  }
+  else
+  if (auto* GV = dyn_cast<GlobalVariable>(&GO)) {
+    if (GV->hasInitializer()) {
+      collectGlobalRefs(GV->getInitializer(), Refs, Visited);
+    }
+  }
+  Refs.remove(&GO);
+  return Refs;
+}
+
+bool canSplit(Module& M)
+{
+  // Module level assembly can only be emitted once, aliases would need to be
+  // kept with their aliasee, and appending globals (llvm.used,
+  // llvm.global_ctors, ...) can't be split.
+  if (!M.getModuleInlineAsm().empty() || !M.alias_empty() || !M.ifunc_empty()) {
+    return false;
+  }
+  for (GlobalVariable const& GV: M.globals()) {
+    if (GV.hasAppendingLinkage()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+GlobalObject* createGlobal(Module& NewM, GlobalObject const& GO)
+{
+  if (auto const* F = dyn_cast<Function>(&GO)) {
+    auto* Ret = Function::Create(F->getFunctionType(), F->getLinkage(), F->getAddressSpace(), F->getName(), &NewM);
+    Ret->copyAttributesFrom(F);
+    return Ret;
+  }
+  auto const& GV = cast<GlobalVariable>(GO);
+  auto* Ret = new GlobalVariable{NewM, GV.getValueType(), GV.isConstant(), GV.getLinkage(),
+    nullptr, GV.getName(), nullptr, GV.getThreadLocalMode(), GV.getType()->getAddressSpace()};
+  Ret->copyAttributesFrom(&GV);
+  return Ret;
+}
+
+} // anonymous
+
+bool splitModule(Module& M, function_ref<void(std::unique_ptr<Module>)> Fn)
+{
+  if (!canSplit(M)) {
+    return false;
+  }
+
+  // A definition must stay in the same module than the local symbols it
+  // references, and than the other members of its comdat.
+  EquivalenceClasses<GlobalObject*> Groups;
+  DenseMap<GlobalObject*, GlobalRefs> Refs;
+  DenseMap<Comdat const*, GlobalObject*> Comdats;
+  for (GlobalObject& GO: M.global_objects()) {
+    if (GO.isDeclaration()) {
+      continue;
+    }
+    Groups.insert(&GO);
+    if (auto const* C = GO.getComdat()) {
+      auto It = Comdats.try_emplace(C, &GO);
+      Groups.unionSets(&GO, It.first->second);
+    }
+    auto& GORefs = Refs[&GO];
+    GORefs = getGlobalRefs(GO);
+    for (GlobalValue* Ref: GORefs) {
+      auto* RefGO = dyn_cast<GlobalObject>(Ref);
+      if (RefGO && RefGO->hasLocalLinkage() && !RefGO->isDeclaration()) {
+        Groups.unionSets(&GO, RefGO);
+      }
+    }
+  }
+
+  // Module flags (e.g. the PIC level or the size of wchar_t) apply to every
+  // partition
+  SmallVector<Module::ModuleFlagEntry, 8> Flags;
+  M.getModuleFlagsMetadata(Flags);
+
+  unsigned Idx = 0;
+  for (auto It = Groups.begin(), End = Groups.end(); It != End; ++It) {
+    if (!It->isLeader()) {
+      continue;
+    }
+    std::unique_ptr<Module> NewM(new Module{M.getModuleIdentifier() + "." + std::to_string(Idx++), M.getContext()});
+    NewM->setTargetTriple(M.getTargetTriple());
+    NewM->setDataLayout(M.getDataLayout());
+    for (auto const& Flag: Flags) {
+      NewM->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+    }
+
+    ValueToValueMapTy VMap;
+    SmallVector<GlobalObject*, 4> Defs;
+    for (auto MIt = Groups.member_begin(It); MIt != Groups.member_end(); ++MIt) {
+      GlobalObject* GO = *MIt;
+      auto* NewGO = createGlobal(*NewM, *GO);
+      if (auto const* C = GO->getComdat()) {
+        Comdat* NewC = NewM->getOrInsertComdat(C->getName());
+        NewC->setSelectionKind(C->getSelectionKind());
+        NewGO->setComdat(NewC);
+      }
+      VMap[GO] = NewGO;
+      Defs.push_back(GO);
+    }
+    // Referenced symbols defined elsewhere are only declared
+    for (GlobalObject* GO: Defs) {
+      for (GlobalValue* Ref: Refs[GO]) {
+        if (VMap.count(Ref)) {
+          continue;
+        }
+        auto* NewGO = createGlobal(*NewM, *cast<GlobalObject>(Ref));
+        NewGO->setLinkage(GlobalValue::ExternalLinkage);
+        NewGO->setComdat(nullptr);
+        VMap[Ref] = NewGO;
+      }
+    }
+
+    for (GlobalObject* GO: Defs) {
+      if (auto* F = dyn_cast<Function>(GO)) {
+        auto* NewF = cast<Function>(VMap[F]);
+        auto NewArgIt = NewF->arg_begin();
+        for (Argument& A: F->args()) {
+          NewArgIt->setName(A.getName());
+          VMap[&A] = &*(NewArgIt++);
+        }
+        SmallVector<ReturnInst*, 8> Returns;
+        CloneFunctionInto(NewF, F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+      }
+      else {
+        auto* GV = cast<GlobalVariable>(GO);
+        cast<GlobalVariable>(VMap[GV])->setInitializer(MapValue(GV->getInitializer(), VMap));
+      }
+    }
+    Fn(std::move(NewM));
+  }
+  return true;
+}
+
+} // details
+} // dffi
@@ -0,0 +1,392 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tiered compilation (see CCOpts::TierUpThreshold). Compilation units are
+// first compiled without optimizations, and each of their functions which can
+// be tiered is called through a stub:
+//
+//   @f.__dffi_slot = global @f.__dffi_count
+//   define @f(args) {
+//     %p = load atomic @f.__dffi_slot
+//     musttail call %p(args)
+//   }
+//   define internal @f.__dffi_count(args) {
+//     if (atomicrmw add @f.__dffi_calls, 1 == threshold-1)
+//       call @__dffi_tier_up(TieredFunc* f)
+//     musttail call @f.__dffi_tier0(args)
+//   }
+//
+// where @f.__dffi_tier0 is the unoptimized code of f. Once f is hot, it is
+// optimized from the unoptimized IR of the compilation unit, loaded in its
+// engine next to the unoptimized code (as a rebased module, see
+// rebaseModule), and its address is stored in the slot. Pointers to f (and
+// calls from the rest of the compilation unit) thus use the optimized code
+// from then on, and its calls aren't counted anymore.
+
+#include <atomic>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+const char* SlotSuffix = ".__dffi_slot";
+const char* Tier0Suffix = ".__dffi_tier0";
+const char* Tier1Suffix = ".__dffi_tier1";
+const char* CountSuffix = ".__dffi_count";
+const char* CallsSuffix = ".__dffi_calls";
+const char* TierUpSymbol = "__dffi_tier_up";
+
+// Called by the code of hot functions (see addCallCounter)
+void tierUpHook(TieredFunc* TF)
+{
+  TF->DFFI.tierUp(TF->shared_from_this());
+}
+
+// Makes the slot of a function (see createStub) first point to a function
+// counting its calls, which then calls its unoptimized code Tier0, and
+// tierUpHook once they reach Threshold.
+void addCallCounter(Function& Tier0, GlobalVariable& Slot, TieredFunc& TF, unsigned Threshold)
+{
+  Module& M = *Tier0.getParent();
+  LLVMContext& Ctx = M.getContext();
+  FunctionType* FTy = Tier0.getFunctionType();
+  auto* Count = Function::Create(FTy, GlobalValue::InternalLinkage, Tier0.getAddressSpace(), TF.Name + CountSuffix, &M);
+  Count->copyAttributesFrom(&Tier0);
+  Type* I64 = Type::getInt64Ty(Ctx);
+  auto* Calls = new GlobalVariable{M, I64, false, GlobalValue::InternalLinkage,
+    ConstantInt::get(I64, 0), TF.Name + CallsSuffix};
+  Type* I8Ptr = Type::getInt8PtrTy(Ctx);
+  FunctionCallee TierUp = M.getOrInsertFunction(TierUpSymbol, Type::getVoidTy(Ctx), I8Ptr);
+
+  auto* Hot = BasicBlock::Create(Ctx, "", Count);
+  auto* Call = BasicBlock::Create(Ctx, "", Count);
+  IRBuilder<> B(BasicBlock::Create(Ctx, "", Count, Hot));
+  auto* N = B.CreateAtomicRMW(AtomicRMWInst::Add, Calls, ConstantInt::get(I64, 1), MaybeAlign(8), AtomicOrdering::Monotonic);
+  B.CreateCondBr(B.CreateICmpEQ(N, ConstantInt::get(I64, Threshold-1)), Hot, Call);
+
+  // Tiered compilation units aren't stored in the on-disk cache, so that
+  // the address of TF can be part of the code.
+  B.SetInsertPoint(Hot);
+  Type* IntPtr = M.getDataLayout().getIntPtrType(Ctx);
+  B.CreateCall(TierUp, B.CreateIntToPtr(ConstantInt::get(IntPtr, (uint64_t)&TF), I8Ptr));
+  B.CreateBr(Call);
+
+  B.SetInsertPoint(Call);
+  SmallVector<Value*, 8> Args;
+  for (Argument& A: Count->args()) {
+    Args.push_back(&A);
+  }
+  CallInst* CI = B.CreateCall(FTy, &Tier0, Args);
+  CI->setCallingConv(Tier0.getCallingConv());
+  CI->setAttributes(Tier0.getAttributes());
+  CI->setTailCallKind(CallInst::TCK_MustTail);
+  if (FTy->getReturnType()->isVoidTy()) {
+    B.CreateRetVoid();
+  }
+  else {
+    B.CreateRet(CI);
+  }
+  Slot.setInitializer(Count);
+}
+
+} // anonymous
+
+std::string createStub(Function& F)
+{
+  Module& M = *F.getParent();
+  FunctionType* FTy = F.getFunctionType();
+  auto* Stub = Function::Create(FTy, F.getLinkage(), F.getAddressSpace(), "", &M);
+  Stub->copyAttributesFrom(&F);
+  F.replaceAllUsesWith(Stub);
+  Stub->takeName(&F);
+  F.setName(Stub->getName() + Tier0Suffix);
+  F.setLinkage(GlobalValue::InternalLinkage);
+
+  const Align PtrAlign = M.getDataLayout().getPointerABIAlignment(F.getAddressSpace());
+  auto* Slot = new GlobalVariable{M, F.getType(), false, GlobalValue::ExternalLinkage,
+    &F, Stub->getName() + SlotSuffix};
+  Slot->setAlignment(PtrAlign);
+
+  IRBuilder<> B(BasicBlock::Create(M.getContext(), "", Stub));
+  auto* Ptr = B.CreateAlignedLoad(F.getType(), Slot, PtrAlign);
+  Ptr->setAtomic(AtomicOrdering::Monotonic);
+  SmallVector<Value*, 8> Args;
+  for (Argument& A: Stub->args()) {
+    Args.push_back(&A);
+  }
+  CallInst* Call = B.CreateCall(FTy, Ptr, Args);
+  Call->setCallingConv(F.getCallingConv());
+  Call->setAttributes(F.getAttributes());
+  Call->setTailCallKind(CallInst::TCK_MustTail);
+  if (FTy->getReturnType()->isVoidTy()) {
+    B.CreateRetVoid();
+  }
+  else {
+    B.CreateRet(Call);
+  }
+  return Slot->getName().str();
+}
+
+void storeSlot(uint64_t SlotAddr, uint64_t Addr)
+{
+  static_assert(sizeof(std::atomic<void*>) == sizeof(void*), "slots can't be updated atomically");
+  reinterpret_cast<std::atomic<void*>*>(SlotAddr)->store((void*)Addr, std::memory_order_release);
+}
+
+void promoteStatics(Module& M, StringRef Prefix)
+{
+  for (GlobalVariable& GV: M.globals()) {
+    if (GV.hasLocalLinkage() && !GV.isConstant()) {
+      GV.setName(Prefix + GV.getName());
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+  }
+}
+
+void rebaseModule(Module& M, function_ref<bool(Function const&)> Keep, StringRef Suffix)
+{
+  for (GlobalAlias& GA: make_early_inc_range(M.aliases())) {
+    GA.replaceAllUsesWith(GA.getAliasee());
+    GA.eraseFromParent();
+  }
+  for (GlobalVariable& GV: make_early_inc_range(M.globals())) {
+    // Static constructors and the like have already been handled by the
+    // code of the compilation unit.
+    if (GV.hasAppendingLinkage()) {
+      GV.eraseFromParent();
+      continue;
+    }
+    // Local constants can be duplicated. Local variables have been made
+    // external (see promoteStatics).
+    if (GV.isDeclaration() || GV.hasLocalLinkage()) {
+      continue;
+    }
+    GV.setComdat(nullptr);
+    if (GV.isConstant() && !GV.isInterposable()) {
+      GV.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+    else {
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+  }
+  for (Function& F: M) {
+    if (F.isDeclaration() || F.hasLocalLinkage()) {
+      continue;
+    }
+    F.setComdat(nullptr);
+    if (Keep(F)) {
+      F.setName(F.getName() + Suffix);
+      F.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    else
+    if (F.isInterposable()) {
+      F.deleteBody();
+    }
+    else {
+      F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+  }
+}
+
+std::vector<std::string> getExternalRefs(Module const& M)
+{
+  std::vector<std::string> Ret;
+  for (GlobalValue const& GV: M.global_values()) {
+    auto const* F = dyn_cast<Function>(&GV);
+    if (GV.isDeclarationForLinker() && !(F && F->isIntrinsic())) {
+      Ret.push_back(GV.getName().str());
+    }
+  }
+  return Ret;
+}
+
+bool checkPassPipeline(StringRef Pipeline, std::string& Err)
+{
+  PassBuilder PB;
+  ModulePassManager MPM;
+  if (auto E = PB.parsePassPipeline(MPM, Pipeline)) {
+    Err = "invalid pass pipeline: " + toString(std::move(E));
+    return false;
+  }
+  return true;
+}
+
+void optimizeModule(Module& M, TargetMachine& TM, unsigned OptLevel, OptPhase Phase, StringRef Pipeline)
+{
+  // Same pipeline as clang at this level
+  PipelineTuningOptions PTO;
+  PTO.LoopVectorization = OptLevel > 1;
+  PTO.SLPVectorization = OptLevel > 1;
+  PassBuilder PB(&TM, PTO);
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  if (!Pipeline.empty()) {
+    // Checked by checkPassPipeline
+    ModulePassManager MPM;
+    if (auto E = PB.parsePassPipeline(MPM, Pipeline)) {
+      llvm::report_fatal_error(std::move(E));
+    }
+    MPM.run(M, MAM);
+    return;
+  }
+  if (OptLevel == 0) {
+    PB.buildO0DefaultPipeline(PassBuilder::OptimizationLevel::O0, Phase == OptPhase::LTOPreLink).run(M, MAM);
+    return;
+  }
+  auto Level = PassBuilder::OptimizationLevel::O2;
+  if (OptLevel == 1) {
+    Level = PassBuilder::OptimizationLevel::O1;
+  }
+  else
+  if (OptLevel >= 3) {
+    Level = PassBuilder::OptimizationLevel::O3;
+  }
+  switch (Phase) {
+    case OptPhase::PerModule:
+      PB.buildPerModuleDefaultPipeline(Level).run(M, MAM);
+      break;
+    case OptPhase::LTOPreLink:
+      PB.buildLTOPreLinkDefaultPipeline(Level).run(M, MAM);
+      break;
+    case OptPhase::LTO:
+      PB.buildLTODefaultPipeline(Level, nullptr).run(M, MAM);
+      break;
+  }
+}
+
+void DFFIImpl::addRebasedObjectToJIT(CUImpl& CU, std::unique_ptr<MemoryBuffer> Obj, ArrayRef<std::string> Refs)
+{
+  // The code of the compilation unit used by the object is loaded first, as
+  // the engine can't be finalized again while the object is (see
+  // getCUSymbolAddress).
+  for (auto const& Ref: Refs) {
+    auto It = SymbolOwners_.find(Ref);
+    if (It != SymbolOwners_.end() && It->second == &CU) {
+      getCUSymbolAddress(CU, Ref, false /* FunctionsOnly */);
+    }
+  }
+  addObjectToJIT(CU, std::move(Obj));
+}
+
+uint64_t getTiersSymbolAddress(StringRef Name)
+{
+  return Name == TierUpSymbol ? (uint64_t)&tierUpHook : 0;
+}
+
+void DFFIImpl::prepareTiers(CUImpl& CU, Module& M)
+{
+  // Module level assembly would be defined twice in the engine of the
+  // compilation unit.
+  if (!M.getModuleInlineAsm().empty() || !M.ifunc_empty()) {
+    return;
+  }
+
+  // Optimized code uses the variables of the unoptimized one, which have
+  // been made external (see promoteStatics).
+  auto IR = std::make_shared<std::string>();
+  raw_string_ostream OS(*IR);
+  WriteBitcodeToFile(M, OS);
+  OS.flush();
+  CU.TierIR_ = std::move(IR);
+
+  for (auto const& It: CU.FuncTys_) {
+    Function* F = M.getFunction(It.getKey());
+    if (!F || F->isDeclaration() || !F->hasExternalLinkage() || F->isVarArg()) {
+      continue;
+    }
+    auto TF = std::make_shared<TieredFunc>(*this, CU, It.getKey());
+    const std::string Slot = createStub(*F);
+    addCallCounter(*F, *M.getGlobalVariable(Slot), *TF, Opts_.TierUpThreshold);
+    CU.TieredFuncs_.try_emplace(It.getKey(), std::move(TF));
+  }
+}
+
+void DFFIImpl::tierUp(std::shared_ptr<TieredFunc> TF)
+{
+  addTask([this, TF]() {
+    {
+      // Don't delay the destruction of the FFI object
+      std::lock_guard<std::mutex> Lock(TasksMutex_);
+      if (StopWorkers_) {
+        return;
+      }
+    }
+    std::shared_ptr<std::string const> IR;
+    {
+      std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+      if (!TF->CU) {
+        return;
+      }
+      IR = TF->CU->TierIR_;
+    }
+
+    // The optimized code is generated in its own context, without the lock
+    // held.
+    LLVMContext Ctx;
+    auto MOrErr = parseBitcodeFile(MemoryBufferRef{*IR, TF->Name}, Ctx);
+    if (!MOrErr) {
+      llvm::report_fatal_error(MOrErr.takeError());
+    }
+    Module& M = **MOrErr;
+    Function* F = M.getFunction(TF->Name);
+    if (!F || F->isDeclaration()) {
+      return;
+    }
+    rebaseModule(M, [F](Function const& G) { return &G == F; }, Tier1Suffix);
+    auto TM = createTargetMachine();
+    M.setDataLayout(TM->createDataLayout());
+    optimizeModule(M, *TM, Opts_.OptLevel);
+    const auto Refs = getExternalRefs(M);
+    auto Obj = emitObject(*TM, M);
+
+    std::lock_guard<std::recursive_mutex> Lock(Mutex_);
+    CUImpl* CU = TF->CU;
+    if (!CU) {
+      return;
+    }
+    addRebasedObjectToJIT(*CU, std::move(Obj), Refs);
+    const uint64_t Addr = getCUSymbolAddress(*CU, TF->Name + Tier1Suffix, true /* FunctionsOnly */);
+    const uint64_t SlotAddr = getCUSymbolAddress(*CU, TF->Name + SlotSuffix, false /* FunctionsOnly */);
+    if (!Addr || !SlotAddr) {
+      return;
+    }
+    storeSlot(SlotAddr, Addr);
+  });
+}
+
+} // details
+} // dffi
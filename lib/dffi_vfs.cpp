@@ -0,0 +1,151 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "dffi_vfs.h"
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+IntrusiveRefCntPtr<vfs::OverlayFileSystem> createOverlay(IntrusiveRefCntPtr<vfs::InMemoryFileSystem> MemFS)
+{
+  IntrusiveRefCntPtr<vfs::OverlayFileSystem> FS(new vfs::OverlayFileSystem{vfs::getRealFileSystem()});
+  // Add an overleay with our in-memory file system on top of the system!
+  FS->pushOverlay(MemFS);
+  // Finally add clang's ressources
+  FS->pushOverlay(getClangResFileSystem());
+  return FS;
+}
+
+// Keeps the file system a file has been opened from alive, as in-memory
+// files reference their node in it (see DFFIFileSystem::removeFiles).
+struct RetainingFile: public vfs::File
+{
+  RetainingFile(std::unique_ptr<vfs::File> F, IntrusiveRefCntPtr<vfs::FileSystem> FS):
+    F_(std::move(F)),
+    FS_(std::move(FS))
+  { }
+
+  ErrorOr<vfs::Status> status() override { return F_->status(); }
+  ErrorOr<std::string> getName() override { return F_->getName(); }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> getBuffer(Twine const& Name, int64_t FileSize, bool RequiresNullTerminator, bool IsVolatile) override
+  {
+    return F_->getBuffer(Name, FileSize, RequiresNullTerminator, IsVolatile);
+  }
+  std::error_code close() override { return F_->close(); }
+
+private:
+  std::unique_ptr<vfs::File> F_;
+  IntrusiveRefCntPtr<vfs::FileSystem> FS_;
+};
+
+} // anonymous
+
+DFFIFileSystem::DFFIFileSystem():
+  MemFS_(new vfs::InMemoryFileSystem{}),
+  FS_(createOverlay(MemFS_))
+{ }
+
+DFFIFileSystem::~DFFIFileSystem()
+{ }
+
+bool DFFIFileSystem::addFile(Twine const& Path, time_t ModificationTime, std::unique_ptr<MemoryBuffer> Buffer)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  if (!MemFS_->addFileNoOwn(Path, ModificationTime, Buffer->getMemBufferRef())) {
+    return false;
+  }
+  // If the file already existed with the same content, MemFS_ still
+  // references the first buffer.
+  Files_.try_emplace(Path.str(), ModificationTime, std::move(Buffer));
+  return true;
+}
+
+void DFFIFileSystem::removeFiles(ArrayRef<std::string> Paths)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  bool Removed = false;
+  for (auto const& Path: Paths) {
+    Removed |= Files_.erase(Path);
+  }
+  if (!Removed) {
+    return;
+  }
+  auto CWD = FS_->getCurrentWorkingDirectory();
+  MemFS_ = new vfs::InMemoryFileSystem{};
+  for (auto const& F: Files_) {
+    MemFS_->addFileNoOwn(F.getKey(), F.second.first, F.second.second->getMemBufferRef());
+  }
+  FS_ = createOverlay(MemFS_);
+  if (CWD) {
+    FS_->setCurrentWorkingDirectory(*CWD);
+  }
+}
+
+ErrorOr<vfs::Status> DFFIFileSystem::status(Twine const& Path)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->status(Path);
+}
+
+ErrorOr<std::unique_ptr<vfs::File>> DFFIFileSystem::openFileForRead(Twine const& Path)
+{
+  // Opened files keep a reference on the in-memory buffer, which is never
+  // modified afterwards (see removeFiles). They can thus be read without
+  // holding the lock.
+  std::lock_guard<std::mutex> Guard(Lock_);
+  auto FileOrErr = FS_->openFileForRead(Path);
+  if (!FileOrErr) {
+    return FileOrErr.getError();
+  }
+  return std::unique_ptr<vfs::File>{new RetainingFile{std::move(*FileOrErr), FS_}};
+}
+
+vfs::directory_iterator DFFIFileSystem::dir_begin(Twine const& Dir, std::error_code& EC)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->dir_begin(Dir, EC);
+}
+
+ErrorOr<std::string> DFFIFileSystem::getCurrentWorkingDirectory() const
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->getCurrentWorkingDirectory();
+}
+
+std::error_code DFFIFileSystem::setCurrentWorkingDirectory(Twine const& Path)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->setCurrentWorkingDirectory(Path);
+}
+
+std::error_code DFFIFileSystem::getRealPath(Twine const& Path, SmallVectorImpl<char>& Output) const
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->getRealPath(Path, Output);
+}
+
+std::error_code DFFIFileSystem::isLocal(Twine const& Path, bool& Result)
+{
+  std::lock_guard<std::mutex> Guard(Lock_);
+  return FS_->isLocal(Path, Result);
+}
+
+} // details
+} // dffi
@@ -0,0 +1,67 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DFFI_VFS_H
+#define DFFI_VFS_H
+
+#include <memory>
+#include <mutex>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+namespace dffi {
+namespace details {
+
+// File system used by every clang instance of a DFFI object: compilation
+// units' sources are stored in memory, on top of clang's ressources and of
+// the real file system. Files can be added while other threads are reading
+// from it.
+// Virtual functions are defined in dffi_vfs.cpp, which is compiled with the
+// same RTTI settings as LLVM.
+struct DFFIFileSystem: public llvm::vfs::FileSystem
+{
+  DFFIFileSystem();
+  ~DFFIFileSystem() override;
+
+  bool addFile(llvm::Twine const& Path, time_t ModificationTime, std::unique_ptr<llvm::MemoryBuffer> Buffer);
+  // Removes files added by addFile. Buffers must be null terminated.
+  void removeFiles(llvm::ArrayRef<std::string> Paths);
+
+  llvm::ErrorOr<llvm::vfs::Status> status(llvm::Twine const& Path) override;
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(llvm::Twine const& Path) override;
+  llvm::vfs::directory_iterator dir_begin(llvm::Twine const& Dir, std::error_code& EC) override;
+  llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override;
+  std::error_code setCurrentWorkingDirectory(llvm::Twine const& Path) override;
+  std::error_code getRealPath(llvm::Twine const& Path, llvm::SmallVectorImpl<char>& Output) const override;
+  std::error_code isLocal(llvm::Twine const& Path, bool& Result) override;
+
+private:
+  mutable std::mutex Lock_;
+  // Contents of the in-memory files. InMemoryFileSystem does not support
+  // removing files, so that MemFS_ only references these buffers, and is
+  // built again from them when files are removed.
+  llvm::StringMap<std::pair<time_t, std::unique_ptr<llvm::MemoryBuffer>>> Files_;
+  llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> MemFS_;
+  llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> FS_;
+};
+
+} // details
+} // dffi
+
+#endif
@@ -0,0 +1,371 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generation of function wrappers directly as LLVM IR. This is only done for
+// function types whose ABI lowering is trivial (scalar arguments and return
+// value, C calling convention), which are passed "as is" in LLVM IR on every
+// supported target. Other function types go through the C wrappers compiled
+// by clang, which does the ABI lowering for us.
+//
+// Functions of compilation units with such types also get a direct wrapper
+// in their own module (see genDirectWrappers), which calls them directly
+// rather than through the function pointer given to the wrapper, and in
+// which small ones are inlined.
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Analysis/InlineCost.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <dffi/composite_type.h>
+#include <dffi/casting.h>
+#include <dffi/ctypes.h>
+#include "dffi_impl.h"
+
+using namespace llvm;
+
+namespace dffi {
+namespace details {
+
+namespace {
+
+// Maximum number of instructions of the functions inlined in their direct
+// wrapper (see genDirectWrappers).
+const unsigned DirectWrapperInlineThreshold = 64;
+
+struct ScalarTy
+{
+  llvm::Type* Ty = nullptr;
+  // Type used to load/store the value in memory (differs for booleans)
+  llvm::Type* MemTy = nullptr;
+  bool Signed = false;
+  bool IsBool = false;
+
+  operator bool() const { return Ty != nullptr; }
+};
+
+ScalarTy getScalarTy(LLVMContext& Ctx, dffi::Type const* Ty)
+{
+  ScalarTy Ret;
+  if (auto const* BTy = dffi::dyn_cast<BasicType>(Ty)) {
+    auto IntTy = [&](size_t Size, bool Signed) {
+      Ret.Ty = Ret.MemTy = IntegerType::get(Ctx, Size*8);
+      Ret.Signed = Signed;
+    };
+    switch (BTy->getBasicKind()) {
+      case BasicType::Bool:
+        Ret.Ty = llvm::Type::getInt1Ty(Ctx);
+        Ret.MemTy = IntegerType::get(Ctx, sizeof(c_bool)*8);
+        Ret.IsBool = true;
+        break;
+      case BasicType::Char:
+        IntTy(sizeof(c_char), std::is_signed<c_char>::value);
+        break;
+      case BasicType::SChar:
+        IntTy(sizeof(c_signed_char), true);
+        break;
+      case BasicType::UChar:
+        IntTy(sizeof(c_unsigned_char), false);
+        break;
+      case BasicType::Short:
+        IntTy(sizeof(c_short), true);
+        break;
+      case BasicType::UShort:
+        IntTy(sizeof(c_unsigned_short), false);
+        break;
+      case BasicType::Int:
+        IntTy(sizeof(c_int), true);
+        break;
+      case BasicType::UInt:
+        IntTy(sizeof(c_unsigned_int), false);
+        break;
+      case BasicType::Long:
+        IntTy(sizeof(c_long), true);
+        break;
+      case BasicType::ULong:
+        IntTy(sizeof(c_unsigned_long), false);
+        break;
+      case BasicType::LongLong:
+        IntTy(sizeof(c_long_long), true);
+        break;
+      case BasicType::ULongLong:
+        IntTy(sizeof(c_unsigned_long_long), false);
+        break;
+      case BasicType::Float:
+        Ret.Ty = Ret.MemTy = llvm::Type::getFloatTy(Ctx);
+        break;
+      case BasicType::Double:
+        Ret.Ty = Ret.MemTy = llvm::Type::getDoubleTy(Ctx);
+        break;
+      default:
+        // long double, int128 and complex types have target-specific ABIs.
+        break;
+    };
+    return Ret;
+  }
+  if (dffi::isa<dffi::PointerType>(Ty)) {
+    Ret.Ty = Ret.MemTy = llvm::Type::getInt8PtrTy(Ctx);
+    return Ret;
+  }
+  if (dffi::isa<EnumType>(Ty)) {
+    Ret.Ty = Ret.MemTy = IntegerType::get(Ctx, sizeof(EnumType::IntType)*8);
+    Ret.Signed = true;
+    return Ret;
+  }
+  return Ret;
+}
+
+// Integers smaller than int are extended by the caller, as clang does.
+Attribute::AttrKind getExtAttr(ScalarTy const& STy)
+{
+  auto* ITy = llvm::dyn_cast<IntegerType>(STy.Ty);
+  if (!ITy || ITy->getBitWidth() >= 32) {
+    return Attribute::None;
+  }
+  return STy.Signed ? Attribute::SExt : Attribute::ZExt;
+}
+
+Value* loadArg(IRBuilder<>& IRB, Value* Args, unsigned Idx, ScalarTy const& STy, unsigned Align)
+{
+  Value* ArgPtr = IRB.CreateConstInBoundsGEP1_32(IRB.getInt8PtrTy(), Args, Idx);
+  ArgPtr = IRB.CreateAlignedLoad(IRB.getInt8PtrTy(), ArgPtr, llvm::Align(alignof(void*)));
+  ArgPtr = IRB.CreateBitCast(ArgPtr, STy.MemTy->getPointerTo());
+  Value* V = IRB.CreateAlignedLoad(STy.MemTy, ArgPtr, llvm::Align(Align));
+  if (STy.IsBool) {
+    V = IRB.CreateTrunc(V, STy.Ty);
+  }
+  return V;
+}
+
+// Creates the wrapper Name of FTy in M. It calls Callee if it is set, and the
+// function pointer given to the wrapper otherwise. Returns null if FTy (or
+// the LLVM type of Callee) is not trivial to lower.
+Function* createWrapperIR(Module& M, Twine const& Name, FunctionType const* FTy, ArrayRef<Type const*> VarArgs, Function* Callee)
+{
+  if (FTy->getCC() != CC_C) {
+    return nullptr;
+  }
+  auto& Ctx = M.getContext();
+
+  ScalarTy RetTy;
+  if (auto const* Ty = FTy->getReturnType()) {
+    RetTy = getScalarTy(Ctx, Ty);
+    if (!RetTy) {
+      return nullptr;
+    }
+  }
+  SmallVector<ScalarTy, 8> ParamsTy;
+  SmallVector<llvm::Type*, 8> LLVMParamsTy;
+  auto const& Params = FTy->getParams();
+  ParamsTy.reserve(Params.size());
+  for (QualType P: Params) {
+    auto STy = getScalarTy(Ctx, P.getType());
+    if (!STy) {
+      return nullptr;
+    }
+    ParamsTy.push_back(STy);
+    LLVMParamsTy.push_back(STy.Ty);
+  }
+  SmallVector<ScalarTy, 4> VarArgsTy;
+  for (Type const* Ty: VarArgs) {
+    auto STy = getScalarTy(Ctx, Ty);
+    if (!STy) {
+      return nullptr;
+    }
+    VarArgsTy.push_back(STy);
+  }
+
+  auto* CalleeTy = llvm::FunctionType::get(RetTy ? RetTy.Ty : llvm::Type::getVoidTy(Ctx), LLVMParamsTy, FTy->hasVarArgs());
+  if (Callee) {
+    // Clang only differs from the type above by the pointee types of
+    // pointers, as the ABI lowering of FTy is trivial.
+    auto* Ty = Callee->getFunctionType();
+    auto Compatible = [](llvm::Type* A, llvm::Type* B) {
+      return A == B || (A->isPointerTy() && B->isPointerTy());
+    };
+    if (Ty->getNumParams() != CalleeTy->getNumParams() || Ty->isVarArg() != CalleeTy->isVarArg() ||
+        !Compatible(Ty->getReturnType(), CalleeTy->getReturnType())) {
+      return nullptr;
+    }
+    for (unsigned I = 0; I < Ty->getNumParams(); ++I) {
+      if (!Compatible(Ty->getParamType(I), CalleeTy->getParamType(I))) {
+        return nullptr;
+      }
+    }
+    CalleeTy = Ty;
+  }
+  auto* I8PtrTy = llvm::Type::getInt8PtrTy(Ctx);
+  auto* WrapperTy = llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), {I8PtrTy, I8PtrTy, I8PtrTy->getPointerTo()}, false);
+  auto* WF = Function::Create(WrapperTy, GlobalValue::ExternalLinkage, Name, &M);
+  auto ArgIt = WF->arg_begin();
+  Value* FPtr = &*(ArgIt++);
+  Value* RetPtr = &*(ArgIt++);
+  Value* Args = &*ArgIt;
+
+  IRBuilder<> IRB(BasicBlock::Create(Ctx, "entry", WF));
+  SmallVector<Value*, 8> CallArgs;
+  unsigned Idx = 0;
+  for (size_t I = 0; I < ParamsTy.size(); ++I, ++Idx) {
+    Value* V = loadArg(IRB, Args, Idx, ParamsTy[I], Params[I]->getAlign());
+    CallArgs.push_back(IRB.CreateBitCast(V, CalleeTy->getParamType(I)));
+  }
+  for (size_t I = 0; I < VarArgsTy.size(); ++I, ++Idx) {
+    // Default argument promotions
+    auto const& STy = VarArgsTy[I];
+    Value* V = loadArg(IRB, Args, Idx, STy, VarArgs[I]->getAlign());
+    if (V->getType()->isFloatTy()) {
+      V = IRB.CreateFPExt(V, IRB.getDoubleTy());
+    }
+    else
+    if (STy.IsBool) {
+      V = IRB.CreateZExt(V, IRB.getInt32Ty());
+    }
+    else
+    if (getExtAttr(STy) != Attribute::None) {
+      V = STy.Signed ? IRB.CreateSExt(V, IRB.getInt32Ty()) : IRB.CreateZExt(V, IRB.getInt32Ty());
+    }
+    CallArgs.push_back(V);
+  }
+
+  CallInst* Call;
+  if (Callee) {
+    Call = IRB.CreateCall(Callee, CallArgs);
+    Call->setAttributes(Callee->getAttributes());
+  }
+  else {
+    Value* Ptr = IRB.CreateBitCast(FPtr, CalleeTy->getPointerTo());
+    Call = IRB.CreateCall(CalleeTy, Ptr, CallArgs);
+    for (size_t I = 0; I < ParamsTy.size(); ++I) {
+      auto const& STy = ParamsTy[I];
+      if (STy.IsBool) {
+        Call->addParamAttr(I, Attribute::ZExt);
+      }
+      else {
+        const auto Ext = getExtAttr(STy);
+        if (Ext != Attribute::None) {
+          Call->addParamAttr(I, Ext);
+        }
+      }
+    }
+  }
+  if (RetTy) {
+    Value* V = IRB.CreateBitCast(Call, RetTy.Ty);
+    if (RetTy.IsBool) {
+      V = IRB.CreateZExt(V, RetTy.MemTy);
+    }
+    Value* Ptr = IRB.CreateBitCast(RetPtr, RetTy.MemTy->getPointerTo());
+    IRB.CreateAlignedStore(V, Ptr, llvm::Align(FTy->getReturnType()->getAlign()));
+  }
+  IRB.CreateRetVoid();
+  return WF;
+}
+
+} // anonymous
+
+bool DFFIImpl::genFuncTypeWrapperIR(Module& M, size_t WrapperIdx, FunctionType const* FTy, ArrayRef<Type const*> VarArgs)
+{
+  return createWrapperIR(M, getWrapperName(WrapperIdx), FTy, VarArgs, nullptr) != nullptr;
+}
+
+void DFFIImpl::genDirectWrappers(CUImpl& CU, Module& M)
+{
+  // InstCombine looks up module analyses through the proxy of the function
+  // analysis manager, which thus needs the other managers.
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  FunctionPassManager FPM;
+  FPM.addPass(SROA{});
+  FPM.addPass(EarlyCSEPass{});
+  FPM.addPass(InstCombinePass{});
+  FPM.addPass(SimplifyCFGPass{});
+
+  SmallString<128> Name;
+  for (auto const& It: CU.FuncTys_) {
+    Function* F = M.getFunction(It.getKey());
+    // Variadic functions are called through the wrappers of their variadic
+    // arguments.
+    if (!F || F->isDeclaration() || !F->hasExternalLinkage() || F->isVarArg()) {
+      continue;
+    }
+    Name.clear();
+    getFuncWrapperName(Name, It.getKey());
+    Function* WF = createWrapperIR(M, Name, It.second, None, F);
+    if (!WF) {
+      continue;
+    }
+    // The body of F might be inlined in its wrapper
+    for (const char* Attr: {"target-cpu", "target-features", "tune-cpu"}) {
+      if (F->hasFnAttribute(Attr)) {
+        WF->addFnAttr(F->getFnAttribute(Attr));
+      }
+    }
+    if (Opts_.OptLevel == 0 || F->hasFnAttribute(Attribute::NoInline) || F->hasFnAttribute(Attribute::OptimizeNone)) {
+      continue;
+    }
+    // Small functions are inlined in their wrapper, whose argument loads and
+    // return value store are then simplified with the body of the function.
+    if (F->getInstructionCount() > DirectWrapperInlineThreshold || !isInlineViable(*F).isSuccess()) {
+      continue;
+    }
+    bool Inlined = false;
+    for (Instruction& I: WF->getEntryBlock()) {
+      auto* Call = dyn_cast<CallBase>(&I);
+      if (Call && Call->getCalledFunction() == F) {
+        InlineFunctionInfo IFI;
+        Inlined = InlineFunction(*Call, IFI).isSuccess();
+        break;
+      }
+    }
+    if (Inlined) {
+      FPM.run(*WF, FAM);
+    }
+  }
+}
+
+std::unique_ptr<Module> DFFIImpl::createWrappersModule()
+{
+  std::stringstream ss;
+  ss << "/__dffi_private/wrappers_ir_" << CUIdx_++;
+  std::unique_ptr<Module> M(new Module{ss.str(), Ctx_});
+  M->setTargetTriple(Triple_);
+  M->setDataLayout(getWrappersEngine().getDataLayout());
+  return M;
+}
+
+void DFFIImpl::compileWrappersModule(std::unique_ptr<Module> M)
+{
+  if (M->empty()) {
+    return;
+  }
+  addWrappersToJIT(std::move(M));
+}
+
+} // details
+} // dffi
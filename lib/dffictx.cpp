@@ -72,3 +72,53 @@ FunctionType* details::DFFICtx::getFunctionType(DFFIImpl& Dffi, QualType RetTy,
   FunctionTys_.insert(Ret);
   return Ret;
 }
+
+void details::DFFICtx::purgeTypes(llvm::SmallPtrSetImpl<Type const*>& Dead)
+{
+  // Derived types can be used by other derived types (e.g. pointers to
+  // pointers): iterate until no more types are found.
+  bool Changed;
+  do {
+    Changed = false;
+    for (auto const& It: PointerTys_) {
+      if (Dead.count(It.first.getType())) {
+        Changed |= Dead.insert(It.second.get()).second;
+      }
+    }
+    for (ArrayType* ATy: ArrayTys_) {
+      if (Dead.count(ATy->getElementType())) {
+        Changed |= Dead.insert(ATy).second;
+      }
+    }
+    for (FunctionType* FTy: FunctionTys_) {
+      bool Uses = Dead.count(FTy->getReturnType());
+      for (QualType PTy: FTy->getParams()) {
+        Uses |= Dead.count(PTy.getType()) > 0;
+      }
+      if (Uses) {
+        Changed |= Dead.insert(FTy).second;
+      }
+    }
+  } while (Changed);
+
+  for (auto It = PointerTys_.begin(), End = PointerTys_.end(); It != End;) {
+    auto Cur = It++;
+    if (Dead.count(Cur->second.get())) {
+      PointerTys_.erase(Cur);
+    }
+  }
+  for (auto It = ArrayTys_.begin(), End = ArrayTys_.end(); It != End;) {
+    ArrayType* ATy = *(It++);
+    if (Dead.count(ATy)) {
+      ArrayTys_.erase(ATy);
+      delete ATy;
+    }
+  }
+  for (auto It = FunctionTys_.begin(), End = FunctionTys_.end(); It != End;) {
+    FunctionType* FTy = *(It++);
+    if (Dead.count(FTy)) {
+      FunctionTys_.erase(FTy);
+      delete FTy;
+    }
+  }
+}
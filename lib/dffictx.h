@@ -23,6 +23,7 @@
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ADT/SmallVector.h>
@@ -204,6 +205,11 @@ struct DFFICtx
   FunctionType* getFunctionType(DFFIImpl& Dffi, QualType RetTy, llvm::ArrayRef<QualType> ParamsTy, CallingConv CC, bool VarArgs, bool UseLastError);
   ArrayType* getArrayType(DFFIImpl& Dffi, QualType EltTy, uint64_t NElements);
 
+  // Frees the pointer, array and function types which use one of the Dead
+  // types (e.g. the composite types of a compilation unit being released),
+  // and adds them to Dead.
+  void purgeTypes(llvm::SmallPtrSetImpl<Type const*>& Dead);
+
 private:
   std::map<BasicType::BasicKind, BasicType> BasicTys_;
   llvm::DenseMap<QualType, std::unique_ptr<PointerType>> PointerTys_;
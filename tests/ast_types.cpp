@@ -0,0 +1,163 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: "%build_dir/ast_types%exeext"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+struct __attribute__((packed)) P {
+  char c;
+  int32_t i;
+};
+
+struct __attribute__((aligned(16))) Al {
+  char c;
+};
+
+struct S {
+  int32_t a;
+  union { short b; char c; };
+  struct P p;
+  struct Al al;
+};
+
+struct BF {
+  int a: 8;
+  int b: 3;
+  int c: 21;
+  int d: 32;
+  int e;
+};
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  auto CU = Jit.compile(R"(
+#include <stdint.h>
+struct __attribute__((packed)) P { char c; int32_t i; };
+int32_t get_i(struct P const* p) { return p->i; }
+)", Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Types and functions of cdefs are imported from the AST
+  auto CUDecls = Jit.cdef(R"(
+#include <stdint.h>
+struct __attribute__((packed)) P { char c; int32_t i; };
+struct __attribute__((aligned(16))) Al { char c; };
+struct S {
+  int32_t a;
+  union { short b; char c; };
+  struct P p;
+  struct Al al;
+};
+struct Outer { struct Inner { int x; } in; };
+struct Flex { int n; char data[]; };
+enum E { E_A = 1, E_B = -4 };
+struct BF { int a: 8; int b: 3; int c: 21; int d: 32; int e; };
+typedef struct S MyS;
+int32_t get_i(struct P const* p);
+)", nullptr, Err);
+  if (!CUDecls) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  auto* STy = dffi::dyn_cast_or_null<StructType>(CUDecls.getType("MyS"));
+  if (!STy || STy != CUDecls.getStructType("S")) {
+    std::cerr << "invalid type MyS!" << std::endl;
+    return 1;
+  }
+  if (STy->getSize() != sizeof(S) || STy->getAlign() != alignof(S)) {
+    std::cerr << "invalid layout for struct S!" << std::endl;
+    return 1;
+  }
+  if (!STy->getField("b") || STy->getField("b")->getOffset() != offsetof(S, b) ||
+      STy->getField("p")->getOffset() != offsetof(S, p) ||
+      STy->getField("al")->getOffset() != offsetof(S, al)) {
+    std::cerr << "invalid fields for struct S!" << std::endl;
+    return 1;
+  }
+
+  auto* PTy = CUDecls.getStructType("P");
+  if (!PTy || PTy->getSize() != sizeof(P) || PTy->getAlign() != alignof(P) ||
+      PTy->getField("i")->getOffset() != offsetof(P, i)) {
+    std::cerr << "invalid layout for struct P!" << std::endl;
+    return 1;
+  }
+
+  auto* InnerTy = CUDecls.getStructType("Inner");
+  if (!InnerTy || InnerTy->getField("x") == nullptr) {
+    std::cerr << "invalid struct Inner!" << std::endl;
+    return 1;
+  }
+
+  auto* FlexTy = CUDecls.getStructType("Flex");
+  if (!FlexTy || FlexTy->getSize() != sizeof(int)) {
+    std::cerr << "invalid struct Flex!" << std::endl;
+    return 1;
+  }
+
+  auto* ETy = CUDecls.getEnumType("E");
+  if (!ETy || ETy->getFields().at("E_A") != 1 || ETy->getFields().at("E_B") != -4) {
+    std::cerr << "invalid enum E!" << std::endl;
+    return 1;
+  }
+
+  // Bitfields which don't span whole bytes of their type can't be accessed
+  auto* BFTy = CUDecls.getStructType("BF");
+  if (!BFTy || BFTy->getSize() != sizeof(BF) || BFTy->getField("a") ||
+      BFTy->getField("b") || BFTy->getField("c") ||
+      !BFTy->getField("d") || BFTy->getField("d")->getOffset() != 4 ||
+      BFTy->getField("e")->getOffset() != offsetof(BF, e)) {
+    std::cerr << "invalid struct BF!" << std::endl;
+    return 1;
+  }
+
+  // Fields whose type isn't supported are reported
+  if (Jit.cdef("struct Half { int a; __fp16 h; };", nullptr, Err) ||
+      Err.find("'h'") == std::string::npos) {
+    std::cerr << "unsupported field not reported!" << std::endl;
+    return 1;
+  }
+
+  P p;
+  p.c = 1;
+  p.i = 42;
+  void* Ptr = &p;
+  void* Args[] = {&Ptr};
+  int32_t Ret;
+  CUDecls.getFunction("get_i").call(&Ret, Args);
+  if (Ret != 42) {
+    std::cerr << "invalid result: " << Ret << std::endl;
+    return 1;
+  }
+  return 0;
+}
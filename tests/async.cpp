@@ -0,0 +1,102 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/async%exeext"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main(int argc, char** argv)
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.Concurrency = 2;
+
+  DFFI Jit(Opts);
+
+  std::vector<std::future<CompileResult>> Futs;
+  for (int I = 0; I < 4; ++I) {
+    const std::string Code = "int add_" + std::to_string(I) + "(int a, int b) { return a+b+" + std::to_string(I) + "; }";
+    Futs.emplace_back(Jit.compileAsync(Code.c_str()));
+  }
+  auto FutDef = Jit.cdefAsync("struct A { int a; char b; };\nint get(struct A* a);", "/async_cdef.h");
+  auto FutErr = Jit.compileAsync("int a(;");
+
+  for (int I = 0; I < 4; ++I) {
+    auto R = Futs[I].get();
+    if (!R.CU) {
+      std::cerr << "Compile error: " << R.Err << std::endl;
+      return 1;
+    }
+    int a = 1, b = 2, Ret;
+    void* Args[] = {&a, &b};
+    const std::string Name = "add_" + std::to_string(I);
+    R.CU.getFunction(Name.c_str()).call(&Ret, Args);
+    if (Ret != 3 + I) {
+      std::cerr << "invalid result for " << Name << ": " << Ret << std::endl;
+      return 1;
+    }
+  }
+
+  auto RDef = FutDef.get();
+  if (!RDef.CU || !RDef.CU.getStructType("A")) {
+    std::cerr << "invalid cdef: " << RDef.Err << std::endl;
+    return 1;
+  }
+
+  auto RErr = FutErr.get();
+  if (RErr.CU || RErr.Err.empty()) {
+    std::cerr << "compilation should have failed!" << std::endl;
+    return 1;
+  }
+
+  // Options of the compilation units are also given to the workers
+  CompileOpts FastMath;
+  FastMath.FastMath = true;
+  auto RFast = Jit.compileAsync("int fast_math(void) { return __FAST_MATH__; }", FastMath).get();
+  if (!RFast.CU) {
+    std::cerr << "unable to compile with fast-math: " << RFast.Err << std::endl;
+    return 1;
+  }
+  int Fast = 0;
+  RFast.CU.getFunction("fast_math").call(&Fast, nullptr);
+  if (Fast != 1) {
+    std::cerr << "invalid fast-math!" << std::endl;
+    return 1;
+  }
+
+  // The callback of an asynchronous compilation can destroy the FFI object
+  // it comes from (which can't join the worker running it).
+  std::promise<bool> Destroyed;
+  auto* OwnedJit = new DFFI(Opts);
+  OwnedJit->compileAsync("int f(int a) { return a; }", [&](CompileResult R) {
+    const bool Valid = (bool)R.CU;
+    delete OwnedJit;
+    Destroyed.set_value(Valid);
+  });
+  if (!Destroyed.get_future().get()) {
+    std::cerr << "invalid compilation before destruction!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
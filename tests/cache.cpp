@@ -0,0 +1,114 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: rm -rf "%t"
+// RUN: "%build_dir/cache%exeext" "%t"
+// RUN: ls -i "%t" > "%t.entries"
+// RUN: "%build_dir/cache%exeext" "%t"
+// A cache miss would replace the entry by a new file (see storeCachedCU)
+// RUN: ls -i "%t" | diff "%t.entries" -
+
+#include <iostream>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+static int test(const char* CacheDir)
+{
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CacheDir = CacheDir;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  auto CU = Jit.compile(R"(
+#include <stdint.h>
+struct A {
+  int32_t a;
+  union { short b; char c; };
+};
+typedef struct A MyA;
+int32_t get(MyA const* A) { return A->a + A->b; }
+)", Err);
+  if (!CU) {
+    std::cerr << "Compile error: " << Err << std::endl;
+    return 1;
+  }
+
+  auto* STy = CU.getStructType("A");
+  if (!STy || CU.getType("MyA") != STy) {
+    std::cerr << "invalid types!" << std::endl;
+    return 1;
+  }
+  if (!STy->getField("b") || !STy->getField("c")) {
+    std::cerr << "anonymous members should be inlined!" << std::endl;
+    return 1;
+  }
+
+  struct { int32_t a; short b; } A = {2, 4};
+  void* Ptr = &A;
+  void* Args[] = {&Ptr};
+  int32_t Ret;
+  CU.getFunction("get").call(&Ret, Args);
+  if (Ret != 6) {
+    std::cerr << "invalid result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // The same code can be loaded twice, and each copy has its own shared
+  // variables.
+  CompileOpts Share;
+  Share.ShareStatics = true;
+  const char* StateCode = "static int counter; int bump(void) { return ++counter; }";
+  auto State0 = Jit.compile(StateCode, Share, Err);
+  auto State1 = Jit.compile(StateCode, Share, Err);
+  if (!State0 || !State1) {
+    std::cerr << "Compile error: " << Err << std::endl;
+    return 1;
+  }
+  auto Use1 = Jit.compile("int get_counter(void) { return counter; }", {State1}, Err);
+  if (!Use1) {
+    std::cerr << "Compile error: " << Err << std::endl;
+    return 1;
+  }
+  int Counter;
+  State1.getFunction("bump").call(&Counter, nullptr);
+  State1.getFunction("bump").call(&Counter, nullptr);
+  State0.getFunction("bump").call(&Counter, nullptr);
+  State0.release();
+  Use1.getFunction("get_counter").call(&Counter, nullptr);
+  if (Counter != 2) {
+    std::cerr << "invalid counter: " << Counter << " (expected 2)" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " cache_dir" << std::endl;
+    return 1;
+  }
+  DFFI::initialize();
+
+  // The first call populates the cache (if it is empty), and the second one
+  // must reuse it.
+  if (test(argv[1])) {
+    return 1;
+  }
+  return test(argv[1]);
+}
@@ -0,0 +1,132 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/compile_imports%exeext"
+
+#include <iostream>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  auto CUDecls = Jit.cdef(R"(
+#include <stdint.h>
+struct A { int32_t a; short b; };
+typedef struct { int x; } B;
+static inline int helper(int a) { return a+1; }
+int twice(int a) { return a*2; }
+)", nullptr, Err);
+  if (!CUDecls) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Declarations and types of CUDecls are visible, without including
+  // anything.
+  auto CU = Jit.compile(R"(
+int sum(struct A const* a, B const* b) { return helper(twice(a->a)) + a->b + b->x; }
+)", {CUDecls}, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  auto* ATy = CUDecls.getStructType("A");
+  if (!ATy || CU.getStructType("A") != ATy || CU.getType("B") != CUDecls.getType("B")) {
+    std::cerr << "imported types must be reused!" << std::endl;
+    return 1;
+  }
+  auto SumFunc = CU.getFunction("sum");
+  if (!SumFunc) {
+    std::cerr << "missing function sum!" << std::endl;
+    return 1;
+  }
+  auto const* SumTy = SumFunc.getType();
+  auto const* PTy = dffi::dyn_cast<PointerType>(SumTy->getParams()[0].getType());
+  auto const* BPTy = dffi::dyn_cast<PointerType>(SumTy->getParams()[1].getType());
+  if (!PTy || PTy->getPointee().getType() != ATy ||
+      !BPTy || BPTy->getPointee().getType() != CUDecls.getType("B")) {
+    std::cerr << "invalid parameter types for sum!" << std::endl;
+    return 1;
+  }
+
+  struct { int32_t a; short b; } A = {4, 2};
+  struct { int x; } B = {10};
+  void* APtr = &A;
+  void* BPtr = &B;
+  void* Args[] = {&APtr, &BPtr};
+  int Ret;
+  SumFunc.call(&Ret, Args);
+  if (Ret != 21) {
+    std::cerr << "invalid sum result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // The precompiled source of CUDecls is reused
+  CU = Jit.compile("int get_x(B const* b) { return twice(b->x); }", {CUDecls}, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  void* GetArgs[] = {&BPtr};
+  CU.getFunction("get_x").call(&Ret, GetArgs);
+  if (Ret != 20) {
+    std::cerr << "invalid get_x result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // Static variables of the imported compilation units are shared with them
+  // if asked for, and copied otherwise.
+  const char* StateCode = R"(
+static int counter;
+static int step = 1;
+static int next(void) { static int calls; ++calls; return counter += step; }
+int get_counter(void) { return counter; }
+)";
+  for (bool Share: {true, false}) {
+    CompileOpts StateOpts;
+    StateOpts.ShareStatics = Share;
+    auto CUState = Jit.compile(StateCode, StateOpts, Err);
+    if (!CUState) {
+      std::cerr << Err << std::endl;
+      return 1;
+    }
+    CU = Jit.compile("int bump(void) { step = 2; return next(); }", {CUState}, Err);
+    if (!CU) {
+      std::cerr << Err << std::endl;
+      return 1;
+    }
+    CU.getFunction("bump").call(&Ret, nullptr);
+    CU.getFunction("bump").call(&Ret, nullptr);
+    int Counter;
+    CUState.getFunction("get_counter").call(&Counter, nullptr);
+    const int Expected = Share ? 4 : 0;
+    if (Ret != 4 || Counter != Expected) {
+      std::cerr << "invalid counter: " << Ret << " " << Counter << " (expected " << Expected << ")" << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
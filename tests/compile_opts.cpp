@@ -0,0 +1,153 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/compile_opts%exeext"
+
+#include <iostream>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* CodeFastMath = R"(
+int fast_math() {
+#ifdef __FAST_MATH__
+  return 1;
+#else
+  return 0;
+#endif
+}
+)";
+
+static const char* CodeSum = R"(
+int sum(int const* p, int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += p[i];
+  }
+  return s;
+}
+)";
+
+static int fastMath(DFFI& Jit, CompileOpts const& Opts)
+{
+  std::string Err;
+  auto CU = Jit.compile(CodeFastMath, Opts, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return -1;
+  }
+  int Ret = -1;
+  CU.getFunction("fast_math").call(&Ret, nullptr);
+  return Ret;
+}
+
+static int sum(DFFI& Jit, CompileOpts const& Opts)
+{
+  std::string Err;
+  auto CU = Jit.compile(CodeSum, Opts, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return -1;
+  }
+  int Data[103];
+  for (int I = 0; I < 103; ++I) {
+    Data[I] = I;
+  }
+  int* P = Data;
+  int N = 103;
+  void* Args[] = {&P, &N};
+  int Ret = -1;
+  CU.getFunction("sum").call(&Ret, Args);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  DFFI Jit(Opts);
+
+  // Options only apply to the compilation unit they are given to
+  CompileOpts FastMath;
+  FastMath.FastMath = true;
+  if (fastMath(Jit, FastMath) != 1 || fastMath(Jit, CompileOpts{}) != 0) {
+    std::cerr << "invalid fast-math!" << std::endl;
+    return 1;
+  }
+
+  // Precompiled headers and sources are built again with the language
+  // options of the compilation unit.
+  std::string Err;
+  auto Lib = Jit.compile("static int twice(int a) { return a*2; }\nint lib(int a) { return twice(a); }", Err);
+  if (!Lib) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto CU = Jit.compile(CodeFastMath, {Lib}, FastMath, Err);
+  if (!CU || !CU.getFunction("fast_math")) {
+    std::cerr << "unable to compile with imports and fast-math: " << Err << std::endl;
+    return 1;
+  }
+  if (!CU.extend("int ext_fast_math(void) { return lib(__FAST_MATH__); }", Err)) {
+    std::cerr << "unable to extend with fast-math: " << Err << std::endl;
+    return 1;
+  }
+  int Ret = -1;
+  CU.getFunction("ext_fast_math").call(&Ret, nullptr);
+  if (Ret != 2) {
+    std::cerr << "invalid fast-math in extension!" << std::endl;
+    return 1;
+  }
+  if (!Jit.precompileHeaders("#include <stdint.h>\n", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (fastMath(Jit, FastMath) != 1 || fastMath(Jit, CompileOpts{}) != 0) {
+    std::cerr << "invalid fast-math with precompiled headers!" << std::endl;
+    return 1;
+  }
+
+  CompileOpts Loops;
+  Loops.VectorizeWidth = 8;
+  Loops.InterleaveCount = 2;
+  Loops.UnrollCount = 4;
+  if (sum(Jit, Loops) != 5253) {
+    std::cerr << "invalid result with loop hints!" << std::endl;
+    return 1;
+  }
+  CompileOpts NoLoops;
+  NoLoops.VectorizeWidth = 1;
+  NoLoops.UnrollCount = 1;
+  if (sum(Jit, NoLoops) != 5253) {
+    std::cerr << "invalid result without loop transformations!" << std::endl;
+    return 1;
+  }
+
+  CompileOpts Pipeline;
+  Pipeline.PassPipeline = "function(sroa,instcombine),default<O3>";
+  if (sum(Jit, Pipeline) != 5253) {
+    std::cerr << "invalid result with pipeline!" << std::endl;
+    return 1;
+  }
+  Pipeline.PassPipeline = "not-a-pass";
+  if (Jit.compile(CodeSum, Pipeline, Err)) {
+    std::cerr << "compiled with an invalid pipeline!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: rm -rf "%t" && mkdir -p "%t"
+// RUN: "%build_dir/decls_only%exeext" "%t"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+static int test(CDefMode Mode, std::string const& SysHeader)
+{
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CDef = Mode;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  auto CUDef = Jit.compile("int get42() { return 42; }", Err);
+  if (!CUDef) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Only declarations: functions are resolved from the process and the
+  // other compilation units. The available externally definition of get42
+  // isn't added to the JIT, and the one of CUDef is used.
+  auto CU = Jit.cdef(R"(
+#include <stdlib.h>
+struct A { int a; short b; };
+extern inline __attribute__((gnu_inline)) int get42(void) { return 0; }
+)", nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (!CU.getStructType("A")) {
+    std::cerr << "missing struct A!" << std::endl;
+    return 1;
+  }
+
+  int Ret;
+  CU.getFunction("get42").call(&Ret, nullptr);
+  if (Ret != 42) {
+    std::cerr << "invalid get42 result: " << Ret << std::endl;
+    return 1;
+  }
+
+  const char* Str = "12";
+  void* Args[] = {&Str};
+  CU.getFunction("atoi").call(&Ret, Args);
+  if (Ret != 12) {
+    std::cerr << "invalid atoi result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // Static inline functions of system headers can only be called if code is
+  // generated.
+  const std::string Include = "#include \"" + SysHeader + "\"\n";
+  CU = Jit.cdef((Include + "int get42(void);").c_str(), nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  int A = 4;
+  void* TwiceArgs[] = {&A};
+  auto SysTwice = CU.getFunction("sys_twice");
+  if (Mode != CDefMode::Full) {
+    if (SysTwice) {
+      std::cerr << "sys_twice has no code!" << std::endl;
+      return 1;
+    }
+  }
+  else {
+    SysTwice.call(&Ret, TwiceArgs);
+    if (Ret != 8) {
+      std::cerr << "invalid sys_twice result: " << Ret << std::endl;
+      return 1;
+    }
+  }
+
+  if (Mode == CDefMode::DeclsOnly) {
+    return 0;
+  }
+
+  CU = Jit.cdef((Include + "int thrice(int a) { return a*3; }").c_str(), nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CU.getFunction("sys_twice").call(&Ret, TwiceArgs);
+  if (Ret != 8) {
+    std::cerr << "invalid sys_twice result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // Definitions are compiled
+  CU = Jit.cdef(R"(
+int twice(int a) { return a*2; }
+)", nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CU.getFunction("twice").call(&Ret, TwiceArgs);
+  if (Ret != 8) {
+    std::cerr << "invalid twice result: " << Ret << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " tmp_dir" << std::endl;
+    return 1;
+  }
+  DFFI::initialize();
+
+  const std::string SysHeader = std::string{argv[1]} + "/sys.h";
+  {
+    std::ofstream OS(SysHeader);
+    OS << "#pragma GCC system_header\nstatic inline int sys_twice(int a) { return a*2; }\n";
+    if (!OS.good()) {
+      std::cerr << "unable to write " << SysHeader << std::endl;
+      return 1;
+    }
+  }
+
+  for (auto Mode: {CDefMode::Auto, CDefMode::Full, CDefMode::DeclsOnly}) {
+    if (test(Mode, SysHeader)) {
+      return 1;
+    }
+  }
+  return 0;
+}
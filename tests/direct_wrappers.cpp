@@ -0,0 +1,126 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/direct_wrappers%exeext"
+
+#include <iostream>
+#include <tuple>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+#include <stdbool.h>
+static int calls;
+int add(int a, int b) { ++calls; return a+b; }
+short neg(short a) { return -a; }
+bool is_zero(unsigned char c) { return c == 0; }
+const char* skip(const char* s, int n) { return s+n; }
+double scale(float a, double b) { return a*b; }
+void count() { ++calls; }
+int get_calls() { return calls; }
+struct S { int a; };
+struct S make_s(int a) { struct S s = {a}; return s; }
+)";
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Functions with a trivial ABI have their own wrapper
+  auto Add = CU.getFunction("add");
+  void* FPtr;
+  FunctionType const* FTy;
+  std::tie(FPtr, FTy) = CU.getFunctionAddressAndTy("add");
+  auto AddByType = CU.getFunction(FPtr, FTy);
+  if (Add.getFuncCodePtr() != FPtr || Add.getTrampPtr() == AddByType.getTrampPtr()) {
+    std::cerr << "no direct wrapper for add!" << std::endl;
+    return 1;
+  }
+
+  int A = 1, B = 2, IRet = 0;
+  void* AddArgs[] = {&A, &B};
+  Add.call(&IRet, AddArgs);
+  if (IRet != 3) {
+    std::cerr << "invalid add result!" << std::endl;
+    return 1;
+  }
+
+  short S = 4, SRet = 0;
+  void* NegArgs[] = {&S};
+  CU.getFunction("neg").call(&SRet, NegArgs);
+  if (SRet != -4) {
+    std::cerr << "invalid neg result!" << std::endl;
+    return 1;
+  }
+
+  unsigned char C = 0;
+  bool BRet = false;
+  void* IsZeroArgs[] = {&C};
+  CU.getFunction("is_zero").call(&BRet, IsZeroArgs);
+  if (!BRet) {
+    std::cerr << "invalid is_zero result!" << std::endl;
+    return 1;
+  }
+
+  const char* Str = "hello";
+  const char* PRet = nullptr;
+  int N = 2;
+  void* SkipArgs[] = {&Str, &N};
+  CU.getFunction("skip").call(&PRet, SkipArgs);
+  if (PRet != Str+2) {
+    std::cerr << "invalid skip result!" << std::endl;
+    return 1;
+  }
+
+  float F = 1.5f;
+  double D = 2., DRet = 0.;
+  void* ScaleArgs[] = {&F, &D};
+  CU.getFunction("scale").call(&DRet, ScaleArgs);
+  if (DRet != 3.) {
+    std::cerr << "invalid scale result!" << std::endl;
+    return 1;
+  }
+
+  // Inlined functions still use the state of the compilation unit
+  CU.getFunction("count").call();
+  CU.getFunction("get_calls").call(&IRet, nullptr);
+  if (IRet != 2) {
+    std::cerr << "invalid number of calls!" << std::endl;
+    return 1;
+  }
+
+  // Others use the wrapper of their type
+  int SA = 5;
+  int SRet2 = 0;
+  void* MakeArgs[] = {&SA};
+  CU.getFunction("make_s").call(&SRet2, MakeArgs);
+  if (SRet2 != 5) {
+    std::cerr << "invalid make_s result!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
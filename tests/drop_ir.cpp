@@ -0,0 +1,96 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/drop_ir%exeext"
+
+#include <iostream>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.DropIR = true;
+
+  DFFI Jit(Opts);
+
+  // Types are created from debug info before it is freed
+  std::string Err;
+  auto CU = Jit.compile(R"(
+struct A { int a; short b; };
+typedef struct { int x; } B;
+struct A init_A(int a, short b) { struct A ret = {a, b}; return ret; }
+int get_x(B const* b) { return b->x; }
+int get42() { return 42; }
+)", Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto* ATy = CU.getStructType("A");
+  auto* BTy = dffi::dyn_cast_or_null<StructType>(CU.getType("B"));
+  if (!ATy || !ATy->getField("b") || !BTy || !BTy->getField("x")) {
+    std::cerr << "missing types!" << std::endl;
+    return 1;
+  }
+
+  struct { int a; short b; } A;
+  int a = 4;
+  short b = 2;
+  void* InitArgs[] = {&a, &b};
+  CU.getFunction("init_A").call(&A, InitArgs);
+  if (A.a != 4 || A.b != 2) {
+    std::cerr << "invalid init_A result!" << std::endl;
+    return 1;
+  }
+
+  // The IR of wrappers is generated again, both for the ones compiled by
+  // clang and the ones generated as LLVM IR.
+  for (const char* Name: {"init_A", "get_x"}) {
+    FunctionType const* FTy;
+    std::tie(std::ignore, FTy) = CU.getFunctionAddressAndTy(Name);
+    const std::string IR = FTy->getWrapperLLVMStr("wrap");
+    if (IR.find("@wrap(") == std::string::npos) {
+      std::cerr << "invalid wrapper IR for " << Name << ": " << IR << std::endl;
+      return 1;
+    }
+  }
+
+  // Code of other compilation units is still resolved through their symbols
+  auto CUDecls = Jit.cdef(R"(
+int get42(void);
+int twice(int a) { return a*2; }
+)", nullptr, Err);
+  if (!CUDecls) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (!CUDecls.extend("int get84(void) { return twice(get42()); }", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  int Ret;
+  CUDecls.getFunction("get84").call(&Ret, nullptr);
+  if (Ret != 84) {
+    std::cerr << "invalid get84 result: " << Ret << std::endl;
+    return 1;
+  }
+  return 0;
+}
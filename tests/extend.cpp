@@ -0,0 +1,112 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/extend%exeext"
+
+#include <iostream>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  auto CU = Jit.cdef(R"(
+#include <stdlib.h>
+struct A { int a; short b; };
+typedef struct { int x; } B;
+int twice(int a) { return a*2; }
+)", nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto* ATy = CU.getStructType("A");
+  auto const* BTy = CU.getType("B");
+
+  // Everything CU declares is visible to the new code
+  if (!CU.extend(R"(
+struct C { struct A a; B b; };
+int sum(struct C const* c) { return twice(c->a.a) + c->a.b + c->b.x + atoi("1"); }
+)", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto* CTy = CU.getStructType("C");
+  if (!CTy || CU.getStructType("A") != ATy || CU.getType("B") != BTy ||
+      CTy->getField("a")->getType() != ATy || CTy->getField("b")->getType() != BTy) {
+    std::cerr << "existing types must be reused!" << std::endl;
+    return 1;
+  }
+
+  struct { struct { int a; short b; } a; struct { int x; } b; } C = {{4, 2}, {10}};
+  void* Ptr = &C;
+  void* Args[] = {&Ptr};
+  int Ret;
+  CU.getFunction("sum").call(&Ret, Args);
+  if (Ret != 21) {
+    std::cerr << "invalid sum result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // And so are the previous extensions
+  if (!CU.extend("int sum_twice(struct C const* c) { return twice(sum(c)); }", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CU.getFunction("sum_twice").call(&Ret, Args);
+  if (Ret != 42) {
+    std::cerr << "invalid sum_twice result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // Static variables of the previous extensions are shared with the new code
+  CompileOpts ShareStatics;
+  ShareStatics.ShareStatics = true;
+  CU = Jit.cdef("#include <stdlib.h>", nullptr, ShareStatics, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (!CU.extend("static int counter; static int step = 1; int bump(void) { return counter += step; }", Err) ||
+      !CU.extend("int bump_twice(void) { step = 2; counter += 1; return bump(); }", Err) ||
+      !CU.extend("int get_counter(void) { return counter; }", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CU.getFunction("bump").call(&Ret, nullptr);
+  CU.getFunction("bump_twice").call(&Ret, nullptr);
+  CU.getFunction("bump").call(&Ret, nullptr);
+  int Counter;
+  CU.getFunction("get_counter").call(&Counter, nullptr);
+  if (Ret != 6 || Counter != 6) {
+    std::cerr << "invalid counter: " << Ret << " " << Counter << " (expected 6)" << std::endl;
+    return 1;
+  }
+
+  if (CU.extend("int invalid(struct D* d) { return d->x; }", Err)) {
+    std::cerr << "invalid code must not compile!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/isa_variants%exeext"
+
+#include <iostream>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+static int calls;
+// Cloned with the variants of dot
+__attribute__((noinline)) static void count_call(void) { ++calls; }
+int dot(int const* a, int const* b, int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += a[i]*b[i];
+  }
+  count_call();
+  return s;
+}
+int get_calls() { return calls; }
+void* dot_ptr() { return (void*)&dot; }
+)";
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.ISAVariants = {"x86-64-v2", "x86-64-v3", "x86-64-v4"};
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Whatever the variant selected for the host, results and the state of
+  // the compilation unit are the same.
+  int A[1000];
+  int B[1000];
+  int Expected = 0;
+  for (int I = 0; I < 1000; ++I) {
+    A[I] = I;
+    B[I] = 1000-I;
+    Expected += A[I]*B[I];
+  }
+  int* PA = A;
+  int* PB = B;
+  int N = 1000;
+  void* Args[] = {&PA, &PB, &N};
+  auto Dot = CU.getFunction("dot");
+  for (int I = 0; I < 10; ++I) {
+    int Ret = 0;
+    Dot.call(&Ret, Args);
+    if (Ret != Expected) {
+      std::cerr << "invalid dot product: " << Ret << " instead of " << Expected << std::endl;
+      return 1;
+    }
+  }
+  int Calls = 0;
+  CU.getFunction("get_calls").call(&Calls, nullptr);
+  if (Calls != 10) {
+    std::cerr << "invalid number of calls: " << Calls << std::endl;
+    return 1;
+  }
+
+  // The variant is resolved once
+  if (std::get<0>(CU.getFunctionAddressAndTy("dot")) != Dot.getFuncCodePtr()) {
+    std::cerr << "variant resolved twice!" << std::endl;
+    return 1;
+  }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  // Every x86-64-v2 CPU supports these features. The code of the
+  // compilation unit itself still uses the baseline function.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+    void* BasePtr = nullptr;
+    CU.getFunction("dot_ptr").call(&BasePtr, nullptr);
+    if (BasePtr == Dot.getFuncCodePtr()) {
+      std::cerr << "no variant selected!" << std::endl;
+      return 1;
+    }
+  }
+#endif
+
+  // Unknown CPUs are reported as compilation errors
+  CCOpts BadOpts;
+  BadOpts.OptLevel = 2;
+  BadOpts.ISAVariants = {"x86-64-v3", "not-a-cpu"};
+  DFFI BadJit(BadOpts);
+  if (BadJit.compile(Code, Err)) {
+    std::cerr << "compiled with an unknown ISA variant!" << std::endl;
+    return 1;
+  }
+  if (Err.find("not-a-cpu") == std::string::npos) {
+    std::cerr << "unexpected error: " << Err << std::endl;
+    return 1;
+  }
+  return 0;
+}
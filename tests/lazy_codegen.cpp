@@ -0,0 +1,89 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: "%build_dir/lazy_codegen%exeext"
+
+#include <iostream>
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static int callInt(CompilationUnit& CU, const char* Name, int A)
+{
+  int Ret = -1;
+  void* Args[] = {&A};
+  auto F = CU.getFunction(Name);
+  if (!F) {
+    std::cerr << Name << " isn't available!" << std::endl;
+    return -1;
+  }
+  F.call(&Ret, Args);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 0;
+
+  DFFI Jit(Opts);
+
+  // Functions are code generated on demand: they must still see the global
+  // variables, static functions and string literals they reference. Only
+  // the ones which are used are generated: the JIT would abort on the
+  // unresolved reference of use_missing otherwise.
+  std::string Err;
+  auto CU = Jit.compile(R"(
+#include <string.h>
+int counter = 10;
+static int inc(int a) { return a+1; }
+static int dec(int a) { return a-1; }
+static int (*ops[])(int) = {inc, dec};
+static inline int unused(int a) { return a*3; }
+int apply(int i) { return ops[i](counter); }
+int bump(int a) { counter += a; return counter + (int)strlen("abc"); }
+int __dffi_test_missing(int a);
+int use_missing(int a) { return __dffi_test_missing(a); }
+)", Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (callInt(CU, "apply", 0) != 11 || callInt(CU, "apply", 1) != 9) {
+    std::cerr << "invalid result for apply!" << std::endl;
+    return 1;
+  }
+  if (callInt(CU, "bump", 5) != 18 || callInt(CU, "apply", 0) != 16) {
+    std::cerr << "invalid result for bump!" << std::endl;
+    return 1;
+  }
+
+  // Functions of a previous compilation unit are generated when another one
+  // references them.
+  auto CU2 = Jit.compile(R"(
+int bump(int a);
+int twice(int a) { bump(a); return bump(a); }
+)", Err);
+  if (!CU2) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (callInt(CU2, "twice", 1) != 20) {
+    std::cerr << "invalid result for twice!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: "%build_dir/lazy_types%exeext"
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  // A long chain of structures referencing each others through pointers,
+  // and a structure used both through a pointer and by value.
+  const unsigned N = 2000;
+  std::stringstream ss;
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "struct L" << I << ";\n";
+  }
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "struct L" << I << " { struct L" << (I+1)%N << "* next; int v; };\n";
+  }
+  ss << R"(
+struct B { char c; double d; };
+struct A { struct B* p; struct B b; };
+typedef struct A MyA;
+int get(struct L0 const* l) { return l->next->v; }
+)";
+
+  std::string Err;
+  auto CU = Jit.cdef(ss.str().c_str(), nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // Unused types are listed even if they haven't been created yet
+  auto Types = CU.getTypes();
+  for (const char* Name: {"A", "B", "MyA", "L1000"}) {
+    if (std::find(Types.begin(), Types.end(), Name) == Types.end()) {
+      std::cerr << Name << " isn't listed!" << std::endl;
+      return 1;
+    }
+  }
+
+  auto* ATy = dffi::dyn_cast_or_null<StructType>(CU.getType("MyA"));
+  if (!ATy || ATy != CU.getStructType("A")) {
+    std::cerr << "invalid type MyA!" << std::endl;
+    return 1;
+  }
+  struct B { char c; double d; };
+  struct A { B* p; B b; };
+  if (ATy->getSize() != sizeof(A) || ATy->getAlign() != alignof(A) || ATy->getField("b")->getOffset() != offsetof(A, b)) {
+    std::cerr << "invalid layout for struct A!" << std::endl;
+    return 1;
+  }
+
+  // The AST of a cdef is freed once enough newer ones have been compiled,
+  // and its types are then all created.
+  for (unsigned I = 0; I < 8; ++I) {
+    const std::string Code = "struct C" + std::to_string(I) + " { int a; };";
+    if (!Jit.cdef(Code.c_str(), nullptr, Err)) {
+      std::cerr << Err << std::endl;
+      return 1;
+    }
+  }
+
+  auto* LTy = CU.getStructType("L1999");
+  if (!LTy || LTy->isOpaque()) {
+    std::cerr << "invalid struct L1999!" << std::endl;
+    return 1;
+  }
+  auto* NextTy = dffi::dyn_cast<PointerType>(LTy->getField("next")->getType());
+  if (!NextTy || NextTy->getPointee().getType() != CU.getStructType("L0")) {
+    std::cerr << "invalid L1999::next!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/lto%exeext"
+
+#include <iostream>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* CodeSquare = R"(
+static int calls;
+int square(int x) {
+  ++calls;
+  return x * x;
+}
+int get_calls() { return calls; }
+)";
+
+static const char* CodeSum = R"(
+int square(int x);
+int sum_squares(int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += square(i);
+  }
+  return s;
+}
+)";
+
+static const char* CodeCube = R"(
+int square(int x);
+int cube(int x) { return square(x) * x; }
+)";
+
+static int callInt(NativeFunc const& F, int A)
+{
+  int Ret = -1;
+  void* Args[] = {&A};
+  F.call(&Ret, Args);
+  return Ret;
+}
+
+static int callGetCalls(CompilationUnit& CU)
+{
+  int Ret = -1;
+  CU.getFunction("get_calls").call(&Ret, nullptr);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.LTO = true;
+
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CUSquare = Jit.compile(CodeSquare, Err);
+  auto CUSum = Jit.compile(CodeSum, Err);
+  if (!CUSquare || !CUSum) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto Sum = CUSum.getFunction("sum_squares");
+  if (!Sum) {
+    std::cerr << "missing function!" << std::endl;
+    return 1;
+  }
+  if (callInt(Sum, 10) != 285 || callGetCalls(CUSquare) != 10) {
+    std::cerr << "invalid result before link!" << std::endl;
+    return 1;
+  }
+
+  if (!Jit.linkCompilationUnits(Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  // Functions keep their address, and use the variables of their
+  // compilation unit.
+  if (CUSum.getFunction("sum_squares").getFuncCodePtr() != Sum.getFuncCodePtr()) {
+    std::cerr << "function address changed!" << std::endl;
+    return 1;
+  }
+  if (callInt(Sum, 10) != 285 || callGetCalls(CUSquare) != 20) {
+    std::cerr << "invalid result after link!" << std::endl;
+    return 1;
+  }
+
+  // Compilation units compiled since are linked with the others by the next
+  // link, which frees the code of the previous one.
+  auto CUCube = Jit.compile(CodeCube, Err);
+  if (!CUCube) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (!Jit.linkCompilationUnits(Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (callInt(CUCube.getFunction("cube"), 3) != 27 || callInt(Sum, 10) != 285 ||
+      callGetCalls(CUSquare) != 31) {
+    std::cerr << "invalid result after second link!" << std::endl;
+    return 1;
+  }
+  CUCube.release();
+  if (!Jit.linkCompilationUnits(Err) || callInt(Sum, 4) != 14) {
+    std::cerr << "invalid result after release!" << std::endl;
+    return 1;
+  }
+
+  // Compilation units defining the same function can't be linked together
+  auto CUSquare2 = Jit.compile("int square(int x) { return x; }", Err);
+  if (!CUSquare2) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (Jit.linkCompilationUnits(Err)) {
+    std::cerr << "linked conflicting compilation units!" << std::endl;
+    return 1;
+  }
+  if (callInt(Sum, 10) != 285) {
+    std::cerr << "invalid result after failed link!" << std::endl;
+    return 1;
+  }
+  // The conflicting one is excluded from the next links
+  if (!Jit.linkCompilationUnits(Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (callInt(Sum, 10) != 285 || callInt(CUSquare2.getFunction("square"), 3) != 3) {
+    std::cerr << "invalid result after link without the conflicting unit!" << std::endl;
+    return 1;
+  }
+
+  // Compilation units can't be linked without CCOpts::LTO
+  CCOpts NoLTOOpts;
+  NoLTOOpts.OptLevel = 2;
+  DFFI NoLTOJit(NoLTOOpts);
+  if (NoLTOJit.linkCompilationUnits(Err)) {
+    std::cerr << "linked without LTO!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
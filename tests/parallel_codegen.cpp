@@ -0,0 +1,80 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// RUN: "%build_dir/parallel_codegen%exeext"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static std::string genCode(unsigned CUIdx, unsigned N)
+{
+  // Every compilation unit defines the same static functions, which must stay
+  // local to each of them.
+  std::stringstream ss;
+  ss << "static int base = " << CUIdx*1000 << ";\n";
+  for (unsigned I = 0; I < N; ++I) {
+    ss << "static int helper" << I << "(int a) { return a + base + " << I << "; }\n";
+    ss << "int func" << CUIdx << "_" << I << "(int a) { return helper" << I << "(a); }\n";
+  }
+  return ss.str();
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 0;
+  Opts.CodeGenThreads = 4;
+  // Compilation units are also compiled concurrently, so that target
+  // machines are created by several threads at once.
+  Opts.Concurrency = 2;
+
+  DFFI Jit(Opts);
+
+  const unsigned N = 64;
+  std::vector<std::future<CompileResult>> Futs;
+  for (unsigned CUIdx = 0; CUIdx < 2; ++CUIdx) {
+    Futs.emplace_back(Jit.compileAsync(genCode(CUIdx, N).c_str()));
+  }
+  for (unsigned CUIdx = 0; CUIdx < 2; ++CUIdx) {
+    auto R = Futs[CUIdx].get();
+    auto& CU = R.CU;
+    if (!CU) {
+      std::cerr << R.Err << std::endl;
+      return 1;
+    }
+    for (unsigned I = 0; I < N; ++I) {
+      const std::string Name = "func" + std::to_string(CUIdx) + "_" + std::to_string(I);
+      auto F = CU.getFunction(Name.c_str());
+      if (!F) {
+        std::cerr << Name << " isn't available!" << std::endl;
+        return 1;
+      }
+      int A = 1;
+      void* Args[] = {&A};
+      int Ret;
+      F.call(&Ret, Args);
+      if (Ret != (int)(1 + CUIdx*1000 + I)) {
+        std::cerr << "invalid result for " << Name << ": " << Ret << std::endl;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
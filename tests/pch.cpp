@@ -0,0 +1,93 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/pch%exeext"
+
+#include <iostream>
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  std::string Err;
+  if (Jit.precompileHeaders("struct A { int a; ", Err)) {
+    std::cerr << "invalid header precompiled!" << std::endl;
+    return 1;
+  }
+
+  if (!Jit.precompileHeaders(R"(
+#include <stdlib.h>
+struct A { int a; short b; };
+)", Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+
+  // struct A and atoi come from the precompiled header
+  auto CU = Jit.cdef(R"(
+#include <stdlib.h>
+static int get(struct A const* a) { return a->a + a->b; }
+int sum(struct A const* a, const char* s) { return get(a) + atoi(s); }
+)", nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto* ATy = CU.getStructType("A");
+  if (!ATy || !ATy->getField("b")) {
+    std::cerr << "missing struct A!" << std::endl;
+    return 1;
+  }
+
+  struct A { int a; short b; } Obj{40, 1};
+  void* Ptr = &Obj;
+  const char* Str = "1";
+  void* Args[] = {&Ptr, &Str};
+  int Ret;
+  CU.getFunction("sum").call(&Ret, Args);
+  if (Ret != 42) {
+    std::cerr << "invalid sum result: " << Ret << std::endl;
+    return 1;
+  }
+
+  Args[0] = &Str;
+  CU.getFunction("atoi").call(&Ret, Args);
+  if (Ret != 1) {
+    std::cerr << "invalid atoi result: " << Ret << std::endl;
+    return 1;
+  }
+
+  // Compilation units still work without declarations
+  CU = Jit.compile("int get42() { return 42; }", Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CU.getFunction("get42").call(&Ret, nullptr);
+  if (Ret != 42) {
+    std::cerr << "invalid get42 result: " << Ret << std::endl;
+    return 1;
+  }
+  return 0;
+}
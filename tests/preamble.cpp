@@ -0,0 +1,104 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: rm -rf "%t" && mkdir -p "%t"
+// RUN: "%build_dir/preamble%exeext" "%t"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static bool writeHeader(std::string const& Path, int Value)
+{
+  std::ofstream OS(Path);
+  OS << "#include <stdlib.h>\n#define VALUE " << Value << "\n";
+  return OS.good();
+}
+
+static int check(DFFI& Jit, std::string const& Prologue, const char* Func, const char* Code, int Expected)
+{
+  std::string Err;
+  auto CU = Jit.cdef((Prologue + Code).c_str(), nullptr, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  int Ret;
+  CU.getFunction(Func).call(&Ret, nullptr);
+  if (Ret != Expected) {
+    std::cerr << "invalid result: " << Ret << " (expected " << Expected << ")" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " tmp_dir" << std::endl;
+    return 1;
+  }
+  DFFI::initialize();
+
+  const std::string Header = std::string{argv[1]} + "/value.h";
+  if (!writeHeader(Header, 1)) {
+    std::cerr << "unable to write " << Header << std::endl;
+    return 1;
+  }
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  DFFI Jit(Opts);
+
+  const std::string Prologue = "#include <stdio.h>\n#include \"" + Header + "\"\n";
+  if (check(Jit, Prologue, "get1", "int get1() { return VALUE; }", 1)) {
+    return 1;
+  }
+
+  // The header is rewritten with the same size and modification time, so
+  // that only a reused preamble still sees the previous value: the second
+  // and third compilation units must reuse the preamble of the first one.
+  struct stat St;
+  if (stat(Header.c_str(), &St) != 0 || !writeHeader(Header, 7)) {
+    std::cerr << "unable to write " << Header << std::endl;
+    return 1;
+  }
+  const struct timespec Times[2] = {St.st_atim, St.st_mtim};
+  if (utimensat(AT_FDCWD, Header.c_str(), Times, 0) != 0) {
+    std::cerr << "unable to set the modification time of " << Header << std::endl;
+    return 1;
+  }
+  if (check(Jit, Prologue, "get2", "int get2() { return VALUE+1; }", 2) ||
+      check(Jit, Prologue, "get3", "int get3() { return atoi(\"3\"); }", 3)) {
+    return 1;
+  }
+
+  // The preamble is rebuilt once the header changed
+  if (!writeHeader(Header, 42)) {
+    std::cerr << "unable to write " << Header << std::endl;
+    return 1;
+  }
+  if (check(Jit, Prologue, "get4", "int get4() { return VALUE; }", 42)) {
+    return 1;
+  }
+
+  // Code without preamble
+  return check(Jit, std::string{}, "get5", "int get5() { return 5; }", 5);
+}
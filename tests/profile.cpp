@@ -0,0 +1,131 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/profile%exeext"
+
+#include <iostream>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+static int calls;
+static int classify(int i) {
+  if (i % 64 == 0) {
+    return -1;
+  }
+  return i & 3;
+}
+int sum(int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += classify(i);
+  }
+  ++calls;
+  return s;
+}
+int get_calls() { return calls; }
+)";
+
+static int callInt(NativeFunc const& F, int A)
+{
+  int Ret = -1;
+  void* Args[] = {&A};
+  F.call(&Ret, Args);
+  return Ret;
+}
+
+static int callGetCalls(CompilationUnit& CU)
+{
+  int Ret = -1;
+  CU.getFunction("get_calls").call(&Ret, nullptr);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.ProfileInstr = true;
+
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto Sum = CU.getFunction("sum");
+  if (!Sum) {
+    std::cerr << "missing function!" << std::endl;
+    return 1;
+  }
+  for (int I = 0; I < 1000; ++I) {
+    if (callInt(Sum, 128) != 190) {
+      std::cerr << "invalid instrumented result!" << std::endl;
+      return 1;
+    }
+  }
+
+  // Fails if the new code doesn't use the profile (i.e. has no function
+  // entry counts)
+  if (!CU.recompileWithProfile(Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto SumPGO = CU.getFunction("sum");
+  if (!SumPGO || SumPGO.getFuncCodePtr() == Sum.getFuncCodePtr()) {
+    std::cerr << "function hasn't been recompiled!" << std::endl;
+    return 1;
+  }
+
+  // Both versions share the state of the compilation unit
+  if (callInt(SumPGO, 128) != 190 || callInt(Sum, 128) != 190) {
+    std::cerr << "invalid result after recompilation!" << std::endl;
+    return 1;
+  }
+  if (callGetCalls(CU) != 1002) {
+    std::cerr << "invalid number of calls!" << std::endl;
+    return 1;
+  }
+
+  // The profile keeps being collected by the instrumented code
+  if (!CU.recompileWithProfile(Err)) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (callInt(CU.getFunction("sum"), 128) != 190 || callGetCalls(CU) != 1003) {
+    std::cerr << "invalid result after second recompilation!" << std::endl;
+    return 1;
+  }
+
+  // Compilation units which aren't instrumented can't be recompiled
+  CCOpts NoInstrOpts;
+  NoInstrOpts.OptLevel = 2;
+  DFFI NoInstrJit(NoInstrOpts);
+  auto CU2 = NoInstrJit.compile(Code, Err);
+  if (!CU2) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  if (CU2.recompileWithProfile(Err)) {
+    std::cerr << "recompiled a compilation unit without profile!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
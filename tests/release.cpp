@@ -0,0 +1,187 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/release%exeext"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace dffi;
+
+// Resident memory of the process, in bytes. Returns 0 if unknown.
+static size_t getRSS()
+{
+#ifdef __linux__
+  FILE* F = fopen("/proc/self/statm", "r");
+  if (!F) {
+    return 0;
+  }
+  long Pages = 0, Resident = 0;
+  const int N = fscanf(F, "%ld %ld", &Pages, &Resident);
+  fclose(F);
+  if (N != 2) {
+    return 0;
+  }
+  return Resident * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+static int callInt(CompilationUnit& CU, const char* Name, int A)
+{
+  int Ret = -1;
+  void* Args[] = {&A};
+  auto F = CU.getFunction(Name);
+  if (!F) {
+    std::cerr << Name << " isn't available!" << std::endl;
+    return -1;
+  }
+  F.call(&Ret, Args);
+  return Ret;
+}
+
+// Compiles, calls and releases a kernel, always with the same name. If
+// StructSig is set, its type uses a structure of its compilation unit, and
+// thus needs a wrapper of its own.
+static bool cycle(DFFI& Jit, int I, bool StructSig)
+{
+  std::string Err;
+  const std::string Code = "struct S { int v; };\n" + std::string{StructSig ?
+    "struct S kernel(struct S s) { s.v += " + std::to_string(I) + "; return s; }" :
+    "int kernel(int a) { struct S s = {a}; return s.v + " + std::to_string(I) + "; }"};
+  auto CU = Jit.compile(Code.c_str(), Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return false;
+  }
+  int Ret = -1;
+  if (StructSig) {
+    struct { int v; } S = {1}, SRet = {-1};
+    void* Args[] = {&S};
+    CU.getFunction("kernel").call(&SRet, Args);
+    Ret = SRet.v;
+  }
+  else {
+    Ret = callInt(CU, "kernel", 1);
+  }
+  if (Ret != I+1) {
+    std::cerr << "invalid result for kernel " << I << "!" << std::endl;
+    return false;
+  }
+  CU.release();
+  return !CU;
+}
+
+// Runs N cycles after a warm up, and returns the growth of the resident
+// memory, or -1 on error.
+static long cycles(DFFI& Jit, int N, bool StructSig)
+{
+  int I = 0;
+  for (; I < 200; ++I) {
+    if (!cycle(Jit, I, StructSig)) {
+      return -1;
+    }
+  }
+  const size_t Start = getRSS();
+  for (; I < 200 + N; ++I) {
+    if (!cycle(Jit, I, StructSig)) {
+      return -1;
+    }
+  }
+  const size_t End = getRSS();
+  return End > Start ? End - Start : 0;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+
+  DFFI Jit(Opts);
+
+  // The memory used by released compilation units is given back, so that
+  // the footprint stays bounded across many compile/release cycles. A
+  // compilation unit which isn't freed takes tens of kilobytes.
+  const long Growth = cycles(Jit, 2800, false);
+  if (Growth < 0) {
+    return 1;
+  }
+  if (getRSS() && Growth > 8*1024*1024) {
+    std::cerr << "memory grows across releases: +" << Growth << " bytes" << std::endl;
+    return 1;
+  }
+
+  // Only the wrappers of the function types using the types of released
+  // compilation units are kept (see CompilationUnit::release).
+  const long WrappersGrowth = cycles(Jit, 1000, true);
+  if (WrappersGrowth < 0) {
+    return 1;
+  }
+  if (getRSS() && WrappersGrowth > 16*1024*1024) {
+    std::cerr << "memory grows across releases with distinct signatures: +" << WrappersGrowth << " bytes" << std::endl;
+    return 1;
+  }
+
+  // Released compilation units that are imported are only freed with their
+  // importers.
+  std::string Err;
+  auto CUBase = Jit.compile("struct A { int v; }; int get_v(struct A const* a) { return a->v; }", Err);
+  if (!CUBase) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto* ATy = CUBase.getStructType("A");
+  auto CUUse = Jit.compile("int get_v2(int v) { struct A a = {v}; return get_v(&a)*2; }", {CUBase}, Err);
+  if (!CUUse) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  CUBase.release();
+  if (CUUse.getStructType("A") != ATy || callInt(CUUse, "get_v2", 21) != 42) {
+    std::cerr << "imported compilation unit has been freed!" << std::endl;
+    return 1;
+  }
+  CUUse.release();
+
+#ifndef _WIN32
+  // The name of a released compilation unit can be used again
+  for (int V: {1, 2}) {
+    const std::string Code = "struct N { int f" + std::to_string(V) + "; };";
+    auto CU = Jit.cdef(Code.c_str(), "/release/named.h", Err);
+    if (!CU) {
+      std::cerr << Err << std::endl;
+      return 1;
+    }
+    auto* NTy = CU.getStructType("N");
+    if (!NTy || !NTy->getField(("f" + std::to_string(V)).c_str())) {
+      std::cerr << "invalid struct N!" << std::endl;
+      return 1;
+    }
+    CU.release();
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/target_cpu%exeext"
+
+#include <iostream>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+int has_avx2() {
+#ifdef __AVX2__
+  return 1;
+#else
+  return 0;
+#endif
+}
+int dot(int const* a, int const* b, int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += a[i]*b[i];
+  }
+  return s;
+}
+)";
+
+static int hasAVX2(CCOpts const& Opts)
+{
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return -1;
+  }
+  int Ret = -1;
+  CU.getFunction("has_avx2").call(&Ret, nullptr);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  // Code generated for the host runs on it
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.CPU = "native";
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  int A[1000];
+  int B[1000];
+  int Expected = 0;
+  for (int I = 0; I < 1000; ++I) {
+    A[I] = I;
+    B[I] = 1000-I;
+    Expected += A[I]*B[I];
+  }
+  int* PA = A;
+  int* PB = B;
+  int N = 1000;
+  void* Args[] = {&PA, &PB, &N};
+  int Ret = 0;
+  CU.getFunction("dot").call(&Ret, Args);
+  if (Ret != Expected) {
+    std::cerr << "invalid dot product: " << Ret << " instead of " << Expected << std::endl;
+    return 1;
+  }
+
+#if defined(__x86_64__) || defined(_M_X64)
+  // Features are seen by clang
+  CCOpts AVX2Opts;
+  AVX2Opts.OptLevel = 2;
+  AVX2Opts.CPU = "x86-64";
+  AVX2Opts.TargetFeatures = {"+avx2"};
+  CCOpts NoAVX2Opts = AVX2Opts;
+  NoAVX2Opts.TargetFeatures = {"-avx2"};
+  if (hasAVX2(AVX2Opts) != 1 || hasAVX2(NoAVX2Opts) != 0) {
+    std::cerr << "target features not applied!" << std::endl;
+    return 1;
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/threads%exeext"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dffi/dffi.h>
+#include <dffi/composite_type.h>
+
+using namespace dffi;
+
+int main(int argc, char** argv)
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.Concurrency = 4;
+
+  DFFI Jit(Opts);
+
+  std::atomic<int> Errors{0};
+  std::vector<std::thread> Threads;
+  for (int T = 0; T < 8; ++T) {
+    Threads.emplace_back([&Jit, &Errors, T]() {
+      for (int I = 0; I < 4; ++I) {
+        const int Val = T*100 + I;
+        const std::string Code =
+          "struct S { int a; short b; };\n"
+          "int get_" + std::to_string(T) + "_" + std::to_string(I) + "(struct S const* s, int c) { return s->a + s->b + c + " + std::to_string(Val) + "; }\n";
+        std::string Err;
+        auto CU = Jit.compile(Code.c_str(), Err);
+        if (!CU) {
+          std::cerr << "Compile error: " << Err << std::endl;
+          ++Errors;
+          return;
+        }
+        auto* STy = CU.getStructType("S");
+        if (!STy || STy->getSize() != sizeof(int)*2) {
+          std::cerr << "invalid struct S!" << std::endl;
+          ++Errors;
+          return;
+        }
+        struct { int a; short b; } S = {1, 2};
+        void* Ptr = &S;
+        int C = 3;
+        void* Args[] = {&Ptr, &C};
+        int Ret;
+        const std::string Name = "get_" + std::to_string(T) + "_" + std::to_string(I);
+        CU.getFunction(Name.c_str()).call(&Ret, Args);
+        if (Ret != 6 + Val) {
+          std::cerr << "invalid result for " << Name << ": " << Ret << std::endl;
+          ++Errors;
+          return;
+        }
+      }
+    });
+  }
+  for (auto& T: Threads) {
+    T.join();
+  }
+  return Errors != 0;
+}
@@ -0,0 +1,147 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// RUN: "%build_dir/tiered%exeext"
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <dffi/dffi.h>
+
+using namespace dffi;
+
+static const char* Code = R"(
+static int calls;
+static const int tbl[4] = {1, 2, 3, 4};
+static int elt(int i) { return tbl[i & 3]; }
+int sum(int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) {
+    s += elt(i);
+  }
+  ++calls;
+  return s;
+}
+int get_calls() { return calls; }
+int fact(int n) { return n <= 1 ? 1 : n*fact(n-1); }
+int call_sum(int n) { return sum(n); }
+void* sum_ptr() { return (void*)&sum; }
+)";
+
+static int callInt(NativeFunc const& F, int A)
+{
+  int Ret = -1;
+  void* Args[] = {&A};
+  F.call(&Ret, Args);
+  return Ret;
+}
+
+int main()
+{
+  DFFI::initialize();
+
+  CCOpts Opts;
+  Opts.OptLevel = 2;
+  Opts.TierUpThreshold = 10;
+
+  DFFI Jit(Opts);
+  std::string Err;
+  auto CU = Jit.compile(Code, Err);
+  if (!CU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto Sum = CU.getFunction("sum");
+  auto Fact = CU.getFunction("fact");
+  auto CallSum = CU.getFunction("call_sum");
+  auto GetCalls = CU.getFunction("get_calls");
+  auto SumPtr = CU.getFunction("sum_ptr");
+  if (!Sum || !Fact || !CallSum || !GetCalls || !SumPtr) {
+    std::cerr << "missing functions!" << std::endl;
+    return 1;
+  }
+
+  // The slot of sum first points to the function counting its calls, and
+  // then to its optimized code.
+  auto SlotCU = Jit.compile(R"(
+extern void* volatile sum_slot __asm__("sum.__dffi_slot");
+void* get_sum_slot(void) { return sum_slot; }
+)", Err);
+  if (!SlotCU) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto GetSumSlot = SlotCU.getFunction("get_sum_slot");
+  auto getSumSlot = [&]() {
+    void* Ret = nullptr;
+    GetSumSlot.call(&Ret, nullptr);
+    return Ret;
+  };
+  void* const CountSlot = getSumSlot();
+  if (!CountSlot) {
+    std::cerr << "invalid slot!" << std::endl;
+    return 1;
+  }
+
+  // Results and the state of the compilation unit are the same whatever the
+  // tier of the code, which is swapped while it is called.
+  int Calls = 0;
+  for (unsigned I = 0; I < 200000; ++I) {
+    if (callInt(Sum, 10) != 24 || callInt(CallSum, 4) != 10 || callInt(Fact, 5) != 120) {
+      std::cerr << "invalid result at iteration " << I << "!" << std::endl;
+      return 1;
+    }
+    Calls += 2;
+    void* Ptr = nullptr;
+    SumPtr.call(&Ptr, nullptr);
+    if (Ptr != Sum.getFuncCodePtr()) {
+      std::cerr << "function pointer changed!" << std::endl;
+      return 1;
+    }
+  }
+  // Optimizations are done in the background
+  for (unsigned I = 0; I < 1000 && getSumSlot() == CountSlot; ++I) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (getSumSlot() == CountSlot) {
+    std::cerr << "sum hasn't been optimized!" << std::endl;
+    return 1;
+  }
+
+  int Ret = -1;
+  GetCalls.call(&Ret, nullptr);
+  if (Ret != Calls) {
+    std::cerr << "invalid number of calls: " << Ret << " instead of " << Calls << std::endl;
+    return 1;
+  }
+
+  // Releasing a compilation unit drops the pending optimizations of its
+  // functions.
+  auto CU2 = Jit.compile("int inc(int a) { return a+1; }", Err);
+  if (!CU2) {
+    std::cerr << Err << std::endl;
+    return 1;
+  }
+  auto Inc = CU2.getFunction("inc");
+  for (int I = 0; I < 10; ++I) {
+    if (callInt(Inc, I) != I+1) {
+      std::cerr << "invalid inc result!" << std::endl;
+      return 1;
+    }
+  }
+  CU2.release();
+  return 0;
+}
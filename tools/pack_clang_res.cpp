@@ -0,0 +1,135 @@
+// Copyright 2018 Adrien Guinet <adrien@guinet.me>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Packs clang's resource headers into a single archive, which is embedded in
+// libdffi as a byte array (see CMakeClangRes.txt). Headers are compressed
+// independently, so that they can be decompressed the first time clang
+// opens them (see lib/dffi_impl_clang_res.cpp).
+//
+// Usage: pack_clang_res OUTPUT_HEADER RES_DIR FILE...
+// where FILEs are relative to RES_DIR.
+//
+// Archive format (integers are 32-bit little endian):
+//   magic "DFFIRES1"
+//   number of files
+//   for each file: name offset, name length, data offset, stored size,
+//                  size, compressed (0 or 1)
+//   names and data
+// Stored data which isn't compressed is followed by a null byte.
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+struct Entry
+{
+  std::string Name;
+  SmallVector<char, 0> Data;
+  uint32_t Size;
+  bool Compressed;
+};
+
+const char Magic[] = "DFFIRES1";
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    errs() << "usage: " << argv[0] << " output_header res_dir [file...]\n";
+    return 1;
+  }
+
+  std::vector<Entry> Entries;
+  for (int I = 3; I < argc; ++I) {
+    SmallString<256> Path{argv[2]};
+    sys::path::append(Path, argv[I]);
+    auto BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+      errs() << "unable to read '" << Path << "': " << BufOrErr.getError().message() << "\n";
+      return 1;
+    }
+    StringRef Data = (*BufOrErr)->getBuffer();
+    Entry E;
+    E.Name = sys::path::convert_to_slash(argv[I]);
+    E.Size = Data.size();
+    E.Compressed = false;
+    if (zlib::isAvailable()) {
+      if (auto Err = zlib::compress(Data, E.Data, zlib::BestSizeCompression)) {
+        errs() << "unable to compress '" << Path << "': " << toString(std::move(Err)) << "\n";
+        return 1;
+      }
+      E.Compressed = E.Data.size() < Data.size();
+    }
+    if (!E.Compressed) {
+      E.Data.assign(Data.begin(), Data.end());
+      E.Data.push_back(0);
+    }
+    Entries.emplace_back(std::move(E));
+  }
+
+  std::string Archive;
+  raw_string_ostream OS(Archive);
+  support::endian::Writer W(OS, support::little);
+  OS.write(Magic, sizeof(Magic)-1);
+  W.write<uint32_t>(Entries.size());
+  uint32_t Offset = sizeof(Magic)-1 + 4 + Entries.size()*6*4;
+  for (auto const& E: Entries) {
+    W.write<uint32_t>(Offset);
+    W.write<uint32_t>(E.Name.size());
+    Offset += E.Name.size();
+    W.write<uint32_t>(Offset);
+    W.write<uint32_t>(E.Data.size() - (E.Compressed ? 0 : 1));
+    W.write<uint32_t>(E.Size);
+    W.write<uint32_t>(E.Compressed);
+    Offset += E.Data.size();
+  }
+  for (auto const& E: Entries) {
+    OS << E.Name;
+    OS.write(E.Data.data(), E.Data.size());
+  }
+  OS.flush();
+
+  std::error_code EC;
+  raw_fd_ostream Out(argv[1], EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "unable to open '" << argv[1] << "': " << EC.message() << "\n";
+    return 1;
+  }
+  static const char Hex[] = "0123456789abcdef";
+  Out << "// Generated by pack_clang_res, do not edit!\n";
+  Out << "static const uint8_t ClangResArchive[] = {";
+  for (size_t I = 0; I < Archive.size(); ++I) {
+    if (I % 16 == 0) {
+      Out << "\n";
+    }
+    const uint8_t C = Archive[I];
+    Out << "0x" << Hex[C >> 4] << Hex[C & 0xF] << ",";
+  }
+  Out << "\n};\n";
+  return 0;
+}